@@ -0,0 +1,169 @@
+#include "include/libemv.h"
+#include "internal.h"
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+// Byte trie of terminal AIDs (see AID_NODE) is part of configuration image
+// Result of search is the same as linear search over AIDs in order of configuration
+
+// Count of cards with every AID (CONFIG_SNAPSHOT), order of probing of list of AIDs
+// Shared by sessions, incremented atomically
+#ifdef _WIN32
+#define AID_HITS_INCREMENT(target)	InterlockedIncrement((LONG volatile*) (target))
+#else
+#define AID_HITS_INCREMENT(target)	__sync_fetch_and_add((target), 1)
+#endif
+
+// Find child of node with byte, add it if not exists
+static int aid_node_child(AID_NODE* nodes, int* nodesCount, int node, unsigned char byte)
+{
+	int child;
+	int last;
+
+	last = -1;
+	for (child = nodes[node].firstChild; child >= 0; child = nodes[child].nextSibling)
+	{
+		if (nodes[child].byte == byte)
+			return child;
+		last = child;
+	}
+
+	child = (*nodesCount)++;
+	nodes[child].byte = byte;
+	nodes[child].firstChild = -1;
+	nodes[child].nextSibling = -1;
+	nodes[child].exactOrdinal = -1;
+	nodes[child].partialOrdinal = -1;
+	if (last < 0)
+		nodes[node].firstChild = child;
+	else
+		nodes[last].nextSibling = child;
+	return child;
+}
+
+int libemv_build_aid_trie(const LIBEMV_APPLICATIONS* apps, int countApps, AID_NODE* outNodes)
+{
+	int nodesCount;
+	int ordinal;
+	int i, j, k;
+
+	// Root
+	outNodes[0].byte = 0;
+	outNodes[0].firstChild = -1;
+	outNodes[0].nextSibling = -1;
+	outNodes[0].exactOrdinal = -1;
+	outNodes[0].partialOrdinal = -1;
+	nodesCount = 1;
+
+	ordinal = 0;
+	for (i = 0; i < countApps; i++)
+	{
+		for (j = 0; j < apps[i].aidsCount; j++, ordinal++)
+		{
+			const LIBEMV_AID* aid;
+			int node;
+
+			aid = &apps[i].aids[j];
+			if (aid->aidLength <= 0 || aid->aidLength > (int) sizeof(aid->aid))
+				continue;
+
+			node = 0;
+			for (k = 0; k < aid->aidLength; k++)
+				node = aid_node_child(outNodes, &nodesCount, node, aid->aid[k]);
+
+			// Ordinals grow, so first AID ending in node has smallest ordinal
+			if (outNodes[node].exactOrdinal < 0)
+				outNodes[node].exactOrdinal = ordinal;
+			if (aid->applicationSelectionIndicator && outNodes[node].partialOrdinal < 0)
+				outNodes[node].partialOrdinal = ordinal;
+		}
+	}
+	return nodesCount;
+}
+
+int libemv_find_aid(const unsigned char* dfName, int dfNameLength, char allowPartial)
+{
+	const AID_NODE* nodes;
+	int node;
+	int best;
+	int depth;
+
+	if (!libemv_config)
+		return -1;
+	nodes = (const AID_NODE*) LIBEMV_CONFIG_PTR(libemv_config->aidNodesOffset);
+
+	best = -1;
+	node = 0;
+	for (depth = 0; depth < dfNameLength; depth++)
+	{
+		int child;
+		for (child = nodes[node].firstChild; child >= 0; child = nodes[child].nextSibling)
+		{
+			if (nodes[child].byte == dfName[depth])
+				break;
+		}
+		if (child < 0)
+			break;
+		node = child;
+
+		// Terminal AID equals DF name, or is shorter and allows partial selection
+		if (depth + 1 == dfNameLength)
+		{
+			if (nodes[node].exactOrdinal >= 0 && (best < 0 || nodes[node].exactOrdinal < best))
+				best = nodes[node].exactOrdinal;
+		} else if (allowPartial)
+		{
+			if (nodes[node].partialOrdinal >= 0 && (best < 0 || nodes[node].partialOrdinal < best))
+				best = nodes[node].partialOrdinal;
+		}
+	}
+
+	return best < 0 ? -1 : LIBEMV_CONFIG_AIDS()[best].app;
+}
+
+int libemv_aid_count(void)
+{
+	return libemv_config ? libemv_config->aidsCount : 0;
+}
+
+void libemv_aid_hit(int ordinal)
+{
+	if (ordinal >= 0 && ordinal < libemv_aid_count())
+		AID_HITS_INCREMENT(&libemv_snapshot->aidHits[ordinal]);
+}
+
+unsigned long libemv_aid_hits(int ordinal)
+{
+	if (ordinal < 0 || ordinal >= libemv_aid_count())
+		return 0;
+	return libemv_snapshot->aidHits[ordinal];
+}
+
+LIBEMV_API int libemv_get_aid_hits(unsigned long* outHits, int maxCount)
+{
+	const CONFIG_SNAPSHOT* snapshot;
+	int count;
+
+	snapshot = libemv_config_current();
+	if (!snapshot || !snapshot->header)
+		return 0;
+	count = snapshot->header->aidsCount < maxCount ? snapshot->header->aidsCount : maxCount;
+	if (count > 0)
+		memcpy(outHits, snapshot->aidHits, count * sizeof(unsigned long));
+	return count;
+}
+
+LIBEMV_API void libemv_set_aid_hits(const unsigned long* hits, int count)
+{
+	const CONFIG_SNAPSHOT* snapshot;
+
+	snapshot = libemv_config_current();
+	if (!snapshot || !snapshot->header)
+		return;
+	if (count > snapshot->header->aidsCount)
+		count = snapshot->header->aidsCount;
+	if (count > 0)
+		memcpy(snapshot->aidHits, hits, count * sizeof(unsigned long));
+}
@@ -0,0 +1,208 @@
+#define _GNU_SOURCE
+#include "bench_common.h"
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+unsigned long long bench_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + (unsigned long long) ts.tv_nsec;
+}
+
+unsigned long long bench_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+int bench_pin_cpu(int cpu)
+{
+	cpu_set_t set;
+	if (cpu < 0)
+		return 0;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+double bench_cycles_per_ns(void)
+{
+	unsigned long long startNs, startCycles;
+	unsigned long long endNs, endCycles;
+
+	startCycles = bench_cycles();
+	if (startCycles == 0)
+		return 0;
+	startNs = bench_now_ns();
+	do
+	{
+		endNs = bench_now_ns();
+	} while (endNs - startNs < 50000000ULL);
+	endCycles = bench_cycles();
+	return (double) (endCycles - startCycles) / (double) (endNs - startNs);
+}
+
+static int compare_samples(const void* a, const void* b)
+{
+	unsigned long long x = *(const unsigned long long*) a;
+	unsigned long long y = *(const unsigned long long*) b;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Nearest rank percentile of sorted samples
+static unsigned long long percentile(const unsigned long long* samples, unsigned long long count, double p)
+{
+	unsigned long long rank;
+	rank = (unsigned long long) (p * (double) count + 0.999999);
+	if (rank < 1)
+		rank = 1;
+	if (rank > count)
+		rank = count;
+	return samples[rank - 1];
+}
+
+void bench_stats(unsigned long long* samples, unsigned long long count, BENCH_STATS* outStats)
+{
+	unsigned long long i;
+	double sum;
+
+	memset(outStats, 0, sizeof(BENCH_STATS));
+	if (count == 0)
+		return;
+
+	qsort(samples, (size_t) count, sizeof(unsigned long long), compare_samples);
+	sum = 0;
+	for (i = 0; i < count; i++)
+		sum += (double) samples[i];
+
+	outStats->count = count;
+	outStats->mean = sum / (double) count;
+	outStats->min = samples[0];
+	outStats->p50 = percentile(samples, count, 0.50);
+	outStats->p99 = percentile(samples, count, 0.99);
+	outStats->p999 = percentile(samples, count, 0.999);
+	outStats->max = samples[count - 1];
+}
+
+static void json_key(BENCH_JSON* json, const char* key)
+{
+	int i;
+	if (json->needComma[json->depth])
+		fprintf(json->file, ",");
+	fprintf(json->file, "\n");
+	for (i = 0; i < json->depth; i++)
+		fprintf(json->file, "  ");
+	json->needComma[json->depth] = 1;
+	if (key)
+		fprintf(json->file, "\"%s\": ", key);
+}
+
+void bench_json_begin(BENCH_JSON* json, FILE* file)
+{
+	memset(json, 0, sizeof(BENCH_JSON));
+	json->file = file;
+	json->depth = 1;
+	fprintf(file, "{");
+}
+
+void bench_json_end(BENCH_JSON* json)
+{
+	fprintf(json->file, "\n}\n");
+	fflush(json->file);
+}
+
+void bench_json_object(BENCH_JSON* json, const char* key)
+{
+	json_key(json, key);
+	fprintf(json->file, "{");
+	json->depth++;
+	json->needComma[json->depth] = 0;
+}
+
+void bench_json_array(BENCH_JSON* json, const char* key)
+{
+	json_key(json, key);
+	fprintf(json->file, "[");
+	json->depth++;
+	json->needComma[json->depth] = 0;
+}
+
+static void json_close(BENCH_JSON* json, char bracket)
+{
+	int i;
+	json->depth--;
+	fprintf(json->file, "\n");
+	for (i = 0; i < json->depth; i++)
+		fprintf(json->file, "  ");
+	fprintf(json->file, "%c", bracket);
+}
+
+void bench_json_close_object(BENCH_JSON* json)
+{
+	json_close(json, '}');
+}
+
+void bench_json_close_array(BENCH_JSON* json)
+{
+	json_close(json, ']');
+}
+
+void bench_json_string(BENCH_JSON* json, const char* key, const char* value)
+{
+	json_key(json, key);
+	fprintf(json->file, "\"%s\"", value);
+}
+
+void bench_json_int(BENCH_JSON* json, const char* key, long long value)
+{
+	json_key(json, key);
+	fprintf(json->file, "%lld", value);
+}
+
+void bench_json_double(BENCH_JSON* json, const char* key, double value)
+{
+	json_key(json, key);
+	fprintf(json->file, "%.3f", value);
+}
+
+void bench_json_stats(BENCH_JSON* json, const char* key, const BENCH_STATS* stats)
+{
+	bench_json_object(json, key);
+	bench_json_int(json, "count", (long long) stats->count);
+	bench_json_double(json, "mean_ns", stats->mean);
+	bench_json_int(json, "min_ns", (long long) stats->min);
+	bench_json_int(json, "p50_ns", (long long) stats->p50);
+	bench_json_int(json, "p99_ns", (long long) stats->p99);
+	bench_json_int(json, "p999_ns", (long long) stats->p999);
+	bench_json_int(json, "max_ns", (long long) stats->max);
+	bench_json_close_object(json);
+}
+
+void bench_json_host(BENCH_JSON* json, int cpu)
+{
+	char hostName[128];
+	char strDate[32];
+	time_t rawtime;
+
+	memset(hostName, 0, sizeof(hostName));
+	gethostname(hostName, sizeof(hostName) - 1);
+	time(&rawtime);
+	strftime(strDate, sizeof(strDate), "%Y-%m-%dT%H:%M:%SZ", gmtime(&rawtime));
+
+	bench_json_object(json, "host");
+	bench_json_string(json, "name", hostName);
+	bench_json_string(json, "date", strDate);
+	bench_json_int(json, "cpu", cpu);
+	bench_json_int(json, "online_cpus", sysconf(_SC_NPROCESSORS_ONLN));
+	bench_json_close_object(json);
+}
@@ -0,0 +1,67 @@
+#ifndef __BENCH_COMMON_H
+#define __BENCH_COMMON_H
+
+// Common helpers of benchmarks: clock, CPU pinning, statistics, JSON output
+// Linux only
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Monotonic time in nanoseconds
+unsigned long long bench_now_ns(void);
+
+// CPU timestamp counter, 0 if not available on this platform
+unsigned long long bench_cycles(void);
+
+// Pin current thread to cpu, cpu < 0 - don't pin
+// Returns 1 if pinned
+int bench_pin_cpu(int cpu);
+
+// Estimate cycles per nanosecond using bench_cycles(), 0 if not available
+double bench_cycles_per_ns(void);
+
+// Statistics of samples (nanoseconds), samples array is sorted by the function
+typedef struct
+{
+	unsigned long long count;
+	double mean;
+	unsigned long long min;
+	unsigned long long p50;
+	unsigned long long p99;
+	unsigned long long p999;
+	unsigned long long max;
+} BENCH_STATS;
+
+void bench_stats(unsigned long long* samples, unsigned long long count, BENCH_STATS* outStats);
+
+// JSON writer, enough for flat benchmark reports
+typedef struct
+{
+	FILE* file;
+	int depth;
+	int needComma[16];
+} BENCH_JSON;
+
+void bench_json_begin(BENCH_JSON* json, FILE* file);
+void bench_json_end(BENCH_JSON* json);
+void bench_json_object(BENCH_JSON* json, const char* key);
+void bench_json_array(BENCH_JSON* json, const char* key);
+void bench_json_close_object(BENCH_JSON* json);
+void bench_json_close_array(BENCH_JSON* json);
+void bench_json_string(BENCH_JSON* json, const char* key, const char* value);
+void bench_json_int(BENCH_JSON* json, const char* key, long long value);
+void bench_json_double(BENCH_JSON* json, const char* key, double value);
+void bench_json_stats(BENCH_JSON* json, const char* key, const BENCH_STATS* stats);
+
+// Write host description (cpu, pinning, date) to json
+void bench_json_host(BENCH_JSON* json, int cpu);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif // __BENCH_COMMON_H
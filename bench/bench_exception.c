@@ -0,0 +1,251 @@
+// Exception file benchmark: build and mapping of file with millions of entries,
+// negative and positive lookups, false positives of Bloom filter and delta updates
+// Results in JSON
+//
+// Build (Linux, from repository root):
+// gcc -O2 -o bench_exception bench/bench_exception.c bench/bench_common.c *.c crypt/*.c
+//
+// Usage: bench_exception [-n entries] [-l lookups] [-d delta entries] [-c cpu] [-f file] [-o results.json]
+
+#include "../include/libemv.h"
+#include "../internal.h"
+#include "bench_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Result of lookups, prevents dead code elimination
+static volatile unsigned long benchSink;
+
+static unsigned long long randomState = 0x9E3779B97F4A7C15ULL;
+
+// xorshift64*
+static unsigned long long next_random(void)
+{
+	randomState ^= randomState >> 12;
+	randomState ^= randomState << 25;
+	randomState ^= randomState >> 27;
+	return randomState * 2685821657736338717ULL;
+}
+
+// Random 16 digits PAN with prefix 4, BCD padded with 'F'
+static void random_pan(unsigned char* outPan)
+{
+	unsigned long long value;
+	int i;
+
+	value = next_random();
+	outPan[0] = 0x40 | (unsigned char) (value % 10);
+	value /= 10;
+	for (i = 1; i < 8; i++)
+	{
+		outPan[i] = (unsigned char) (((value % 10) << 4) | ((value / 10) % 10));
+		value /= 100;
+	}
+	outPan[8] = 0xFF;
+	outPan[9] = 0xFF;
+}
+
+// Median ns per lookup of keys, 5 repetitions
+static double measure_lookups(const EXCEPTION_LIST* list, const LIBEMV_EXCEPTION_ENTRY* keys, int count, unsigned long* outHits)
+{
+	unsigned long long samples[5];
+	BENCH_STATS stats;
+	unsigned long hits;
+	int rep, i;
+
+	hits = 0;
+	for (rep = 0; rep < 5; rep++)
+	{
+		unsigned long long start;
+		hits = 0;
+		start = bench_now_ns();
+		for (i = 0; i < count; i++)
+			hits += libemv_exception_lookup(list, keys[i].pan, keys[i].panSequence);
+		samples[rep] = (bench_now_ns() - start) * 1000 / count;
+		benchSink += hits;
+	}
+	bench_stats(samples, 5, &stats);
+	*outHits = hits;
+	return stats.p50 / 1000.0;
+}
+
+int main(int argc, char** argv)
+{
+	int entries, lookups, deltaEntries, cpu;
+	const char* filePath;
+	const char* outPath;
+	FILE* outFile;
+	FILE* imageFile;
+	BENCH_JSON json;
+	LIBEMV_EXCEPTION_ENTRY* fileEntries;
+	LIBEMV_EXCEPTION_ENTRY* keys;
+	LIBEMV_EXCEPTION_ENTRY* delta;
+	unsigned char* image;
+	unsigned long long start, buildNs, mapNs, deltaNs;
+	unsigned long hits;
+	unsigned long passed;
+	double negativeNs, positiveNs, deltaNegativeNs;
+	int size;
+	int i;
+
+	entries = 10000000;
+	lookups = 1000000;
+	deltaEntries = 10000;
+	cpu = -1;
+	filePath = "/tmp/bench_exception.bin";
+	outPath = 0;
+	for (i = 1; i + 1 < argc; i += 2)
+	{
+		if (strcmp(argv[i], "-n") == 0)
+			entries = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-l") == 0)
+			lookups = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-d") == 0)
+			deltaEntries = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-c") == 0)
+			cpu = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-f") == 0)
+			filePath = argv[i + 1];
+		else if (strcmp(argv[i], "-o") == 0)
+			outPath = argv[i + 1];
+	}
+	if (entries <= 0)
+		entries = 1;
+	if (lookups <= 0)
+		lookups = 1;
+	if (deltaEntries < 0)
+		deltaEntries = 0;
+
+	if (cpu >= 0 && !bench_pin_cpu(cpu))
+		fprintf(stderr, "Unable pin to cpu %d\n", cpu);
+
+	outFile = stdout;
+	if (outPath)
+	{
+		outFile = fopen(outPath, "w");
+		if (!outFile)
+		{
+			fprintf(stderr, "Unable open %s\n", outPath);
+			return 1;
+		}
+	}
+
+	fileEntries = malloc(entries * sizeof(LIBEMV_EXCEPTION_ENTRY));
+	keys = malloc(lookups * sizeof(LIBEMV_EXCEPTION_ENTRY));
+	delta = malloc((deltaEntries + 1) * sizeof(LIBEMV_EXCEPTION_ENTRY));
+	if (!fileEntries || !keys || !delta)
+	{
+		fprintf(stderr, "Unable allocate memory\n");
+		return 1;
+	}
+	for (i = 0; i < entries; i++)
+	{
+		random_pan(fileEntries[i].pan);
+		// Most entries block all cards of PAN
+		fileEntries[i].panSequence = (i & 7) == 0 ? (unsigned char) (i & 0x0F) : 0xFF;
+		fileEntries[i].remove = 0;
+	}
+
+	// Build image and write file like terminal management system does
+	start = bench_now_ns();
+	size = libemv_build_exception_image(fileEntries, entries, 0, 0);
+	image = size > 0 ? malloc(size) : 0;
+	if (!image || !(size = libemv_build_exception_image(fileEntries, entries, image, size)))
+	{
+		fprintf(stderr, "Unable build exception file\n");
+		return 1;
+	}
+	buildNs = bench_now_ns() - start;
+	imageFile = fopen(filePath, "wb");
+	if (!imageFile || fwrite(image, 1, size, imageFile) != (size_t) size)
+	{
+		fprintf(stderr, "Unable write %s\n", filePath);
+		return 1;
+	}
+	fclose(imageFile);
+	free(image);
+
+	libemv_init();
+	start = bench_now_ns();
+	if (libemv_map_exception_file(filePath) != LIBEMV_OK)
+	{
+		fprintf(stderr, "Unable map %s\n", filePath);
+		return 1;
+	}
+	mapNs = bench_now_ns() - start;
+
+	// Lookups run out of transaction, pin configuration like transaction does
+	libemv_config_enter();
+
+	// Random cards are almost never in file
+	for (i = 0; i < lookups; i++)
+	{
+		random_pan(keys[i].pan);
+		keys[i].panSequence = (unsigned char) (i & 0x03);
+	}
+	negativeNs = measure_lookups(libemv_snapshot->exceptions, keys, lookups, &hits);
+
+	bench_json_begin(&json, outFile);
+	bench_json_string(&json, "benchmark", "exception_file");
+	bench_json_host(&json, cpu);
+	bench_json_int(&json, "entries", entries);
+	bench_json_int(&json, "lookups", lookups);
+	bench_json_int(&json, "file_size", size);
+	bench_json_double(&json, "build_ms", buildNs / 1e6);
+	bench_json_double(&json, "map_ms", mapNs / 1e6);
+	bench_json_double(&json, "negative_lookup_ns", negativeNs);
+	bench_json_int(&json, "negative_hits", hits);
+
+	// Random keys that pass filter, true hits are negligible
+	passed = 0;
+	for (i = 0; i < lookups; i++)
+		passed += libemv_exception_filter(libemv_snapshot->exceptions, keys[i].pan);
+	bench_json_double(&json, "false_positive_rate", (double) passed / lookups);
+
+	// Keys of file in random order
+	for (i = 0; i < lookups; i++)
+		keys[i] = fileEntries[next_random() % entries];
+	positiveNs = measure_lookups(libemv_snapshot->exceptions, keys, lookups, &hits);
+	bench_json_double(&json, "positive_lookup_ns", positiveNs);
+	bench_json_int(&json, "positive_hits", hits);
+
+	// Delta removes half of entries and adds new PANs
+	for (i = 0; i < deltaEntries; i++)
+	{
+		if (i & 1)
+		{
+			delta[i] = fileEntries[next_random() % entries];
+			delta[i].remove = 1;
+		} else
+		{
+			random_pan(delta[i].pan);
+			delta[i].panSequence = 0xFF;
+			delta[i].remove = 0;
+		}
+	}
+	start = bench_now_ns();
+	libemv_apply_exception_delta(delta, deltaEntries);
+	deltaNs = bench_now_ns() - start;
+	libemv_config_enter();
+	for (i = 0; i < lookups; i++)
+	{
+		random_pan(keys[i].pan);
+		keys[i].panSequence = (unsigned char) (i & 0x03);
+	}
+	deltaNegativeNs = measure_lookups(libemv_snapshot->exceptions, keys, lookups, &hits);
+	bench_json_int(&json, "delta_entries", deltaEntries);
+	bench_json_double(&json, "delta_apply_ms", deltaNs / 1e6);
+	bench_json_double(&json, "negative_lookup_with_delta_ns", deltaNegativeNs);
+	bench_json_end(&json);
+
+	libemv_end_transaction();
+	libemv_destroy();
+	remove(filePath);
+	free(fileEntries);
+	free(keys);
+	free(delta);
+	if (outFile != stdout)
+		fclose(outFile);
+	return 0;
+}
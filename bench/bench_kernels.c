@@ -0,0 +1,727 @@
+// Micro-benchmarks of library kernels: TLV, tag store, AID matching, DOL, CVM list, SHA-1, 3DES, RSA
+// Every kernel is calibrated to run at least 10 ms per repetition,
+// warmed up, repeated and reported as median ns/op and bytes/cycle in JSON
+// Cycles are taken from CPU timestamp counter (reference cycles)
+// Batch DES is checked against DES of des.h before timing, benchmark fails if results differ
+//
+// Build (Linux, from repository root):
+// gcc -O2 -o bench_kernels bench/bench_kernels.c bench/bench_common.c *.c crypt/*.c
+//
+// Usage: bench_kernels [-r repetitions] [-c cpu] [-f filter] [-o results.json]
+
+#include "../include/libemv.h"
+#include "../internal.h"
+#include "../crypt/des.h"
+#include "../crypt/des_batch.h"
+#include "../crypt/sha1.h"
+#include "../crypt/rsaeuro.h"
+#include "../crypt/rsa.h"
+#include "bench_common.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_REPETITION_NS	10000000ULL
+#define WARMUP_NS			50000000ULL
+
+typedef struct
+{
+	const char* name;
+	void (*run)(void* arg);
+	void* arg;
+	int bytesPerOp;			// Bytes processed by one operation, 0 - not applicable
+} BENCH_KERNEL;
+
+// Result of kernels, prevents dead code elimination
+static volatile unsigned long benchSink;
+
+static int repetitions;
+static double cyclesPerNs;
+
+// Random input data of kernels
+static unsigned char hashData[4096];
+
+// Run kernel ops times, returns elapsed ns
+static unsigned long long run_batch(const BENCH_KERNEL* kernel, unsigned long ops, unsigned long long* outCycles)
+{
+	unsigned long long startNs, startCycles;
+	unsigned long i;
+	startCycles = bench_cycles();
+	startNs = bench_now_ns();
+	for (i = 0; i < ops; i++)
+		kernel->run(kernel->arg);
+	*outCycles = bench_cycles() - startCycles;
+	return bench_now_ns() - startNs;
+}
+
+static void measure(const BENCH_KERNEL* kernel, BENCH_JSON* json)
+{
+	unsigned long ops;
+	unsigned long long elapsed, cycles;
+	unsigned long long* nsPerOp;
+	unsigned long long* cyclesPerOp;
+	unsigned long long warmupStart;
+	BENCH_STATS nsStats, cycleStats;
+	int rep;
+
+	// Calibrate count of operations in one repetition
+	ops = 1;
+	while (1)
+	{
+		elapsed = run_batch(kernel, ops, &cycles);
+		if (elapsed >= MIN_REPETITION_NS)
+			break;
+		ops *= 2;
+	}
+
+	// Warm up caches, branch predictors and frequency
+	warmupStart = bench_now_ns();
+	while (bench_now_ns() - warmupStart < WARMUP_NS)
+		run_batch(kernel, ops, &cycles);
+
+	// Values are scaled by 1000 to keep fraction of ns
+	nsPerOp = (unsigned long long*) malloc(repetitions * sizeof(unsigned long long));
+	cyclesPerOp = (unsigned long long*) malloc(repetitions * sizeof(unsigned long long));
+	for (rep = 0; rep < repetitions; rep++)
+	{
+		elapsed = run_batch(kernel, ops, &cycles);
+		nsPerOp[rep] = elapsed * 1000ULL / ops;
+		cyclesPerOp[rep] = cycles * 1000ULL / ops;
+	}
+	bench_stats(nsPerOp, repetitions, &nsStats);
+	bench_stats(cyclesPerOp, repetitions, &cycleStats);
+
+	bench_json_object(json, 0);
+	bench_json_string(json, "name", kernel->name);
+	bench_json_int(json, "bytes_per_op", kernel->bytesPerOp);
+	bench_json_int(json, "ops_per_repetition", ops);
+	bench_json_int(json, "repetitions", repetitions);
+	bench_json_double(json, "ns_per_op_median", nsStats.p50 / 1000.0);
+	bench_json_double(json, "ns_per_op_min", nsStats.min / 1000.0);
+	bench_json_double(json, "ns_per_op_max", nsStats.max / 1000.0);
+	bench_json_double(json, "cycles_per_op_median", cycleStats.p50 / 1000.0);
+	if (kernel->bytesPerOp > 0 && cycleStats.p50 > 0)
+		bench_json_double(json, "bytes_per_cycle", kernel->bytesPerOp * 1000.0 / cycleStats.p50);
+	bench_json_close_object(json);
+
+	fprintf(stderr, "%-32s %12.1f ns/op", kernel->name, nsStats.p50 / 1000.0);
+	if (kernel->bytesPerOp > 0 && cycleStats.p50 > 0)
+		fprintf(stderr, " %8.3f bytes/cycle", kernel->bytesPerOp * 1000.0 / cycleStats.p50);
+	fprintf(stderr, "\n");
+
+	free(nsPerOp);
+	free(cyclesPerOp);
+}
+
+// TLV kernels
+static unsigned char tlvRecord[] =
+{
+	0x70, 0x81, 0x8A,
+	0x5A, 0x08, 0x47, 0x61, 0x73, 0x90, 0x01, 0x01, 0x00, 0x10,
+	0x5F, 0x24, 0x03, 0x51, 0x12, 0x31,
+	0x5F, 0x25, 0x03, 0x09, 0x07, 0x01,
+	0x5F, 0x28, 0x02, 0x08, 0x40,
+	0x5F, 0x34, 0x01, 0x01,
+	0x9F, 0x07, 0x02, 0xFF, 0x00,
+	0x9F, 0x0D, 0x05, 0xF0, 0x40, 0x00, 0x88, 0x00,
+	0x9F, 0x0E, 0x05, 0x00, 0x10, 0x00, 0x00, 0x00,
+	0x9F, 0x0F, 0x05, 0xF0, 0x40, 0x00, 0x98, 0x00,
+	0x8E, 0x0E, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x42, 0x03, 0x1E, 0x03, 0x1F, 0x03,
+	0x8C, 0x15, 0x9F, 0x02, 0x06, 0x9F, 0x03, 0x06, 0x9F, 0x1A, 0x02, 0x95, 0x05, 0x5F, 0x2A, 0x02,
+	0x9A, 0x03, 0x9C, 0x01, 0x9F, 0x37, 0x04,
+	0x8D, 0x17, 0x8A, 0x02, 0x9F, 0x02, 0x06, 0x9F, 0x03, 0x06, 0x9F, 0x1A, 0x02, 0x95, 0x05, 0x5F,
+	0x2A, 0x02, 0x9A, 0x03, 0x9C, 0x01, 0x9F, 0x37, 0x04,
+	0x9F, 0x08, 0x02, 0x00, 0x8C,
+	0x5F, 0x30, 0x02, 0x02, 0x01,
+	0x9F, 0x42, 0x02, 0x08, 0x40,
+	0x9F, 0x44, 0x01, 0x02
+};
+
+static void kernel_parse_tlv(void* arg)
+{
+	unsigned short tag;
+	unsigned char* data;
+	int size;
+	unsigned char* inner;
+	int innerSize;
+	int shift;
+
+	libemv_parse_tlv(tlvRecord, sizeof(tlvRecord), &tag, &inner, &innerSize);
+	while ((shift = libemv_parse_tlv(inner, innerSize, &tag, &data, &size)) != 0)
+	{
+		benchSink += tag;
+		inner += shift;
+		innerSize -= shift;
+	}
+}
+
+static void kernel_make_tlv(void* arg)
+{
+	unsigned char out[300];
+	int size;
+	size = *(int*) arg;
+	benchSink += libemv_make_tlv(hashData, size, 0x9F46, out);
+}
+
+// Tag store kernels, store filled with storeSize tags, access to the last one
+typedef struct
+{
+	int storeSize;
+	unsigned short lastTag;
+} STORE_ARG;
+
+static void fill_store(int count)
+{
+	unsigned char value[16];
+	int i;
+	libemv_clear_tlv_buffer();
+	memset(value, 0x5A, sizeof(value));
+	for (i = 0; i < count; i++)
+		libemv_set_tag((unsigned short) (0xDF00 + i), value, 4 + i % 12);
+}
+
+static void kernel_get_tag(void* arg)
+{
+	STORE_ARG* storeArg;
+	int size;
+	storeArg = (STORE_ARG*) arg;
+	benchSink += (unsigned long) libemv_get_tag(storeArg->lastTag, &size) + size;
+}
+
+// Update of the last tag with value of the same size: lookup in application buffer (not counted
+// in tagGetCount of LIBEMV_STATS) and copy of value in place, buffer isn't moved or reallocated
+static void kernel_set_tag(void* arg)
+{
+	STORE_ARG* storeArg;
+	unsigned char value[16];
+	storeArg = (STORE_ARG*) arg;
+	memset(value, (int) benchSink, sizeof(value));
+	libemv_set_tag(storeArg->lastTag, value, 4 + (storeArg->storeSize - 1) % 12);
+}
+
+// DOL kernel, CDOL1 of typical card
+static unsigned char benchCDOL1[] = {0x9F, 0x02, 0x06, 0x9F, 0x03, 0x06, 0x9F, 0x1A, 0x02, 0x95, 0x05, 0x5F, 0x2A, 0x02,
+	0x9A, 0x03, 0x9C, 0x01, 0x9F, 0x37, 0x04, 0x9F, 0x35, 0x01, 0x9F, 0x45, 0x02, 0x9F, 0x4C, 0x08, 0x9F, 0x34, 0x03};
+
+static void kernel_dol(void* arg)
+{
+	unsigned char out[256];
+	benchSink += libemv_dol(benchCDOL1, sizeof(benchCDOL1), out);
+}
+
+// CVM list kernels, list of rulesCount rules: rules which are skipped (condition isn't satisfied, method isn't
+// supported by terminal and next rule is applied), the last one is "No CVM required"
+#define CVM_BENCH_CAPABILITIES	0xE0A8C8ULL		// Plaintext PIN, signature, no CVM; no offline enciphered PIN
+
+typedef struct
+{
+	int rulesCount;
+	unsigned char list[8 + 2 * 10];
+	int size;
+	CVM_TABLE table;
+	unsigned long conditions;		// Conditions of transaction of cvm_store
+} CVM_ARG;
+
+static void cvm_arg_init(CVM_ARG* cvmArg, int rulesCount)
+{
+	static const unsigned char skipped[3][2] = {{0x44, 0x00}, {0x5E, 0x04}, {0x41, 0x09}};
+	int i;
+
+	cvmArg->rulesCount = rulesCount;
+	memset(cvmArg->list, 0, 4);
+	memset(cvmArg->list + 4, 0xFF, 4);
+	cvmArg->size = 8;
+	for (i = 0; i < rulesCount - 1; i++)
+	{
+		cvmArg->list[cvmArg->size++] = skipped[i % 3][0];
+		cvmArg->list[cvmArg->size++] = skipped[i % 3][1];
+	}
+	cvmArg->list[cvmArg->size++] = 0x1F;
+	cvmArg->list[cvmArg->size++] = 0x00;
+	libemv_cvm_compile(cvmArg->list, cvmArg->size, &cvmArg->table);
+}
+
+// Tags of transaction for conditions of rules, conditions are computed once per transaction
+static void cvm_store(CVM_ARG* cvmArg)
+{
+	fill_store(64);
+	libemv_set_tag(TAG_TERMINAL_TYPE, "\x22", 1);
+	libemv_set_tag(TAG_TRANSACTION_TYPE, "\x00", 1);
+	libemv_set_tag(TAG_AMOUNT_AUTHORISED, "\x00\x00\x00\x00\x10\x00", 6);
+	libemv_set_tag(TAG_TRANSACTION_CURRENCY_CODE, "\x08\x40", 2);
+	libemv_set_tag(TAG_APPLICATION_CURRENCY_CODE, "\x08\x40", 2);
+	cvmArg->conditions = libemv_cvm_conditions(&cvmArg->table);
+}
+
+static void kernel_cvm_compile(void* arg)
+{
+	CVM_ARG* cvmArg;
+	CVM_TABLE table;
+	cvmArg = (CVM_ARG*) arg;
+	benchSink += libemv_cvm_compile(cvmArg->list, cvmArg->size, &table) + table.count;
+}
+
+static void kernel_cvm_conditions(void* arg)
+{
+	benchSink += libemv_cvm_conditions(&((CVM_ARG*) arg)->table);
+}
+
+// Choice of rule like libemv_cardholder_verification, without performing of method
+static void kernel_cvm_select(void* arg)
+{
+	CVM_ARG* cvmArg;
+	int index;
+	cvmArg = (CVM_ARG*) arg;
+	for (index = libemv_cvm_next(&cvmArg->table, 0, cvmArg->conditions, CVM_BENCH_CAPABILITIES); index < cvmArg->table.count;
+		index = libemv_cvm_next(&cvmArg->table, index + 1, cvmArg->conditions, CVM_BENCH_CAPABILITIES))
+	{
+		if (CVM_SUPPORTED(&cvmArg->table.rules[index], CVM_BENCH_CAPABILITIES))
+			break;
+	}
+	benchSink += index;
+}
+
+// AID matching kernel, multi-brand terminal with 64 AIDs of 4 payment systems
+static unsigned char benchDFName[] = {0xA0, 0x00, 0x00, 0x00, 0x04, 0x30, 0x60, 0x10};
+
+static void configure_aids(void)
+{
+	LIBEMV_APPLICATIONS apps[4];
+	int i, j;
+
+	memset(apps, 0, sizeof(apps));
+	for (i = 0; i < 4; i++)
+	{
+		memcpy(apps[i].RID, "\xA0\x00\x00\x00\x01", 5);
+		apps[i].RID[4] = (unsigned char) (i + 1);
+		apps[i].aidsCount = 16;
+		for (j = 0; j < 16; j++)
+		{
+			apps[i].aids[j].aidLength = 7;
+			memcpy(apps[i].aids[j].aid, apps[i].RID, 5);
+			apps[i].aids[j].aid[5] = (unsigned char) (0x10 * (j + 1));
+			apps[i].aids[j].aid[6] = 0x60;
+			apps[i].aids[j].applicationSelectionIndicator = 1;
+		}
+	}
+	set_applications_data(apps, 4);
+
+	// Kernel runs out of transaction, pin configuration like transaction does
+	libemv_config_enter();
+}
+
+static void kernel_aid_match(void* arg)
+{
+	benchSink += libemv_find_aid(benchDFName, sizeof(benchDFName), 1);
+}
+
+// SHA-1 kernel
+static void kernel_sha1(void* arg)
+{
+	SHA1Context context;
+	SHA1Reset(&context);
+	SHA1Input(&context, hashData, *(int*) arg);
+	SHA1Result(&context);
+	benchSink += context.Message_Digest[0];
+}
+
+// 3DES kernel
+static des3_context desContext;
+
+static void kernel_des3_cbc(void* arg)
+{
+	unsigned char iv[8];
+	unsigned char out[4096];
+	memset(iv, 0, sizeof(iv));
+	des3_crypt_cbc(&desContext, DES_ENCRYPT, *(int*) arg, iv, hashData, out);
+	benchSink += out[0];
+}
+
+// 3DES of DES_BATCH_KEYED_BLOCKS blocks, every block with own key (session keys of cards)
+#define DES_BATCH_KEYED_BLOCKS	256
+
+static des_batch_context desBatchContext;
+
+static void kernel_des3_keyed(void* arg)
+{
+	des3_context context;
+	unsigned char out[8];
+	int i;
+	for (i = 0; i < DES_BATCH_KEYED_BLOCKS; i++)
+	{
+		des3_set2key_enc(&context, hashData + i * 16);
+		des3_crypt_ecb(&context, hashData + i * 8, out);
+		benchSink += out[0];
+	}
+}
+
+static void kernel_des3_batch(void* arg)
+{
+	unsigned char out[DES_BATCH_KEYED_BLOCKS * 8];
+	des3_batch_crypt_ecb(&desBatchContext, DES_ENCRYPT, hashData, hashData, out, DES_BATCH_KEYED_BLOCKS);
+	benchSink += out[0];
+}
+
+// MAC of DES_BATCH_KEYED_BLOCKS messages (padded data of ARQC), every message with own key
+#define DES_BATCH_MAC_SIZE		48
+
+static unsigned char desBatchMessages[DES_BATCH_KEYED_BLOCKS * DES_BATCH_MAC_SIZE];
+
+// ISO/IEC 9797-1 MAC algorithm 3 of one message by DES of des.h, reference of des_batch_mac_alg3
+static void des_mac_alg3(const unsigned char* key, const unsigned char* data, int size, unsigned char* outMac)
+{
+	des_context k1, k2;
+	unsigned char block[8];
+	int i, j;
+
+	des_setkey_enc(&k1, key);
+	des_setkey_dec(&k2, key + 8);
+	memset(outMac, 0, 8);
+	for (i = 0; i < size; i += 8)
+	{
+		for (j = 0; j < 8; j++)
+			block[j] = outMac[j] ^ data[i + j];
+		des_crypt_ecb(&k1, block, outMac);
+	}
+	des_crypt_ecb(&k2, outMac, block);
+	des_crypt_ecb(&k1, block, outMac);
+}
+
+static void kernel_des_mac_keyed(void* arg)
+{
+	unsigned char mac[8];
+	int i;
+	for (i = 0; i < DES_BATCH_KEYED_BLOCKS; i++)
+	{
+		des_mac_alg3(hashData + i * 16, desBatchMessages + i * DES_BATCH_MAC_SIZE, DES_BATCH_MAC_SIZE, mac);
+		benchSink += mac[0];
+	}
+}
+
+static void kernel_des_batch_mac(void* arg)
+{
+	unsigned char macs[DES_BATCH_KEYED_BLOCKS * 8];
+	des_batch_mac_alg3(&desBatchContext, hashData, desBatchMessages, DES_BATCH_MAC_SIZE, macs, DES_BATCH_KEYED_BLOCKS);
+	benchSink += macs[0];
+}
+
+// Encryption, decryption and MAC of batch against des.h, for full and partial batches
+// Returns 0 if result is different
+static int check_des_batch(void)
+{
+	static const int counts[] = {1, DES_BATCH_BITS - 1, DES_BATCH_KEYED_BLOCKS};
+	unsigned char batch[DES_BATCH_KEYED_BLOCKS * 8];
+	unsigned char reference[8];
+	des3_context context;
+	int c, i, mode;
+
+	for (c = 0; c < (int) (sizeof(counts) / sizeof(counts[0])); c++)
+	{
+		for (mode = 0; mode < 2; mode++)
+		{
+			des3_batch_crypt_ecb(&desBatchContext, mode == 0 ? DES_ENCRYPT : DES_DECRYPT, hashData, hashData, batch, counts[c]);
+			for (i = 0; i < counts[c]; i++)
+			{
+				if (mode == 0)
+					des3_set2key_enc(&context, hashData + i * 16);
+				else
+					des3_set2key_dec(&context, hashData + i * 16);
+				des3_crypt_ecb(&context, hashData + i * 8, reference);
+				if (memcmp(reference, batch + i * 8, 8) != 0)
+				{
+					fprintf(stderr, "des3_batch_crypt_ecb (%s): block %d of %d differs from des3_crypt_ecb\n",
+						mode == 0 ? "encrypt" : "decrypt", i, counts[c]);
+					return 0;
+				}
+			}
+		}
+
+		des_batch_mac_alg3(&desBatchContext, hashData, desBatchMessages, DES_BATCH_MAC_SIZE, batch, counts[c]);
+		for (i = 0; i < counts[c]; i++)
+		{
+			des_mac_alg3(hashData + i * 16, desBatchMessages + i * DES_BATCH_MAC_SIZE, DES_BATCH_MAC_SIZE, reference);
+			if (memcmp(reference, batch + i * 8, 8) != 0)
+			{
+				fprintf(stderr, "des_batch_mac_alg3: MAC %d of %d differs from DES of des.h\n", i, counts[c]);
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+// RSA kernels, random odd modulus with top bit set
+typedef struct
+{
+	R_RSA_PUBLIC_KEY key;
+	unsigned char input[MAX_RSA_MODULUS_LEN];
+	NN_DIGIT n[MAX_NN_DIGITS];
+	NN_DIGIT e[MAX_NN_DIGITS];
+	NN_DIGIT m[MAX_NN_DIGITS];
+	unsigned int nDigits;
+	unsigned int eDigits;
+} RSA_ARG;
+
+static void rsa_arg_init(RSA_ARG* rsaArg, unsigned int bits, unsigned long exponent)
+{
+	unsigned int len, i;
+	unsigned char* modulus;
+	memset(rsaArg, 0, sizeof(RSA_ARG));
+	len = bits / 8;
+	rsaArg->key.bits = bits;
+	modulus = rsaArg->key.modulus + MAX_RSA_MODULUS_LEN - len;
+	for (i = 0; i < len; i++)
+		modulus[i] = (unsigned char) (rand() & 0xFF);
+	modulus[0] |= 0x80;
+	modulus[len - 1] |= 0x01;
+	rsaArg->key.exponent[MAX_RSA_MODULUS_LEN - 3] = (unsigned char) (exponent >> 16);
+	rsaArg->key.exponent[MAX_RSA_MODULUS_LEN - 2] = (unsigned char) (exponent >> 8);
+	rsaArg->key.exponent[MAX_RSA_MODULUS_LEN - 1] = (unsigned char) exponent;
+
+	// Input is less than modulus
+	for (i = 0; i < len; i++)
+		rsaArg->input[i] = (unsigned char) (rand() & 0xFF);
+	rsaArg->input[0] = modulus[0] >> 1;
+
+	NN_Decode(rsaArg->n, MAX_NN_DIGITS, rsaArg->key.modulus, MAX_RSA_MODULUS_LEN);
+	NN_Decode(rsaArg->e, MAX_NN_DIGITS, rsaArg->key.exponent, MAX_RSA_MODULUS_LEN);
+	NN_Decode(rsaArg->m, MAX_NN_DIGITS, rsaArg->input, len);
+	rsaArg->nDigits = NN_Digits(rsaArg->n, MAX_NN_DIGITS);
+	rsaArg->eDigits = NN_Digits(rsaArg->e, MAX_NN_DIGITS);
+}
+
+static void kernel_nn_modexp(void* arg)
+{
+	RSA_ARG* rsaArg;
+	NN_DIGIT c[MAX_NN_DIGITS];
+	rsaArg = (RSA_ARG*) arg;
+	NN_ModExp(c, rsaArg->m, rsaArg->e, rsaArg->eDigits, rsaArg->n, rsaArg->nDigits);
+	benchSink += c[0];
+}
+
+static void kernel_rsa_public_decrypt(void* arg)
+{
+	RSA_ARG* rsaArg;
+	unsigned char out[MAX_RSA_MODULUS_LEN];
+	unsigned int outLen;
+	rsaArg = (RSA_ARG*) arg;
+	benchSink += RSAPublicDecrypt(out, &outLen, rsaArg->input, rsaArg->key.bits / 8, &rsaArg->key);
+}
+
+int main(int argc, char** argv)
+{
+	static int tlvSizes[] = {8, 64, 250};
+	static int storeSizes[] = {8, 32, 128};
+	static int hashSizes[] = {64, 1024, 4096};
+	static int desSizes[] = {8, 64, 1024};
+	static unsigned int rsaBits[] = {1024, 1408, 1984};
+	static int cvmRules[] = {2, 5, 10};
+	static STORE_ARG storeArgs[3];
+	static CVM_ARG cvmArgs[3];
+	static RSA_ARG rsaArgs[3][2];
+	static char names[64][48];
+	BENCH_KERNEL kernels[64];
+	int kernelsCount;
+	const char* outPath;
+	const char* filter;
+	FILE* outFile;
+	BENCH_JSON json;
+	int cpu;
+	int i;
+
+	repetitions = 15;
+	cpu = 0;
+	outPath = 0;
+	filter = 0;
+	for (i = 1; i + 1 < argc; i += 2)
+	{
+		if (strcmp(argv[i], "-r") == 0)
+			repetitions = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-c") == 0)
+			cpu = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-f") == 0)
+			filter = argv[i + 1];
+		else if (strcmp(argv[i], "-o") == 0)
+			outPath = argv[i + 1];
+	}
+	if (repetitions <= 0)
+		repetitions = 1;
+
+	if (cpu >= 0 && !bench_pin_cpu(cpu))
+		fprintf(stderr, "Unable pin to cpu %d\n", cpu);
+	cyclesPerNs = bench_cycles_per_ns();
+
+	libemv_init();
+	srand(1);
+	for (i = 0; i < (int) sizeof(hashData); i++)
+		hashData[i] = (unsigned char) rand();
+	des3_set2key_enc(&desContext, hashData);
+	for (i = 0; i < (int) sizeof(desBatchMessages); i++)
+		desBatchMessages[i] = (unsigned char) rand();
+	des_batch_init(&desBatchContext);
+	if (!check_des_batch())
+		return 1;
+
+	// Register kernels
+	kernelsCount = 0;
+	kernels[kernelsCount].name = "parse_tlv_record";
+	kernels[kernelsCount].run = kernel_parse_tlv;
+	kernels[kernelsCount].arg = 0;
+	kernels[kernelsCount].bytesPerOp = sizeof(tlvRecord);
+	kernelsCount++;
+	for (i = 0; i < 3; i++)
+	{
+		sprintf(names[kernelsCount], "make_tlv_%d", tlvSizes[i]);
+		kernels[kernelsCount].name = names[kernelsCount];
+		kernels[kernelsCount].run = kernel_make_tlv;
+		kernels[kernelsCount].arg = &tlvSizes[i];
+		kernels[kernelsCount].bytesPerOp = tlvSizes[i];
+		kernelsCount++;
+	}
+	for (i = 0; i < 3; i++)
+	{
+		storeArgs[i].storeSize = storeSizes[i];
+		storeArgs[i].lastTag = (unsigned short) (0xDF00 + storeSizes[i] - 1);
+		sprintf(names[kernelsCount], "get_tag_store_%d", storeSizes[i]);
+		kernels[kernelsCount].name = names[kernelsCount];
+		kernels[kernelsCount].run = kernel_get_tag;
+		kernels[kernelsCount].arg = &storeArgs[i];
+		kernels[kernelsCount].bytesPerOp = 0;
+		kernelsCount++;
+		sprintf(names[kernelsCount], "set_tag_store_%d", storeSizes[i]);
+		kernels[kernelsCount].name = names[kernelsCount];
+		kernels[kernelsCount].run = kernel_set_tag;
+		kernels[kernelsCount].arg = &storeArgs[i];
+		kernels[kernelsCount].bytesPerOp = 0;
+		kernelsCount++;
+	}
+	configure_aids();
+	kernels[kernelsCount].name = "aid_match_64";
+	kernels[kernelsCount].run = kernel_aid_match;
+	kernels[kernelsCount].arg = 0;
+	kernels[kernelsCount].bytesPerOp = sizeof(benchDFName);
+	kernelsCount++;
+	kernels[kernelsCount].name = "dol_cdol1";
+	kernels[kernelsCount].run = kernel_dol;
+	kernels[kernelsCount].arg = 0;
+	kernels[kernelsCount].bytesPerOp = sizeof(benchCDOL1);
+	kernelsCount++;
+	for (i = 0; i < 3; i++)
+	{
+		cvm_arg_init(&cvmArgs[i], cvmRules[i]);
+		sprintf(names[kernelsCount], "cvm_compile_%d", cvmRules[i]);
+		kernels[kernelsCount].name = names[kernelsCount];
+		kernels[kernelsCount].run = kernel_cvm_compile;
+		kernels[kernelsCount].arg = &cvmArgs[i];
+		kernels[kernelsCount].bytesPerOp = cvmArgs[i].size;
+		kernelsCount++;
+		sprintf(names[kernelsCount], "cvm_select_%d", cvmRules[i]);
+		kernels[kernelsCount].name = names[kernelsCount];
+		kernels[kernelsCount].run = kernel_cvm_select;
+		kernels[kernelsCount].arg = &cvmArgs[i];
+		kernels[kernelsCount].bytesPerOp = 0;
+		kernelsCount++;
+	}
+	kernels[kernelsCount].name = "cvm_conditions";
+	kernels[kernelsCount].run = kernel_cvm_conditions;
+	kernels[kernelsCount].arg = &cvmArgs[0];
+	kernels[kernelsCount].bytesPerOp = 0;
+	kernelsCount++;
+	for (i = 0; i < 3; i++)
+	{
+		sprintf(names[kernelsCount], "sha1_%d", hashSizes[i]);
+		kernels[kernelsCount].name = names[kernelsCount];
+		kernels[kernelsCount].run = kernel_sha1;
+		kernels[kernelsCount].arg = &hashSizes[i];
+		kernels[kernelsCount].bytesPerOp = hashSizes[i];
+		kernelsCount++;
+	}
+	for (i = 0; i < 3; i++)
+	{
+		sprintf(names[kernelsCount], "des3_cbc_%d", desSizes[i]);
+		kernels[kernelsCount].name = names[kernelsCount];
+		kernels[kernelsCount].run = kernel_des3_cbc;
+		kernels[kernelsCount].arg = &desSizes[i];
+		kernels[kernelsCount].bytesPerOp = desSizes[i];
+		kernelsCount++;
+	}
+	kernels[kernelsCount].name = "des3_keyed_256";
+	kernels[kernelsCount].run = kernel_des3_keyed;
+	kernels[kernelsCount].arg = 0;
+	kernels[kernelsCount].bytesPerOp = DES_BATCH_KEYED_BLOCKS * 8;
+	kernelsCount++;
+	kernels[kernelsCount].name = "des3_batch_256";
+	kernels[kernelsCount].run = kernel_des3_batch;
+	kernels[kernelsCount].arg = 0;
+	kernels[kernelsCount].bytesPerOp = DES_BATCH_KEYED_BLOCKS * 8;
+	kernelsCount++;
+	kernels[kernelsCount].name = "des_mac_alg3_keyed_256";
+	kernels[kernelsCount].run = kernel_des_mac_keyed;
+	kernels[kernelsCount].arg = 0;
+	kernels[kernelsCount].bytesPerOp = DES_BATCH_KEYED_BLOCKS * DES_BATCH_MAC_SIZE;
+	kernelsCount++;
+	kernels[kernelsCount].name = "des_batch_mac_alg3_256";
+	kernels[kernelsCount].run = kernel_des_batch_mac;
+	kernels[kernelsCount].arg = 0;
+	kernels[kernelsCount].bytesPerOp = DES_BATCH_KEYED_BLOCKS * DES_BATCH_MAC_SIZE;
+	kernelsCount++;
+	for (i = 0; i < 3; i++)
+	{
+		int e;
+		for (e = 0; e < 2; e++)
+		{
+			unsigned long exponent;
+			exponent = e == 0 ? 3 : 65537;
+			rsa_arg_init(&rsaArgs[i][e], rsaBits[i], exponent);
+			sprintf(names[kernelsCount], "nn_modexp_%u_e%lu", rsaBits[i], exponent);
+			kernels[kernelsCount].name = names[kernelsCount];
+			kernels[kernelsCount].run = kernel_nn_modexp;
+			kernels[kernelsCount].arg = &rsaArgs[i][e];
+			kernels[kernelsCount].bytesPerOp = rsaBits[i] / 8;
+			kernelsCount++;
+			sprintf(names[kernelsCount], "rsa_public_decrypt_%u_e%lu", rsaBits[i], exponent);
+			kernels[kernelsCount].name = names[kernelsCount];
+			kernels[kernelsCount].run = kernel_rsa_public_decrypt;
+			kernels[kernelsCount].arg = &rsaArgs[i][e];
+			kernels[kernelsCount].bytesPerOp = rsaBits[i] / 8;
+			kernelsCount++;
+		}
+	}
+
+	outFile = stdout;
+	if (outPath)
+	{
+		outFile = fopen(outPath, "w");
+		if (!outFile)
+		{
+			fprintf(stderr, "Unable open %s\n", outPath);
+			return 1;
+		}
+	}
+
+	bench_json_begin(&json, outFile);
+	bench_json_string(&json, "benchmark", "kernels");
+	bench_json_host(&json, cpu);
+	bench_json_double(&json, "tsc_cycles_per_ns", cyclesPerNs);
+	bench_json_array(&json, "kernels");
+	for (i = 0; i < kernelsCount; i++)
+	{
+		if (filter && !strstr(kernels[i].name, filter))
+			continue;
+		// Tag store kernels need filled store
+		if (kernels[i].run == kernel_get_tag || kernels[i].run == kernel_set_tag)
+			fill_store(((STORE_ARG*) kernels[i].arg)->storeSize);
+		else if (kernels[i].run == kernel_dol)
+			fill_store(64);
+		else if (kernels[i].run == kernel_cvm_select || kernels[i].run == kernel_cvm_conditions)
+			cvm_store((CVM_ARG*) kernels[i].arg);
+		measure(&kernels[i], &json);
+	}
+	bench_json_close_array(&json);
+	bench_json_end(&json);
+
+	libemv_destroy();
+	if (outFile != stdout)
+		fclose(outFile);
+	return 0;
+}
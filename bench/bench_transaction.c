@@ -0,0 +1,519 @@
+// End-to-end transaction benchmark against simulated card
+// Measures every phase of transaction flow and transactions per second
+// for matrix of card profiles, writes results in JSON
+// Flow in EMV order: selection, GPO, records, offline data authentication, cardholder
+// verification (PIN pad enters right PIN), terminal risk management, terminal action analysis,
+// GENERATE AC and completion approved by simulated issuer if card asks to go online.
+// Phases with DDA or CDA include RSA signature of simulated card, generate_ac_result is wait
+// for check of CDA signature
+//
+// Build (Linux, from repository root):
+// gcc -O2 -o bench_transaction bench/bench_transaction.c bench/bench_common.c sim/card_sim.c *.c crypt/*.c -lpthread
+//
+// Usage: bench_transaction [-n iterations] [-w warmup] [-c cpu] [-d apdu delay us] [-t transport] [-s selection] [-p preprocess] [-a async] [-o results.json]
+//   -t 0: set_function_apdu (default), 1: raw T=0 transport, 2: raw T=0 transport with Le prediction
+//   -s 0: list of AIDs in order of configuration (default), 1: adaptive order, 2: adaptive order with stop on match
+//   -p 1: libemv_preprocess_transaction before every transaction, out of measured phases
+//   -a 1: set_function_run_async with worker thread, CDA signature is checked while GENERATE AC
+//      phase goes on, 0: check by calling thread (default)
+
+#include "../include/libemv.h"
+#include "../sim/card_sim.h"
+#include "bench_common.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Phases of transaction flow
+#define PHASE_BUILD_CANDIDATE_LIST	0
+#define PHASE_APPLICATION_SELECTION	1
+#define PHASE_GET_PROCESSING_OPTION	2
+#define PHASE_READ_APP_DATA			3
+#define PHASE_OFFLINE_DATA_AUTH		4
+#define PHASE_CARDHOLDER_VERIFICATION	5
+#define PHASE_TERMINAL_RISK_MANAGEMENT	6
+#define PHASE_TERMINAL_ACTION_ANALYSIS	7
+#define PHASE_GENERATE_AC			8
+#define PHASE_GENERATE_AC_RESULT	9
+#define PHASE_COMPLETION			10
+#define PHASE_TOTAL					11
+#define PHASES_COUNT				12
+
+static const char* phaseNames[PHASES_COUNT] =
+{
+	"build_candidate_list",
+	"application_selection",
+	"get_processing_option",
+	"read_app_data",
+	"offline_data_authentication",
+	"cardholder_verification",
+	"terminal_risk_management",
+	"terminal_action_analysis",
+	"generate_ac",
+	"generate_ac_result",
+	"completion",
+	"total"
+};
+
+typedef struct
+{
+	const char* name;
+	char hasPSE;
+	char gpoFormat;
+	int aflRecords;
+	char contactless;		// 1 - PPSE and libemv_build_candidate_list_contactless, no cardholder selection
+	char odaMethod;			// CARD_SIM_ODA_...
+} BENCH_PROFILE;
+
+static const BENCH_PROFILE profiles[] =
+{
+	{"pse_format1_small_afl", 1, 1, 3, 0, CARD_SIM_ODA_NONE},
+	{"pse_format1_large_afl", 1, 1, 24, 0, CARD_SIM_ODA_NONE},
+	{"pse_format2_small_afl", 1, 2, 3, 0, CARD_SIM_ODA_NONE},
+	{"pse_format2_large_afl", 1, 2, 24, 0, CARD_SIM_ODA_NONE},
+	{"aidlist_format1_small_afl", 0, 1, 3, 0, CARD_SIM_ODA_NONE},
+	{"aidlist_format1_large_afl", 0, 1, 24, 0, CARD_SIM_ODA_NONE},
+	{"aidlist_format2_small_afl", 0, 2, 3, 0, CARD_SIM_ODA_NONE},
+	{"aidlist_format2_large_afl", 0, 2, 24, 0, CARD_SIM_ODA_NONE},
+	{"ppse_format2_small_afl", 0, 2, 3, 1, CARD_SIM_ODA_NONE},
+	{"ppse_format2_large_afl", 0, 2, 24, 1, CARD_SIM_ODA_NONE},
+	{"pse_format2_dda", 1, 2, 8, 0, CARD_SIM_ODA_DDA},
+	{"pse_format2_cda", 1, 2, 8, 0, CARD_SIM_ODA_CDA}
+};
+
+#define PROFILES_COUNT ((int) (sizeof(profiles) / sizeof(profiles[0])))
+
+// Pre-processing before card is presented (-p)
+static int preprocess;
+static const LIBEMV_TRANSACTION_DATA transactionData =
+{
+	{0x00, 0x00, 0x00, 0x00, 0x10, 0x00},
+	{0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
+	{0x09, 0x78},
+	2,
+	0x00,
+	{0x36, 0x00, 0x40, 0x00}
+};
+
+// Response of simulated issuer to ARQC: Authorisation Response Code "00", Issuer Authentication Data
+static const unsigned char issuerARC[] = {0x30, 0x30};
+static const unsigned char issuerAuthData[] = {0x5B, 0x1E, 0x49, 0x07, 0xC2, 0x7D, 0x33, 0xA0, 0x30, 0x30};
+
+// Worker of set_function_run_async (-a 1), one job waits in slot
+static pthread_mutex_t asyncMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t asyncCond = PTHREAD_COND_INITIALIZER;
+static void (*asyncJob)(void* context);
+static void* asyncContext;
+
+static void* async_worker(void* arg)
+{
+	void (*job)(void* context);
+	void* context;
+
+	(void) arg;
+	while (1)
+	{
+		pthread_mutex_lock(&asyncMutex);
+		while (!asyncJob)
+			pthread_cond_wait(&asyncCond, &asyncMutex);
+		job = asyncJob;
+		context = asyncContext;
+		asyncJob = 0;
+		pthread_cond_broadcast(&asyncCond);
+		pthread_mutex_unlock(&asyncMutex);
+		job(context);
+	}
+	return 0;
+}
+
+static void run_async(void (*job)(void* context), void* context)
+{
+	pthread_mutex_lock(&asyncMutex);
+	while (asyncJob)
+		pthread_cond_wait(&asyncCond, &asyncMutex);
+	asyncJob = job;
+	asyncContext = context;
+	pthread_cond_broadcast(&asyncCond);
+	pthread_mutex_unlock(&asyncMutex);
+}
+
+// PIN pad: cardholder enters right PIN, offline PIN is sent to simulated card by VERIFY
+static int verify_pin(unsigned char method)
+{
+	unsigned char outData[258];
+	int outSize;
+
+	if (method == LIBEMV_CVM_ONLINE_PIN)
+		return LIBEMV_PIN_OK;
+	if (method != LIBEMV_CVM_PLAINTEXT_PIN && method != LIBEMV_CVM_PLAINTEXT_PIN_SIGNATURE)
+		return LIBEMV_PIN_PAD_FAILED;
+	card_sim_apdu(0x00, 0x20, 0x00, 0x80, 8, (const unsigned char*) CARD_SIM_PIN_BLOCK, &outSize, outData);
+	if (outData[0] == 0x90 && outData[1] == 0x00)
+		return LIBEMV_PIN_OK;
+	if (outData[0] == 0x69 && outData[1] == 0x83)
+		return LIBEMV_PIN_TRY_LIMIT_EXCEEDED;
+	return LIBEMV_PIN_WRONG;
+}
+
+// Terminal configuration: several payment systems, like multi-brand terminal
+static void configure_terminal(void)
+{
+	static const LIBEMV_AID aids[][4] =
+	{
+		{
+			{7, {0xA0, 0x00, 0x00, 0x00, 0x03, 0x10, 0x10}, 1},
+			{7, {0xA0, 0x00, 0x00, 0x00, 0x03, 0x20, 0x10}, 1},
+			{7, {0xA0, 0x00, 0x00, 0x00, 0x03, 0x20, 0x20}, 1},
+			{7, {0xA0, 0x00, 0x00, 0x00, 0x03, 0x80, 0x10}, 1}
+		},
+		{
+			{7, {0xA0, 0x00, 0x00, 0x00, 0x04, 0x10, 0x10}, 1},
+			{7, {0xA0, 0x00, 0x00, 0x00, 0x04, 0x30, 0x60}, 1},
+			{7, {0xA0, 0x00, 0x00, 0x00, 0x04, 0x60, 0x00}, 1},
+			{7, {0xA0, 0x00, 0x00, 0x00, 0x04, 0x99, 0x99}, 0}
+		},
+		{
+			{6, {0xA0, 0x00, 0x00, 0x00, 0x25, 0x01}, 1},
+			{7, {0xA0, 0x00, 0x00, 0x00, 0x65, 0x10, 0x10}, 1},
+			{7, {0xA0, 0x00, 0x00, 0x01, 0x52, 0x30, 0x10}, 1},
+			{7, {0xA0, 0x00, 0x00, 0x03, 0x33, 0x01, 0x01}, 1}
+		}
+	};
+	static const unsigned char rids[][5] =
+	{
+		{0xA0, 0x00, 0x00, 0x00, 0x03},
+		{0xA0, 0x00, 0x00, 0x00, 0x04},
+		{0xA0, 0x00, 0x00, 0x00, 0x25}
+	};
+	LIBEMV_GLOBAL globalSettings = {"12345678", {0x08, 0x40}, {0xC1, 0x00, 0xF0, 0xA0, 0x01}, {0xE0, 0xF8, 0xE8}, 0x22};
+	LIBEMV_APPLICATIONS apps[3];
+	int i;
+
+	libemv_set_global_settings(&globalSettings);
+
+	memset(apps, 0, sizeof(apps));
+	for (i = 0; i < 3; i++)
+	{
+		memcpy(apps[i].RID, rids[i], 5);
+		apps[i].aidsCount = 4;
+		memcpy(apps[i].aids, aids[i], sizeof(aids[i]));
+		strcpy(apps[i].strAcquirerIdentifier, "100200");
+		memcpy(apps[i].applicationVersionNumber, "\x00\x8C", 2);
+		memcpy(apps[i].merchantCategoryCode, "\x30\x01", 2);
+		strcpy(apps[i].strMerchantIdentifier, "000000000018003");
+		strcpy(apps[i].strMerchantNameAndLocation, "BENCHMARK SHOP");
+		strcpy(apps[i].strTerminalIdentification, "EMVPOS4 ");
+		memcpy(apps[i].terminalFloorLimit, "\x00\x00\x10\x00", 4);
+		memcpy(apps[i].transactionReferenceCurrency, "\x09\x78", 2);
+	}
+
+	// CA key of simulated card
+	apps[0].publicKeysCount = 1;
+	apps[0].publicKeys[0].keySize = card_sim_ca_key(&apps[0].publicKeys[0].keyIndex, apps[0].publicKeys[0].keyModulus) * 8;
+	memcpy(apps[0].publicKeys[0].keyExponent, "\x00\x00\x03", 3);
+	set_applications_data(apps, 3);
+}
+
+// Run one transaction, store duration of every phase
+// Returns LIBEMV_OK or error of failed phase
+static int run_transaction(const BENCH_PROFILE* profile, unsigned long long* phaseNs)
+{
+	unsigned long long t0, t1;
+	unsigned char method;
+	unsigned char cryptogram;
+	int result;
+	int phase;
+
+	card_sim_reset();
+	if (preprocess && libemv_preprocess_transaction(&transactionData) != LIBEMV_OK)
+		return LIBEMV_UNKNOWN_ERROR;
+
+	t0 = bench_now_ns();
+	if (profile->contactless)
+		result = libemv_build_candidate_list_contactless();
+	else
+		result = libemv_build_candidate_list();
+	t1 = bench_now_ns();
+	phaseNs[PHASE_BUILD_CANDIDATE_LIST] = t1 - t0;
+	if (result != LIBEMV_OK)
+		return result;
+
+	phaseNs[PHASE_APPLICATION_SELECTION] = 0;
+	phaseNs[PHASE_GET_PROCESSING_OPTION] = 0;
+	while (1)
+	{
+		t0 = bench_now_ns();
+		if (profile->contactless)
+			result = libemv_select_application(0);
+		else
+			result = libemv_application_selection();
+		if (result == LIBEMV_NEED_CONFIRM_APPLICATION || result == LIBEMV_NEED_SELECT_APPLICATION)
+			result = libemv_select_application(0);
+		t1 = bench_now_ns();
+		phaseNs[PHASE_APPLICATION_SELECTION] += t1 - t0;
+		if (result < 0 && libemv_count_candidates() == 0)
+			return result;
+		if (result != LIBEMV_OK)
+			continue;
+
+		t0 = bench_now_ns();
+		result = libemv_get_processing_option();
+		t1 = bench_now_ns();
+		phaseNs[PHASE_GET_PROCESSING_OPTION] += t1 - t0;
+		if (result == LIBEMV_OK)
+			break;
+		if (libemv_count_candidates() == 0)
+			return result;
+	}
+
+	t0 = bench_now_ns();
+	result = libemv_read_app_data();
+	t1 = bench_now_ns();
+	phaseNs[PHASE_READ_APP_DATA] = t1 - t0;
+	if (result != LIBEMV_OK)
+		return result;
+
+	t0 = bench_now_ns();
+	result = libemv_dynamic_data_authentication();
+	t1 = bench_now_ns();
+	phaseNs[PHASE_OFFLINE_DATA_AUTH] = t1 - t0;
+	if (result != LIBEMV_OK)
+		return result;
+
+	t0 = bench_now_ns();
+	result = libemv_cardholder_verification(&method);
+	t1 = bench_now_ns();
+	phaseNs[PHASE_CARDHOLDER_VERIFICATION] = t1 - t0;
+	if (result != LIBEMV_OK)
+		return result;
+
+	t0 = bench_now_ns();
+	result = libemv_terminal_risk_management();
+	t1 = bench_now_ns();
+	phaseNs[PHASE_TERMINAL_RISK_MANAGEMENT] = t1 - t0;
+	if (result != LIBEMV_OK)
+		return result;
+
+	t0 = bench_now_ns();
+	result = libemv_terminal_action_analysis(&cryptogram);
+	t1 = bench_now_ns();
+	phaseNs[PHASE_TERMINAL_ACTION_ANALYSIS] = t1 - t0;
+	if (result != LIBEMV_OK)
+		return result;
+
+	t0 = bench_now_ns();
+	result = libemv_generate_ac(cryptogram, &cryptogram);
+	t1 = bench_now_ns();
+	phaseNs[PHASE_GENERATE_AC] = t1 - t0;
+	if (result != LIBEMV_OK)
+		return result;
+
+	// Decision of first GENERATE AC is known after check of CDA signature
+	t0 = bench_now_ns();
+	result = libemv_generate_ac_result(&cryptogram);
+	t1 = bench_now_ns();
+	phaseNs[PHASE_GENERATE_AC_RESULT] = t1 - t0;
+	if (result != LIBEMV_OK)
+		return result;
+
+	// Card asked to go online, issuer approves: EXTERNAL AUTHENTICATE and second GENERATE AC
+	phaseNs[PHASE_COMPLETION] = 0;
+	if (cryptogram == LIBEMV_CRYPTOGRAM_ARQC)
+	{
+		t0 = bench_now_ns();
+		result = libemv_completion(LIBEMV_ONLINE_APPROVED, issuerARC, issuerAuthData, sizeof(issuerAuthData), &cryptogram);
+		if (result == LIBEMV_OK)
+			result = libemv_generate_ac_result(&cryptogram);
+		t1 = bench_now_ns();
+		phaseNs[PHASE_COMPLETION] = t1 - t0;
+	}
+
+	phaseNs[PHASE_TOTAL] = 0;
+	for (phase = 0; phase < PHASE_TOTAL; phase++)
+		phaseNs[PHASE_TOTAL] += phaseNs[phase];
+	return result;
+}
+
+static int run_profile(const BENCH_PROFILE* profile, int iterations, int warmup, int apduDelay, BENCH_JSON* json)
+{
+	CARD_SIM_PROFILE simProfile;
+	unsigned long long* samples[PHASES_COUNT];
+	unsigned long long phaseNs[PHASES_COUNT];
+	unsigned long long startNs, elapsedNs;
+	unsigned long apdus;
+	int i, phase;
+
+	memset(&simProfile, 0, sizeof(simProfile));
+	simProfile.hasPSE = profile->hasPSE;
+	simProfile.hasPPSE = profile->contactless;
+	simProfile.gpoFormat = profile->gpoFormat;
+	simProfile.aflRecords = profile->aflRecords;
+	simProfile.apduDelayMicroseconds = apduDelay;
+	simProfile.odaMethod = profile->odaMethod;
+	card_sim_init(&simProfile);
+
+	for (phase = 0; phase < PHASES_COUNT; phase++)
+	{
+		samples[phase] = (unsigned long long*) malloc(iterations * sizeof(unsigned long long));
+		if (!samples[phase])
+			return 0;
+	}
+
+	for (i = 0; i < warmup; i++)
+	{
+		if (run_transaction(profile, phaseNs) != LIBEMV_OK)
+		{
+			fprintf(stderr, "%s: transaction failed\n", profile->name);
+			return 0;
+		}
+	}
+
+	apdus = card_sim_apdu_count();
+	startNs = bench_now_ns();
+	for (i = 0; i < iterations; i++)
+	{
+		if (run_transaction(profile, phaseNs) != LIBEMV_OK)
+		{
+			fprintf(stderr, "%s: transaction failed\n", profile->name);
+			return 0;
+		}
+		for (phase = 0; phase < PHASES_COUNT; phase++)
+			samples[phase][i] = phaseNs[phase];
+	}
+	elapsedNs = bench_now_ns() - startNs;
+	apdus = card_sim_apdu_count() - apdus;
+
+	bench_json_object(json, 0);
+	bench_json_string(json, "name", profile->name);
+	bench_json_int(json, "pse", profile->hasPSE);
+	bench_json_int(json, "contactless", profile->contactless);
+	bench_json_int(json, "gpo_format", profile->gpoFormat);
+	bench_json_int(json, "afl_records", profile->aflRecords);
+	bench_json_int(json, "oda", profile->odaMethod);
+	bench_json_double(json, "apdus_per_transaction", (double) apdus / iterations);
+	bench_json_double(json, "transactions_per_second", (double) iterations * 1e9 / (double) elapsedNs);
+	bench_json_object(json, "phases");
+	for (phase = 0; phase < PHASES_COUNT; phase++)
+	{
+		BENCH_STATS stats;
+		bench_stats(samples[phase], iterations, &stats);
+		bench_json_stats(json, phaseNames[phase], &stats);
+		free(samples[phase]);
+	}
+	bench_json_close_object(json);
+	bench_json_close_object(json);
+
+	fprintf(stderr, "%-28s %10.0f tps\n", profile->name, (double) iterations * 1e9 / (double) elapsedNs);
+	return 1;
+}
+
+int main(int argc, char** argv)
+{
+	int iterations, warmup, cpu, apduDelay, transport, selection, async;
+	pthread_t asyncThread;
+	const char* outPath;
+	FILE* outFile;
+	BENCH_JSON json;
+	LIBEMV_SETTINGS settings;
+	int i;
+	int ok;
+
+	iterations = 20000;
+	warmup = 1000;
+	cpu = -1;
+	apduDelay = 0;
+	transport = 0;
+	selection = 0;
+	preprocess = 0;
+	async = 0;
+	outPath = 0;
+	for (i = 1; i + 1 < argc; i += 2)
+	{
+		if (strcmp(argv[i], "-n") == 0)
+			iterations = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-w") == 0)
+			warmup = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-c") == 0)
+			cpu = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-d") == 0)
+			apduDelay = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-t") == 0)
+			transport = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-s") == 0)
+			selection = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-p") == 0)
+			preprocess = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-a") == 0)
+			async = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-o") == 0)
+			outPath = argv[i + 1];
+	}
+	if (iterations <= 0)
+		iterations = 1;
+
+	if (cpu >= 0 && !bench_pin_cpu(cpu))
+		fprintf(stderr, "Unable pin to cpu %d\n", cpu);
+
+	outFile = stdout;
+	if (outPath)
+	{
+		outFile = fopen(outPath, "w");
+		if (!outFile)
+		{
+			fprintf(stderr, "Unable open %s\n", outPath);
+			return 1;
+		}
+	}
+
+	libemv_init();
+	configure_terminal();
+	set_function_verify_pin(verify_pin);
+	if (async)
+	{
+		if (pthread_create(&asyncThread, 0, async_worker, 0) != 0)
+		{
+			fprintf(stderr, "Unable create worker thread\n");
+			return 1;
+		}
+		pthread_detach(asyncThread);
+		set_function_run_async(run_async);
+	}
+	if (transport == 0)
+		set_function_apdu(card_sim_apdu);
+	else
+		set_function_transmit(card_sim_transmit, 0);
+
+	// The same PSE and partial selection settings for every selection mode, results are comparable
+	memset(&settings, 0, sizeof(settings));
+	settings.appSelectionUsePSE = 1;
+	settings.appSelectionSupportConfirm = 1;
+	settings.appSelectionPartial = 1;
+	settings.appSelectionSupport = 1;
+	settings.apduPredictLe = transport == 2;
+	settings.appSelectionAdaptiveOrder = selection > 0;
+	settings.appSelectionStopOnMatch = selection == 2;
+	libemv_set_library_settings(&settings);
+
+	bench_json_begin(&json, outFile);
+	bench_json_string(&json, "benchmark", "transaction");
+	bench_json_host(&json, cpu);
+	bench_json_int(&json, "iterations", iterations);
+	bench_json_int(&json, "warmup", warmup);
+	bench_json_int(&json, "apdu_delay_us", apduDelay);
+	bench_json_int(&json, "transport", transport);
+	bench_json_int(&json, "selection", selection);
+	bench_json_int(&json, "preprocess", preprocess);
+	bench_json_int(&json, "async", async);
+	bench_json_array(&json, "profiles");
+	ok = 1;
+	for (i = 0; i < PROFILES_COUNT && ok; i++)
+		ok = run_profile(&profiles[i], iterations, warmup, apduDelay, &json);
+	bench_json_close_array(&json);
+	bench_json_end(&json);
+
+	libemv_destroy();
+	if (outFile != stdout)
+		fclose(outFile);
+	return ok ? 0 : 1;
+}
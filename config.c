@@ -0,0 +1,911 @@
+#include "include/libemv.h"
+#include "internal.h"
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Terminal configuration image (see CONFIG_HEADER): applications, AIDs, CAPKs with variable
+// length data, trie of AIDs and templates of terminal tags. Library reads configuration only
+// from image, so image mapped from file is shared by all processes of host
+
+// Version pinned by transaction of session, see libemv_config_enter
+LIBEMV_SESSION const CONFIG_SNAPSHOT* libemv_snapshot;
+LIBEMV_SESSION const CONFIG_HEADER* libemv_config;
+
+// Version with memory it owns. Image and statistics of AIDs are moved to next version if only
+// LIBEMV_GLOBAL is changed, image of caller of libemv_load_config_image isn't owned
+typedef struct CONFIG_ENTRY
+{
+	CONFIG_SNAPSHOT snapshot;
+	unsigned char* owned;			// Image built by set_applications_data
+	const unsigned char* mapped;	// Image mapped from file
+	size_t mappedSize;
+	char ownsAidHits;
+	char ownsExceptions;
+	unsigned long retiredEpoch;		// Last epoch when version was current
+	struct CONFIG_ENTRY* nextRetired;
+} CONFIG_ENTRY;
+
+// Session pins epoch of configuration for transaction. Version replaced in epoch E is retired
+// with E and freed when no session pinned epoch <= E, sessions never wait for updates
+// Record of session is reused by next session after libemv_destroy_session
+typedef struct CONFIG_READER
+{
+	volatile unsigned long epoch;	// Pinned epoch, 0 - session is out of transaction
+	volatile long used;
+	struct CONFIG_READER* next;
+} CONFIG_READER;
+
+// Written only by thread that updates configuration, read by sessions
+static CONFIG_ENTRY* volatile config_current;
+static volatile unsigned long config_epoch;
+
+// Old versions, only thread that updates configuration uses list
+static CONFIG_ENTRY* config_retired;
+
+// Records of sessions, list only grows
+static CONFIG_READER* volatile config_readers;
+static LIBEMV_SESSION CONFIG_READER* config_reader;
+
+void libemv_init_config(void)
+{
+	libemv_snapshot = 0;
+	libemv_config = 0;
+	config_current = 0;
+	config_epoch = 1;
+	config_retired = 0;
+	config_readers = 0;
+	config_reader = 0;
+}
+
+// Free version and memory it owns
+static void config_free_entry(CONFIG_ENTRY* entry)
+{
+	if (entry->owned)
+		libemv_free(entry->owned);
+	if (entry->mapped)
+		libemv_unmap_file(entry->mapped, entry->mappedSize);
+	if (entry->ownsAidHits)
+		libemv_free(entry->snapshot.aidHits);
+	if (entry->snapshot.globalTemplate)
+		libemv_free((void*) entry->snapshot.globalTemplate);
+	if (entry->ownsExceptions)
+		libemv_free_exception_list((EXCEPTION_LIST*) entry->snapshot.exceptions);
+	libemv_free(entry);
+}
+
+void libemv_destroy_config(void)
+{
+	libemv_config_leave();
+	if (config_current)
+		config_free_entry(config_current);
+	while (config_retired)
+	{
+		CONFIG_ENTRY* next;
+		next = config_retired->nextRetired;
+		config_free_entry(config_retired);
+		config_retired = next;
+	}
+	while (config_readers)
+	{
+		CONFIG_READER* next;
+		next = config_readers->next;
+		libemv_free(config_readers);
+		config_readers = next;
+	}
+	libemv_init_config();
+}
+
+void libemv_destroy_config_session(void)
+{
+	libemv_config_leave();
+	if (config_reader)
+	{
+		config_reader->used = 0;
+		config_reader = 0;
+	}
+}
+
+// Record of calling session, registered on first transaction
+// Returns 0 if no memory
+static CONFIG_READER* config_register(void)
+{
+	CONFIG_READER* reader;
+
+	if (config_reader)
+		return config_reader;
+
+	for (reader = config_readers; reader; reader = reader->next)
+	{
+		if (!reader->used && LIBEMV_CAS_LONG(&reader->used, 0, 1))
+		{
+			config_reader = reader;
+			return reader;
+		}
+	}
+
+	reader = libemv_malloc(sizeof(CONFIG_READER));
+	LIBEMV_STATS_ADD(allocCount, 1);
+	if (!reader)
+		return 0;
+	reader->epoch = 0;
+	reader->used = 1;
+	do
+	{
+		reader->next = config_readers;
+	} while (!LIBEMV_CAS_PTR(&config_readers, reader->next, reader));
+	config_reader = reader;
+	return reader;
+}
+
+int libemv_config_enter(void)
+{
+	CONFIG_READER* reader;
+	CONFIG_ENTRY* entry;
+	unsigned long epoch;
+
+	libemv_config_leave();
+	reader = config_register();
+	if (!reader)
+	{
+		if (libemv_debug_enabled)
+			libemv_printf("Unable allocate memory\n");
+		return LIBEMV_UNKNOWN_ERROR;
+	}
+
+	// Pinned epoch is visible before epoch is checked again: thread that updates configuration
+	// either sees pinned epoch when it frees old version, or session sees new epoch and retries
+	do
+	{
+		epoch = config_epoch;
+		reader->epoch = epoch;
+		LIBEMV_FULL_BARRIER();
+	} while (epoch != config_epoch);
+
+	entry = config_current;
+	libemv_snapshot = entry ? &entry->snapshot : 0;
+	libemv_config = entry ? entry->snapshot.header : 0;
+	return LIBEMV_OK;
+}
+
+void libemv_config_leave(void)
+{
+	libemv_use_tag_template(-1);
+	libemv_snapshot = 0;
+	libemv_config = 0;
+	if (config_reader && config_reader->epoch)
+	{
+		// Reads of version are done before it can be freed
+		LIBEMV_BARRIER();
+		config_reader->epoch = 0;
+	}
+}
+
+const CONFIG_SNAPSHOT* libemv_config_current(void)
+{
+	return config_current ? &config_current->snapshot : 0;
+}
+
+// New version of image with template of global. If sameImage, image and statistics of AIDs
+// are moved from current version, else statistics are kept if count of AIDs isn't changed
+// Version owns exceptions, if it is 0 exception file is moved from current version
+// Returns 0 if no memory
+static CONFIG_ENTRY* config_new_entry(const CONFIG_HEADER* header, const LIBEMV_GLOBAL* global, char sameImage, EXCEPTION_LIST* exceptions)
+{
+	CONFIG_ENTRY* entry;
+	unsigned char* globalTemplate;
+	int size;
+
+	entry = libemv_malloc(sizeof(CONFIG_ENTRY));
+	size = libemv_global_template(global, 0);
+	globalTemplate = libemv_malloc(size > 0 ? size : 1);
+	LIBEMV_STATS_ADD(allocCount, 2);
+	if (!entry || !globalTemplate)
+	{
+		if (entry)
+			libemv_free(entry);
+		if (globalTemplate)
+			libemv_free(globalTemplate);
+		if (libemv_debug_enabled)
+			libemv_printf("Unable allocate memory\n");
+		return 0;
+	}
+	memset(entry, 0, sizeof(CONFIG_ENTRY));
+	entry->snapshot.header = header;
+	entry->snapshot.globalTemplateLength = libemv_global_template(global, globalTemplate);
+	entry->snapshot.globalTemplate = globalTemplate;
+
+	if (sameImage && config_current)
+	{
+		// Nothing can fail after move
+		entry->owned = config_current->owned;
+		entry->mapped = config_current->mapped;
+		entry->mappedSize = config_current->mappedSize;
+		entry->snapshot.aidHits = config_current->snapshot.aidHits;
+		entry->ownsAidHits = config_current->ownsAidHits;
+		config_current->owned = 0;
+		config_current->mapped = 0;
+		config_current->ownsAidHits = 0;
+	} else if (header)
+	{
+		entry->snapshot.aidHits = libemv_malloc((header->aidsCount + 1) * sizeof(unsigned long));
+		LIBEMV_STATS_ADD(allocCount, 1);
+		if (!entry->snapshot.aidHits)
+		{
+			if (libemv_debug_enabled)
+				libemv_printf("Unable allocate memory\n");
+			config_free_entry(entry);
+			return 0;
+		}
+		entry->ownsAidHits = 1;
+		if (config_current && config_current->snapshot.header && config_current->snapshot.header->aidsCount == header->aidsCount)
+			memcpy(entry->snapshot.aidHits, config_current->snapshot.aidHits, (header->aidsCount + 1) * sizeof(unsigned long));
+		else
+			memset(entry->snapshot.aidHits, 0, (header->aidsCount + 1) * sizeof(unsigned long));
+	}
+
+	if (exceptions)
+	{
+		entry->snapshot.exceptions = exceptions;
+		entry->ownsExceptions = 1;
+	} else if (config_current)
+	{
+		entry->snapshot.exceptions = config_current->snapshot.exceptions;
+		entry->ownsExceptions = config_current->ownsExceptions;
+		config_current->ownsExceptions = 0;
+	}
+	return entry;
+}
+
+// Make version current for next transactions, old version is retired
+static void config_publish(CONFIG_ENTRY* entry)
+{
+	CONFIG_ENTRY* old;
+
+	old = config_current;
+	config_current = entry;
+	LIBEMV_FULL_BARRIER();
+	config_epoch++;
+	LIBEMV_FULL_BARRIER();
+
+	if (old)
+	{
+		old->retiredEpoch = config_epoch - 1;
+		old->nextRetired = config_retired;
+		config_retired = old;
+	}
+	libemv_reclaim_config();
+}
+
+LIBEMV_API int libemv_reclaim_config(void)
+{
+	CONFIG_READER* reader;
+	CONFIG_ENTRY** link;
+	unsigned long oldest;
+	int count;
+
+	// Oldest epoch pinned by sessions
+	oldest = ~0UL;
+	LIBEMV_FULL_BARRIER();
+	for (reader = config_readers; reader; reader = reader->next)
+	{
+		unsigned long epoch;
+		epoch = reader->epoch;
+		if (epoch && epoch < oldest)
+			oldest = epoch;
+	}
+
+	count = 0;
+	link = &config_retired;
+	while (*link)
+	{
+		CONFIG_ENTRY* entry;
+		entry = *link;
+		if (entry->retiredEpoch < oldest)
+		{
+			*link = entry->nextRetired;
+			config_free_entry(entry);
+		} else
+		{
+			link = &entry->nextRetired;
+			count++;
+		}
+	}
+	return count;
+}
+
+LIBEMV_API void libemv_end_transaction(void)
+{
+	libemv_config_leave();
+}
+
+int libemv_config_global_changed(void)
+{
+	CONFIG_ENTRY* entry;
+
+	entry = config_new_entry(config_current ? config_current->snapshot.header : 0, &libemv_global, 1, 0);
+	if (!entry)
+		return LIBEMV_UNKNOWN_ERROR;
+	config_publish(entry);
+	return LIBEMV_OK;
+}
+
+int libemv_config_exceptions_changed(EXCEPTION_LIST* exceptions)
+{
+	CONFIG_ENTRY* entry;
+
+	entry = config_new_entry(config_current ? config_current->snapshot.header : 0, &libemv_global, 1, exceptions);
+	if (!entry)
+		return LIBEMV_UNKNOWN_ERROR;
+	config_publish(entry);
+	return LIBEMV_OK;
+}
+
+// FNV-1a
+static unsigned int config_checksum(const unsigned char* data, unsigned int size)
+{
+	unsigned int hash;
+	unsigned int i;
+	hash = 2166136261U;
+	for (i = 0; i < size; i++)
+	{
+		hash ^= data[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+// Section of count elements at offset is inside of image
+static char config_section(const CONFIG_HEADER* header, unsigned int offset, int count, unsigned int elementSize)
+{
+	if (count < 0 || offset > header->size)
+		return 0;
+	return (unsigned int) count <= (header->size - offset) / elementSize;
+}
+
+// Check image before use, image can be from file
+// Returns LIBEMV_OK or LIBEMV_UNKNOWN_ERROR
+static int config_check(const unsigned char* image, int size)
+{
+	const CONFIG_HEADER* header;
+	const CONFIG_APP* apps;
+	const CONFIG_AID* aids;
+	const CONFIG_CAPK* capks;
+	const AID_NODE* nodes;
+	const unsigned int* templates;
+	int i;
+
+	header = (const CONFIG_HEADER*) image;
+	if (size < (int) sizeof(CONFIG_HEADER) || header->magic != CONFIG_MAGIC)
+	{
+		if (libemv_debug_enabled)
+			libemv_printf("Configuration image: wrong format\n");
+		return LIBEMV_UNKNOWN_ERROR;
+	}
+	if (header->version != CONFIG_VERSION)
+	{
+		if (libemv_debug_enabled)
+			libemv_printf("Configuration image: version %u, supported %u\n", header->version, CONFIG_VERSION);
+		return LIBEMV_UNKNOWN_ERROR;
+	}
+	if (header->size < sizeof(CONFIG_HEADER) || header->size > (unsigned int) size
+		|| config_checksum(image + sizeof(CONFIG_HEADER), header->size - sizeof(CONFIG_HEADER)) != header->checksum)
+	{
+		if (libemv_debug_enabled)
+			libemv_printf("Configuration image: wrong size or checksum\n");
+		return LIBEMV_UNKNOWN_ERROR;
+	}
+
+	if (!config_section(header, header->appsOffset, header->appsCount, sizeof(CONFIG_APP))
+		|| !config_section(header, header->aidsOffset, header->aidsCount, sizeof(CONFIG_AID))
+		|| !config_section(header, header->capksOffset, header->capksCount, sizeof(CONFIG_CAPK))
+		|| !config_section(header, header->aidNodesOffset, header->aidNodesCount, sizeof(AID_NODE))
+		|| !config_section(header, header->templatesOffset, header->appsCount + 1, sizeof(unsigned int))
+		|| header->aidNodesCount < 1 || header->appsCount > 0xFFFF)
+	{
+		if (libemv_debug_enabled)
+			libemv_printf("Configuration image: section out of image\n");
+		return LIBEMV_UNKNOWN_ERROR;
+	}
+
+	// References between sections
+	apps = (const CONFIG_APP*) (image + header->appsOffset);
+	aids = (const CONFIG_AID*) (image + header->aidsOffset);
+	capks = (const CONFIG_CAPK*) (image + header->capksOffset);
+	nodes = (const AID_NODE*) (image + header->aidNodesOffset);
+	templates = (const unsigned int*) (image + header->templatesOffset);
+	for (i = 0; i < header->appsCount; i++)
+	{
+		if (apps[i].firstAid < 0 || apps[i].aidsCount < 0 || apps[i].firstAid > header->aidsCount - apps[i].aidsCount
+			|| apps[i].firstCapk < 0 || apps[i].capksCount < 0 || apps[i].firstCapk > header->capksCount - apps[i].capksCount
+			|| !config_section(header, apps[i].defaultDDOLOffset, apps[i].defaultDDOLSize, 1)
+			|| !config_section(header, apps[i].defaultTDOLOffset, apps[i].defaultTDOLSize, 1)
+			|| apps[i].defaultDDOLPlan.count < 0 || apps[i].defaultDDOLPlan.count > MAX_DOL_ENTRIES
+			|| templates[i] > templates[i + 1])
+			break;
+	}
+	if (i < header->appsCount || templates[header->appsCount] > header->size)
+	{
+		if (libemv_debug_enabled)
+			libemv_printf("Configuration image: wrong application %d\n", i);
+		return LIBEMV_UNKNOWN_ERROR;
+	}
+	for (i = 0; i < header->aidsCount; i++)
+	{
+		if (aids[i].app >= header->appsCount || aids[i].aidLength > 16 || !config_section(header, aids[i].aidOffset, aids[i].aidLength, 1))
+			break;
+	}
+	if (i < header->aidsCount)
+	{
+		if (libemv_debug_enabled)
+			libemv_printf("Configuration image: wrong AID %d\n", i);
+		return LIBEMV_UNKNOWN_ERROR;
+	}
+	for (i = 0; i < header->capksCount; i++)
+	{
+		// Sizes are copied to fixed buffers of RSA key by ODA
+		if (capks[i].app >= header->appsCount || capks[i].exponentLength < 1 || capks[i].exponentLength > 3
+			|| (capks[i].modulusLength != 0 && (capks[i].modulusLength < CONFIG_CAPK_MIN_MODULUS
+			|| capks[i].modulusLength > CONFIG_CAPK_MAX_MODULUS))
+			|| !config_section(header, capks[i].exponentOffset, capks[i].exponentLength, 1)
+			|| !config_section(header, capks[i].modulusOffset, capks[i].modulusLength, 1))
+			break;
+	}
+	if (i < header->capksCount)
+	{
+		if (libemv_debug_enabled)
+			libemv_printf("Configuration image: wrong CAPK %d\n", i);
+		return LIBEMV_UNKNOWN_ERROR;
+	}
+	for (i = 0; i < header->aidNodesCount; i++)
+	{
+		if (nodes[i].firstChild >= header->aidNodesCount || nodes[i].nextSibling >= header->aidNodesCount
+			|| (nodes[i].firstChild >= 0 && nodes[i].firstChild <= i) || (nodes[i].nextSibling >= 0 && nodes[i].nextSibling <= i)
+			|| nodes[i].exactOrdinal >= header->aidsCount || nodes[i].partialOrdinal >= header->aidsCount)
+			break;
+	}
+	if (i < header->aidNodesCount)
+	{
+		if (libemv_debug_enabled)
+			libemv_printf("Configuration image: wrong AID index node %d\n", i);
+		return LIBEMV_UNKNOWN_ERROR;
+	}
+
+	return LIBEMV_OK;
+}
+
+static unsigned int align4(unsigned int size)
+{
+	return (size + 3) & ~3U;
+}
+
+// Copy data to pool of image
+// Returns offset of data
+static unsigned int config_pool(unsigned char* outImage, unsigned int* poolOffset, const void* data, int size)
+{
+	unsigned int offset;
+	offset = *poolOffset;
+	if (size > 0)
+		memcpy(outImage + offset, data, size);
+	*poolOffset += size;
+	return offset;
+}
+
+// Size of DOL field, 0 if out of limits
+static int dol_size(int size, int maxSize)
+{
+	return size < 0 || size > maxSize ? 0 : size;
+}
+
+// Exponent without leading zeros (at least 1 byte) and modulus of key
+static void capk_lengths(const LIEBEMV_AUTHORITY_PUBLIC_KEY* key, int* outExponentStart, int* outModulusLength)
+{
+	int exponentStart;
+	for (exponentStart = 0; exponentStart < 2 && key->keyExponent[exponentStart] == 0; exponentStart++)
+		;
+	*outExponentStart = exponentStart;
+	*outModulusLength = key->keySize / 8;
+	if (*outModulusLength < CONFIG_CAPK_MIN_MODULUS || *outModulusLength > (int) sizeof(key->keyModulus))
+		*outModulusLength = 0;
+}
+
+LIBEMV_API int libemv_build_config_image(const LIBEMV_GLOBAL* global, const LIBEMV_APPLICATIONS* apps, int countApps,
+										 unsigned char* outImage, int maxSize)
+{
+	CONFIG_HEADER header;
+	AID_NODE* nodes;
+	unsigned int* templates;
+	unsigned int poolSize;
+	unsigned int poolOffset;
+	int totalBytes;
+	int i, j;
+
+	if (countApps < 0 || countApps > 0xFFFF)
+		return 0;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = CONFIG_MAGIC;
+	header.version = CONFIG_VERSION;
+	if (global)
+		memcpy(&header.global, global, sizeof(LIBEMV_GLOBAL));
+	header.appsCount = countApps;
+
+	// Counts and size of variable length data
+	poolSize = 0;
+	totalBytes = 0;
+	for (i = 0; i < countApps; i++)
+	{
+		int aidsCount;
+		int capksCount;
+		aidsCount = apps[i].aidsCount < 0 ? 0 : apps[i].aidsCount;
+		capksCount = apps[i].publicKeysCount < 0 ? 0 : apps[i].publicKeysCount;
+		if (aidsCount > (int) (sizeof(apps[i].aids) / sizeof(apps[i].aids[0])))
+			aidsCount = sizeof(apps[i].aids) / sizeof(apps[i].aids[0]);
+		if (capksCount > (int) (sizeof(apps[i].publicKeys) / sizeof(apps[i].publicKeys[0])))
+			capksCount = sizeof(apps[i].publicKeys) / sizeof(apps[i].publicKeys[0]);
+		header.aidsCount += aidsCount;
+		header.capksCount += capksCount;
+		for (j = 0; j < aidsCount; j++)
+		{
+			if (apps[i].aids[j].aidLength > 0 && apps[i].aids[j].aidLength <= (int) sizeof(apps[i].aids[j].aid))
+			{
+				poolSize += apps[i].aids[j].aidLength;
+				totalBytes += apps[i].aids[j].aidLength;
+			}
+		}
+		for (j = 0; j < capksCount; j++)
+		{
+			int exponentStart;
+			int modulusLength;
+			capk_lengths(&apps[i].publicKeys[j], &exponentStart, &modulusLength);
+			poolSize += 3 - exponentStart + modulusLength;
+		}
+		poolSize += dol_size(apps[i].defaultDDOLSize, sizeof(apps[i].defaultDDOL));
+		poolSize += dol_size(apps[i].defaultTDOLSize, sizeof(apps[i].defaultTDOL));
+		poolSize += libemv_app_template(&apps[i], 0);
+	}
+
+	// Trie is built to temporary memory, image gets only used nodes
+	nodes = libemv_malloc((totalBytes + 1) * sizeof(AID_NODE));
+	if (!nodes)
+		return 0;
+	header.aidNodesCount = libemv_build_aid_trie(apps, countApps, nodes);
+
+	// Layout
+	header.appsOffset = align4(sizeof(CONFIG_HEADER));
+	header.aidsOffset = align4(header.appsOffset + countApps * sizeof(CONFIG_APP));
+	header.capksOffset = align4(header.aidsOffset + header.aidsCount * sizeof(CONFIG_AID));
+	header.aidNodesOffset = align4(header.capksOffset + header.capksCount * sizeof(CONFIG_CAPK));
+	header.templatesOffset = align4(header.aidNodesOffset + header.aidNodesCount * sizeof(AID_NODE));
+	poolOffset = header.templatesOffset + (countApps + 1) * sizeof(unsigned int);
+	header.size = align4(poolOffset + poolSize);
+
+	if (!outImage)
+	{
+		libemv_free(nodes);
+		return header.size;
+	}
+	if (maxSize < (int) header.size)
+	{
+		libemv_free(nodes);
+		return 0;
+	}
+
+	memset(outImage, 0, header.size);
+	memcpy(outImage + header.aidNodesOffset, nodes, header.aidNodesCount * sizeof(AID_NODE));
+	libemv_free(nodes);
+
+	// Templates first, then other data, pool isn't aligned
+	templates = (unsigned int*) (outImage + header.templatesOffset);
+	for (i = 0; i < countApps; i++)
+	{
+		templates[i] = poolOffset;
+		poolOffset += libemv_app_template(&apps[i], outImage + poolOffset);
+	}
+	templates[countApps] = poolOffset;
+
+	{
+		CONFIG_APP* configApps;
+		CONFIG_AID* configAids;
+		CONFIG_CAPK* configCapks;
+		int ordinal;
+		int capk;
+
+		configApps = (CONFIG_APP*) (outImage + header.appsOffset);
+		configAids = (CONFIG_AID*) (outImage + header.aidsOffset);
+		configCapks = (CONFIG_CAPK*) (outImage + header.capksOffset);
+		ordinal = 0;
+		capk = 0;
+		for (i = 0; i < countApps; i++)
+		{
+			const LIBEMV_APPLICATIONS* app;
+			CONFIG_APP* configApp;
+			int aidsCount;
+			int capksCount;
+
+			app = &apps[i];
+			configApp = &configApps[i];
+			aidsCount = app->aidsCount < 0 ? 0 : app->aidsCount;
+			capksCount = app->publicKeysCount < 0 ? 0 : app->publicKeysCount;
+			if (aidsCount > (int) (sizeof(app->aids) / sizeof(app->aids[0])))
+				aidsCount = sizeof(app->aids) / sizeof(app->aids[0]);
+			if (capksCount > (int) (sizeof(app->publicKeys) / sizeof(app->publicKeys[0])))
+				capksCount = sizeof(app->publicKeys) / sizeof(app->publicKeys[0]);
+
+			memcpy(configApp->RID, app->RID, 5);
+			memcpy(configApp->applicationVersionNumber, app->applicationVersionNumber, 2);
+			memcpy(configApp->merchantCategoryCode, app->merchantCategoryCode, 2);
+			memcpy(configApp->terminalActionCodeDefault, app->terminalActionCodeDefault, 5);
+			memcpy(configApp->terminalActionCodeDenial, app->terminalActionCodeDenial, 5);
+			memcpy(configApp->terminalActionCodeOnline, app->terminalActionCodeOnline, 5);
+			memcpy(configApp->terminalFloorLimit, app->terminalFloorLimit, 4);
+			memcpy(configApp->thresholdValueForRandomSelection, app->thresholdValueForRandomSelection, 4);
+			memcpy(configApp->transactionReferenceCurrency, app->transactionReferenceCurrency, 2);
+			memcpy(configApp->transactionReferenceCurrencyConv, app->transactionReferenceCurrencyConv, 4);
+			configApp->transactionReferenceCurrencyExponent = app->transactionReferenceCurrencyExponent;
+			configApp->targetForRandomSelection = (unsigned char) app->targetForRandomSelection;
+			configApp->maxTargetForBiasedRandomSelection = (unsigned char) app->maxTargetForBiasedRandomSelection;
+			configApp->defaultDDOLSize = dol_size(app->defaultDDOLSize, sizeof(app->defaultDDOL));
+			configApp->defaultDDOLOffset = config_pool(outImage, &poolOffset, app->defaultDDOL, configApp->defaultDDOLSize);
+			if (!libemv_compile_dol(app->defaultDDOL, configApp->defaultDDOLSize, &configApp->defaultDDOLPlan))
+				memset(&configApp->defaultDDOLPlan, 0, sizeof(configApp->defaultDDOLPlan));
+			configApp->defaultTDOLSize = dol_size(app->defaultTDOLSize, sizeof(app->defaultTDOL));
+			configApp->defaultTDOLOffset = config_pool(outImage, &poolOffset, app->defaultTDOL, configApp->defaultTDOLSize);
+
+			configApp->firstAid = ordinal;
+			configApp->aidsCount = aidsCount;
+			for (j = 0; j < aidsCount; j++, ordinal++)
+			{
+				const LIBEMV_AID* aid;
+				aid = &app->aids[j];
+				configAids[ordinal].app = (unsigned short) i;
+				configAids[ordinal].applicationSelectionIndicator = aid->applicationSelectionIndicator;
+				if (aid->aidLength > 0 && aid->aidLength <= (int) sizeof(aid->aid))
+				{
+					configAids[ordinal].aidLength = (unsigned char) aid->aidLength;
+					configAids[ordinal].aidOffset = config_pool(outImage, &poolOffset, aid->aid, aid->aidLength);
+				}
+			}
+
+			configApp->firstCapk = capk;
+			configApp->capksCount = capksCount;
+			for (j = 0; j < capksCount; j++, capk++)
+			{
+				const LIEBEMV_AUTHORITY_PUBLIC_KEY* key;
+				int exponentStart;
+				int modulusLength;
+
+				key = &app->publicKeys[j];
+				capk_lengths(key, &exponentStart, &modulusLength);
+
+				configCapks[capk].app = (unsigned short) i;
+				configCapks[capk].keyIndex = key->keyIndex;
+				configCapks[capk].exponentLength = (unsigned char) (3 - exponentStart);
+				configCapks[capk].exponentOffset = config_pool(outImage, &poolOffset, key->keyExponent + exponentStart, 3 - exponentStart);
+				configCapks[capk].modulusLength = (unsigned short) modulusLength;
+				configCapks[capk].modulusOffset = config_pool(outImage, &poolOffset, key->keyModulus, modulusLength);
+				memcpy(configCapks[capk].checkSum, key->checkSum, 20);
+			}
+		}
+	}
+
+	header.checksum = config_checksum(outImage + sizeof(CONFIG_HEADER), header.size - sizeof(CONFIG_HEADER));
+	memcpy(outImage, &header, sizeof(CONFIG_HEADER));
+	return header.size;
+}
+
+
+LIBEMV_API int libemv_load_config_image(const unsigned char* image, int size)
+{
+	const CONFIG_HEADER* header;
+	CONFIG_ENTRY* entry;
+
+	if (config_check(image, size) != LIBEMV_OK)
+		return LIBEMV_UNKNOWN_ERROR;
+	header = (const CONFIG_HEADER*) image;
+	entry = config_new_entry(header, &header->global, 0, 0);
+	if (!entry)
+		return LIBEMV_UNKNOWN_ERROR;
+	memcpy(&libemv_global, &header->global, sizeof(LIBEMV_GLOBAL));
+	config_publish(entry);
+	return LIBEMV_OK;
+}
+
+const unsigned char* libemv_map_file(const char* path, size_t* outSize)
+{
+	void* mapped;
+
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+	LARGE_INTEGER fileSize;
+
+	file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	if (file == INVALID_HANDLE_VALUE)
+		return 0;
+	if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart <= 0 || fileSize.QuadPart > 0x7FFFFFFF)
+	{
+		CloseHandle(file);
+		return 0;
+	}
+	*outSize = (size_t) fileSize.QuadPart;
+	mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+	CloseHandle(file);
+	if (!mapping)
+		return 0;
+	mapped = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	return (const unsigned char*) mapped;
+#else
+	int fd;
+	struct stat st;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0 || st.st_size > 0x7FFFFFFF)
+	{
+		close(fd);
+		return 0;
+	}
+	*outSize = (size_t) st.st_size;
+
+	// Read only shared mapping, pages are in page cache once per host
+	mapped = mmap(0, *outSize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED)
+		return 0;
+	return (const unsigned char*) mapped;
+#endif
+}
+
+unsigned char* libemv_map_file_writable(const char* path, size_t size, void** outFile)
+{
+	void* mapped;
+
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+
+	*outFile = 0;
+	file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, 0, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+	if (file == INVALID_HANDLE_VALUE)
+		return 0;
+	// Mapping extends file to size
+	mapping = CreateFileMappingA(file, 0, PAGE_READWRITE, 0, (DWORD) size, 0);
+	if (!mapping)
+	{
+		CloseHandle(file);
+		return 0;
+	}
+	mapped = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size);
+	CloseHandle(mapping);
+	if (!mapped)
+	{
+		CloseHandle(file);
+		return 0;
+	}
+
+	// Handle is kept for FlushFileBuffers, see libemv_sync_file
+	*outFile = file;
+	return (unsigned char*) mapped;
+#else
+	int fd;
+	struct stat st;
+
+	// msync of mapping writes file, descriptor isn't kept
+	*outFile = 0;
+	fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd < 0)
+		return 0;
+	if (fstat(fd, &st) != 0 || (st.st_size < (off_t) size && ftruncate(fd, (off_t) size) != 0))
+	{
+		close(fd);
+		return 0;
+	}
+
+	// Written pages are in page cache, so they survive crash of process
+	mapped = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapped == MAP_FAILED)
+		return 0;
+	return (unsigned char*) mapped;
+#endif
+}
+
+void libemv_unmap_file(const unsigned char* mapped, size_t size)
+{
+#ifdef _WIN32
+	UnmapViewOfFile(mapped);
+#else
+	munmap((void*) mapped, size);
+#endif
+}
+
+void libemv_close_file(void* file)
+{
+#ifdef _WIN32
+	if (file)
+		CloseHandle((HANDLE) file);
+#endif
+}
+
+void libemv_sync_file(void* file, const unsigned char* address, size_t size)
+{
+#ifdef _WIN32
+	// View is written to cache of system, file buffers are written to disk
+	FlushViewOfFile(address, size);
+	if (file)
+		FlushFileBuffers((HANDLE) file);
+#else
+	size_t page;
+	size_t offset;
+
+	// Start of range must be aligned to page
+	page = (size_t) sysconf(_SC_PAGESIZE);
+	offset = (size_t) address % page;
+	msync((void*) (address - offset), size + offset, MS_SYNC);
+#endif
+}
+
+LIBEMV_API int libemv_map_config_file(const char* path)
+{
+	const CONFIG_HEADER* header;
+	CONFIG_ENTRY* entry;
+	const unsigned char* mapped;
+	size_t size;
+
+	mapped = libemv_map_file(path, &size);
+	if (!mapped)
+		return LIBEMV_UNKNOWN_ERROR;
+
+	// New file is checked before it is published, sessions keep their version
+	header = (const CONFIG_HEADER*) mapped;
+	entry = config_check(mapped, (int) size) == LIBEMV_OK ? config_new_entry(header, &header->global, 0, 0) : 0;
+	if (!entry)
+	{
+		libemv_unmap_file(mapped, size);
+		return LIBEMV_UNKNOWN_ERROR;
+	}
+	entry->mapped = mapped;
+	entry->mappedSize = size;
+	memcpy(&libemv_global, &header->global, sizeof(LIBEMV_GLOBAL));
+	config_publish(entry);
+	return LIBEMV_OK;
+}
+
+int libemv_config_from_applications(const LIBEMV_APPLICATIONS* apps, int countApps)
+{
+	CONFIG_ENTRY* entry;
+	unsigned char* image;
+	int size;
+
+	size = libemv_build_config_image(&libemv_global, apps, countApps, 0, 0);
+	if (size <= 0)
+		return LIBEMV_UNKNOWN_ERROR;
+	image = libemv_malloc(size);
+	LIBEMV_STATS_ADD(allocCount, 1);
+	if (!image)
+	{
+		if (libemv_debug_enabled)
+			libemv_printf("Unable allocate memory\n");
+		return LIBEMV_UNKNOWN_ERROR;
+	}
+	libemv_build_config_image(&libemv_global, apps, countApps, image, size);
+
+	entry = config_new_entry((const CONFIG_HEADER*) image, &libemv_global, 0, 0);
+	if (!entry)
+	{
+		libemv_free(image);
+		return LIBEMV_UNKNOWN_ERROR;
+	}
+	entry->owned = image;
+	config_publish(entry);
+	return LIBEMV_OK;
+}
@@ -0,0 +1,371 @@
+#include "des.h"
+#include "des_batch.h"
+#include <string.h>
+
+// Lane: bit of DES_BATCH_BITS blocks, word: part of lane for loading and storing of blocks (up to 64 blocks)
+#if DES_BATCH_BITS == 32
+typedef unsigned int DES_LANE;
+typedef unsigned int DES_WORD;
+#elif DES_BATCH_BITS == 64
+typedef unsigned long long DES_LANE;
+typedef unsigned long long DES_WORD;
+#elif DES_BATCH_BITS == 128 || DES_BATCH_BITS == 256
+typedef unsigned long long DES_LANE __attribute__((vector_size(DES_BATCH_BITS / 8)));
+typedef unsigned long long DES_WORD;
+#else
+#error DES_BATCH_BITS must be 32, 64, 128 or 256
+#endif
+
+#define DES_WORD_BITS	((int) sizeof(DES_WORD) * 8)
+#define DES_LANE_WORDS	(DES_BATCH_BITS / DES_WORD_BITS)
+
+// Tables of FIPS 46-3, bits are numbered from 1 (most significant bit of byte 0)
+static const unsigned char initialPermutation[64] =
+{
+	58, 50, 42, 34, 26, 18, 10, 2, 60, 52, 44, 36, 28, 20, 12, 4,
+	62, 54, 46, 38, 30, 22, 14, 6, 64, 56, 48, 40, 32, 24, 16, 8,
+	57, 49, 41, 33, 25, 17, 9, 1, 59, 51, 43, 35, 27, 19, 11, 3,
+	61, 53, 45, 37, 29, 21, 13, 5, 63, 55, 47, 39, 31, 23, 15, 7
+};
+
+static const unsigned char expansion[48] =
+{
+	32, 1, 2, 3, 4, 5, 4, 5, 6, 7, 8, 9,
+	8, 9, 10, 11, 12, 13, 12, 13, 14, 15, 16, 17,
+	16, 17, 18, 19, 20, 21, 20, 21, 22, 23, 24, 25,
+	24, 25, 26, 27, 28, 29, 28, 29, 30, 31, 32, 1
+};
+
+static const unsigned char permutation[32] =
+{
+	16, 7, 20, 21, 29, 12, 28, 17, 1, 15, 23, 26, 5, 18, 31, 10,
+	2, 8, 24, 14, 32, 27, 3, 9, 19, 13, 30, 6, 22, 11, 4, 25
+};
+
+static const unsigned char permutedChoice1[56] =
+{
+	57, 49, 41, 33, 25, 17, 9, 1, 58, 50, 42, 34, 26, 18,
+	10, 2, 59, 51, 43, 35, 27, 19, 11, 3, 60, 52, 44, 36,
+	63, 55, 47, 39, 31, 23, 15, 7, 62, 54, 46, 38, 30, 22,
+	14, 6, 61, 53, 45, 37, 29, 21, 13, 5, 28, 20, 12, 4
+};
+
+static const unsigned char permutedChoice2[48] =
+{
+	14, 17, 11, 24, 1, 5, 3, 28, 15, 6, 21, 10,
+	23, 19, 12, 4, 26, 8, 16, 7, 27, 20, 13, 2,
+	41, 52, 31, 37, 47, 55, 30, 40, 51, 45, 33, 48,
+	44, 49, 39, 56, 34, 53, 46, 42, 50, 36, 29, 32
+};
+
+static const unsigned char shifts[16] = {1, 1, 2, 2, 2, 2, 2, 2, 1, 2, 2, 2, 2, 2, 2, 1};
+
+// S-boxes, row (inputs 1 and 6) by 16 columns (inputs 2-5)
+static const unsigned char sboxes[8][64] =
+{
+	{
+		14, 4, 13, 1, 2, 15, 11, 8, 3, 10, 6, 12, 5, 9, 0, 7,
+		0, 15, 7, 4, 14, 2, 13, 1, 10, 6, 12, 11, 9, 5, 3, 8,
+		4, 1, 14, 8, 13, 6, 2, 11, 15, 12, 9, 7, 3, 10, 5, 0,
+		15, 12, 8, 2, 4, 9, 1, 7, 5, 11, 3, 14, 10, 0, 6, 13
+	},
+	{
+		15, 1, 8, 14, 6, 11, 3, 4, 9, 7, 2, 13, 12, 0, 5, 10,
+		3, 13, 4, 7, 15, 2, 8, 14, 12, 0, 1, 10, 6, 9, 11, 5,
+		0, 14, 7, 11, 10, 4, 13, 1, 5, 8, 12, 6, 9, 3, 2, 15,
+		13, 8, 10, 1, 3, 15, 4, 2, 11, 6, 7, 12, 0, 5, 14, 9
+	},
+	{
+		10, 0, 9, 14, 6, 3, 15, 5, 1, 13, 12, 7, 11, 4, 2, 8,
+		13, 7, 0, 9, 3, 4, 6, 10, 2, 8, 5, 14, 12, 11, 15, 1,
+		13, 6, 4, 9, 8, 15, 3, 0, 11, 1, 2, 12, 5, 10, 14, 7,
+		1, 10, 13, 0, 6, 9, 8, 7, 4, 15, 14, 3, 11, 5, 2, 12
+	},
+	{
+		7, 13, 14, 3, 0, 6, 9, 10, 1, 2, 8, 5, 11, 12, 4, 15,
+		13, 8, 11, 5, 6, 15, 0, 3, 4, 7, 2, 12, 1, 10, 14, 9,
+		10, 6, 9, 0, 12, 11, 7, 13, 15, 1, 3, 14, 5, 2, 8, 4,
+		3, 15, 0, 6, 10, 1, 13, 8, 9, 4, 5, 11, 12, 7, 2, 14
+	},
+	{
+		2, 12, 4, 1, 7, 10, 11, 6, 8, 5, 3, 15, 13, 0, 14, 9,
+		14, 11, 2, 12, 4, 7, 13, 1, 5, 0, 15, 10, 3, 9, 8, 6,
+		4, 2, 1, 11, 10, 13, 7, 8, 15, 9, 12, 5, 6, 3, 0, 14,
+		11, 8, 12, 7, 1, 14, 2, 13, 6, 15, 0, 9, 10, 4, 5, 3
+	},
+	{
+		12, 1, 10, 15, 9, 2, 6, 8, 0, 13, 3, 4, 14, 7, 5, 11,
+		10, 15, 4, 2, 7, 12, 9, 5, 6, 1, 13, 14, 0, 11, 3, 8,
+		9, 14, 15, 5, 2, 8, 12, 3, 7, 0, 4, 10, 1, 13, 11, 6,
+		4, 3, 2, 12, 9, 5, 15, 10, 11, 14, 1, 7, 6, 0, 8, 13
+	},
+	{
+		4, 11, 2, 14, 15, 0, 8, 13, 3, 12, 9, 7, 5, 10, 6, 1,
+		13, 0, 11, 7, 4, 9, 1, 10, 14, 3, 5, 12, 2, 15, 8, 6,
+		1, 4, 11, 13, 12, 3, 7, 14, 10, 15, 6, 8, 0, 5, 9, 2,
+		6, 11, 13, 8, 1, 4, 10, 7, 9, 5, 0, 15, 14, 2, 3, 12
+	},
+	{
+		13, 2, 8, 4, 6, 15, 11, 1, 10, 9, 3, 14, 5, 0, 12, 7,
+		1, 15, 13, 8, 10, 3, 7, 4, 12, 5, 6, 11, 0, 14, 9, 2,
+		7, 11, 4, 1, 9, 12, 14, 2, 0, 6, 10, 13, 15, 3, 5, 8,
+		2, 1, 14, 7, 4, 10, 8, 13, 15, 12, 9, 0, 3, 5, 6, 11
+	}
+};
+
+void des_batch_init(des_batch_context* ctx)
+{
+	int round, shift, i, s, o, k, t;
+
+	// Subkey bit i of round is bit of C (0..27) or D (28..55) rotated left by sum of shifts
+	shift = 0;
+	for (round = 0; round < 16; round++)
+	{
+		shift += shifts[round];
+		for (i = 0; i < 48; i++)
+		{
+			int position;
+			position = permutedChoice2[i] - 1;
+			if (position < 28)
+				position = (position + shift) % 28;
+			else
+				position = 28 + (position - 28 + shift) % 28;
+			ctx->keyBits[round][i] = (unsigned char) (permutedChoice1[position] - 1);
+		}
+	}
+
+	// Bit t of function is output for inputs 5, 6 equal to t >> 1, t & 1
+	for (s = 0; s < 8; s++)
+	{
+		for (o = 0; o < 4; o++)
+		{
+			for (k = 0; k < 16; k++)
+			{
+				unsigned char function;
+				function = 0;
+				for (t = 0; t < 4; t++)
+				{
+					int input, row, column;
+					input = (k << 2) | t;
+					row = ((input >> 4) & 2) | (input & 1);
+					column = (input >> 1) & 0x0F;
+					function |= (unsigned char) (((sboxes[s][row * 16 + column] >> (3 - o)) & 1) << t);
+				}
+				ctx->sboxFunctions[s][o][k] = function;
+			}
+		}
+	}
+
+	for (i = 0; i < 32; i++)
+		ctx->outputBits[permutation[i] - 1] = (unsigned char) i;
+}
+
+// Transpose of 64 x 64 bit matrix, column 0 is most significant bit
+static void des_batch_transpose(unsigned long long* rows)
+{
+	unsigned long long mask, t;
+	int j, k;
+
+	mask = 0x00000000FFFFFFFFULL;
+	for (j = 32; j != 0; j >>= 1, mask ^= mask << j)
+	{
+		for (k = 0; k < 64; k = ((k | j) + 1) & ~j)
+		{
+			t = (rows[k] ^ (rows[k | j] >> j)) & mask;
+			rows[k] ^= t;
+			rows[k | j] ^= t << j;
+		}
+	}
+}
+
+// Bit j of block b (stride bytes between blocks) to bit b of lane j
+// Block b is row 63 - b of transposed matrix, so bit b of row j of result is block b
+static void des_batch_load(DES_LANE* lanes, const unsigned char* blocks, int stride, int count)
+{
+	DES_WORD words[64][DES_LANE_WORDS];
+	unsigned long long rows[64];
+	int group, b, j, n;
+
+	for (group = 0; group < DES_LANE_WORDS; group++)
+	{
+		n = count - group * DES_WORD_BITS;
+		n = n < 0 ? 0 : n > DES_WORD_BITS ? DES_WORD_BITS : n;
+		memset(rows, 0, sizeof(rows));
+		for (b = 0; b < n; b++)
+		{
+			const unsigned char* block;
+			block = blocks + (size_t) (group * DES_WORD_BITS + b) * stride;
+			for (j = 0; j < 8; j++)
+				rows[63 - b] = (rows[63 - b] << 8) | block[j];
+		}
+		des_batch_transpose(rows);
+		for (j = 0; j < 64; j++)
+			words[j][group] = (DES_WORD) rows[j];
+	}
+	memcpy(lanes, words, sizeof(words));
+}
+
+static void des_batch_store(const DES_LANE* lanes, unsigned char* blocks, int count)
+{
+	DES_WORD words[64][DES_LANE_WORDS];
+	unsigned long long rows[64];
+	int group, b, j, n;
+
+	memcpy(words, lanes, sizeof(words));
+	for (group = 0; group < DES_LANE_WORDS && group * DES_WORD_BITS < count; group++)
+	{
+		n = count - group * DES_WORD_BITS;
+		n = n > DES_WORD_BITS ? DES_WORD_BITS : n;
+		for (j = 0; j < 64; j++)
+			rows[j] = words[j][group];
+		des_batch_transpose(rows);
+		for (b = 0; b < n; b++)
+		{
+			unsigned char* block;
+			block = blocks + (size_t) (group * DES_WORD_BITS + b) * 8;
+			for (j = 0; j < 8; j++)
+				block[j] = (unsigned char) (rows[63 - b] >> (56 - j * 8));
+		}
+	}
+}
+
+// Outputs of S-box: minterms of inputs 1-4 select function of inputs 5, 6
+static void des_batch_sbox(const unsigned char functions[4][16], const DES_LANE* x, DES_LANE* out)
+{
+	DES_LANE high[4], low[4], minterms[16], last[4], values[16];
+	int i, j, o;
+
+	high[0] = ~x[0] & ~x[1];
+	high[1] = ~x[0] & x[1];
+	high[2] = x[0] & ~x[1];
+	high[3] = x[0] & x[1];
+	low[0] = ~x[2] & ~x[3];
+	low[1] = ~x[2] & x[3];
+	low[2] = x[2] & ~x[3];
+	low[3] = x[2] & x[3];
+	for (i = 0; i < 4; i++)
+	{
+		for (j = 0; j < 4; j++)
+			minterms[i * 4 + j] = high[i] & low[j];
+	}
+
+	// All 16 functions of inputs 5, 6
+	last[0] = ~x[4] & ~x[5];
+	last[1] = ~x[4] & x[5];
+	last[2] = x[4] & ~x[5];
+	last[3] = x[4] & x[5];
+	values[0] = last[0] ^ last[0];
+	values[1] = last[0];
+	values[2] = last[1];
+	values[3] = last[0] | last[1];
+	values[4] = last[2];
+	values[8] = last[3];
+	values[12] = last[2] | last[3];
+	for (i = 5; i < 16; i++)
+	{
+		if (i & 3)
+			values[i] = values[i & 3] | values[i & 12];
+	}
+
+	for (o = 0; o < 4; o++)
+	{
+		DES_LANE value;
+		value = minterms[0] & values[functions[o][0]];
+		for (i = 1; i < 16; i++)
+			value |= minterms[i] & values[functions[o][i]];
+		out[o] = value;
+	}
+}
+
+// DES of bitsliced block with bitsliced key in place
+static void des_batch_block(const des_batch_context* ctx, DES_LANE* block, const DES_LANE* key, int mode)
+{
+	DES_LANE halves[64];
+	DES_LANE x[6];
+	DES_LANE out[4];
+	DES_LANE* left;
+	DES_LANE* right;
+	DES_LANE* swap;
+	int round, s, j;
+
+	for (j = 0; j < 64; j++)
+		halves[j] = block[initialPermutation[j] - 1];
+	left = halves;
+	right = halves + 32;
+
+	for (round = 0; round < 16; round++)
+	{
+		const unsigned char* keyBits;
+		keyBits = ctx->keyBits[mode == DES_ENCRYPT ? round : 15 - round];
+		for (s = 0; s < 8; s++)
+		{
+			for (j = 0; j < 6; j++)
+				x[j] = right[expansion[s * 6 + j] - 1] ^ key[keyBits[s * 6 + j]];
+			des_batch_sbox((const unsigned char (*)[16]) ctx->sboxFunctions[s], x, out);
+			for (j = 0; j < 4; j++)
+				left[ctx->outputBits[s * 4 + j]] ^= out[j];
+		}
+		swap = left;
+		left = right;
+		right = swap;
+	}
+
+	// Output is R16 L16 with inverse of initial permutation
+	for (j = 0; j < 32; j++)
+	{
+		block[initialPermutation[j] - 1] = right[j];
+		block[initialPermutation[j + 32] - 1] = left[j];
+	}
+}
+
+void des3_batch_crypt_ecb(const des_batch_context* ctx, int mode, const unsigned char* keys,
+						  const unsigned char* input, unsigned char* output, int count)
+{
+	DES_LANE block[64];
+	DES_LANE key1[64];
+	DES_LANE key2[64];
+	int first, n;
+
+	for (first = 0; first < count; first += DES_BATCH_BITS)
+	{
+		n = count - first < DES_BATCH_BITS ? count - first : DES_BATCH_BITS;
+		des_batch_load(key1, keys + first * 16, 16, n);
+		des_batch_load(key2, keys + first * 16 + 8, 16, n);
+		des_batch_load(block, input + first * 8, 8, n);
+		des_batch_block(ctx, block, key1, mode);
+		des_batch_block(ctx, block, key2, mode == DES_ENCRYPT ? DES_DECRYPT : DES_ENCRYPT);
+		des_batch_block(ctx, block, key1, mode);
+		des_batch_store(block, output + first * 8, n);
+	}
+}
+
+void des_batch_mac_alg3(const des_batch_context* ctx, const unsigned char* keys,
+						const unsigned char* data, int size, unsigned char* outMac, int count)
+{
+	DES_LANE state[64];
+	DES_LANE block[64];
+	DES_LANE key1[64];
+	DES_LANE key2[64];
+	int first, n, offset, j;
+
+	for (first = 0; first < count; first += DES_BATCH_BITS)
+	{
+		n = count - first < DES_BATCH_BITS ? count - first : DES_BATCH_BITS;
+		des_batch_load(key1, keys + first * 16, 16, n);
+		des_batch_load(key2, keys + first * 16 + 8, 16, n);
+
+		// Zero initial value
+		for (j = 0; j < 64; j++)
+			state[j] = key1[j] ^ key1[j];
+		for (offset = 0; offset + 8 <= size; offset += 8)
+		{
+			des_batch_load(block, data + (size_t) first * size + offset, size, n);
+			for (j = 0; j < 64; j++)
+				state[j] ^= block[j];
+			des_batch_block(ctx, state, key1, DES_ENCRYPT);
+		}
+		des_batch_block(ctx, state, key2, DES_DECRYPT);
+		des_batch_block(ctx, state, key1, DES_ENCRYPT);
+		des_batch_store(state, outMac + first * 8, n);
+	}
+}
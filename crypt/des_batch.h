@@ -0,0 +1,50 @@
+#ifndef __DES_BATCH_H
+#define __DES_BATCH_H
+
+// Bitsliced DES for batches of independent blocks, every block with own key (for example session keys
+// of many cards). Bit i of DES_BATCH_BITS blocks is one machine word or vector register, so one
+// boolean operation works on all blocks, S-boxes are boolean functions of 6 inputs
+// Results are the same as des3_crypt_ecb of des.h, bench_kernels checks it before timing
+//
+// DES_BATCH_BITS (build flag): 32, 64, 128 or 256 blocks at once, 128 and 256 need GCC vector
+// extensions (SSE2, AVX2 with -mavx2, NEON). Default: 128 with GCC, 64 with other compilers
+
+#if !defined(DES_BATCH_BITS)
+#if defined(__GNUC__)
+#define DES_BATCH_BITS 128
+#else
+#define DES_BATCH_BITS 64
+#endif
+#endif
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Tables derived from tables of DES, built by des_batch_init, read only after it
+typedef struct
+{
+	unsigned char keyBits[16][48];			// Bit of key (from most significant bit of byte 0) for bit of subkey of round
+	unsigned char sboxFunctions[8][4][16];	// Output bit of S-box as function of inputs 5, 6 for every value of inputs 1-4
+	unsigned char outputBits[32];			// Bit of right half for output bit of S-boxes (permutation P)
+} des_batch_context;
+
+void des_batch_init(des_batch_context* ctx);
+
+// Triple DES EDE with 2 keys (K1 K2 K1) of count blocks, block i (8 bytes) with key i (16 bytes)
+// mode: DES_ENCRYPT or DES_DECRYPT of des.h
+void des3_batch_crypt_ecb(const des_batch_context* ctx, int mode, const unsigned char* keys,
+						  const unsigned char* input, unsigned char* output, int count);
+
+// ISO/IEC 9797-1 MAC algorithm 3: CBC with K1, last block is decrypted with K2 and encrypted with K1
+// Message i is size bytes at data + i * size, it is padded by caller, size is multiple of 8
+// MAC of message i with key i (16 bytes) is 8 bytes at outMac + i * 8
+void des_batch_mac_alg3(const des_batch_context* ctx, const unsigned char* keys,
+						const unsigned char* data, int size, unsigned char* outMac, int count);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif // __DES_BATCH_H
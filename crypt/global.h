@@ -29,7 +29,7 @@ typedef unsigned short int UINT2;
  
 /* UINT4 defines a four byte word */ 
  
-typedef unsigned long int UINT4; 
+typedef unsigned int UINT4; 
  
 /* BYTE defines a unsigned character */ 
  
@@ -37,7 +37,7 @@ typedef unsigned char BYTE;
  
 /* internal signed value */ 
  
-typedef signed long int signeddigit; 
+typedef signed int signeddigit; 
  
 #ifndef NULL_PTR 
 #define NULL_PTR ((POINTER)0) 
@@ -10,6 +10,7 @@
 #include "r_random.h"   
 #include "rsa.h"   
 #include "nn.h"   
+#include "../probes.h"
    
 static int rsapublicfunc PROTO_LIST((unsigned char *, unsigned int *, unsigned char *, unsigned int, R_RSA_PUBLIC_KEY *));   
 static int rsaprivatefunc PROTO_LIST((unsigned char *, unsigned int *, unsigned char *, unsigned int, R_RSA_PRIVATE_KEY *));   
@@ -125,6 +126,40 @@ R_RSA_PUBLIC_KEY *publicKey;    /* RSA public key */
     return(ID_OK);   
 }   
    
+/* Raw RSA public-key operation without PKCS #1 block (EMV recovery
+     of certificates and signatures). Input has length of modulus.
+ */   
+   
+int RSAPublicBlock(output, outputLen, input, inputLen, publicKey)   
+unsigned char *output;          /* output block */   
+unsigned int *outputLen;        /* length of output block */   
+unsigned char *input;           /* input block */   
+unsigned int inputLen;          /* length of input block */   
+R_RSA_PUBLIC_KEY *publicKey;    /* RSA public key */   
+{   
+    if(inputLen != (publicKey->bits + 7) / 8)   
+        return(RE_LEN);   
+   
+    return(rsapublicfunc(output, outputLen, input, inputLen, publicKey));   
+}   
+   
+/* Raw RSA private-key operation without PKCS #1 block (EMV signatures
+     of simulated card). Input has length of modulus.
+ */   
+   
+int RSAPrivateBlock(output, outputLen, input, inputLen, privateKey)   
+unsigned char *output;          /* output block */   
+unsigned int *outputLen;        /* length of output block */   
+unsigned char *input;           /* input block */   
+unsigned int inputLen;          /* length of input block */   
+R_RSA_PRIVATE_KEY *privateKey;  /* RSA private key */   
+{   
+    if(inputLen != (privateKey->bits + 7) / 8)   
+        return(RE_LEN);   
+   
+    return(rsaprivatefunc(output, outputLen, input, inputLen, privateKey));   
+}   
+   
 /* RSA encryption, according to RSADSI's PKCS #1. */   
    
 int RSAPrivateEncrypt(output, outputLen, input, inputLen, privateKey)   
@@ -238,6 +273,7 @@ R_RSA_PUBLIC_KEY *publicKey;    /* RSA public key */
         n[MAX_NN_DIGITS];   
     unsigned int eDigits, nDigits;   
    
+    LIBEMV_PROBE2(rsa_public_begin, publicKey->bits, inputLen);
    
     /* decode the required RSA function input data */   
    
@@ -248,8 +284,10 @@ R_RSA_PUBLIC_KEY *publicKey;    /* RSA public key */
     nDigits = NN_Digits(n, MAX_NN_DIGITS);   
     eDigits = NN_Digits(e, MAX_NN_DIGITS);   
    
-    if(NN_Cmp(m, n, nDigits) >= 0)   
+    if(NN_Cmp(m, n, nDigits) >= 0) {
+        LIBEMV_PROBE2(rsa_public_end, publicKey->bits, RE_DATA);
         return(RE_DATA);   
+    }
    
     *outputLen = (publicKey->bits + 7) / 8;   
    
@@ -266,6 +304,7 @@ R_RSA_PUBLIC_KEY *publicKey;    /* RSA public key */
     R_memset((POINTER)c, 0, sizeof(c));   
     R_memset((POINTER)m, 0, sizeof(m));   
    
+    LIBEMV_PROBE2(rsa_public_end, publicKey->bits, ID_OK);
     return(ID_OK);   
 }   
    
@@ -287,6 +326,8 @@ R_RSA_PRIVATE_KEY *privateKey;  /* RSA private key */
         qInv[MAX_NN_DIGITS], t[MAX_NN_DIGITS];   
     unsigned int cDigits, nDigits, pDigits;   
    
+    LIBEMV_PROBE2(rsa_private_begin, privateKey->bits, inputLen);
+   
     /* decode required input data from standard form */   
    
     NN_Decode(c, MAX_NN_DIGITS, input, inputLen);           /* input */   
@@ -307,8 +348,10 @@ R_RSA_PRIVATE_KEY *privateKey;  /* RSA private key */
     nDigits = NN_Digits(n, MAX_NN_DIGITS);   
    
    
-    if(NN_Cmp(c, n, nDigits) >= 0)   
+    if(NN_Cmp(c, n, nDigits) >= 0) {
+        LIBEMV_PROBE2(rsa_private_end, privateKey->bits, RE_DATA);
         return(RE_DATA);   
+    }
    
     *outputLen = (privateKey->bits + 7) / 8;   
    
@@ -357,5 +400,6 @@ R_RSA_PRIVATE_KEY *privateKey;  /* RSA private key */
     R_memset((POINTER)q, 0, sizeof(q));   
     R_memset((POINTER)qInv, 0, sizeof(qInv));   
     R_memset((POINTER)t, 0, sizeof(t));   
+    LIBEMV_PROBE2(rsa_private_end, privateKey->bits, ID_OK);
     return(ID_OK);   
 }  
\ No newline at end of file
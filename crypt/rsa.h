@@ -19,6 +19,10 @@ int RSAPublicDecrypt PROTO_LIST ((unsigned char *, unsigned int *, unsigned char
     R_RSA_PUBLIC_KEY *)); 
 int RSAPrivateDecrypt PROTO_LIST ((unsigned char *, unsigned int *, unsigned char *, unsigned int, 
     R_RSA_PRIVATE_KEY *)); 
+int RSAPublicBlock PROTO_LIST ((unsigned char *, unsigned int *, unsigned char *, unsigned int, 
+    R_RSA_PUBLIC_KEY *)); 
+int RSAPrivateBlock PROTO_LIST ((unsigned char *, unsigned int *, unsigned char *, unsigned int, 
+    R_RSA_PRIVATE_KEY *)); 
 
 #ifdef __cplusplus
 }
@@ -39,6 +39,7 @@
  */
 
 #include "sha1.h"
+#include "../probes.h"
 
 /*
  *  Define the circular shift macro
@@ -70,6 +71,8 @@ void SHA1PadMessage(SHA1Context *);
  */
 void SHA1Reset(SHA1Context *context)
 {
+    LIBEMV_PROBE1(sha1_begin, context);
+
     context->Length_Low             = 0;
     context->Length_High            = 0;
     context->Message_Block_Index    = 0;
@@ -113,6 +116,7 @@ int SHA1Result(SHA1Context *context)
     {
         SHA1PadMessage(context);
         context->Computed = 1;
+        LIBEMV_PROBE2(sha1_end, context, context->Length_Low);
     }
 
     return 1;
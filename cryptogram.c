@@ -0,0 +1,324 @@
+#include "include/libemv.h"
+#include "internal.h"
+#include "crypt/des.h"
+#include <string.h>
+
+// EMV symmetric cryptography (EMV Book 2, Annex A1). Key schedules of double length keys are kept
+// in LRU cache shared by sessions of process, hosts verify cryptograms of the same cards many times
+
+#define KEYCACHE_SLOTS		(LIBEMV_KEY_CACHE_SIZE * 2)
+
+typedef struct
+{
+	unsigned char key[16];
+	des3_context ede;		// K1 K2 K1 encryption
+	des_context single;		// K1 encryption, CBC part of MAC
+	int chain;				// Next entry with the same slot or -1
+	int newer;				// LRU list, -1 - end
+	int older;
+	char used;
+} KEYCACHE_ENTRY;
+
+static KEYCACHE_ENTRY keyCache[LIBEMV_KEY_CACHE_SIZE];
+static int keyCacheSlots[KEYCACHE_SLOTS];	// First entry of slot or -1
+static int keyCacheNewest;
+static int keyCacheOldest;
+static int keyCacheReady;
+static unsigned long keyCacheHits;
+static unsigned long keyCacheMisses;
+
+static volatile long keyCacheLock;
+
+// Lock is taken by workers of issuer host for every cryptogram, waiting threads back off
+static void keycache_lock(void)
+{
+	int spins;
+
+	for (spins = 0; keyCacheLock || !LIBEMV_CAS_LONG(&keyCacheLock, 0, 1); spins++)
+		LIBEMV_SPIN_WAIT(spins);
+}
+
+static void keycache_unlock(void)
+{
+	LIBEMV_BARRIER();
+	keyCacheLock = 0;
+}
+
+// Empty cache, all entries in LRU list, called under lock
+static void keycache_reset(void)
+{
+	int i;
+
+	memset(keyCache, 0, sizeof(keyCache));
+	memset(keyCacheSlots, 0xFF, sizeof(keyCacheSlots));
+	for (i = 0; i < LIBEMV_KEY_CACHE_SIZE; i++)
+	{
+		keyCache[i].chain = -1;
+		keyCache[i].newer = i > 0 ? i - 1 : -1;
+		keyCache[i].older = i < LIBEMV_KEY_CACHE_SIZE - 1 ? i + 1 : -1;
+	}
+	keyCacheNewest = 0;
+	keyCacheOldest = LIBEMV_KEY_CACHE_SIZE - 1;
+	keyCacheReady = 1;
+}
+
+// FNV-1a
+static unsigned int keycache_slot(const unsigned char* key)
+{
+	unsigned int hash;
+	int i;
+
+	hash = 2166136261U;
+	for (i = 0; i < 16; i++)
+	{
+		hash ^= key[i];
+		hash *= 16777619U;
+	}
+	return (hash ^ (hash >> 16)) % KEYCACHE_SLOTS;
+}
+
+// Move entry to head of LRU list
+static void keycache_touch(int index)
+{
+	KEYCACHE_ENTRY* entry;
+
+	if (index == keyCacheNewest)
+		return;
+	entry = &keyCache[index];
+	keyCache[entry->newer].older = entry->older;
+	if (entry->older >= 0)
+		keyCache[entry->older].newer = entry->newer;
+	else
+		keyCacheOldest = entry->newer;
+	entry->newer = -1;
+	entry->older = keyCacheNewest;
+	keyCache[keyCacheNewest].newer = index;
+	keyCacheNewest = index;
+}
+
+// Copy key schedules of key from cache, expand and add key if not found
+static void keycache_get(const unsigned char* key, des3_context* outEde, des_context* outSingle)
+{
+	KEYCACHE_ENTRY* entry;
+	des3_context ede;
+	unsigned int slot;
+	int index;
+	int* link;
+
+	slot = keycache_slot(key);
+	keycache_lock();
+	if (!keyCacheReady)
+		keycache_reset();
+	for (index = keyCacheSlots[slot]; index >= 0; index = keyCache[index].chain)
+	{
+		if (memcmp(keyCache[index].key, key, 16) == 0)
+			break;
+	}
+	if (index >= 0)
+	{
+		keycache_touch(index);
+		memcpy(outEde, &keyCache[index].ede, sizeof(des3_context));
+		memcpy(outSingle, &keyCache[index].single, sizeof(des_context));
+		keyCacheHits++;
+		keycache_unlock();
+		return;
+	}
+	keyCacheMisses++;
+	keycache_unlock();
+
+	// Expansion is done without lock, schedule of K1 is first part of 3DES schedule
+	memset(&ede, 0, sizeof(ede));
+	des3_set2key_enc(&ede, key);
+	memcpy(outEde, &ede, sizeof(ede));
+	memset(outSingle, 0, sizeof(des_context));
+	memcpy(outSingle->sk, ede.sk, sizeof(outSingle->sk));
+
+	keycache_lock();
+	for (index = keyCacheSlots[slot]; index >= 0; index = keyCache[index].chain)
+	{
+		// Added by other thread
+		if (memcmp(keyCache[index].key, key, 16) == 0)
+		{
+			keycache_unlock();
+			return;
+		}
+	}
+
+	// Replace oldest entry
+	index = keyCacheOldest;
+	entry = &keyCache[index];
+	if (entry->used)
+	{
+		for (link = &keyCacheSlots[keycache_slot(entry->key)]; *link != index; link = &keyCache[*link].chain)
+			;
+		*link = entry->chain;
+	}
+	memcpy(entry->key, key, 16);
+	memcpy(&entry->ede, &ede, sizeof(ede));
+	memcpy(&entry->single, outSingle, sizeof(des_context));
+	entry->used = 1;
+	entry->chain = keyCacheSlots[slot];
+	keyCacheSlots[slot] = index;
+	keycache_touch(index);
+	keycache_unlock();
+	memset(&ede, 0, sizeof(ede));
+}
+
+LIBEMV_API void libemv_clear_key_cache(void)
+{
+	keycache_lock();
+	keycache_reset();
+	keyCacheHits = 0;
+	keyCacheMisses = 0;
+	keycache_unlock();
+}
+
+LIBEMV_API void libemv_get_key_cache_stats(unsigned long* outHits, unsigned long* outMisses)
+{
+	*outHits = keyCacheHits;
+	*outMisses = keyCacheMisses;
+}
+
+// Odd parity in least significant bit of every byte
+static void set_odd_parity(unsigned char* key, int size)
+{
+	unsigned char bits;
+	int i, j;
+
+	for (i = 0; i < size; i++)
+	{
+		bits = 0;
+		for (j = 1; j < 8; j++)
+			bits ^= (unsigned char) ((key[i] >> j) & 1);
+		key[i] = (unsigned char) ((key[i] & 0xFE) | (bits ^ 1));
+	}
+}
+
+// Left and right halves of key derived by 3DES of key: 3DES(left), 3DES(right)
+static void derive_key(const unsigned char* key, const unsigned char* left, const unsigned char* right, unsigned char* outKey)
+{
+	des3_context ede;
+	des_context single;
+
+	keycache_get(key, &ede, &single);
+	des3_crypt_ecb(&ede, left, outKey);
+	des3_crypt_ecb(&ede, right, outKey + 8);
+	memset(&ede, 0, sizeof(ede));
+	memset(&single, 0, sizeof(single));
+}
+
+LIBEMV_API int libemv_derive_icc_master_key(const unsigned char* issuerMasterKey, const unsigned char* pan, int panSize,
+											unsigned char panSequence, unsigned char* outKey)
+{
+	unsigned char digits[22];
+	unsigned char left[8];
+	unsigned char right[8];
+	int count, i;
+
+	if (!issuerMasterKey || !pan || panSize <= 0 || panSize > 10 || !outKey)
+		return LIBEMV_UNKNOWN_ERROR;
+
+	// Digits of PAN without padding F, then 2 digits of PAN Sequence Number
+	count = 0;
+	for (i = 0; i < panSize * 2; i++)
+	{
+		unsigned char digit;
+		digit = (unsigned char) ((i & 1) ? pan[i >> 1] & 0x0F : pan[i >> 1] >> 4);
+		if (digit == 0x0F)
+			break;
+		if (digit > 9)
+			return LIBEMV_UNKNOWN_ERROR;
+		digits[count++] = digit;
+	}
+	digits[count++] = (unsigned char) (panSequence >> 4);
+	digits[count++] = (unsigned char) (panSequence & 0x0F);
+
+	// Y: rightmost 16 digits, padded with zeros on the left
+	memset(left, 0, sizeof(left));
+	for (i = 0; i < 16 && i < count; i++)
+	{
+		unsigned char digit;
+		digit = digits[count - 1 - i];
+		left[7 - i / 2] |= (unsigned char) ((i & 1) ? digit << 4 : digit);
+	}
+	for (i = 0; i < 8; i++)
+		right[i] = (unsigned char) (left[i] ^ 0xFF);
+
+	derive_key(issuerMasterKey, left, right, outKey);
+	set_odd_parity(outKey, 16);
+	return LIBEMV_OK;
+}
+
+LIBEMV_API int libemv_derive_session_key(const unsigned char* masterKey, int method, const unsigned char* atc,
+										 const unsigned char* unpredictableNumber, unsigned char* outKey)
+{
+	unsigned char left[8];
+	unsigned char right[8];
+
+	if (!masterKey || !atc || !outKey)
+		return LIBEMV_UNKNOWN_ERROR;
+	memset(left, 0, sizeof(left));
+	left[0] = atc[0];
+	left[1] = atc[1];
+	if (method == LIBEMV_SESSION_KEY_ATC_UN)
+	{
+		if (!unpredictableNumber)
+			return LIBEMV_UNKNOWN_ERROR;
+		memcpy(left + 4, unpredictableNumber, 4);
+	} else if (method != LIBEMV_SESSION_KEY_COMMON)
+		return LIBEMV_UNKNOWN_ERROR;
+	memcpy(right, left, sizeof(right));
+	left[2] = 0xF0;
+	right[2] = 0x0F;
+
+	derive_key(masterKey, left, right, outKey);
+	return LIBEMV_OK;
+}
+
+LIBEMV_API int libemv_retail_mac(const unsigned char* key, const unsigned char* data, int size, unsigned char* outMac)
+{
+	des3_context ede;
+	des_context single;
+	unsigned char block[8];
+	int offset, i;
+
+	if (!key || (!data && size > 0) || size < 0 || !outMac)
+		return LIBEMV_UNKNOWN_ERROR;
+	keycache_get(key, &ede, &single);
+
+	// CBC with K1, last block (padded with 80 00 ..) with K1 K2 K1
+	memset(block, 0, sizeof(block));
+	for (offset = 0; offset + 8 <= size; offset += 8)
+	{
+		for (i = 0; i < 8; i++)
+			block[i] ^= data[offset + i];
+		des_crypt_ecb(&single, block, block);
+	}
+	for (i = 0; offset + i < size; i++)
+		block[i] ^= data[offset + i];
+	block[i] ^= 0x80;
+	des3_crypt_ecb(&ede, block, outMac);
+
+	memset(&ede, 0, sizeof(ede));
+	memset(&single, 0, sizeof(single));
+	return LIBEMV_OK;
+}
+
+LIBEMV_API int libemv_generate_arpc(const unsigned char* sessionKey, const unsigned char* arqc, const unsigned char* arc,
+									unsigned char* outArpc)
+{
+	des3_context ede;
+	des_context single;
+	unsigned char block[8];
+
+	if (!sessionKey || !arqc || !arc || !outArpc)
+		return LIBEMV_UNKNOWN_ERROR;
+	memcpy(block, arqc, 8);
+	block[0] ^= arc[0];
+	block[1] ^= arc[1];
+	keycache_get(sessionKey, &ede, &single);
+	des3_crypt_ecb(&ede, block, outArpc);
+	memset(&ede, 0, sizeof(ede));
+	memset(&single, 0, sizeof(single));
+	return LIBEMV_OK;
+}
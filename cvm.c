@@ -0,0 +1,126 @@
+#include "include/libemv.h"
+#include "internal.h"
+#include <string.h>
+
+// Cardholder verification (EMV Book 3, 10.5): CVM list of card is compiled once into table of rules.
+// Condition of rule is bit of word of transaction conditions, method is mask of Terminal Capabilities,
+// so choice of rule is two AND per rule
+
+// Methods of CV Rule (bits 6-1 of byte 1) and Terminal Capabilities they need
+typedef struct
+{
+	unsigned char method;
+	unsigned long long capabilities;
+} CVM_METHOD;
+
+static const CVM_METHOD cvmMethods[] =
+{
+	{LIBEMV_CVM_FAIL, 0},
+	{LIBEMV_CVM_PLAINTEXT_PIN, TERMINAL_CAP_PLAINTEXT_PIN},
+	{LIBEMV_CVM_ONLINE_PIN, TERMINAL_CAP_ENCIPHERED_PIN_ONLINE},
+	{LIBEMV_CVM_PLAINTEXT_PIN_SIGNATURE, TERMINAL_CAP_PLAINTEXT_PIN | TERMINAL_CAP_SIGNATURE},
+	{LIBEMV_CVM_ENCIPHERED_PIN, TERMINAL_CAP_ENCIPHERED_PIN_OFFLINE},
+	{LIBEMV_CVM_ENCIPHERED_PIN_SIGNATURE, TERMINAL_CAP_ENCIPHERED_PIN_OFFLINE | TERMINAL_CAP_SIGNATURE},
+	{LIBEMV_CVM_SIGNATURE, TERMINAL_CAP_SIGNATURE},
+	{LIBEMV_CVM_NO_CVM, TERMINAL_CAP_NO_CVM}
+};
+
+int libemv_cvm_compile(const unsigned char* list, int size, CVM_TABLE* outTable)
+{
+	int i, j;
+
+	outTable->count = 0;
+	outTable->amountX = 0;
+	outTable->amountY = 0;
+	if (!list || size < 10 || (size & 1) || size - 8 > MAX_CVM_RULES * 2)
+		return 0;
+
+	// Amounts X and Y are binary, in currency of application
+	for (i = 0; i < 4; i++)
+	{
+		outTable->amountX = (outTable->amountX << 8) | list[i];
+		outTable->amountY = (outTable->amountY << 8) | list[4 + i];
+	}
+
+	for (i = 8; i < size; i += 2)
+	{
+		CVM_RULE* rule;
+
+		rule = &outTable->rules[outTable->count++];
+		rule->rule[0] = list[i];
+		rule->rule[1] = list[i + 1];
+
+		// Unknown condition is never satisfied, unknown method is never supported
+		rule->condition = list[i + 1] <= CVM_CONDITION_OVER_Y ? 1UL << list[i + 1] : 0;
+		rule->supportCondition = (unsigned char) (list[i + 1] == CVM_CONDITION_TERMINAL_SUPPORTS);
+		rule->capabilities = CVM_UNRECOGNISED;
+		for (j = 0; j < (int) (sizeof(cvmMethods) / sizeof(cvmMethods[0])); j++)
+		{
+			if (cvmMethods[j].method == (list[i] & 0x3F))
+				rule->capabilities = cvmMethods[j].capabilities;
+		}
+	}
+	return 1;
+}
+
+unsigned long libemv_cvm_conditions(const CVM_TABLE* table)
+{
+	unsigned long conditions;
+	unsigned char* data;
+	int size;
+	unsigned char transactionType;
+	char cash, unattended;
+
+	// Unattended terminal: type x4, x5, x6
+	data = libemv_get_tag(TAG_TERMINAL_TYPE, &size);
+	unattended = data && size == 1 && (*data & 0x0F) >= 4 && (*data & 0x0F) <= 6;
+	data = libemv_get_tag(TAG_TRANSACTION_TYPE, &size);
+	transactionType = data && size == 1 ? *data : 0;
+	cash = transactionType == 0x01;
+
+	conditions = (1UL << CVM_CONDITION_ALWAYS) | (1UL << CVM_CONDITION_TERMINAL_SUPPORTS);
+	if (cash && unattended)
+		conditions |= 1UL << CVM_CONDITION_UNATTENDED_CASH;
+	if (!cash && transactionType != 0x09)
+		conditions |= 1UL << CVM_CONDITION_NOT_CASH_OR_CASHBACK;
+	if (cash && !unattended)
+		conditions |= 1UL << CVM_CONDITION_MANUAL_CASH;
+	if (transactionType == 0x09)
+		conditions |= 1UL << CVM_CONDITION_CASHBACK;
+
+	// Amounts X and Y only for transaction in currency of application
+	data = libemv_get_tag(TAG_APPLICATION_CURRENCY_CODE, &size);
+	if (data && size == 2)
+	{
+		unsigned char* currency;
+		unsigned long long amount;
+
+		currency = libemv_get_tag(TAG_TRANSACTION_CURRENCY_CODE, &size);
+		if (currency && size == 2 && memcmp(currency, data, 2) == 0)
+		{
+			amount = libemv_get_numeric(TAG_AMOUNT_AUTHORISED);
+			if (amount < table->amountX)
+				conditions |= 1UL << CVM_CONDITION_UNDER_X;
+			if (amount > table->amountX)
+				conditions |= 1UL << CVM_CONDITION_OVER_X;
+			if (amount < table->amountY)
+				conditions |= 1UL << CVM_CONDITION_UNDER_Y;
+			if (amount > table->amountY)
+				conditions |= 1UL << CVM_CONDITION_OVER_Y;
+		}
+	}
+	return conditions;
+}
+
+int libemv_cvm_next(const CVM_TABLE* table, int index, unsigned long conditions, unsigned long long capabilities)
+{
+	const CVM_RULE* rule;
+
+	for (rule = table->rules + index; index < table->count; index++, rule++)
+	{
+		// Condition "terminal supports CVM" is satisfied only by supported method
+		if ((conditions & rule->condition) && (CVM_SUPPORTED(rule, capabilities) | !rule->supportCondition))
+			return index;
+	}
+	return table->count;
+}
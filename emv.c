@@ -2,12 +2,6 @@
 #include "internal.h"
 #include <string.h>
 
-EMV_BITS* libemv_TSI;
-EMV_BITS* libemv_TVR;
-EMV_BITS* libemv_capa;
-EMV_BITS* libemv_addi_capa;
-EMV_BITS* libemv_AIP;
-
 LIBEMV_API char libemv_is_emv_ATR(unsigned char* bufATR, int size)
 {
 	if (size < 4)
@@ -44,25 +38,182 @@ LIBEMV_API char libemv_is_emv_ATR(unsigned char* bufATR, int size)
 	return 0;
 }
 
+// Cache of Le learned from 6Cxx, key is command header and last selected file
+// (records of PSE and application often have the same SFI)
+#define LE_CACHE_SIZE 64
+typedef struct
+{
+	unsigned char header[4];
+	unsigned int selected;
+	unsigned char le;
+	char used;
+} LE_CACHE_ENTRY;
+static LIBEMV_SESSION LE_CACHE_ENTRY leCache[LE_CACHE_SIZE];
+static LIBEMV_SESSION unsigned int leCacheSelected;
+
+// Procedure bytes of one command can't make more hops
+#define MAX_TRANSMIT_HOPS 16
+
+static LE_CACHE_ENTRY* le_cache_entry(const unsigned char* header)
+{
+	return &leCache[(header[0] ^ (header[1] * 7) ^ (header[2] * 31) ^ (header[3] * 131) ^ leCacheSelected) & (LE_CACHE_SIZE - 1)];
+}
+
+// One command-response pair of raw transport
+static char transmit_hop(const unsigned char* cmd, int cmdSize, unsigned char* resp, int* respSize)
+{
+	*respSize = LIBEMV_APDU_RESPONSE_SIZE;
+	if (!libemv_ext_transmit(libemv_transmit_context, cmd, cmdSize, resp, respSize))
+		return 0;
+	LIBEMV_STATS_ADD(bytesOut, cmdSize);
+	LIBEMV_STATS_ADD(bytesIn, *respSize);
+	return *respSize >= 2;
+}
+
+// Send command with raw transport, process procedure bytes 61xx and 6Cxx
+// Data of all GET RESPONSE is joined, outData has SW1 SW2 of last response
+static char transmit_apdu(unsigned char cla, unsigned char ins, unsigned char p1, unsigned char p2,
+						  unsigned char dataSize, const unsigned char* data,
+						  int* outDataSize, unsigned char* outData)
+{
+	unsigned char cmd[5 + 255];
+	unsigned char resp[LIBEMV_APDU_RESPONSE_SIZE];
+	int cmdSize, respSize;
+	int outSize;
+	int hop;
+	unsigned char sw1, sw2;
+	LE_CACHE_ENTRY* cacheEntry;
+
+	cmd[0] = cla;
+	cmd[1] = ins;
+	cmd[2] = p1;
+	cmd[3] = p2;
+	cmd[4] = dataSize;
+	memcpy(cmd + 5, data, dataSize);
+	cmdSize = 5 + dataSize;
+
+	// SELECT changes current file, hash of file name is part of cache key
+	if (ins == 0xA4)
+	{
+		int i;
+		leCacheSelected = 0;
+		for (i = 0; i < dataSize; i++)
+			leCacheSelected = leCacheSelected * 31 + data[i];
+	}
+
+	// Command without data: P3 is Le, use Le from previous transactions
+	cacheEntry = 0;
+	if (dataSize == 0 && libemv_settings.apduPredictLe)
+	{
+		cacheEntry = le_cache_entry(cmd);
+		if (cacheEntry->used && cacheEntry->selected == leCacheSelected && memcmp(cacheEntry->header, cmd, 4) == 0)
+			cmd[4] = cacheEntry->le;
+	}
+
+	outSize = 0;
+	for (hop = 0; hop < MAX_TRANSMIT_HOPS; hop++)
+	{
+		if (!transmit_hop(cmd, cmdSize, resp, &respSize))
+			return 0;
+		sw1 = resp[respSize - 2];
+		sw2 = resp[respSize - 1];
+
+		// Wrong length, repeat with Le from SW2
+		if (sw1 == 0x6C && cmdSize == 5)
+		{
+			if (libemv_debug_enabled)
+				libemv_printf("SW1 SW2: 6C %02X, repeat with right Le\n", sw2);
+			cmd[4] = sw2;
+			if (cacheEntry && cmd[1] == ins)
+			{
+				memcpy(cacheEntry->header, cmd, 4);
+				cacheEntry->selected = leCacheSelected;
+				cacheEntry->le = sw2;
+				cacheEntry->used = 1;
+			}
+			LIBEMV_STATS_ADD(retries, 1);
+			continue;
+		}
+
+		if (outSize + respSize > LIBEMV_APDU_RESPONSE_SIZE)
+		{
+			libemv_printf("Response apdu is too long\n");
+			return 0;
+		}
+		memcpy(outData + outSize, resp, respSize - 2);
+		outSize += respSize - 2;
+
+		// Response bytes still available
+		if (sw1 == 0x61)
+		{
+			if (libemv_debug_enabled)
+				libemv_printf("SW1 SW2: 61 %02X, GET RESPONSE\n", sw2);
+			cmd[0] = 0x00;
+			cmd[1] = 0xC0;
+			cmd[2] = 0x00;
+			cmd[3] = 0x00;
+			cmd[4] = sw2;
+			cmdSize = 5;
+			LIBEMV_STATS_ADD(retries, 1);
+			continue;
+		}
+
+		outData[outSize++] = sw1;
+		outData[outSize++] = sw2;
+		*outDataSize = outSize;
+		return 1;
+	}
+
+	libemv_printf("Too many procedure bytes from card\n");
+	return 0;
+}
+
 char libemv_apdu(unsigned char cla, unsigned char ins, unsigned char p1, unsigned char p2,
 				 unsigned char dataSize, const unsigned char* data,
 				 int* outDataSize, unsigned char* outData)
 {
 	char res;
+	LIBEMV_PROBE5(apdu_send, cla, ins, p1, p2, dataSize);
+	if (libemv_trace_enabled)
+	{
+		unsigned char header[5];
+		header[0] = cla;
+		header[1] = ins;
+		header[2] = p1;
+		header[3] = p2;
+		header[4] = dataSize;
+		libemv_trace_event2(LIBEMV_TRACE_APDU_COMMAND, header, 5, data, dataSize);
+	}
 	if (libemv_debug_enabled)
 	{
-		int i;
-		libemv_printf("C-APDU: %02X %02X %02X %02X; %02X ", cla & 0xFF, ins & 0xFF, p1 & 0xFF, p2 & 0xFF, dataSize & 0xFF);
-		for (i = 0; i < dataSize; i++)
-			libemv_printf("%02X", data[i] & 0xFF);
-		libemv_printf("\n");
+		char strData[2 * 255 + 1];
+		libemv_format_hex(strData, data, dataSize, "");
+		libemv_printf("C-APDU: %02X %02X %02X %02X; %02X %s\n", cla & 0xFF, ins & 0xFF, p1 & 0xFF, p2 & 0xFF, dataSize & 0xFF, strData);
+	}
+	LIBEMV_STATS_ADD(apduCount, 1);
+	if (libemv_ext_transmit)
+	{
+		res = transmit_apdu(cla, ins, p1, p2, dataSize, data, outDataSize, outData);
+	} else
+	{
+		res = libemv_ext_apdu(cla, ins, p1, p2, dataSize, data, outDataSize, outData);
+		if (res)
+		{
+			LIBEMV_STATS_ADD(bytesOut, 5 + dataSize);
+			LIBEMV_STATS_ADD(bytesIn, *outDataSize);
+		}
 	}
-	res = libemv_ext_apdu(cla, ins, p1, p2, dataSize, data, outDataSize, outData);
 	if (!res)
 	{
+		LIBEMV_PROBE1(apdu_error, ins);
+		if (libemv_trace_enabled)
+			libemv_trace_event(LIBEMV_TRACE_TRANSMIT_ERROR, 0, 0);
 		libemv_printf("libemv_ext_apdu failed, transmission error\n");
 		return res;
 	}
+	LIBEMV_PROBE3(apdu_receive, ins, *outDataSize >= 2 ? (outData[*outDataSize - 2] << 8) | outData[*outDataSize - 1] : 0, *outDataSize);
+	if (libemv_trace_enabled)
+		libemv_trace_event(LIBEMV_TRACE_APDU_RESPONSE, outData, *outDataSize);
 
 	// Response data must at least have SW1 SW2
 	if (*outDataSize < 2)
@@ -72,21 +223,18 @@ char libemv_apdu(unsigned char cla, unsigned char ins, unsigned char p1, unsigne
 	}
 	if (libemv_debug_enabled)
 	{
-		int i;
-		libemv_printf("R-APDU: ");
-		for (i = 0; i < *outDataSize - 2; i++)
-			libemv_printf("%02X", outData[i] & 0xFF);
-		libemv_printf("; %02X %02X", outData[*outDataSize - 2] & 0xFF, outData[*outDataSize - 1] & 0xFF);
-		libemv_printf("\n");
+		char strData[2 * 256 + 1];
+		libemv_format_hex(strData, outData, *outDataSize - 2, "");
+		libemv_printf("R-APDU: %s; %02X %02X\n", strData, outData[*outDataSize - 2] & 0xFF, outData[*outDataSize - 1] & 0xFF);
 	}
 	return res;
 }
 
 // Candidate applications
 #define MAX_CANDIDATE_APPLICATIONS 20
-static LIBEMV_SEL_APPLICATION_INFO candidateApplications[MAX_CANDIDATE_APPLICATIONS];
-static int candidateApplicationCount;
-static int indexApplicationSelected;
+static LIBEMV_SESSION LIBEMV_SEL_APPLICATION_INFO candidateApplications[MAX_CANDIDATE_APPLICATIONS];
+static LIBEMV_SESSION int candidateApplicationCount;
+static LIBEMV_SESSION int indexApplicationSelected;
 
 // Check DF in application list (and check ASI)
 static char check_candidate_in_app_list(LIBEMV_SEL_APPLICATION_INFO* candidate);
@@ -96,25 +244,178 @@ static char check_candidate_in_app_list(LIBEMV_SEL_APPLICATION_INFO* candidate);
 static int select_adf_parse(unsigned char* rApdu, int rApduSize, LIBEMV_SEL_APPLICATION_INFO* appInfo);
 
 // Re-init data of application buffer, need before every transaction
+// Uses image of libemv_preprocess_transaction if it is ready
 static void zeroizeAppBuffer(void);
 
+// Add default terminal tags to application buffer, tags of configuration are in template
+static void set_terminal_tags(void);
+
+// Terminal part of application buffer prepared by libemv_preprocess_transaction
+// Image is used by one transaction, 0 size - no image
+#define TERMINAL_IMAGE_SIZE 512
+static LIBEMV_SESSION unsigned char terminalImage[TERMINAL_IMAGE_SIZE];
+static LIBEMV_SESSION int terminalImageSize;
+
+// Data of PDOL sent with GET PROCESSING OPTIONS, part of transaction data signed by CDA
+static LIBEMV_SESSION unsigned char pdolData[256];
+static LIBEMV_SESSION int pdolDataSize;
+
+// Cryptogram of last GENERATE AC (CID), applied with result of CDA by libemv_generate_ac_result
+static LIBEMV_SESSION unsigned char cardCryptogram;
+
+// Data of CDOL1 and CDOL2, built once after records are read, only values of lateTags are written again
+// before GENERATE AC
+#define CDOL_1		0
+#define CDOL_2		1
+static LIBEMV_SESSION DOL_PLAN cdolPlans[2];
+static LIBEMV_SESSION unsigned char cdolData[2][256];
+static LIBEMV_SESSION char cdolReady;
+
+// CVM list of card compiled after records are read, empty if card hasn't list
+static LIBEMV_SESSION CVM_TABLE cvmTable;
+
+// Handles of tags written by cardholder verification
+static LIBEMV_SESSION TAG_HANDLE tvrHandle;
+static LIBEMV_SESSION TAG_HANDLE cvmResultsHandle;
+
+// Tags set after records are read
+static const unsigned short lateTags[] = {TAG_TVR, TAG_TSI, TAG_CVM_RESULTS, TAG_UNPREDICTABLE_NUMBER, TAG_ICC_DYNAMIC_NUMBER,
+	TAG_AUTHORISATION_RESPONSE_CODE, TAG_ISSUER_AUTHENTICATION_DATA};
+
+// Convert string of digits to BCD, 2 digits in byte
+static void digits_to_bcd(const char* strDigits, unsigned char* outBcd, int bcdSize);
+
+// Build candidate list, body of libemv_build_candidate_list
+static int build_candidate_list(void);
+
+// Parse entry of directory (contents of tag 61) from PSE record or PPSE FCI, add candidate if AID is supported
+static void add_directory_entry(unsigned char* entry, int entrySize, const LIBEMV_SEL_APPLICATION_INFO* standartCandidate, const char* strSource);
+
+// Build candidate list from PPSE, body of libemv_build_candidate_list_contactless
+static int build_candidate_list_contactless(void);
+
+// SELECT AID from terminal list (with next occurrences if partial selection), add candidates
+// outComplete: 1 if partial selection was allowed and card returned all its applications started with AID
+// Return LIBEMV_OK or error
+static int probe_aid(int ordinal, char* outComplete);
+
+// Adaptive order of list of AIDs: hint, then count of cards found with AID, then order of configuration
+#define MAX_PROBE_AIDS 256
+typedef struct
+{
+	int ordinal;
+	unsigned long hits;
+	char hinted;
+} PROBE_AID;
+static LIBEMV_SESSION unsigned char aidHint[16];
+static LIBEMV_SESSION int aidHintSize;
+
+// Order of all AIDs of terminal, count of AIDs must not be greater MAX_PROBE_AIDS
+static void build_probe_order(PROBE_AID* order);
+
+// AID order[index] can't add candidates: AID of the same application selected before is its prefix
+// and card returned all applications started with it (complete[] of AIDs selected before)
+static char probe_covered(const PROBE_AID* order, const char* complete, int index);
+
+// Final selection, body of libemv_application_selection
+static int application_selection(void);
+
+// Select application, body of libemv_select_application
+static int select_application(int indexApplication);
+
+// Get processing option, body of libemv_get_processing_option
+static int get_processing_option(void);
+
+// Read application data, body of libemv_read_app_data
+static int read_app_data(void);
+
+// Dynamic data authentication, body of libemv_dynamic_data_authentication
+static int dynamic_data_authentication(void);
+
+// SDAD from response of INTERNAL AUTHENTICATE (format 1 or 2), other tags of format 2 are saved
+// Returns 0 if response is wrong
+static int internal_authenticate_parse(unsigned char* rApdu, int rApduSize, unsigned char** outSdad, int* outSdadSize);
+
+// Cardholder verification, body of libemv_cardholder_verification
+static int cardholder_verification(unsigned char* outMethod);
+
+// Perform method of CV Rule, PIN is entered by libemv_verify_pin. Offline PIN isn't asked if
+// PIN Try Counter of card is 0, counter is read by GET DATA only here
+// outResult: CVM_RESULT_...
+// Returns LIBEMV_OK or LIBEMV_ERROR_TRANSMIT
+static int perform_cvm(unsigned char method, unsigned char* outResult);
+
+// Write CVM Results (tag 9F34)
+static void set_cvm_results(unsigned char method, unsigned char condition, unsigned char result);
+
+// Build data of CDOL1 and CDOL2 after records are read
+// Returns 0 if CDOL is wrong
+static int build_cdol_data(void);
+
+// GENERATE AC with data of CDOL_1 or CDOL_2, body of libemv_generate_ac
+static int generate_ac(int cdol, unsigned char cryptogram, unsigned char* outCryptogram);
+
+// Tags of GENERATE AC response (format 1 or 2) are saved, TLVs of format 2 without SDAD are appended to
+// outHashData (Transaction Data Hash Code of CDA)
+// Returns 0 if response is wrong
+static int generate_ac_parse(unsigned char* rApdu, int rApduSize, unsigned char** outSdad, int* outSdadSize,
+							 unsigned char* outHashData, int* inOutHashDataSize, int maxHashDataSize);
+
+// Wait for pending check of CDA signature of last GENERATE AC, wrong signature is AAC with CDA failed in TVR
+// Returns cryptogram of card
+static unsigned char generate_ac_settle(void);
+
+// Terminal action analysis, body of libemv_terminal_action_analysis
+static int terminal_action_analysis(unsigned char* outCryptogram);
+
+// TVR has bit of TAC-Default or IAC-Default, transaction is declined if terminal can't go online
+static char default_action_decline(const CONFIG_APP* app, unsigned long long tvr);
+
+// Completion, body of libemv_completion
+static int completion(int onlineResult, const unsigned char* arc, const unsigned char* issuerAuthData, int issuerAuthDataSize,
+					  unsigned char* outCryptogram);
+
+// EXTERNAL AUTHENTICATE with Issuer Authentication Data, failure is in TVR
+static int external_authenticate(unsigned char* issuerAuthData, int size);
+
+// Action code of 5 bytes from tag of card, defaultCode if card doesn't have it
+static unsigned long long issuer_action_code(unsigned short tag, unsigned long long defaultCode);
+
+// Terminal can go online, from terminal type
+static char terminal_online_capable(void);
+
+// Terminal risk management, body of libemv_terminal_risk_management
+static int terminal_risk_management(void);
+
+// Random transaction selection, amount is below floor limit
+static void random_selection(const CONFIG_APP* app, unsigned long long amount, unsigned long long floorLimit);
+
+// Velocity checking with Lower and Upper Consecutive Offline Limits of card
+static int velocity_checking(void);
+
+// 2 bytes counter of card (ATC, Last Online ATC Register), GET DATA only if card didn't return it before
+// Returns LIBEMV_OK, LIBEMV_ERROR_TRANSMIT or LIBEMV_UNKNOWN_ERROR if card doesn't have it
+static int get_counter(unsigned short tag, int* outValue);
+
 LIBEMV_API int libemv_build_candidate_list(void)
 {
-	unsigned short endianNumber;
-	char isBigEndian;
+	int result;
 
-	// Detect endiannes
-	endianNumber = 1; /* 0x0001 */
-	isBigEndian = *((unsigned char *) &endianNumber) == 0 ? 1 : 0;
+	// New transaction, reset counters
+	if (libemv_stats_enabled)
+		libemv_reset_stats();
 
-	if (isBigEndian)
-	{
-		#ifndef BIG_ENDIAN
-			libemv_printf("Your system is big endian model, please compile with define BIG_ENDIAN\n");
-			return LIBEMV_UNKNOWN_ERROR;
-		#endif
-	}
+	LIBEMV_PHASE_BEGIN(LIBEMV_PHASE_BUILD_CANDIDATE_LIST);
+	result = build_candidate_list();
+	LIBEMV_PHASE_END(LIBEMV_PHASE_BUILD_CANDIDATE_LIST, result);
+	return result;
+}
 
+static int build_candidate_list(void)
+{
+	// Version of configuration for transaction, pre-processing pins it before
+	if (terminalImageSize <= 0 && libemv_config_enter() != LIBEMV_OK)
+		return LIBEMV_UNKNOWN_ERROR;
 	zeroizeAppBuffer();
 	candidateApplicationCount = 0;
 	indexApplicationSelected = 0;
@@ -124,7 +425,7 @@ LIBEMV_API int libemv_build_candidate_list(void)
 	if (libemv_settings.appSelectionUsePSE)
 	{
 		int outSize;
-		unsigned char outData[256];
+		unsigned char outData[LIBEMV_APDU_RESPONSE_SIZE];
 		if (libemv_debug_enabled)
 			libemv_printf("Try to select 1PAY.SYS.DDF01\n");
 		if (!libemv_apdu(0x00, 0xA4, 0x04, 0x00, 14, "1PAY.SYS.DDF01", &outSize, outData))
@@ -261,7 +562,6 @@ LIBEMV_API int libemv_build_candidate_list(void)
 					unsigned short parseTag_5;
 					unsigned char* parseData_5;
 					int parseSize_5;
-					LIBEMV_SEL_APPLICATION_INFO currentApplicationInfo;
 
 					parseShift_5 = libemv_parse_tlv(parseData_4, parseSize_4, &parseTag_5, &parseData_5, &parseSize_5);
 					if (!parseShift_5)
@@ -271,68 +571,7 @@ LIBEMV_API int libemv_build_candidate_list(void)
 					if (parseTag_5 != TAG_APPLICATION_TEMPLATE)
 						break;
 
-					// Parse applications info, 4F (ADF Name), 50 (Application Label), etc
-					memcpy(&currentApplicationInfo, &standartCandidate, sizeof(LIBEMV_SEL_APPLICATION_INFO));
-					while (1)
-					{
-						int parseShift_6;
-						unsigned short parseTag_6;
-						unsigned char* parseData_6;
-						int parseSize_6;
-
-						parseShift_6 = libemv_parse_tlv(parseData_5, parseSize_5, &parseTag_6, &parseData_6, &parseSize_6);
-						if (!parseShift_6)
-							break;
-
-						// Tag 4F (ADF Name)
-						if (parseTag_6 == TAG_ADF_NAME)
-						{
-							if (parseSize_6 <= 16)
-							{
-								currentApplicationInfo.DFNameLength = parseSize_6;
-								memcpy(currentApplicationInfo.DFName, parseData_6, parseSize_6);
-							}
-						}
-
-						// Tag 50 (Application Label)
-						if (parseTag_6 == TAG_APPLICATION_LABEL)
-						{
-							if (parseSize_6 <= 16)
-								memcpy(currentApplicationInfo.strApplicationLabel, parseData_6, parseSize_6);
-						}
-
-						// Tag 9F12 (Application Preferred Name)
-						if (parseTag_6 == TAG_APP_PREFERRED_NAME)
-						{
-							if (parseSize_6 <= 16)
-								memcpy(currentApplicationInfo.strApplicationPreferredName, parseData_6, parseSize_6);
-						}
-
-						// Tag 87 (Application Priority Indicator)
-						if (parseTag_6 == TAG_APP_PRIORITY_INDICATOR)
-						{
-							if (parseSize_6 == 1)
-							{
-								if (*parseData_6 & 0x80)
-									currentApplicationInfo.needCardholderConfirm = 1;
-								currentApplicationInfo.priority = *parseData_6 & 0x0F;
-							}
-						}
-
-						// Next
-						parseData_5 += parseShift_6;
-						parseSize_5 -= parseShift_6;
-					}
-
-					// Check currentApplicationInfo is candidate and then add to list
-					if (candidateApplicationCount < MAX_CANDIDATE_APPLICATIONS && currentApplicationInfo.DFNameLength > 0
-						&& check_candidate_in_app_list(&currentApplicationInfo))
-					{
-						if (libemv_debug_enabled)
-							libemv_printf("Add candidate from PSE: %s\n", currentApplicationInfo.strApplicationLabel);
-						memcpy(candidateApplications + candidateApplicationCount, &currentApplicationInfo, sizeof(LIBEMV_SEL_APPLICATION_INFO));
-						candidateApplicationCount++;
-					}
+					add_directory_entry(parseData_5, parseSize_5, &standartCandidate, "PSE");
 
 					// Next
 					parseData_4 += parseShift_5;
@@ -348,92 +587,69 @@ LIBEMV_API int libemv_build_candidate_list(void)
 	// If no candidates found using PSE, build candidates using list of AIDs
 	if (candidateApplicationCount == 0)
 	{
-		int i;
-		for (i = 0; i < libemv_applications_count; i++)
+		int total;
+		total = libemv_aid_count();
+		if (libemv_settings.appSelectionAdaptiveOrder && total > 0 && total <= MAX_PROBE_AIDS)
 		{
-			int j;
-			for (j = 0; j < libemv_applications[i].aidsCount; j++)
+			PROBE_AID order[MAX_PROBE_AIDS];
+			char complete[MAX_PROBE_AIDS];
+			int candidateOrdinals[MAX_CANDIDATE_APPLICATIONS];
+			int n, k;
+
+			// EMV compliant stops: full candidate list, AID covered by partial selection of AID before
+			build_probe_order(order);
+			for (n = 0; n < total && candidateApplicationCount < MAX_CANDIDATE_APPLICATIONS; n++)
 			{
-				unsigned char selectionIndicator;
-				selectionIndicator = 0;
+				int countBefore;
+				int result;
 
-				// For repeat select for 1 AID
-				while (1)
+				complete[n] = 0;
+				if (probe_covered(order, complete, n))
+					continue;
+				countBefore = candidateApplicationCount;
+				result = probe_aid(order[n].ordinal, &complete[n]);
+				if (result != LIBEMV_OK)
+					return result;
+				for (k = countBefore; k < candidateApplicationCount; k++)
+					candidateOrdinals[k] = order[n].ordinal;
+				if (candidateApplicationCount > countBefore)
 				{
-					int outSize;
-					unsigned char outData[256];
-					int selectAdfParse;
-					LIBEMV_SEL_APPLICATION_INFO currentApplicationInfo;
-
-					// SELECT AID in terminal list
-					if (libemv_debug_enabled)
-						libemv_printf("SELECT AID[%d][%d]\n", i, j);
-					if (!libemv_apdu(0x00, 0xA4, 0x04, selectionIndicator, libemv_applications[i].aids[j].aidLength,
-									libemv_applications[i].aids[j].aid, &outSize, outData))
-						return LIBEMV_ERROR_TRANSMIT;
-					if (outData[outSize - 2] == 0x6A && outData[outSize - 1] == 0x81)
-						return LIBEMV_NOT_SUPPORTED;
-
-					if (selectionIndicator == 0)
-					{
-						// Skip status codes except 90 00 or 62 83 (blocked)
-						if (!(outData[outSize - 2] == 0x90 && outData[outSize - 1] == 0x00)
-							&& !(outData[outSize - 2] == 0x62 && outData[outSize - 1] == 0x83))
-							break;
-					} else
-					{
-						// Skip status codes except 90 00, 62 xx, 63 xx
-						if (!(outData[outSize - 2] == 0x90 && outData[outSize - 1] == 0x00)
-							&& !(outData[outSize - 2] == 0x62) && !(outData[outSize - 2] == 0x63))
-							break;
-					}
-
-					selectAdfParse = select_adf_parse(outData, outSize, &currentApplicationInfo);
-					if (selectAdfParse != LIBEMV_OK)
-						return selectAdfParse;
-
-					// DF name must exists
-					if (currentApplicationInfo.DFNameLength == 0)
+					libemv_aid_hit(order[n].ordinal);
+					if (libemv_settings.appSelectionStopOnMatch)
 						break;
+				}
+			}
 
-					// Detect match exact
-					if (libemv_applications[i].aids[j].aidLength == currentApplicationInfo.DFNameLength
-						&& memcmp(libemv_applications[i].aids[j].aid, currentApplicationInfo.DFName, currentApplicationInfo.DFNameLength) == 0)
-					{
-						// Check currentApplicationInfo is candidate and then add to list
-						if (candidateApplicationCount < MAX_CANDIDATE_APPLICATIONS && outData[outSize - 2] == 0x90 && outData[outSize - 1] == 0x00)
-						{
-							if (libemv_debug_enabled)
-								libemv_printf("Add candidate from list AIDs, match exact: %s\n", currentApplicationInfo.strApplicationLabel);
-							currentApplicationInfo.indexRID = i;
-							memcpy(candidateApplications + candidateApplicationCount, &currentApplicationInfo, sizeof(LIBEMV_SEL_APPLICATION_INFO));
-							candidateApplicationCount++;
-						}
-					}
-
-					// Partial selection
-					if (libemv_settings.appSelectionPartial && libemv_applications[i].aids[j].applicationSelectionIndicator
-						&& libemv_applications[i].aids[j].aidLength < currentApplicationInfo.DFNameLength
-						&& memcmp(libemv_applications[i].aids[j].aid, currentApplicationInfo.DFName, libemv_applications[i].aids[j].aidLength) == 0)
-					{
-						// Check currentApplicationInfo is candidate and then add to list
-						if (candidateApplicationCount < MAX_CANDIDATE_APPLICATIONS && outData[outSize - 2] == 0x90 && outData[outSize - 1] == 0x00)
-						{
-							if (libemv_debug_enabled)
-								libemv_printf("Add candidate from list AIDs, partial: %s\n", currentApplicationInfo.strApplicationLabel);
-							currentApplicationInfo.indexRID = i;
-							memcpy(candidateApplications + candidateApplicationCount, &currentApplicationInfo, sizeof(LIBEMV_SEL_APPLICATION_INFO));
-							candidateApplicationCount++;
-						}
-
-						// Next selection with current aid
-						selectionIndicator = 2;
-						continue;
-					}
-
-					// Always break
-					break;
-				}				
+			// Candidate list in order of terminal list, like without adaptive order
+			for (n = 1; n < candidateApplicationCount; n++)
+			{
+				LIBEMV_SEL_APPLICATION_INFO candidate;
+				int ordinal;
+				memcpy(&candidate, candidateApplications + n, sizeof(LIBEMV_SEL_APPLICATION_INFO));
+				ordinal = candidateOrdinals[n];
+				for (k = n; k > 0 && candidateOrdinals[k - 1] > ordinal; k--)
+				{
+					memcpy(candidateApplications + k, candidateApplications + k - 1, sizeof(LIBEMV_SEL_APPLICATION_INFO));
+					candidateOrdinals[k] = candidateOrdinals[k - 1];
+				}
+				memcpy(candidateApplications + k, &candidate, sizeof(LIBEMV_SEL_APPLICATION_INFO));
+				candidateOrdinals[k] = ordinal;
+			}
+		} else
+		{
+			int ordinal;
+			for (ordinal = 0; ordinal < total; ordinal++)
+			{
+				int countBefore;
+				int result;
+				char complete;
+
+				countBefore = candidateApplicationCount;
+				result = probe_aid(ordinal, &complete);
+				if (result != LIBEMV_OK)
+					return result;
+				if (candidateApplicationCount > countBefore)
+					libemv_aid_hit(ordinal);
 			}
 		}
 	}
@@ -441,55 +657,58 @@ LIBEMV_API int libemv_build_candidate_list(void)
 	return LIBEMV_OK;
 }
 
-static char check_candidate_in_app_list(LIBEMV_SEL_APPLICATION_INFO* candidate)
+LIBEMV_API int libemv_build_candidate_list_contactless(void)
 {
-	int i;
-	for (i = 0; i < libemv_applications_count; i++)
-	{
-		int j;
-		for (j = 0; j < libemv_applications[i].aidsCount; j++)
-		{
-			int smallSize;
-			// Detect smaller size AID (from terminal) or DF name (from ICC)
-			smallSize = libemv_applications[i].aids[j].aidLength;
-			if (smallSize > candidate->DFNameLength)
-				smallSize = candidate->DFNameLength;
-			if (memcmp(libemv_applications[i].aids[j].aid, candidate->DFName, smallSize) == 0)
-			{
-				// Check exact match
-				if (libemv_applications[i].aids[j].aidLength == candidate->DFNameLength)
-				{
-					candidate->indexRID = i;
-					return 1;
-				}
-				// Check ASI
-				if (libemv_settings.appSelectionPartial && libemv_applications[i].aids[j].applicationSelectionIndicator
-					&& libemv_applications[i].aids[j].aidLength < candidate->DFNameLength)
-				{
-					candidate->indexRID = i;
-					return 1;
-				}
-			}
-		}		
-	}
-	return 0;
+	int result;
+
+	LIBEMV_PHASE_BEGIN(LIBEMV_PHASE_BUILD_CANDIDATE_LIST);
+	result = build_candidate_list_contactless();
+	LIBEMV_PHASE_END(LIBEMV_PHASE_BUILD_CANDIDATE_LIST, result);
+	return result;
 }
 
-static int select_adf_parse(unsigned char* rApdu, int rApduSize, LIBEMV_SEL_APPLICATION_INFO* appInfo)
+static int build_candidate_list_contactless(void)
 {
+	int outSize;
+	unsigned char outData[LIBEMV_APDU_RESPONSE_SIZE];
+	LIBEMV_SEL_APPLICATION_INFO standartCandidate;
+	int n, k;
+
 	int parseShift_1;
 	unsigned short parseTag_1;
 	unsigned char* parseData_1;
 	int parseSize_1;
 
-	if (appInfo)
-		memset(appInfo, 0, sizeof(LIBEMV_SEL_APPLICATION_INFO));
+	// Version of configuration for transaction, pre-processing pins it before
+	if (terminalImageSize <= 0 && libemv_config_enter() != LIBEMV_OK)
+		return LIBEMV_UNKNOWN_ERROR;
+	zeroizeAppBuffer();
+	candidateApplicationCount = 0;
+	indexApplicationSelected = 0;
+
+	// SELECT "2PAY.SYS.DDF02", directory is in FCI, no READ RECORD
+	if (libemv_debug_enabled)
+		libemv_printf("Try to select 2PAY.SYS.DDF02\n");
+	if (!libemv_apdu(0x00, 0xA4, 0x04, 0x00, 14, "2PAY.SYS.DDF02", &outSize, outData))
+		return LIBEMV_ERROR_TRANSMIT;
+	if (outData[outSize - 2] == 0x6A && outData[outSize - 1] == 0x81)
+		return LIBEMV_NOT_SUPPORTED;
+
+	// Without PPSE contactless transaction is not possible, terminal can try other interface
+	if (outData[outSize - 2] != 0x90 || outData[outSize - 1] != 0x00)
+	{
+		if (libemv_debug_enabled)
+			libemv_printf("PPSE not found\n");
+		return LIBEMV_TERMINATED;
+	}
+
+	memset(&standartCandidate, 0, sizeof(standartCandidate));
 
 	// Parse 6F (FCI Template)
-	parseShift_1 = libemv_parse_tlv(rApdu, rApduSize - 2, &parseTag_1, &parseData_1, &parseSize_1);
+	parseShift_1 = libemv_parse_tlv(outData, outSize - 2, &parseTag_1, &parseData_1, &parseSize_1);
 	if (!parseShift_1)
 		return LIBEMV_UNKNOWN_ERROR;
-	if (parseTag_1 != 0x6F)
+	if (parseTag_1 != TAG_FCI_TEMPLATE)
 		return LIBEMV_UNKNOWN_ERROR;
 
 	// Parse 84 (DF Name), A5 (FCI Proprietary Template)
@@ -504,22 +723,9 @@ static int select_adf_parse(unsigned char* rApdu, int rApduSize, LIBEMV_SEL_APPL
 		if (!parseShift_2)
 			break;
 
-		// Tag 84 (DF Name)
-		if (parseTag_2 == TAG_DF_NAME)
-		{
-			if (parseSize_2 <= 16)
-			{
-				if (appInfo)
-				{
-					memcpy(appInfo->DFName, parseData_2, parseSize_2);
-					appInfo->DFNameLength = parseSize_2;
-				}
-			}
-		}
-
 		if (parseTag_2 == TAG_FCI_PROP_TEMPLATE)
 		{
-			// Parse all like 50 (Application Label) etc
+			// Parse BF0C (FCI Issuer Discretionary Data)
 			while (1)
 			{
 				int parseShift_3;
@@ -531,57 +737,408 @@ static int select_adf_parse(unsigned char* rApdu, int rApduSize, LIBEMV_SEL_APPL
 				if (!parseShift_3)
 					break;
 
-				// Tag 50 (Application Label)
-				if (parseTag_3 == TAG_APPLICATION_LABEL)
+				if (parseTag_3 == TAG_FCI_ISSUER_DISCR_DATA)
 				{
-					if (parseSize_3 <= 16)
+					// Parse every tag 61, other tags are skipped
+					while (1)
 					{
-						if (appInfo)
-							memcpy(appInfo->strApplicationLabel, parseData_3, parseSize_3);
-					}
-				}			
+						int parseShift_4;
+						unsigned short parseTag_4;
+						unsigned char* parseData_4;
+						int parseSize_4;
 
-				// Tag 87 (Application Priority Indicator)
-				if (parseTag_3 == TAG_APP_PRIORITY_INDICATOR)
-				{
-					if (parseSize_3 == 1)
-					{
-						if (appInfo)
-						{
-							if (*parseData_3 & 0x80)
-								appInfo->needCardholderConfirm = 1;
-							appInfo->priority = *parseData_3 & 0x0F;
-						}
-					}
-				}
+						parseShift_4 = libemv_parse_tlv(parseData_3, parseSize_3, &parseTag_4, &parseData_4, &parseSize_4);
+						if (!parseShift_4)
+							break;
 
-				// Tag 9F38 (PDOL)
-				if (parseTag_3 == TAG_PDOL)
-				{
-				}
+						if (parseTag_4 == TAG_APPLICATION_TEMPLATE)
+							add_directory_entry(parseData_4, parseSize_4, &standartCandidate, "PPSE");
 
-				// Tag 5F2D (Language Preference)
-				if (parseTag_3 == TAG_LANGUAGE_PREFERENCE)
-				{
-					if (parseSize_3 <= 8)
-					{
-						if (appInfo)
-							memcpy(appInfo->strLanguagePreference, parseData_3, parseSize_3);
+						// Next
+						parseData_3 += parseShift_4;
+						parseSize_3 -= parseShift_4;
 					}
 				}
 
-				// Tag 9F11 (Issuer Code Table Index)
-				if (parseTag_3 == TAG_ISSUER_CODE_TABLE_INDEX)
-				{
-					if (parseSize_3 == 1)
-					{
-						if (appInfo)
-							appInfo->issuerCodeTableIndex = *parseData_3;
-					}
-				}
+				// Next
+				parseData_2 += parseShift_3;
+				parseSize_2 -= parseShift_3;
+			}
+		}
 
-				// Tag 9F12 (Application Preferred Name)
-				if (parseTag_3 == TAG_APP_PREFERRED_NAME)
+		// Next
+		parseData_1 += parseShift_2;
+		parseSize_1 -= parseShift_2;
+	}
+
+	// Sort by priority, 1 is highest, without priority (0) are last, order of PPSE is kept for equal priority
+	for (n = 1; n < candidateApplicationCount; n++)
+	{
+		LIBEMV_SEL_APPLICATION_INFO candidate;
+		int priority;
+		memcpy(&candidate, candidateApplications + n, sizeof(LIBEMV_SEL_APPLICATION_INFO));
+		priority = candidate.priority == 0 ? 16 : candidate.priority;
+		for (k = n; k > 0 && (candidateApplications[k - 1].priority == 0 ? 16 : candidateApplications[k - 1].priority) > priority; k--)
+			memcpy(candidateApplications + k, candidateApplications + k - 1, sizeof(LIBEMV_SEL_APPLICATION_INFO));
+		memcpy(candidateApplications + k, &candidate, sizeof(LIBEMV_SEL_APPLICATION_INFO));
+	}
+
+	return LIBEMV_OK;
+}
+
+static int probe_aid(int ordinal, char* outComplete)
+{
+	const CONFIG_AID* aid;
+	const unsigned char* aidData;
+	unsigned char selectionIndicator;
+	char partial;
+
+	*outComplete = 0;
+	aid = LIBEMV_CONFIG_AIDS() + ordinal;
+	aidData = LIBEMV_CONFIG_PTR(aid->aidOffset);
+	if (aid->aidLength == 0)
+		return LIBEMV_OK;
+	selectionIndicator = 0;
+	partial = libemv_settings.appSelectionPartial && aid->applicationSelectionIndicator;
+
+	// For repeat select for 1 AID
+	while (1)
+	{
+		int outSize;
+		unsigned char outData[LIBEMV_APDU_RESPONSE_SIZE];
+		int selectAdfParse;
+		LIBEMV_SEL_APPLICATION_INFO currentApplicationInfo;
+
+		// SELECT AID in terminal list
+		if (libemv_debug_enabled)
+			libemv_printf("SELECT AID[%d][%d]\n", aid->app, ordinal - LIBEMV_CONFIG_APPS()[aid->app].firstAid);
+		if (!libemv_apdu(0x00, 0xA4, 0x04, selectionIndicator, aid->aidLength, aidData, &outSize, outData))
+			return LIBEMV_ERROR_TRANSMIT;
+		if (outData[outSize - 2] == 0x6A && outData[outSize - 1] == 0x81)
+			return LIBEMV_NOT_SUPPORTED;
+
+		if (selectionIndicator == 0)
+		{
+			// Skip status codes except 90 00 or 62 83 (blocked), card has no application started with AID
+			if (!(outData[outSize - 2] == 0x90 && outData[outSize - 1] == 0x00)
+				&& !(outData[outSize - 2] == 0x62 && outData[outSize - 1] == 0x83))
+			{
+				*outComplete = partial;
+				break;
+			}
+		} else
+		{
+			// Skip status codes except 90 00, 62 xx, 63 xx, no next application
+			if (!(outData[outSize - 2] == 0x90 && outData[outSize - 1] == 0x00)
+				&& !(outData[outSize - 2] == 0x62) && !(outData[outSize - 2] == 0x63))
+			{
+				*outComplete = 1;
+				break;
+			}
+		}
+
+		selectAdfParse = select_adf_parse(outData, outSize, &currentApplicationInfo);
+		if (selectAdfParse != LIBEMV_OK)
+			return selectAdfParse;
+
+		// DF name must exists
+		if (currentApplicationInfo.DFNameLength == 0)
+			break;
+
+		// Detect match exact
+		if (aid->aidLength == currentApplicationInfo.DFNameLength
+			&& memcmp(aidData, currentApplicationInfo.DFName, currentApplicationInfo.DFNameLength) == 0)
+		{
+			// Check currentApplicationInfo is candidate and then add to list
+			if (candidateApplicationCount < MAX_CANDIDATE_APPLICATIONS && outData[outSize - 2] == 0x90 && outData[outSize - 1] == 0x00)
+			{
+				if (libemv_debug_enabled)
+					libemv_printf("Add candidate from list AIDs, match exact: %s\n", currentApplicationInfo.strApplicationLabel);
+				currentApplicationInfo.indexRID = aid->app;
+				memcpy(candidateApplications + candidateApplicationCount, &currentApplicationInfo, sizeof(LIBEMV_SEL_APPLICATION_INFO));
+				candidateApplicationCount++;
+			}
+		}
+
+		// Partial selection
+		if (partial && aid->aidLength < currentApplicationInfo.DFNameLength
+			&& memcmp(aidData, currentApplicationInfo.DFName, aid->aidLength) == 0)
+		{
+			// Check currentApplicationInfo is candidate and then add to list
+			if (candidateApplicationCount < MAX_CANDIDATE_APPLICATIONS && outData[outSize - 2] == 0x90 && outData[outSize - 1] == 0x00)
+			{
+				if (libemv_debug_enabled)
+					libemv_printf("Add candidate from list AIDs, partial: %s\n", currentApplicationInfo.strApplicationLabel);
+				currentApplicationInfo.indexRID = aid->app;
+				memcpy(candidateApplications + candidateApplicationCount, &currentApplicationInfo, sizeof(LIBEMV_SEL_APPLICATION_INFO));
+				candidateApplicationCount++;
+			}
+
+			// Next selection with current aid
+			selectionIndicator = 2;
+			continue;
+		}
+
+		// Always break, next application doesn't start with AID
+		*outComplete = selectionIndicator == 2;
+		break;
+	}
+	return LIBEMV_OK;
+}
+
+LIBEMV_API void libemv_set_aid_hint(const unsigned char* prefix, int size)
+{
+	if (size < 0)
+		size = 0;
+	if (size > (int) sizeof(aidHint))
+		size = sizeof(aidHint);
+	memcpy(aidHint, prefix, size);
+	aidHintSize = size;
+}
+
+// AID a must be selected before AID b
+static char probe_before(const PROBE_AID* a, const PROBE_AID* b)
+{
+	if (a->hinted != b->hinted)
+		return a->hinted;
+	if (a->hits != b->hits)
+		return a->hits > b->hits;
+	return a->ordinal < b->ordinal;
+}
+
+static char probe_covered(const PROBE_AID* order, const char* complete, int index)
+{
+	const CONFIG_AID* aids;
+	const CONFIG_AID* aid;
+	int k;
+
+	aids = LIBEMV_CONFIG_AIDS();
+	aid = aids + order[index].ordinal;
+	for (k = 0; k < index; k++)
+	{
+		const CONFIG_AID* before;
+		before = aids + order[k].ordinal;
+		if (complete[k] && before->app == aid->app && before->aidLength > 0 && before->aidLength <= aid->aidLength
+			&& memcmp(LIBEMV_CONFIG_PTR(before->aidOffset), LIBEMV_CONFIG_PTR(aid->aidOffset), before->aidLength) == 0)
+		{
+			if (libemv_debug_enabled)
+				libemv_printf("AID[%d] is covered by partial selection of AID[%d]\n", order[index].ordinal, order[k].ordinal);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void build_probe_order(PROBE_AID* order)
+{
+	const CONFIG_AID* aids;
+	int count;
+
+	aids = LIBEMV_CONFIG_AIDS();
+	for (count = 0; count < libemv_config->aidsCount; count++)
+	{
+		PROBE_AID current;
+		int k;
+
+		current.ordinal = count;
+		current.hits = libemv_aid_hits(count);
+		current.hinted = aidHintSize > 0 && aids[count].aidLength >= aidHintSize
+			&& memcmp(LIBEMV_CONFIG_PTR(aids[count].aidOffset), aidHint, aidHintSize) == 0;
+
+		// Insertion sort, list is short
+		for (k = count; k > 0 && probe_before(&current, &order[k - 1]); k--)
+			order[k] = order[k - 1];
+		order[k] = current;
+	}
+}
+
+static void add_directory_entry(unsigned char* entry, int entrySize, const LIBEMV_SEL_APPLICATION_INFO* standartCandidate, const char* strSource)
+{
+	LIBEMV_SEL_APPLICATION_INFO currentApplicationInfo;
+
+	// Parse applications info, 4F (ADF Name), 50 (Application Label), etc
+	memcpy(&currentApplicationInfo, standartCandidate, sizeof(LIBEMV_SEL_APPLICATION_INFO));
+	while (1)
+	{
+		int parseShift;
+		unsigned short parseTag;
+		unsigned char* parseData;
+		int parseSize;
+
+		parseShift = libemv_parse_tlv(entry, entrySize, &parseTag, &parseData, &parseSize);
+		if (!parseShift)
+			break;
+
+		// Tag 4F (ADF Name)
+		if (parseTag == TAG_ADF_NAME)
+		{
+			if (parseSize <= 16)
+			{
+				currentApplicationInfo.DFNameLength = parseSize;
+				memcpy(currentApplicationInfo.DFName, parseData, parseSize);
+			}
+		}
+
+		// Tag 50 (Application Label)
+		if (parseTag == TAG_APPLICATION_LABEL)
+		{
+			if (parseSize <= 16)
+				memcpy(currentApplicationInfo.strApplicationLabel, parseData, parseSize);
+		}
+
+		// Tag 9F12 (Application Preferred Name)
+		if (parseTag == TAG_APP_PREFERRED_NAME)
+		{
+			if (parseSize <= 16)
+				memcpy(currentApplicationInfo.strApplicationPreferredName, parseData, parseSize);
+		}
+
+		// Tag 87 (Application Priority Indicator)
+		if (parseTag == TAG_APP_PRIORITY_INDICATOR)
+		{
+			if (parseSize == 1)
+			{
+				if (*parseData & 0x80)
+					currentApplicationInfo.needCardholderConfirm = 1;
+				currentApplicationInfo.priority = *parseData & 0x0F;
+			}
+		}
+
+		// Next
+		entry += parseShift;
+		entrySize -= parseShift;
+	}
+
+	// Check currentApplicationInfo is candidate and then add to list
+	if (candidateApplicationCount < MAX_CANDIDATE_APPLICATIONS && currentApplicationInfo.DFNameLength > 0
+		&& check_candidate_in_app_list(&currentApplicationInfo))
+	{
+		if (libemv_debug_enabled)
+			libemv_printf("Add candidate from %s: %s\n", strSource, currentApplicationInfo.strApplicationLabel);
+		memcpy(candidateApplications + candidateApplicationCount, &currentApplicationInfo, sizeof(LIBEMV_SEL_APPLICATION_INFO));
+		candidateApplicationCount++;
+	}
+}
+
+static char check_candidate_in_app_list(LIBEMV_SEL_APPLICATION_INFO* candidate)
+{
+	int indexApp;
+
+	// Exact match or partial match with ASI, first AID in order of configuration
+	indexApp = libemv_find_aid(candidate->DFName, candidate->DFNameLength, libemv_settings.appSelectionPartial);
+	if (indexApp < 0)
+		return 0;
+	candidate->indexRID = indexApp;
+	return 1;
+}
+
+static int select_adf_parse(unsigned char* rApdu, int rApduSize, LIBEMV_SEL_APPLICATION_INFO* appInfo)
+{
+	int parseShift_1;
+	unsigned short parseTag_1;
+	unsigned char* parseData_1;
+	int parseSize_1;
+
+	if (appInfo)
+		memset(appInfo, 0, sizeof(LIBEMV_SEL_APPLICATION_INFO));
+
+	// Parse 6F (FCI Template)
+	parseShift_1 = libemv_parse_tlv(rApdu, rApduSize - 2, &parseTag_1, &parseData_1, &parseSize_1);
+	if (!parseShift_1)
+		return LIBEMV_UNKNOWN_ERROR;
+	if (parseTag_1 != 0x6F)
+		return LIBEMV_UNKNOWN_ERROR;
+
+	// Parse 84 (DF Name), A5 (FCI Proprietary Template)
+	while (1)
+	{
+		int parseShift_2;
+		unsigned short parseTag_2;
+		unsigned char* parseData_2;
+		int parseSize_2;
+
+		parseShift_2 = libemv_parse_tlv(parseData_1, parseSize_1, &parseTag_2, &parseData_2, &parseSize_2);
+		if (!parseShift_2)
+			break;
+
+		// Tag 84 (DF Name)
+		if (parseTag_2 == TAG_DF_NAME)
+		{
+			if (parseSize_2 <= 16)
+			{
+				if (appInfo)
+				{
+					memcpy(appInfo->DFName, parseData_2, parseSize_2);
+					appInfo->DFNameLength = parseSize_2;
+				}
+			}
+		}
+
+		if (parseTag_2 == TAG_FCI_PROP_TEMPLATE)
+		{
+			// Parse all like 50 (Application Label) etc
+			while (1)
+			{
+				int parseShift_3;
+				unsigned short parseTag_3;
+				unsigned char* parseData_3;
+				int parseSize_3;
+
+				parseShift_3 = libemv_parse_tlv(parseData_2, parseSize_2, &parseTag_3, &parseData_3, &parseSize_3);
+				if (!parseShift_3)
+					break;
+
+				// Tag 50 (Application Label)
+				if (parseTag_3 == TAG_APPLICATION_LABEL)
+				{
+					if (parseSize_3 <= 16)
+					{
+						if (appInfo)
+							memcpy(appInfo->strApplicationLabel, parseData_3, parseSize_3);
+					}
+				}			
+
+				// Tag 87 (Application Priority Indicator)
+				if (parseTag_3 == TAG_APP_PRIORITY_INDICATOR)
+				{
+					if (parseSize_3 == 1)
+					{
+						if (appInfo)
+						{
+							if (*parseData_3 & 0x80)
+								appInfo->needCardholderConfirm = 1;
+							appInfo->priority = *parseData_3 & 0x0F;
+						}
+					}
+				}
+
+				// Tag 9F38 (PDOL)
+				if (parseTag_3 == TAG_PDOL)
+				{
+				}
+
+				// Tag 5F2D (Language Preference)
+				if (parseTag_3 == TAG_LANGUAGE_PREFERENCE)
+				{
+					if (parseSize_3 <= 8)
+					{
+						if (appInfo)
+							memcpy(appInfo->strLanguagePreference, parseData_3, parseSize_3);
+					}
+				}
+
+				// Tag 9F11 (Issuer Code Table Index)
+				if (parseTag_3 == TAG_ISSUER_CODE_TABLE_INDEX)
+				{
+					if (parseSize_3 == 1)
+					{
+						if (appInfo)
+							appInfo->issuerCodeTableIndex = *parseData_3;
+					}
+				}
+
+				// Tag 9F12 (Application Preferred Name)
+				if (parseTag_3 == TAG_APP_PREFERRED_NAME)
 				{
 					if (parseSize_3 <= 16)
 					{
@@ -606,31 +1163,95 @@ static int select_adf_parse(unsigned char* rApdu, int rApduSize, LIBEMV_SEL_APPL
 
 static void zeroizeAppBuffer(void)
 {
-	int outSize;
+	if (terminalImageSize > 0)
+	{
+		// Pre-processed, only copy of image
+		libemv_restore_tlv_buffer(terminalImage, terminalImageSize);
+		terminalImageSize = 0;
+	} else
+	{
+		libemv_clear_tlv_buffer();
+		set_terminal_tags();
+	}
 
-	libemv_clear_tlv_buffer();
+	// Tags of LIBEMV_GLOBAL until application is selected
+	libemv_use_tag_template(-1);
+}
 
+static void set_terminal_tags(void)
+{
 	// Add default value
 	libemv_set_tag(TAG_TVR, "\x00\x00\x00\x00\x00", 5);
 	libemv_set_tag(TAG_TSI, "\x00\x00", 2);
 	libemv_set_tag(TAG_AIP, "\x00\x00", 2);
+}
+
+static void digits_to_bcd(const char* strDigits, unsigned char* outBcd, int bcdSize)
+{
+	int i;
+	for (i = 0; i < bcdSize; i++)
+		outBcd[i] = (unsigned char) (((strDigits[2 * i] - '0') << 4) | (strDigits[2 * i + 1] - '0'));
+}
+
+LIBEMV_API int libemv_preprocess_transaction(const LIBEMV_TRANSACTION_DATA* data)
+{
+	char strDate[7];
+	char strTime[7];
+	unsigned char bcd[3];
+	unsigned char unpredictableNumber[4];
+	int i;
 
-	// Add value from config
-	libemv_set_tag(TAG_IFD_SERIAL_NUMBER, libemv_global.strIFDSerialNumber, strlen(libemv_global.strIFDSerialNumber));
-	libemv_set_tag(TAG_TERMINAL_COUNTRY_CODE, libemv_global.terminalCountryCode, 2);
-	libemv_set_tag(TAG_TERMINAL_CAPABILITIES, libemv_global.terminalCapabilities, 3);
-	libemv_set_tag(TAG_ADDI_TERMINAL_CAPABILITIES, libemv_global.additionalTerminalCapabilities, 5);
-	libemv_set_tag(TAG_TERMINAL_TYPE, &libemv_global.terminalType, 1);
-
-	// Update pointers to data in app buffer
-	libemv_TVR = (EMV_BITS*) libemv_get_tag(TAG_TVR, &outSize);
-	libemv_TSI = (EMV_BITS*) libemv_get_tag(TAG_TSI, &outSize);
-	libemv_capa = (EMV_BITS*) libemv_get_tag(TAG_TERMINAL_CAPABILITIES, &outSize);
-	libemv_addi_capa = (EMV_BITS*) libemv_get_tag(TAG_ADDI_TERMINAL_CAPABILITIES, &outSize);
-	libemv_AIP = (EMV_BITS*) libemv_get_tag(TAG_AIP, &outSize);
+	terminalImageSize = 0;
+	if (libemv_config_enter() != LIBEMV_OK)
+		return LIBEMV_UNKNOWN_ERROR;
+	libemv_clear_tlv_buffer();
+	set_terminal_tags();
+
+	// Transaction data
+	libemv_set_tag(TAG_AMOUNT_AUTHORISED, (unsigned char*) data->amountAuthorised, 6);
+	libemv_set_tag(TAG_AMOUNT_OTHER, (unsigned char*) data->amountOther, 6);
+	libemv_set_tag(TAG_TRANSACTION_CURRENCY_CODE, (unsigned char*) data->transactionCurrencyCode, 2);
+	libemv_set_tag(TAG_TRANSACTION_CURRENCY_EXPONENT, (unsigned char*) &data->transactionCurrencyExponent, 1);
+	libemv_set_tag(TAG_TRANSACTION_TYPE, (unsigned char*) &data->transactionType, 1);
+	libemv_set_tag(TAG_TTQ, (unsigned char*) data->terminalTransactionQualifiers, 4);
+
+	// Date and time of pre-processing, it is before card is presented
+	memset(strDate, '0', sizeof(strDate));
+	memset(strTime, '0', sizeof(strTime));
+	libemv_get_date(strDate);
+	libemv_get_time(strTime);
+	digits_to_bcd(strDate, bcd, 3);
+	libemv_set_tag(TAG_TRANSACTION_DATE, bcd, 3);
+	digits_to_bcd(strTime, bcd, 3);
+	libemv_set_tag(TAG_TRANSACTION_TIME, bcd, 3);
+
+	// New unpredictable number for every image, rand gives at least 15 bits
+	for (i = 0; i < 4; i++)
+		unpredictableNumber[i] = (unsigned char) (libemv_rand() & 0xFF);
+	libemv_set_tag(TAG_UNPREDICTABLE_NUMBER, unpredictableNumber, 4);
+
+	terminalImageSize = libemv_copy_tlv_buffer(terminalImage, TERMINAL_IMAGE_SIZE);
+	if (terminalImageSize <= 0)
+	{
+		if (libemv_debug_enabled)
+			libemv_printf("Terminal data is too big for pre-processing\n");
+		terminalImageSize = 0;
+		return LIBEMV_UNKNOWN_ERROR;
+	}
+	return LIBEMV_OK;
 }
 
 LIBEMV_API int libemv_application_selection(void)
+{
+	int result;
+
+	LIBEMV_PHASE_BEGIN(LIBEMV_PHASE_APPLICATION_SELECTION);
+	result = application_selection();
+	LIBEMV_PHASE_END(LIBEMV_PHASE_APPLICATION_SELECTION, result);
+	return result;
+}
+
+static int application_selection(void)
 {
 	// No candidates
 	if (candidateApplicationCount <= 0)
@@ -707,9 +1328,19 @@ LIBEMV_API int libemv_application_selection(void)
 }
 
 LIBEMV_API int libemv_select_application(int indexApplication)
+{
+	int result;
+
+	LIBEMV_PHASE_BEGIN(LIBEMV_PHASE_SELECT_APPLICATION);
+	result = select_application(indexApplication);
+	LIBEMV_PHASE_END(LIBEMV_PHASE_SELECT_APPLICATION, result);
+	return result;
+}
+
+static int select_application(int indexApplication)
 {
 	int outSize;
-	unsigned char outData[256];
+	unsigned char outData[LIBEMV_APDU_RESPONSE_SIZE];
 
 	// Input parameter wrong
 	if (indexApplication < 0 || indexApplication >= candidateApplicationCount)
@@ -806,23 +1437,8 @@ LIBEMV_API int libemv_select_application(int indexApplication)
 		}
 	} while (0);
 
-	// Store tags from LIBEMV_APPLICATIONS* libemv_applications
-	{
-		int indexRID;
-		LIBEMV_APPLICATIONS* app;
-		indexRID = candidateApplications[indexApplication].indexRID;
-		app = &libemv_applications[indexRID];
-		libemv_set_tag(TAG_ACQUIRER_ID, app->strAcquirerIdentifier, strlen(app->strAcquirerIdentifier));
-		libemv_set_tag(TAG_APPLICATION_VERSION_NUMBER, app->applicationVersionNumber, 2);
-		libemv_set_tag(TAG_MCC, app->merchantCategoryCode, 2);
-		libemv_set_tag(TAG_MERCHANT_ID, app->strMerchantIdentifier, strlen(app->strMerchantIdentifier));
-		libemv_set_tag(TAG_MERCHANT_NAME_AND_LOCATION, app->strMerchantNameAndLocation, strlen(app->strMerchantNameAndLocation));
-		libemv_set_tag(TAG_TERMINAL_FLOOR_LIMIT, app->terminalFloorLimit, 4);
-		libemv_set_tag(TAG_MERCHANT_NAME_AND_LOCATION, app->strTerminalIdentification, strlen(app->strTerminalIdentification));
-		libemv_set_tag(TAG_RISK_MANAGEMENT_DATA, app->terminalRiskManagementData, app->terminalRiskManagementDataSize);
-		libemv_set_tag(TAG_TRANSACTION_REFERENCE_CURRENCY, app->transactionReferenceCurrency, 2);
-		libemv_set_tag(TAG_TRANSACTION_REFERENCE_EXPONENT, &app->transactionReferenceCurrencyExponent, 1);
-	}
+	// Tags of application, template in configuration image
+	libemv_use_tag_template(candidateApplications[indexApplication].indexRID);
 
 	indexApplicationSelected = indexApplication;
 	return LIBEMV_OK;
@@ -844,14 +1460,24 @@ LIBEMV_API LIBEMV_SEL_APPLICATION_INFO* libemv_get_candidate(int indexApplicatio
 
 LIBEMV_API int libemv_get_processing_option(void)
 {
-	unsigned char* pdolTagValue;
-	int pdolTagSize;
-	unsigned char dolComposed[256];
+	int result;
+
+	LIBEMV_PHASE_BEGIN(LIBEMV_PHASE_GET_PROCESSING_OPTION);
+	result = get_processing_option();
+	LIBEMV_PHASE_END(LIBEMV_PHASE_GET_PROCESSING_OPTION, result);
+	return result;
+}
+
+static int get_processing_option(void)
+{
+	unsigned char* pdolTagValue;
+	int pdolTagSize;
+	unsigned char dolComposed[256];
 	int dolComposedSize;
 	unsigned char lcData[256];
 	int lcSize;
 	int outSize;
-	unsigned char outData[256];
+	unsigned char outData[LIBEMV_APDU_RESPONSE_SIZE];
 	int processingOptionResult;
 
 	processingOptionResult = LIBEMV_UNKNOWN_ERROR;
@@ -860,6 +1486,7 @@ LIBEMV_API int libemv_get_processing_option(void)
 	if (libemv_debug_enabled)
 		libemv_printf("Get processing option\n");
 
+	pdolDataSize = 0;
 	pdolTagValue = libemv_get_tag(TAG_PDOL, &pdolTagSize);
 	if (pdolTagValue)
 	{
@@ -987,6 +1614,11 @@ LIBEMV_API int libemv_get_processing_option(void)
 		break;
 	} while (0);
 
+	if (processingOptionResult == LIBEMV_OK)
+	{
+		memcpy(pdolData, dolComposed, dolComposedSize);
+		pdolDataSize = dolComposedSize;
+	}
 	if (processingOptionResult != LIBEMV_OK)
 	{
 		// Remove candidate from list
@@ -1002,20 +1634,43 @@ LIBEMV_API int libemv_get_processing_option(void)
 
 LIBEMV_API int libemv_read_app_data(void)
 {
-	unsigned char* aflValue;	
+	int result;
+
+	LIBEMV_PHASE_BEGIN(LIBEMV_PHASE_READ_APP_DATA);
+	result = read_app_data();
+	LIBEMV_PHASE_END(LIBEMV_PHASE_READ_APP_DATA, result);
+	return result;
+}
+
+static int read_app_data(void)
+{
+	const CONFIG_APP* app;
+	unsigned char* aflValue;
+	unsigned char afl[252];
 	int aflSize;
 	unsigned char* aflCurrent;
 	int aflIndex;
 	int tagSize;
+	unsigned char* cvmList;
 
 	if (libemv_debug_enabled)
 		libemv_printf("Read application data\n");
 
 	aflValue = libemv_get_tag(TAG_AFL, &aflSize);
-	if (!aflValue || (aflSize % 4) != 0)
+	if (!aflValue || (aflSize % 4) != 0 || aflSize > (int) sizeof(afl))
 		return LIBEMV_UNKNOWN_ERROR;
 
-	aflCurrent = aflValue;
+	// Records are saved in application buffer, it can be reallocated while AFL is read
+	memcpy(afl, aflValue, aflSize);
+
+	// Certificates of offline data authentication are recovered while next records are read
+	app = libemv_config && indexApplicationSelected >= 0 && indexApplicationSelected < candidateApplicationCount ?
+		&LIBEMV_CONFIG_APPS()[candidateApplications[indexApplicationSelected].indexRID] : 0;
+	libemv_oda_reset();
+	cdolReady = 0;
+	cvmTable.count = 0;
+
+	aflCurrent = afl;
 	for (aflIndex = 0; aflIndex < aflSize; aflIndex += 4, aflCurrent += 4)
 	{
 		unsigned char record;
@@ -1026,7 +1681,7 @@ LIBEMV_API int libemv_read_app_data(void)
 		for (record = aflCurrent[1]; record <= aflCurrent[2]; record++)
 		{
 			int outSize;
-			unsigned char outData[256];
+			unsigned char outData[LIBEMV_APDU_RESPONSE_SIZE];
 			int parseShift_1;
 			unsigned short parseTag_1;
 			unsigned char* parseData_1;
@@ -1048,6 +1703,10 @@ LIBEMV_API int libemv_read_app_data(void)
 			if (parseTag_1 != TAG_READ_RECORD_RESPONSE_TEMPLATE)
 				return LIBEMV_UNKNOWN_ERROR;
 
+			// First records of AFL entry are signed
+			if (record - aflCurrent[1] < aflCurrent[3])
+				libemv_oda_add_record((unsigned char) (aflCurrent[0] >> 3), outData, outSize - 2);
+
 			// Parse data in records
 			while (1)
 			{
@@ -1071,6 +1730,8 @@ LIBEMV_API int libemv_read_app_data(void)
 				parseData_1 += parseShift_2;
 				parseSize_1 -= parseShift_2;
 			}
+			if (app)
+				libemv_oda_prepare(app);
 		}
 	}
 
@@ -1078,6 +1739,775 @@ LIBEMV_API int libemv_read_app_data(void)
 	if (!libemv_get_tag(TAG_APPLICATION_EXP_DATE, &tagSize) || !libemv_get_tag(TAG_PAN, &tagSize)
 		|| !libemv_get_tag(TAG_CDOL_1, &tagSize) || !libemv_get_tag(TAG_CDOL_2, &tagSize))
 		return LIBEMV_TERMINATED;
+	if (!build_cdol_data())
+		return LIBEMV_TERMINATED;
+	cvmList = libemv_get_tag(TAG_CVM_LIST, &tagSize);
+	libemv_cvm_compile(cvmList, cvmList ? tagSize : 0, &cvmTable);
+
+	return LIBEMV_OK;
+}
 
+static int build_cdol_data(void)
+{
+	unsigned short cdolTags[2];
+	unsigned char* cdol;
+	int size;
+	int i;
+
+	cdolTags[CDOL_1] = TAG_CDOL_1;
+	cdolTags[CDOL_2] = TAG_CDOL_2;
+	for (i = 0; i < 2; i++)
+	{
+		cdol = libemv_get_tag(cdolTags[i], &size);
+		if (!cdol || !libemv_compile_dol(cdol, size, &cdolPlans[i]) || cdolPlans[i].size > 0xFF)
+			return 0;
+		libemv_dol_plan_set_late(&cdolPlans[i], lateTags, sizeof(lateTags) / sizeof(lateTags[0]));
+		libemv_dol_plan_data(&cdolPlans[i], cdolData[i]);
+	}
+	cdolReady = 1;
+	return 1;
+}
+
+LIBEMV_API int libemv_dynamic_data_authentication(void)
+{
+	int result;
+
+	LIBEMV_PHASE_BEGIN(LIBEMV_PHASE_OFFLINE_DATA_AUTHENTICATION);
+	result = dynamic_data_authentication();
+	LIBEMV_PHASE_END(LIBEMV_PHASE_OFFLINE_DATA_AUTHENTICATION, result);
+	return result;
+}
+
+static int dynamic_data_authentication(void)
+{
+	const CONFIG_APP* app;
+	DOL_PLAN cardPlan;
+	const DOL_PLAN* plan;
+	unsigned char ddolData[LIBEMV_APDU_RESPONSE_SIZE];
+	int ddolSize;
+	unsigned char outData[LIBEMV_APDU_RESPONSE_SIZE];
+	int outSize;
+	unsigned char* sdad;
+	int sdadSize;
+	unsigned char* data;
+	int size;
+	unsigned long long aip;
+	unsigned long long capabilities;
+
+	if (!libemv_config || indexApplicationSelected < 0 || indexApplicationSelected >= candidateApplicationCount)
+		return LIBEMV_UNKNOWN_ERROR;
+	app = &LIBEMV_CONFIG_APPS()[candidateApplications[indexApplicationSelected].indexRID];
+
+	aip = libemv_get_bits(TAG_AIP);
+	capabilities = libemv_get_bits(TAG_TERMINAL_CAPABILITIES);
+
+	// CDA: only ICC key here, signature is checked with GENERATE AC
+	if ((aip & AIP_CDA_SUPPORTED) && (capabilities & TERMINAL_CAP_CDA))
+	{
+		libemv_set_bits(TAG_TSI, TSI_OFFLINE_DATA_AUTH_PERFORMED);
+		if (!libemv_oda_icc_key(app))
+		{
+			if (libemv_debug_enabled)
+				libemv_printf("CDA: ICC public key isn't recovered\n");
+			libemv_set_bits(TAG_TVR, libemv_oda_icc_data_missing() ? TVR_CDA_FAILED | TVR_ICC_DATA_MISSING : TVR_CDA_FAILED);
+		}
+		return LIBEMV_OK;
+	}
+
+	if (!(aip & AIP_DDA_SUPPORTED) || !(capabilities & TERMINAL_CAP_DDA))
+		return LIBEMV_OK;
+	libemv_set_bits(TAG_TSI, TSI_OFFLINE_DATA_AUTH_PERFORMED);
+
+	// Issuer key and ICC certificate are recovered while records are read, only hash with static data is left
+	if (!libemv_oda_icc_key(app))
+	{
+		if (libemv_debug_enabled)
+			libemv_printf("DDA: ICC public key isn't recovered\n");
+		libemv_set_bits(TAG_TVR, libemv_oda_icc_data_missing() ? TVR_DDA_FAILED | TVR_ICC_DATA_MISSING : TVR_DDA_FAILED);
+		return LIBEMV_OK;
+	}
+
+	// DDOL of card or default DDOL of application (compiled with configuration), must have Unpredictable Number
+	data = libemv_get_tag(TAG_DDOL, &size);
+	plan = &app->defaultDDOLPlan;
+	if (data)
+	{
+		if (!libemv_compile_dol(data, size, &cardPlan))
+			cardPlan.count = 0;
+		plan = &cardPlan;
+	}
+	if (!libemv_dol_plan_has_tag(plan, TAG_UNPREDICTABLE_NUMBER) || plan->size > 0xFF)
+	{
+		if (libemv_debug_enabled)
+			libemv_printf("DDA: DDOL without Unpredictable Number\n");
+		libemv_set_bits(TAG_TVR, TVR_DDA_FAILED);
+		return LIBEMV_OK;
+	}
+	ddolSize = libemv_dol_plan_data(plan, ddolData);
+
+	// INTERNAL AUTHENTICATE
+	if (!libemv_apdu(0x00, 0x88, 0x00, 0x00, (unsigned char) ddolSize, ddolData, &outSize, outData))
+		return LIBEMV_ERROR_TRANSMIT;
+	if (outData[outSize - 2] != 0x90 || outData[outSize - 1] != 0x00)
+		return LIBEMV_TERMINATED;
+	if (!internal_authenticate_parse(outData, outSize - 2, &sdad, &sdadSize))
+		return LIBEMV_TERMINATED;
+	libemv_set_tag(TAG_SIGNED_DYNAMIC_APP_DATA, sdad, sdadSize);
+
+	if (!libemv_oda_verify_sdad(sdad, sdadSize, ddolData, ddolSize))
+		libemv_set_bits(TAG_TVR, TVR_DDA_FAILED);
+	if (libemv_debug_enabled)
+		libemv_printf("DDA: TVR %010llX\n", libemv_get_bits(TAG_TVR));
+	return LIBEMV_OK;
+}
+
+static int internal_authenticate_parse(unsigned char* rApdu, int rApduSize, unsigned char** outSdad, int* outSdadSize)
+{
+	unsigned short parseTag_1;
+	unsigned char* parseData_1;
+	int parseSize_1;
+
+	if (!libemv_parse_tlv(rApdu, rApduSize, &parseTag_1, &parseData_1, &parseSize_1))
+		return 0;
+	if (parseTag_1 == TAG_RESPONSE_FORMAT_1)
+	{
+		*outSdad = parseData_1;
+		*outSdadSize = parseSize_1;
+		return parseSize_1 > 0;
+	}
+	if (parseTag_1 != TAG_RESPONSE_FORMAT_2)
+		return 0;
+
+	*outSdad = 0;
+	*outSdadSize = 0;
+	while (1)
+	{
+		int parseShift_2;
+		unsigned short parseTag_2;
+		unsigned char* parseData_2;
+		int parseSize_2;
+
+		parseShift_2 = libemv_parse_tlv(parseData_1, parseSize_1, &parseTag_2, &parseData_2, &parseSize_2);
+		if (!parseShift_2)
+			break;
+		if (parseTag_2 == TAG_SIGNED_DYNAMIC_APP_DATA)
+		{
+			*outSdad = parseData_2;
+			*outSdadSize = parseSize_2;
+		} else
+			libemv_set_tag(parseTag_2, parseData_2, parseSize_2);
+
+		// Next
+		parseData_1 += parseShift_2;
+		parseSize_1 -= parseShift_2;
+	}
+	return *outSdad != 0;
+}
+
+LIBEMV_API int libemv_cardholder_verification(unsigned char* outMethod)
+{
+	int result;
+
+	LIBEMV_PHASE_BEGIN(LIBEMV_PHASE_CARDHOLDER_VERIFICATION);
+	result = cardholder_verification(outMethod);
+	LIBEMV_PHASE_END(LIBEMV_PHASE_CARDHOLDER_VERIFICATION, result);
+	return result;
+}
+
+static int cardholder_verification(unsigned char* outMethod)
+{
+	const CVM_RULE* rule;
+	const CVM_RULE* performed;
+	unsigned long conditions;
+	unsigned long long capabilities;
+	unsigned char method;
+	unsigned char result;
+	int index;
+
+	*outMethod = LIBEMV_CVM_NOT_PERFORMED;
+	if (!libemv_config || indexApplicationSelected < 0 || indexApplicationSelected >= candidateApplicationCount)
+		return LIBEMV_UNKNOWN_ERROR;
+
+	// TVR and CVM Results are found once, written in place
+	libemv_init_tag_handle(&tvrHandle, TAG_TVR, 5);
+	libemv_init_tag_handle(&cvmResultsHandle, TAG_CVM_RESULTS, 3);
+	set_cvm_results(LIBEMV_CVM_NOT_PERFORMED, 0x00, CVM_RESULT_UNKNOWN);
+	if (!(libemv_get_bits(TAG_AIP) & AIP_CARDHOLDER_VERIFICATION_SUPPORTED))
+		return LIBEMV_OK;
+	if (!cvmTable.count)
+	{
+		if (libemv_debug_enabled)
+			libemv_printf("Cardholder verification: no CVM list\n");
+		libemv_tag_handle_set_bits(&tvrHandle, TVR_ICC_DATA_MISSING);
+		return LIBEMV_OK;
+	}
+	libemv_set_bits(TAG_TSI, TSI_CARDHOLDER_VERIFICATION_PERFORMED);
+
+	// Rules with satisfied condition in order of list
+	conditions = libemv_cvm_conditions(&cvmTable);
+	capabilities = libemv_get_bits(TAG_TERMINAL_CAPABILITIES);
+	performed = 0;
+	for (index = libemv_cvm_next(&cvmTable, 0, conditions, capabilities); index < cvmTable.count;
+		index = libemv_cvm_next(&cvmTable, index + 1, conditions, capabilities))
+	{
+		rule = &cvmTable.rules[index];
+		method = (unsigned char) (rule->rule[0] & 0x3F);
+		if (libemv_debug_enabled)
+			libemv_printf("CV Rule %02X %02X\n", rule->rule[0], rule->rule[1]);
+		if (!CVM_SUPPORTED(rule, capabilities))
+		{
+			if (rule->capabilities & CVM_UNRECOGNISED)
+				libemv_tag_handle_set_bits(&tvrHandle, TVR_UNRECOGNISED_CVM);
+		} else
+		{
+			performed = rule;
+			if (perform_cvm(method, &result) != LIBEMV_OK)
+				return LIBEMV_ERROR_TRANSMIT;
+			if (result != CVM_RESULT_FAILED)
+			{
+				set_cvm_results(rule->rule[0], rule->rule[1], result);
+				*outMethod = method;
+				return LIBEMV_OK;
+			}
+			if (method == LIBEMV_CVM_FAIL)
+				break;
+		}
+		if (!(rule->rule[0] & CVM_APPLY_SUCCEEDING))
+			break;
+	}
+
+	// Failed: last performed rule or no CVM performed
+	if (libemv_debug_enabled)
+		libemv_printf("Cardholder verification failed\n");
+	libemv_tag_handle_set_bits(&tvrHandle, TVR_CARDHOLDER_VERIFICATION_FAILED);
+	if (performed)
+		set_cvm_results(performed->rule[0], performed->rule[1], CVM_RESULT_FAILED);
+	else
+		set_cvm_results(LIBEMV_CVM_NOT_PERFORMED, 0x00, CVM_RESULT_FAILED);
+	*outMethod = LIBEMV_CVM_FAIL;
+	return LIBEMV_OK;
+}
+
+static int perform_cvm(unsigned char method, unsigned char* outResult)
+{
+	unsigned char* counter;
+	int counterSize;
+	int result;
+	int pin;
+
+	*outResult = CVM_RESULT_FAILED;
+	if (method == LIBEMV_CVM_FAIL)
+		return LIBEMV_OK;
+	*outResult = CVM_RESULT_SUCCESSFUL;
+	if (method == LIBEMV_CVM_NO_CVM)
+		return LIBEMV_OK;
+	*outResult = CVM_RESULT_UNKNOWN;
+	if (method == LIBEMV_CVM_SIGNATURE)
+		return LIBEMV_OK;
+
+	// Offline PIN: no entry if card has no tries left, card without counter is asked anyway
+	if (method != LIBEMV_CVM_ONLINE_PIN)
+	{
+		result = libemv_fetch_tag(TAG_PIN_TRY_COUNTER, &counter, &counterSize);
+		if (result == LIBEMV_ERROR_TRANSMIT)
+			return result;
+		if (result == LIBEMV_OK && counterSize == 1 && *counter == 0)
+		{
+			if (libemv_debug_enabled)
+				libemv_printf("PIN Try Counter is 0\n");
+			libemv_tag_handle_set_bits(&tvrHandle, TVR_PIN_TRY_LIMIT_EXCEEDED);
+			*outResult = CVM_RESULT_FAILED;
+			return LIBEMV_OK;
+		}
+	}
+
+	// PIN methods
+	pin = libemv_verify_pin ? libemv_verify_pin(method) : LIBEMV_PIN_PAD_FAILED;
+	if (libemv_debug_enabled)
+		libemv_printf("PIN of method %02X: %d\n", method, pin);
+	if (pin == LIBEMV_PIN_OK)
+	{
+		if (method == LIBEMV_CVM_ONLINE_PIN)
+			libemv_tag_handle_set_bits(&tvrHandle, TVR_ONLINE_PIN_ENTERED);
+		else if (method != LIBEMV_CVM_PLAINTEXT_PIN_SIGNATURE && method != LIBEMV_CVM_ENCIPHERED_PIN_SIGNATURE)
+			*outResult = CVM_RESULT_SUCCESSFUL;
+		return LIBEMV_OK;
+	}
+	if (pin == LIBEMV_PIN_TRY_LIMIT_EXCEEDED)
+		libemv_tag_handle_set_bits(&tvrHandle, TVR_PIN_TRY_LIMIT_EXCEEDED);
+	else if (pin == LIBEMV_PIN_NOT_ENTERED)
+		libemv_tag_handle_set_bits(&tvrHandle, TVR_PIN_NOT_ENTERED);
+	else if (pin == LIBEMV_PIN_PAD_FAILED)
+		libemv_tag_handle_set_bits(&tvrHandle, TVR_PIN_PAD_NOT_PRESENT);
+	*outResult = CVM_RESULT_FAILED;
+	return LIBEMV_OK;
+}
+
+static void set_cvm_results(unsigned char method, unsigned char condition, unsigned char result)
+{
+	unsigned char* results;
+
+	results = libemv_tag_handle_data(&cvmResultsHandle);
+	if (!results)
+		return;
+	results[0] = method;
+	results[1] = condition;
+	results[2] = result;
+}
+
+LIBEMV_API int libemv_terminal_action_analysis(unsigned char* outCryptogram)
+{
+	int result;
+
+	LIBEMV_PHASE_BEGIN(LIBEMV_PHASE_TERMINAL_ACTION_ANALYSIS);
+	result = terminal_action_analysis(outCryptogram);
+	LIBEMV_PHASE_END(LIBEMV_PHASE_TERMINAL_ACTION_ANALYSIS, result);
+	return result;
+}
+
+static unsigned long long issuer_action_code(unsigned short tag, unsigned long long defaultCode)
+{
+	unsigned char* data;
+	int size;
+
+	data = libemv_get_tag(tag, &size);
+	if (!data || size != 5)
+		return defaultCode;
+	return libemv_pack_bits(data, size);
+}
+
+static int terminal_action_analysis(unsigned char* outCryptogram)
+{
+	const CONFIG_APP* app;
+	unsigned long long tvr;
+	char onlineCapable;
+
+	if (!libemv_config || indexApplicationSelected < 0 || indexApplicationSelected >= candidateApplicationCount)
+		return LIBEMV_UNKNOWN_ERROR;
+	app = &LIBEMV_CONFIG_APPS()[candidateApplications[indexApplicationSelected].indexRID];
+
+	// Offline data authentication wasn't done in this transaction
+	if (!(libemv_get_bits(TAG_TSI) & TSI_OFFLINE_DATA_AUTH_PERFORMED))
+		libemv_set_bits(TAG_TVR, TVR_OFFLINE_DATA_AUTH_NOT_PERFORMED);
+	tvr = libemv_get_bits(TAG_TVR);
+
+	onlineCapable = terminal_online_capable();
+
+	// Every check is one AND of TVR with TAC | IAC, absent IAC-Denial is all zeros,
+	// absent IAC-Online and IAC-Default are all ones
+	if (tvr & (libemv_pack_bits(app->terminalActionCodeDenial, 5) | issuer_action_code(TAG_IAC_DENIAL, 0)))
+		*outCryptogram = LIBEMV_CRYPTOGRAM_AAC;
+	else if (onlineCapable)
+	{
+		if (tvr & (libemv_pack_bits(app->terminalActionCodeOnline, 5) | issuer_action_code(TAG_IAC_ONLINE, 0xFFFFFFFFFFULL)))
+			*outCryptogram = LIBEMV_CRYPTOGRAM_ARQC;
+		else
+			*outCryptogram = LIBEMV_CRYPTOGRAM_TC;
+	} else
+	{
+		if (default_action_decline(app, tvr))
+			*outCryptogram = LIBEMV_CRYPTOGRAM_AAC;
+		else
+			*outCryptogram = LIBEMV_CRYPTOGRAM_TC;
+	}
+
+	if (libemv_debug_enabled)
+		libemv_printf("Terminal action analysis: TVR %010llX, cryptogram %02X\n", tvr, *outCryptogram);
+	return LIBEMV_OK;
+}
+
+static char default_action_decline(const CONFIG_APP* app, unsigned long long tvr)
+{
+	return (tvr & (libemv_pack_bits(app->terminalActionCodeDefault, 5) | issuer_action_code(TAG_IAC_DEFAULT, 0xFFFFFFFFFFULL))) != 0;
+}
+
+static char terminal_online_capable(void)
+{
+	unsigned char* terminalType;
+	int typeDigit;
+	int size;
+
+	// Terminal type: x1, x4 - online only, x2, x5 - offline with online capability, x3, x6 - offline only
+	terminalType = libemv_get_tag(TAG_TERMINAL_TYPE, &size);
+	typeDigit = terminalType && size == 1 ? (*terminalType & 0x0F) : 0;
+	return typeDigit == 1 || typeDigit == 2 || typeDigit == 4 || typeDigit == 5;
+}
+
+LIBEMV_API int libemv_terminal_risk_management(void)
+{
+	int result;
+
+	LIBEMV_PHASE_BEGIN(LIBEMV_PHASE_TERMINAL_RISK_MANAGEMENT);
+	result = terminal_risk_management();
+	LIBEMV_PHASE_END(LIBEMV_PHASE_TERMINAL_RISK_MANAGEMENT, result);
+	return result;
+}
+
+static int terminal_risk_management(void)
+{
+	const CONFIG_APP* app;
+	unsigned long long amount;
+	unsigned long long logged;
+	unsigned long long floorLimit;
+	unsigned char pan[10];
+	unsigned char* data;
+	int size;
+	int result;
+
+	if (!libemv_config || indexApplicationSelected < 0 || indexApplicationSelected >= candidateApplicationCount)
+		return LIBEMV_UNKNOWN_ERROR;
+	app = &LIBEMV_CONFIG_APPS()[candidateApplications[indexApplicationSelected].indexRID];
+
+	// Card doesn't require terminal risk management (AIP), TSI isn't set
+	if (!(libemv_get_bits(TAG_AIP) & AIP_TERMINAL_RISK_MANAGEMENT_REQUIRED))
+	{
+		if (libemv_debug_enabled)
+			libemv_printf("Terminal risk management isn't required by card\n");
+		return LIBEMV_OK;
+	}
+
+	libemv_check_exception_file();
+
+	// Floor limit, approved amounts of the same card in transaction log are added (split sales)
+	amount = libemv_get_numeric(TAG_AMOUNT_AUTHORISED);
+	floorLimit = libemv_pack_bits(app->terminalFloorLimit, 4);
+	logged = 0;
+	data = libemv_get_tag(TAG_PAN, &size);
+	if (data && size > 0 && size <= 10)
+	{
+		memset(pan, 0xFF, sizeof(pan));
+		memcpy(pan, data, size);
+		logged = libemv_txlog_sum(pan);
+	}
+	if (amount + logged >= floorLimit)
+		libemv_set_bits(TAG_TVR, TVR_FLOOR_LIMIT_EXCEEDED);
+	else if (terminal_online_capable())
+		random_selection(app, amount, floorLimit);
+
+	result = velocity_checking();
+	if (result == LIBEMV_ERROR_TRANSMIT)
+		return result;
+
+	if (libemv_debug_enabled)
+		libemv_printf("Terminal risk management: amount %llu, logged %llu, floor limit %llu, TVR %010llX\n",
+			amount, logged, floorLimit, libemv_get_bits(TAG_TVR));
+	libemv_set_bits(TAG_TSI, TSI_TERMINAL_RISK_MANAGEMENT_PERFORMED);
+	return LIBEMV_OK;
+}
+
+static void random_selection(const CONFIG_APP* app, unsigned long long amount, unsigned long long floorLimit)
+{
+	unsigned long long threshold;
+	unsigned long long percent;
+	int random;
+
+	// Percentage grows from target at threshold to maximum target at floor limit (biased selection)
+	threshold = libemv_pack_bits(app->thresholdValueForRandomSelection, 4);
+	percent = app->targetForRandomSelection;
+	if (amount >= threshold && app->maxTargetForBiasedRandomSelection > app->targetForRandomSelection)
+		percent += (app->maxTargetForBiasedRandomSelection - app->targetForRandomSelection) * (amount - threshold) / (floorLimit - threshold);
+
+	random = libemv_rand() % 99 + 1;
+	if ((unsigned long long) random <= percent)
+		libemv_set_bits(TAG_TVR, TVR_RANDOMLY_SELECTED_ONLINE);
+}
+
+static int velocity_checking(void)
+{
+	unsigned char* lowerLimit;
+	unsigned char* upperLimit;
+	int lowerSize, upperSize;
+	int atc, lastOnlineAtc;
+	int result;
+
+	lowerLimit = libemv_get_tag(TAG_LOWER_CONSECUTIVE_OFFLINE_LIMIT, &lowerSize);
+	upperLimit = libemv_get_tag(TAG_UPPER_CONSECUTIVE_OFFLINE_LIMIT, &upperSize);
+	if (!lowerLimit || lowerSize != 1 || !upperLimit || upperSize != 1)
+		return LIBEMV_OK;
+
+	result = get_counter(TAG_ATC, &atc);
+	if (result == LIBEMV_OK)
+		result = get_counter(TAG_LAST_ONLINE_ATC, &lastOnlineAtc);
+	if (result == LIBEMV_ERROR_TRANSMIT)
+		return result;
+
+	// Counters aren't available or ATC doesn't grow since last online transaction
+	if (result != LIBEMV_OK || atc <= lastOnlineAtc)
+		libemv_set_bits(TAG_TVR, TVR_LOWER_OFFLINE_LIMIT_EXCEEDED | TVR_UPPER_OFFLINE_LIMIT_EXCEEDED);
+	else
+	{
+		if (atc - lastOnlineAtc > *lowerLimit)
+			libemv_set_bits(TAG_TVR, TVR_LOWER_OFFLINE_LIMIT_EXCEEDED);
+		if (atc - lastOnlineAtc > *upperLimit)
+			libemv_set_bits(TAG_TVR, TVR_UPPER_OFFLINE_LIMIT_EXCEEDED);
+	}
+	if (result == LIBEMV_OK && lastOnlineAtc == 0)
+		libemv_set_bits(TAG_TVR, TVR_NEW_CARD);
+	return LIBEMV_OK;
+}
+
+static int get_counter(unsigned short tag, int* outValue)
+{
+	unsigned char* data;
+	int size;
+	int result;
+
+	result = libemv_fetch_tag(tag, &data, &size);
+	if (result != LIBEMV_OK)
+		return result;
+	if (size != 2)
+		return LIBEMV_UNKNOWN_ERROR;
+	*outValue = (data[0] << 8) | data[1];
+	return LIBEMV_OK;
+}
+
+LIBEMV_API int libemv_generate_ac(unsigned char cryptogram, unsigned char* outCryptogram)
+{
+	int result;
+
+	LIBEMV_PHASE_BEGIN(LIBEMV_PHASE_GENERATE_AC);
+	result = generate_ac(CDOL_1, cryptogram, outCryptogram);
+	LIBEMV_PHASE_END(LIBEMV_PHASE_GENERATE_AC, result);
+	return result;
+}
+
+static int generate_ac(int cdol, unsigned char cryptogram, unsigned char* outCryptogram)
+{
+	const CONFIG_APP* app;
+	unsigned char hashData[1024];
+	int hashDataSize;
+	unsigned char outData[LIBEMV_APDU_RESPONSE_SIZE];
+	int outSize;
+	unsigned char* sdad;
+	int sdadSize;
+	unsigned char* data;
+	int size;
+	unsigned char p1;
+	char cda;
+
+	if (!libemv_config || indexApplicationSelected < 0 || indexApplicationSelected >= candidateApplicationCount)
+		return LIBEMV_UNKNOWN_ERROR;
+	app = &LIBEMV_CONFIG_APPS()[candidateApplications[indexApplicationSelected].indexRID];
+
+	if (!cdolReady)
+		return LIBEMV_UNKNOWN_ERROR;
+	libemv_dol_plan_patch(&cdolPlans[cdol], cdolData[cdol]);
+
+	// Result of previous GENERATE AC isn't dropped by next one
+	generate_ac_settle();
+
+	// Transaction data of CDA: PDOL data, CDOL1 data, CDOL2 data for second GENERATE AC, response
+	memcpy(hashData, pdolData, pdolDataSize);
+	hashDataSize = pdolDataSize;
+	if (cdol == CDOL_2)
+	{
+		memcpy(hashData + hashDataSize, cdolData[CDOL_1], cdolPlans[CDOL_1].size);
+		hashDataSize += cdolPlans[CDOL_1].size;
+	}
+	memcpy(hashData + hashDataSize, cdolData[cdol], cdolPlans[cdol].size);
+	hashDataSize += cdolPlans[cdol].size;
+
+	// CDA is requested for TC and ARQC if ICC key is recovered
+	p1 = (unsigned char) (cryptogram & 0xC0);
+	cda = p1 != LIBEMV_CRYPTOGRAM_AAC && (libemv_get_bits(TAG_AIP) & AIP_CDA_SUPPORTED)
+		&& (libemv_get_bits(TAG_TERMINAL_CAPABILITIES) & TERMINAL_CAP_CDA)
+		&& !(libemv_get_bits(TAG_TVR) & TVR_CDA_FAILED) && libemv_oda_icc_key(app);
+	if (cda)
+		p1 |= 0x10;
+
+	// GENERATE AC
+	if (libemv_debug_enabled)
+		libemv_printf("GENERATE AC, P1: %02X\n", p1);
+	if (!libemv_apdu(0x80, 0xAE, p1, 0x00, (unsigned char) cdolPlans[cdol].size, cdolData[cdol], &outSize, outData))
+		return LIBEMV_ERROR_TRANSMIT;
+	if (outData[outSize - 2] != 0x90 || outData[outSize - 1] != 0x00)
+		return LIBEMV_TERMINATED;
+	if (!generate_ac_parse(outData, outSize - 2, &sdad, &sdadSize, hashData, &hashDataSize, sizeof(hashData)))
+		return LIBEMV_TERMINATED;
+	data = libemv_get_tag(TAG_CID, &size);
+	if (!data || size != 1)
+		return LIBEMV_TERMINATED;
+	cardCryptogram = (unsigned char) (*data & 0xC0);
+	libemv_set_bits(TAG_TSI, TSI_CARD_RISK_MANAGEMENT_PERFORMED);
+
+	if (libemv_debug_enabled)
+		libemv_printf("GENERATE AC: cryptogram %02X, CDA %d\n", cardCryptogram, cda);
+	*outCryptogram = cardCryptogram;
+	if (!cda || cardCryptogram == LIBEMV_CRYPTOGRAM_AAC)
+		return LIBEMV_OK;
+
+	// Card is done, signature of TC or ARQC is checked by job. Until job is done decision is AAC,
+	// TC or ARQC is released by libemv_generate_ac_result
+	if (!sdad || !libemv_oda_cda_start(sdad, sdadSize, *data, hashData, hashDataSize))
+	{
+		libemv_set_bits(TAG_TVR, TVR_CDA_FAILED);
+		cardCryptogram = LIBEMV_CRYPTOGRAM_AAC;
+		*outCryptogram = cardCryptogram;
+	} else if (libemv_run_async)
+		*outCryptogram = LIBEMV_CRYPTOGRAM_AAC;
+	else
+		*outCryptogram = generate_ac_settle();
+	return LIBEMV_OK;
+}
+
+static int generate_ac_parse(unsigned char* rApdu, int rApduSize, unsigned char** outSdad, int* outSdadSize,
+							 unsigned char* outHashData, int* inOutHashDataSize, int maxHashDataSize)
+{
+	unsigned short parseTag_1;
+	unsigned char* parseData_1;
+	int parseSize_1;
+
+	*outSdad = 0;
+	*outSdadSize = 0;
+	if (!libemv_parse_tlv(rApdu, rApduSize, &parseTag_1, &parseData_1, &parseSize_1))
+		return 0;
+
+	// Format 1: CID, ATC, Application Cryptogram, Issuer Application Data
+	if (parseTag_1 == TAG_RESPONSE_FORMAT_1)
+	{
+		if (parseSize_1 < 11)
+			return 0;
+		libemv_set_tag(TAG_CID, parseData_1, 1);
+		libemv_set_tag(TAG_ATC, parseData_1 + 1, 2);
+		libemv_set_tag(TAG_APPLICATION_CRYPTOGRAM, parseData_1 + 3, 8);
+		if (parseSize_1 > 11)
+			libemv_set_tag(TAG_ISSUER_APPLICATION_DATA, parseData_1 + 11, parseSize_1 - 11);
+		return 1;
+	}
+	if (parseTag_1 != TAG_RESPONSE_FORMAT_2)
+		return 0;
+
+	while (1)
+	{
+		int parseShift_2;
+		unsigned short parseTag_2;
+		unsigned char* parseData_2;
+		int parseSize_2;
+
+		parseShift_2 = libemv_parse_tlv(parseData_1, parseSize_1, &parseTag_2, &parseData_2, &parseSize_2);
+		if (!parseShift_2)
+			break;
+		if (parseTag_2 == TAG_SIGNED_DYNAMIC_APP_DATA)
+		{
+			*outSdad = parseData_2;
+			*outSdadSize = parseSize_2;
+		} else
+		{
+			libemv_set_tag(parseTag_2, parseData_2, parseSize_2);
+			if (*inOutHashDataSize + parseShift_2 <= maxHashDataSize)
+				memcpy(outHashData + *inOutHashDataSize, parseData_1, parseShift_2);
+			*inOutHashDataSize += parseShift_2;
+		}
+
+		// Next
+		parseData_1 += parseShift_2;
+		parseSize_1 -= parseShift_2;
+	}
+	return *inOutHashDataSize <= maxHashDataSize;
+}
+
+static unsigned char generate_ac_settle(void)
+{
+	if (libemv_oda_cda_finish() == 0)
+	{
+		if (libemv_debug_enabled)
+			libemv_printf("CDA: signature of GENERATE AC is wrong\n");
+		libemv_set_bits(TAG_TVR, TVR_CDA_FAILED);
+		cardCryptogram = LIBEMV_CRYPTOGRAM_AAC;
+	}
+	return cardCryptogram;
+}
+
+LIBEMV_API int libemv_generate_ac_result(unsigned char* outCryptogram)
+{
+	// Decision is released only with result of CDA
+	*outCryptogram = generate_ac_settle();
+	return LIBEMV_OK;
+}
+
+LIBEMV_API int libemv_completion(int onlineResult, const unsigned char* arc, const unsigned char* issuerAuthData, int issuerAuthDataSize,
+								 unsigned char* outCryptogram)
+{
+	int result;
+
+	LIBEMV_PHASE_BEGIN(LIBEMV_PHASE_COMPLETION);
+	result = completion(onlineResult, arc, issuerAuthData, issuerAuthDataSize, outCryptogram);
+	LIBEMV_PHASE_END(LIBEMV_PHASE_COMPLETION, result);
+	return result;
+}
+
+static int completion(int onlineResult, const unsigned char* arc, const unsigned char* issuerAuthData, int issuerAuthDataSize,
+					  unsigned char* outCryptogram)
+{
+	const CONFIG_APP* app;
+	unsigned char cryptogram;
+	int result;
+
+	if (!libemv_config || indexApplicationSelected < 0 || indexApplicationSelected >= candidateApplicationCount)
+		return LIBEMV_UNKNOWN_ERROR;
+	app = &LIBEMV_CONFIG_APPS()[candidateApplications[indexApplicationSelected].indexRID];
+
+	// Only card which asked to go online waits for second GENERATE AC
+	if (cardCryptogram != LIBEMV_CRYPTOGRAM_ARQC)
+		return LIBEMV_UNKNOWN_ERROR;
+
+	// ARQC with wrong CDA signature (libemv_generate_ac_result wasn't called) is declined, result of issuer isn't used
+	if (generate_ac_settle() != LIBEMV_CRYPTOGRAM_ARQC)
+		cryptogram = LIBEMV_CRYPTOGRAM_AAC;
+	else if (onlineResult == LIBEMV_ONLINE_FAILED)
+	{
+		// Unable to go online: TAC-Default and IAC-Default, Authorisation Response Code Y3 or Z3
+		if (default_action_decline(app, libemv_get_bits(TAG_TVR)))
+		{
+			cryptogram = LIBEMV_CRYPTOGRAM_AAC;
+			libemv_set_tag(TAG_AUTHORISATION_RESPONSE_CODE, "Z3", 2);
+		} else
+		{
+			cryptogram = LIBEMV_CRYPTOGRAM_TC;
+			libemv_set_tag(TAG_AUTHORISATION_RESPONSE_CODE, "Y3", 2);
+		}
+	} else
+	{
+		if (!arc || (onlineResult != LIBEMV_ONLINE_APPROVED && onlineResult != LIBEMV_ONLINE_DECLINED)
+			|| (issuerAuthData && (issuerAuthDataSize < 8 || issuerAuthDataSize > 16)))
+			return LIBEMV_UNKNOWN_ERROR;
+		libemv_set_tag(TAG_AUTHORISATION_RESPONSE_CODE, (unsigned char*) arc, 2);
+		if (issuerAuthData)
+		{
+			libemv_set_tag(TAG_ISSUER_AUTHENTICATION_DATA, (unsigned char*) issuerAuthData, issuerAuthDataSize);
+
+			// Card without issuer authentication gets Issuer Authentication Data in CDOL2
+			if (libemv_get_bits(TAG_AIP) & AIP_ISSUER_AUTHENTICATION_SUPPORTED)
+			{
+				result = external_authenticate((unsigned char*) issuerAuthData, issuerAuthDataSize);
+				if (result != LIBEMV_OK)
+					return result;
+			}
+		}
+		cryptogram = onlineResult == LIBEMV_ONLINE_APPROVED ? LIBEMV_CRYPTOGRAM_TC : LIBEMV_CRYPTOGRAM_AAC;
+	}
+
+	if (libemv_debug_enabled)
+		libemv_printf("Completion: online result %d, cryptogram %02X\n", onlineResult, cryptogram);
+	return generate_ac(CDOL_2, cryptogram, outCryptogram);
+}
+
+static int external_authenticate(unsigned char* issuerAuthData, int size)
+{
+	int outSize;
+	unsigned char outData[LIBEMV_APDU_RESPONSE_SIZE];
+
+	// EXTERNAL AUTHENTICATE
+	if (libemv_debug_enabled)
+		libemv_debug_buffer("EXTERNAL AUTHENTICATE: ", issuerAuthData, size, "\n");
+	if (!libemv_apdu(0x00, 0x82, 0x00, 0x00, (unsigned char) size, issuerAuthData, &outSize, outData))
+		return LIBEMV_ERROR_TRANSMIT;
+	libemv_set_bits(TAG_TSI, TSI_ISSUER_AUTHENTICATION_PERFORMED);
+	if (outData[outSize - 2] != 0x90 || outData[outSize - 1] != 0x00)
+	{
+		if (libemv_debug_enabled)
+			libemv_printf("Issuer authentication failed: %02X%02X\n", outData[outSize - 2], outData[outSize - 1]);
+		libemv_set_bits(TAG_TVR, TVR_ISSUER_AUTHENTICATION_FAILED);
+	}
 	return LIBEMV_OK;
 }
@@ -0,0 +1,394 @@
+#include "include/libemv.h"
+#include "internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Exception file (see EXCEPTION_HEADER) belongs to version of configuration: new file and delta
+// are published like configuration, transactions keep exception list of their version
+
+// Hash of PAN for Bloom filter: FNV-1a and finalizer of MurmurHash3
+static unsigned long long exception_hash(const unsigned char* pan)
+{
+	unsigned long long hash;
+	int i;
+
+	hash = 14695981039346656037ULL;
+	for (i = 0; i < 10; i++)
+	{
+		hash ^= pan[i];
+		hash *= 1099511628211ULL;
+	}
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCDULL;
+	hash ^= hash >> 33;
+	hash *= 0xC4CEB9FE1A85EC53ULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+// Block of filter is chosen by low bits of hash, bits in block (512) by 9 bit parts of second hash
+static void bloom_position(unsigned int blocks, unsigned long long hash, unsigned int* outBlock, unsigned long long* outBits)
+{
+	*outBlock = (unsigned int) hash & (blocks - 1);
+	*outBits = (hash ^ (hash >> 31)) * 0xBF58476D1CE4E5B9ULL;
+	*outBits ^= *outBits >> 27;
+}
+
+// Count of blocks of filter for count of entries, power of 2
+static unsigned int bloom_blocks(int count)
+{
+	unsigned int blocks;
+
+	blocks = 1;
+	while ((unsigned long long) blocks * EXCEPTION_BLOOM_BLOCK * 8 < (unsigned long long) count * EXCEPTION_BITS_PER_ENTRY)
+		blocks <<= 1;
+	return blocks;
+}
+
+// Returns 0 if PAN is surely not in filter
+static char bloom_test(const unsigned char* filter, unsigned int blocks, unsigned long long hash)
+{
+	const unsigned long long* block;
+	unsigned long long bits;
+	unsigned int index;
+	int i;
+
+	bloom_position(blocks, hash, &index, &bits);
+	block = (const unsigned long long*) filter + index * (EXCEPTION_BLOOM_BLOCK / 8);
+	for (i = 0; i < EXCEPTION_BLOOM_HASHES; i++, bits >>= 9)
+	{
+		if (!(block[(bits & 511) >> 6] & (1ULL << (bits & 63))))
+			return 0;
+	}
+	return 1;
+}
+
+static void bloom_add(unsigned char* filter, unsigned int blocks, unsigned long long hash)
+{
+	unsigned long long* block;
+	unsigned long long bits;
+	unsigned int index;
+	int i;
+
+	bloom_position(blocks, hash, &index, &bits);
+	block = (unsigned long long*) filter + index * (EXCEPTION_BLOOM_BLOCK / 8);
+	for (i = 0; i < EXCEPTION_BLOOM_HASHES; i++, bits >>= 9)
+		block[(bits & 511) >> 6] |= 1ULL << (bits & 63);
+}
+
+static int exception_compare(const void* a, const void* b)
+{
+	return memcmp(a, b, EXCEPTION_KEY_SIZE);
+}
+
+// Binary search of key in sorted entries
+// Returns entry or 0
+static const LIBEMV_EXCEPTION_ENTRY* exception_search(const LIBEMV_EXCEPTION_ENTRY* entries, int count, const unsigned char* key)
+{
+	int low;
+	int high;
+
+	low = 0;
+	high = count - 1;
+	while (low <= high)
+	{
+		int middle;
+		int compare;
+		middle = low + (high - low) / 2;
+		compare = memcmp(entries[middle].pan, key, EXCEPTION_KEY_SIZE);
+		if (compare == 0)
+			return &entries[middle];
+		if (compare < 0)
+			low = middle + 1;
+		else
+			high = middle - 1;
+	}
+	return 0;
+}
+
+// Key is in delta or, if delta doesn't have it, in file
+static char exception_contains(const EXCEPTION_LIST* list, const unsigned char* key, char inFilter, char inDelta)
+{
+	const LIBEMV_EXCEPTION_ENTRY* entry;
+
+	if (inDelta)
+	{
+		entry = exception_search(list->delta, list->deltaCount, key);
+		if (entry)
+			return !entry->remove;
+	}
+	if (!inFilter)
+		return 0;
+	return exception_search((const LIBEMV_EXCEPTION_ENTRY*) ((const unsigned char*) list->header + list->header->entriesOffset),
+		list->header->count, key) != 0;
+}
+
+int libemv_exception_filter(const EXCEPTION_LIST* list, const unsigned char* pan)
+{
+	return list->header && bloom_test((const unsigned char*) list->header + list->header->bloomOffset,
+		list->header->bloomBlocks, exception_hash(pan));
+}
+
+int libemv_exception_lookup(const EXCEPTION_LIST* list, const unsigned char* pan, unsigned char panSequence)
+{
+	unsigned char key[EXCEPTION_KEY_SIZE];
+	unsigned long long hash;
+	char inFilter;
+	char inDelta;
+
+	// Most cards aren't in file and delta, filters answer with one cache line each
+	hash = exception_hash(pan);
+	inFilter = list->header && bloom_test((const unsigned char*) list->header + list->header->bloomOffset, list->header->bloomBlocks, hash);
+	inDelta = list->deltaCount > 0 && bloom_test(list->deltaFilter, list->deltaBlocks, hash);
+	if (!inFilter && !inDelta)
+		return 0;
+
+	memcpy(key, pan, 10);
+	key[10] = panSequence;
+	if (exception_contains(list, key, inFilter, inDelta))
+		return 1;
+	key[10] = 0xFF;
+	return panSequence != 0xFF && exception_contains(list, key, inFilter, inDelta);
+}
+
+void libemv_free_exception_list(EXCEPTION_LIST* list)
+{
+	if (list->ownsFile)
+		libemv_unmap_file((const unsigned char*) list->header, list->mappedSize);
+	if (list->delta)
+		libemv_free(list->delta);
+	if (list->deltaFilter)
+		libemv_free(list->deltaFilter);
+	libemv_free(list);
+}
+
+LIBEMV_API int libemv_build_exception_image(const LIBEMV_EXCEPTION_ENTRY* entries, int count, unsigned char* outImage, int maxSize)
+{
+	EXCEPTION_HEADER header;
+	LIBEMV_EXCEPTION_ENTRY* outEntries;
+	unsigned long long size;
+	int i, j;
+
+	if (count < 0)
+		return 0;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = EXCEPTION_MAGIC;
+	header.version = EXCEPTION_VERSION;
+	header.bloomOffset = EXCEPTION_BLOOM_BLOCK;
+	header.bloomBlocks = bloom_blocks(count);
+	header.entriesOffset = header.bloomOffset + header.bloomBlocks * EXCEPTION_BLOOM_BLOCK;
+
+	// Size with all entries, duplicates make image only smaller
+	size = header.entriesOffset + (unsigned long long) count * sizeof(LIBEMV_EXCEPTION_ENTRY);
+	if (size > 0x7FFFFFFF)
+		return 0;
+	if (!outImage)
+		return (int) size;
+	if (maxSize < (int) size)
+		return 0;
+
+	memset(outImage, 0, header.entriesOffset);
+	outEntries = (LIBEMV_EXCEPTION_ENTRY*) (outImage + header.entriesOffset);
+	memcpy(outEntries, entries, count * sizeof(LIBEMV_EXCEPTION_ENTRY));
+	qsort(outEntries, count, sizeof(LIBEMV_EXCEPTION_ENTRY), exception_compare);
+
+	for (i = 0, j = 0; i < count; i++)
+	{
+		if (j > 0 && exception_compare(&outEntries[j - 1], &outEntries[i]) == 0)
+			continue;
+		outEntries[j] = outEntries[i];
+		outEntries[j].remove = 0;
+		bloom_add(outImage + header.bloomOffset, header.bloomBlocks, exception_hash(outEntries[j].pan));
+		j++;
+	}
+	header.count = j;
+	header.size = header.entriesOffset + j * sizeof(LIBEMV_EXCEPTION_ENTRY);
+	memcpy(outImage, &header, sizeof(header));
+	return header.size;
+}
+
+LIBEMV_API int libemv_map_exception_file(const char* path)
+{
+	const EXCEPTION_HEADER* header;
+	EXCEPTION_LIST* list;
+	const unsigned char* mapped;
+	size_t size;
+
+	mapped = libemv_map_file(path, &size);
+	if (!mapped)
+		return LIBEMV_UNKNOWN_ERROR;
+
+	// Structure is checked, sorting of entries is trusted, file is built by libemv_build_exception_image
+	header = (const EXCEPTION_HEADER*) mapped;
+	if (size < sizeof(EXCEPTION_HEADER) || header->magic != EXCEPTION_MAGIC || header->version != EXCEPTION_VERSION
+		|| header->size > size || header->bloomOffset % EXCEPTION_BLOOM_BLOCK != 0
+		|| header->bloomBlocks == 0 || (header->bloomBlocks & (header->bloomBlocks - 1)) != 0
+		|| header->bloomBlocks > (header->size - header->bloomOffset) / EXCEPTION_BLOOM_BLOCK
+		|| header->entriesOffset != header->bloomOffset + header->bloomBlocks * EXCEPTION_BLOOM_BLOCK
+		|| header->count < 0 || (unsigned int) header->count > (header->size - header->entriesOffset) / sizeof(LIBEMV_EXCEPTION_ENTRY))
+	{
+		if (libemv_debug_enabled)
+			libemv_printf("Exception file: wrong format\n");
+		libemv_unmap_file(mapped, size);
+		return LIBEMV_UNKNOWN_ERROR;
+	}
+
+	list = libemv_malloc(sizeof(EXCEPTION_LIST));
+	LIBEMV_STATS_ADD(allocCount, 1);
+	if (!list)
+	{
+		if (libemv_debug_enabled)
+			libemv_printf("Unable allocate memory\n");
+		libemv_unmap_file(mapped, size);
+		return LIBEMV_UNKNOWN_ERROR;
+	}
+	memset(list, 0, sizeof(EXCEPTION_LIST));
+	list->header = header;
+	list->mappedSize = size;
+	list->ownsFile = 1;
+	if (libemv_config_exceptions_changed(list) != LIBEMV_OK)
+	{
+		libemv_free_exception_list(list);
+		return LIBEMV_UNKNOWN_ERROR;
+	}
+	return LIBEMV_OK;
+}
+
+// Stable sort by key (merge sort), later entry of delta overrides earlier entry with the same key
+static void delta_sort(LIBEMV_EXCEPTION_ENTRY* entries, LIBEMV_EXCEPTION_ENTRY* temp, int count)
+{
+	int width;
+	int i;
+
+	for (width = 1; width < count; width *= 2)
+	{
+		for (i = 0; i < count; i += 2 * width)
+		{
+			int left, leftEnd, right, rightEnd, k;
+			left = i;
+			leftEnd = i + width < count ? i + width : count;
+			right = leftEnd;
+			rightEnd = i + 2 * width < count ? i + 2 * width : count;
+			for (k = i; k < rightEnd; k++)
+			{
+				if (left < leftEnd && (right >= rightEnd || exception_compare(&entries[left], &entries[right]) <= 0))
+					temp[k] = entries[left++];
+				else
+					temp[k] = entries[right++];
+			}
+		}
+		memcpy(entries, temp, count * sizeof(LIBEMV_EXCEPTION_ENTRY));
+	}
+}
+
+LIBEMV_API int libemv_apply_exception_delta(const LIBEMV_EXCEPTION_ENTRY* entries, int count)
+{
+	const CONFIG_SNAPSHOT* snapshot;
+	EXCEPTION_LIST* current;
+	EXCEPTION_LIST* list;
+	LIBEMV_EXCEPTION_ENTRY* temp;
+	int oldCount;
+	int i, j;
+
+	if (count < 0)
+		return LIBEMV_UNKNOWN_ERROR;
+	snapshot = libemv_config_current();
+	current = snapshot ? (EXCEPTION_LIST*) snapshot->exceptions : 0;
+	oldCount = current ? current->deltaCount : 0;
+
+	// Old delta, then new entries in order
+	list = libemv_malloc(sizeof(EXCEPTION_LIST));
+	temp = libemv_malloc((oldCount + count + 1) * sizeof(LIBEMV_EXCEPTION_ENTRY));
+	LIBEMV_STATS_ADD(allocCount, 2);
+	if (list)
+	{
+		memset(list, 0, sizeof(EXCEPTION_LIST));
+		list->delta = libemv_malloc((oldCount + count + 1) * sizeof(LIBEMV_EXCEPTION_ENTRY));
+		LIBEMV_STATS_ADD(allocCount, 1);
+	}
+	if (!list || !temp || !list->delta)
+	{
+		if (libemv_debug_enabled)
+			libemv_printf("Unable allocate memory\n");
+		if (list)
+			libemv_free_exception_list(list);
+		if (temp)
+			libemv_free(temp);
+		return LIBEMV_UNKNOWN_ERROR;
+	}
+	if (oldCount > 0)
+		memcpy(list->delta, current->delta, oldCount * sizeof(LIBEMV_EXCEPTION_ENTRY));
+	if (count > 0)
+		memcpy(list->delta + oldCount, entries, count * sizeof(LIBEMV_EXCEPTION_ENTRY));
+	delta_sort(list->delta, temp, oldCount + count);
+	libemv_free(temp);
+
+	// Last entry of key wins
+	for (i = 0, j = 0; i < oldCount + count; i++)
+	{
+		if (j > 0 && exception_compare(&list->delta[j - 1], &list->delta[i]) == 0)
+			j--;
+		list->delta[j++] = list->delta[i];
+	}
+	list->deltaCount = j;
+
+	// Filter of delta has removed entries too, they override file
+	list->deltaBlocks = bloom_blocks(j);
+	list->deltaFilter = libemv_malloc(list->deltaBlocks * EXCEPTION_BLOOM_BLOCK);
+	LIBEMV_STATS_ADD(allocCount, 1);
+	if (!list->deltaFilter)
+	{
+		if (libemv_debug_enabled)
+			libemv_printf("Unable allocate memory\n");
+		libemv_free_exception_list(list);
+		return LIBEMV_UNKNOWN_ERROR;
+	}
+	memset(list->deltaFilter, 0, list->deltaBlocks * EXCEPTION_BLOOM_BLOCK);
+	for (i = 0; i < j; i++)
+		bloom_add(list->deltaFilter, list->deltaBlocks, exception_hash(list->delta[i].pan));
+
+	// File is moved to new list, old list is used by transactions until it is freed
+	if (current)
+	{
+		list->header = current->header;
+		list->mappedSize = current->mappedSize;
+		list->ownsFile = current->ownsFile;
+		current->ownsFile = 0;
+	}
+	if (libemv_config_exceptions_changed(list) != LIBEMV_OK)
+	{
+		if (current)
+			current->ownsFile = list->ownsFile;
+		list->ownsFile = 0;
+		libemv_free_exception_list(list);
+		return LIBEMV_UNKNOWN_ERROR;
+	}
+	return LIBEMV_OK;
+}
+
+LIBEMV_API int libemv_check_exception_file(void)
+{
+	unsigned char pan[10];
+	unsigned char* data;
+	unsigned char panSequence;
+	int size;
+
+	data = libemv_get_tag(TAG_PAN, &size);
+	if (!data || size <= 0 || size > 10)
+		return LIBEMV_UNKNOWN_ERROR;
+	memset(pan, 0xFF, sizeof(pan));
+	memcpy(pan, data, size);
+
+	data = libemv_get_tag(TAG_PAN_SEQUENCE_NUMBER, &size);
+	panSequence = data && size == 1 ? *data : 0xFF;
+
+	if (!libemv_snapshot || !libemv_snapshot->exceptions
+		|| !libemv_exception_lookup(libemv_snapshot->exceptions, pan, panSequence))
+		return 0;
+
+	if (libemv_debug_enabled)
+		libemv_printf("Card appears on exception file\n");
+	libemv_set_bits(TAG_TVR, TVR_CARD_ON_EXCEPTION_FILE);
+	return 1;
+}
@@ -0,0 +1,580 @@
+// Linux host driver on pcsc-lite for terminals with several readers
+// Watches all readers with SCardGetStatusChange and runs transaction for every
+// inserted card on pool of worker threads. Connection of every reader is kept
+// and reused for next cards (SCardReconnect), Le of commands is predicted
+// from previous cards.
+//
+// Library must be compiled with LIBEMV_THREADS: every worker thread has own session
+// Build (Linux, from repository root):
+// gcc -O2 -DLIBEMV_THREADS $(pkg-config --cflags libpcsclite) -o pcsc_host host/pcsc_host.c sim/card_sim.c *.c crypt/*.c $(pkg-config --libs libpcsclite) -lpthread
+//
+// Usage: pcsc_host [-w workers] [-c image] [-d]
+//   -w count of worker threads, default 4
+//   -c file with configuration image (libemv_build_config_image), SIGHUP maps it again,
+//      running transactions finish with old configuration
+//   -d enable libemv debug output
+//
+// Without cards: run pcscd with virtual reader vpcd (vsmartcard project)
+// and connect sim/vpcd_card to every slot of vpcd
+
+#include "../include/libemv.h"
+#include "../sim/card_sim.h"
+#include <PCSC/winscard.h>
+#include <PCSC/reader.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MAX_READERS			16
+#define MAX_WORKERS			32
+#define PNP_READER_NAME		"\\\\?PnP?\\Notification"
+
+// Reader and its connection, slot is never freed while transaction runs on it
+typedef struct
+{
+	char name[MAX_READERNAME];
+	char used;				// Slot has reader
+	char present;			// Reader is in list of pcscd
+	char busy;				// Transaction is queued or running
+	SCARDCONTEXT hContext;	// Context of reader, used only by thread that owns reader
+	SCARDHANDLE hCard;
+	char connected;
+	DWORD protocol;
+	DWORD eventState;		// Last state from SCardGetStatusChange
+	unsigned long transactions;
+} READER;
+
+static READER readers[MAX_READERS];
+static pthread_mutex_t readersMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Queue of readers with inserted cards
+static int queue[MAX_READERS];
+static int queueHead;
+static int queueCount;
+static pthread_mutex_t queueMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueCond = PTHREAD_COND_INITIALIZER;
+
+static volatile sig_atomic_t stopRequested;
+static volatile sig_atomic_t reloadRequested;
+static const char* configPath;
+static SCARDCONTEXT hMonitorContext;
+static DWORD pnpState;
+
+static unsigned long long now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000ULL + (unsigned long long) ts.tv_nsec / 1000000ULL;
+}
+
+// Raw transport of libemv, context is reader of transaction
+// GET RESPONSE and wrong length are processed by libemv
+static char host_transmit(void* context, const unsigned char* cmd, int cmdSize, unsigned char* resp, int* respSize)
+{
+	READER* reader;
+	const SCARD_IO_REQUEST* pci;
+	DWORD recvSize;
+	LONG rv;
+
+	reader = (READER*) context;
+	pci = reader->protocol == SCARD_PROTOCOL_T1 ? SCARD_PCI_T1 : SCARD_PCI_T0;
+	recvSize = *respSize;
+	rv = SCardTransmit(reader->hCard, pci, cmd, cmdSize, NULL, resp, &recvSize);
+	if (rv != SCARD_S_SUCCESS)
+	{
+		fprintf(stderr, "%s: SCardTransmit failed: %s\n", reader->name, pcsc_stringify_error(rv));
+		return 0;
+	}
+	*respSize = (int) recvSize;
+	return 1;
+}
+
+// Connect to card, reuse connection of reader if it exists
+static int connect_card(READER* reader)
+{
+	LONG rv;
+
+	if (!reader->hContext)
+	{
+		rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &reader->hContext);
+		if (rv != SCARD_S_SUCCESS)
+		{
+			reader->hContext = 0;
+			fprintf(stderr, "%s: SCardEstablishContext failed: %s\n", reader->name, pcsc_stringify_error(rv));
+			return 0;
+		}
+	}
+
+	if (reader->connected)
+	{
+		rv = SCardReconnect(reader->hCard, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1,
+			SCARD_RESET_CARD, &reader->protocol);
+		if (rv == SCARD_S_SUCCESS)
+			return 1;
+		SCardDisconnect(reader->hCard, SCARD_LEAVE_CARD);
+		reader->connected = 0;
+	}
+
+	rv = SCardConnect(reader->hContext, reader->name, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1,
+		&reader->hCard, &reader->protocol);
+	if (rv != SCARD_S_SUCCESS)
+	{
+		fprintf(stderr, "%s: SCardConnect failed: %s\n", reader->name, pcsc_stringify_error(rv));
+		return 0;
+	}
+	reader->connected = 1;
+	return 1;
+}
+
+static void close_reader(READER* reader)
+{
+	if (reader->connected)
+		SCardDisconnect(reader->hCard, SCARD_LEAVE_CARD);
+	if (reader->hContext)
+		SCardReleaseContext(reader->hContext);
+	reader->connected = 0;
+	reader->hContext = 0;
+}
+
+// Amount of unattended terminal
+static const LIBEMV_TRANSACTION_DATA transactionData =
+{
+	{0x00, 0x00, 0x00, 0x00, 0x10, 0x00},
+	{0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
+	{0x08, 0x40},
+	2,
+	0x00,
+	{0x36, 0x00, 0x40, 0x00}
+};
+
+// Transaction flow, unattended: application with highest priority is selected, terminal has no PIN pad
+// and no host, card that asks to go online gets decision of TAC-Default and IAC-Default
+// outCryptogram: final cryptogram of card
+static int run_transaction(unsigned char* outCryptogram)
+{
+	unsigned char method;
+	unsigned char cryptogram;
+	int result;
+
+	*outCryptogram = LIBEMV_CRYPTOGRAM_AAC;
+	result = libemv_preprocess_transaction(&transactionData);
+	if (result != LIBEMV_OK)
+		return result;
+	result = libemv_build_candidate_list();
+	if (result != LIBEMV_OK)
+		return result;
+
+	while (1)
+	{
+		result = libemv_application_selection();
+		if (result == LIBEMV_NEED_CONFIRM_APPLICATION || result == LIBEMV_NEED_SELECT_APPLICATION)
+			result = libemv_select_application(0);
+		if (result < 0 && libemv_count_candidates() == 0)
+			return result;
+		if (result != LIBEMV_OK)
+			continue;
+
+		result = libemv_get_processing_option();
+		if (result == LIBEMV_OK)
+			break;
+		if (libemv_count_candidates() == 0)
+			return result;
+	}
+
+	result = libemv_read_app_data();
+	if (result != LIBEMV_OK)
+		return result;
+	result = libemv_dynamic_data_authentication();
+	if (result != LIBEMV_OK)
+		return result;
+	result = libemv_cardholder_verification(&method);
+	if (result != LIBEMV_OK)
+		return result;
+	result = libemv_terminal_risk_management();
+	if (result != LIBEMV_OK)
+		return result;
+	result = libemv_terminal_action_analysis(&cryptogram);
+	if (result != LIBEMV_OK)
+		return result;
+	result = libemv_generate_ac(cryptogram, &cryptogram);
+	if (result != LIBEMV_OK)
+		return result;
+	libemv_generate_ac_result(outCryptogram);
+	if (*outCryptogram != LIBEMV_CRYPTOGRAM_ARQC)
+		return LIBEMV_OK;
+	result = libemv_completion(LIBEMV_ONLINE_FAILED, 0, 0, 0, outCryptogram);
+	if (result == LIBEMV_OK)
+		libemv_generate_ac_result(outCryptogram);
+	return result;
+}
+
+static void process_card(READER* reader)
+{
+	unsigned char atr[MAX_ATR_SIZE];
+	DWORD atrSize;
+	char readerName[MAX_READERNAME];
+	DWORD readerNameSize;
+	DWORD state;
+	unsigned long long startMs;
+	unsigned char cryptogram;
+	unsigned char* pan;
+	int panSize;
+	char strPan[21];
+	int panLength;
+	int result;
+	int i;
+
+	startMs = now_ms();
+	if (!connect_card(reader))
+		return;
+
+	atrSize = sizeof(atr);
+	readerNameSize = sizeof(readerName);
+	if (SCardStatus(reader->hCard, readerName, &readerNameSize, &state, &reader->protocol, atr, &atrSize) != SCARD_S_SUCCESS
+		|| !libemv_is_emv_ATR(atr, atrSize))
+	{
+		printf("%s: not EMV card\n", reader->name);
+		return;
+	}
+
+	// Transport context belongs to session of this thread
+	set_function_transmit(host_transmit, reader);
+	result = run_transaction(&cryptogram);
+	reader->transactions++;
+
+	// PAN (tag 5A), only first 6 and last 4 digits are shown
+	strPan[0] = 0;
+	pan = libemv_get_tag(0x5A, &panSize);
+	if (pan && result == LIBEMV_OK)
+	{
+		for (i = 0; i < panSize && i < 10; i++)
+			sprintf(strPan + i * 2, "%02X", pan[i]);
+		panLength = (int) strlen(strPan);
+		while (panLength > 0 && strPan[panLength - 1] == 'F')
+			strPan[--panLength] = 0;
+		for (i = 6; i < panLength - 4; i++)
+			strPan[i] = '*';
+	}
+	printf("%s: result %d, %s, PAN %s, %llu ms\n", reader->name, result,
+		   cryptogram == LIBEMV_CRYPTOGRAM_TC ? "approved" : "declined", strPan, now_ms() - startMs);
+
+	// Old configuration isn't kept by idle worker
+	libemv_end_transaction();
+}
+
+static void* worker(void* arg)
+{
+	int index;
+
+	(void) arg;
+	while (1)
+	{
+		pthread_mutex_lock(&queueMutex);
+		while (queueCount == 0 && !stopRequested)
+			pthread_cond_wait(&queueCond, &queueMutex);
+		if (queueCount == 0)
+		{
+			pthread_mutex_unlock(&queueMutex);
+			break;
+		}
+		index = queue[queueHead];
+		queueHead = (queueHead + 1) % MAX_READERS;
+		queueCount--;
+		pthread_mutex_unlock(&queueMutex);
+
+		process_card(&readers[index]);
+
+		pthread_mutex_lock(&readersMutex);
+		readers[index].busy = 0;
+		if (!readers[index].present)
+		{
+			// Reader was removed during transaction
+			close_reader(&readers[index]);
+			readers[index].used = 0;
+		}
+		pthread_mutex_unlock(&readersMutex);
+	}
+
+	libemv_destroy_session();
+	return 0;
+}
+
+// Called with locked readersMutex, reader isn't queued twice
+static void queue_reader(int index)
+{
+	if (readers[index].busy)
+		return;
+	readers[index].busy = 1;
+
+	pthread_mutex_lock(&queueMutex);
+	queue[(queueHead + queueCount) % MAX_READERS] = index;
+	queueCount++;
+	pthread_cond_signal(&queueCond);
+	pthread_mutex_unlock(&queueMutex);
+}
+
+// Synchronize slots with list of readers of pcscd
+static void update_readers(void)
+{
+	char* readerNames;
+	DWORD size;
+	char* name;
+	int i;
+
+	readerNames = 0;
+	size = SCARD_AUTOALLOCATE;
+	if (SCardListReaders(hMonitorContext, NULL, (LPSTR) &readerNames, &size) != SCARD_S_SUCCESS)
+		readerNames = 0;
+
+	pthread_mutex_lock(&readersMutex);
+	for (i = 0; i < MAX_READERS; i++)
+		readers[i].present = 0;
+
+	for (name = readerNames; name && *name; name += strlen(name) + 1)
+	{
+		int freeSlot = -1;
+		for (i = 0; i < MAX_READERS; i++)
+		{
+			if (readers[i].used && strcmp(readers[i].name, name) == 0)
+				break;
+			if (!readers[i].used && freeSlot < 0)
+				freeSlot = i;
+		}
+		if (i == MAX_READERS)
+		{
+			if (freeSlot < 0)
+			{
+				fprintf(stderr, "Too many readers, %s is ignored\n", name);
+				continue;
+			}
+			i = freeSlot;
+			memset(&readers[i], 0, sizeof(READER));
+			strncpy(readers[i].name, name, MAX_READERNAME - 1);
+			readers[i].used = 1;
+			readers[i].eventState = SCARD_STATE_UNAWARE;
+			printf("Reader added: %s\n", name);
+		}
+		readers[i].present = 1;
+	}
+
+	for (i = 0; i < MAX_READERS; i++)
+	{
+		if (readers[i].used && !readers[i].present && !readers[i].busy)
+		{
+			printf("Reader removed: %s\n", readers[i].name);
+			close_reader(&readers[i]);
+			readers[i].used = 0;
+		}
+	}
+	pthread_mutex_unlock(&readersMutex);
+
+	if (readerNames)
+		SCardFreeMemory(hMonitorContext, readerNames);
+}
+
+static void monitor(void)
+{
+	SCARD_READERSTATE states[MAX_READERS + 1];
+	int slots[MAX_READERS + 1];
+	DWORD timeout;
+	int count;
+	int i;
+	LONG rv;
+
+	update_readers();
+	timeout = INFINITE;
+	while (!stopRequested)
+	{
+		// Configuration is updated by this thread only, workers aren't stopped
+		if (reloadRequested)
+		{
+			reloadRequested = 0;
+			if (libemv_map_config_file(configPath) == LIBEMV_OK)
+				printf("Configuration %s is loaded\n", configPath);
+			else
+				fprintf(stderr, "Configuration %s is wrong, old configuration is used\n", configPath);
+		}
+
+		// Old configurations are freed when workers finish their transactions
+		timeout = libemv_reclaim_config() > 0 ? 1000 : INFINITE;
+
+		// Reader list notification and state of every present reader
+		memset(states, 0, sizeof(states));
+		states[0].szReader = PNP_READER_NAME;
+		states[0].dwCurrentState = pnpState;
+		count = 1;
+		pthread_mutex_lock(&readersMutex);
+		for (i = 0; i < MAX_READERS; i++)
+		{
+			if (!readers[i].used || !readers[i].present)
+				continue;
+			states[count].szReader = readers[i].name;
+			states[count].dwCurrentState = readers[i].eventState;
+			slots[count] = i;
+			count++;
+		}
+		pthread_mutex_unlock(&readersMutex);
+
+		rv = SCardGetStatusChange(hMonitorContext, timeout, states, count);
+		if (rv == SCARD_E_CANCELLED && reloadRequested)
+			continue;
+		if (rv == SCARD_E_CANCELLED)
+			break;
+		if (rv == SCARD_E_NO_SERVICE || rv == SCARD_E_INVALID_HANDLE)
+		{
+			fprintf(stderr, "pcscd is unavailable: %s\n", pcsc_stringify_error(rv));
+			break;
+		}
+		if (rv != SCARD_S_SUCCESS && rv != SCARD_E_TIMEOUT)
+		{
+			update_readers();
+			continue;
+		}
+
+		pthread_mutex_lock(&readersMutex);
+		for (i = 1; i < count; i++)
+		{
+			READER* reader;
+			DWORD oldState;
+			if (!(states[i].dwEventState & SCARD_STATE_CHANGED))
+				continue;
+
+			reader = &readers[slots[i]];
+			oldState = reader->eventState;
+			reader->eventState = states[i].dwEventState & ~SCARD_STATE_CHANGED;
+
+			// New card: present now and wasn't present before
+			if ((states[i].dwEventState & SCARD_STATE_PRESENT) && !(states[i].dwEventState & SCARD_STATE_MUTE)
+				&& !(oldState & SCARD_STATE_PRESENT))
+				queue_reader(slots[i]);
+		}
+		pthread_mutex_unlock(&readersMutex);
+
+		// Notification reader keeps count of readers in high word of state
+		if (states[0].dwEventState & SCARD_STATE_CHANGED)
+		{
+			pnpState = states[0].dwEventState & ~SCARD_STATE_CHANGED;
+			update_readers();
+		}
+	}
+}
+
+static void on_signal(int sig)
+{
+	if (sig == SIGHUP)
+		reloadRequested = 1;
+	else
+		stopRequested = 1;
+	SCardCancel(hMonitorContext);
+}
+
+static void configure_terminal(void)
+{
+	LIBEMV_GLOBAL globalSettings = {"12345678", {0x08, 0x40}, {0xC1, 0x00, 0xF0, 0xA0, 0x01}, {0xE0, 0xF8, 0xE8}, 0x22};
+	LIBEMV_AID visa1010 = {7, {0xA0, 0x00, 0x00, 0x00, 0x03, 0x10, 0x10}, 1};
+	LIBEMV_AID visa2010 = {7, {0xA0, 0x00, 0x00, 0x00, 0x03, 0x20, 0x10}, 1};
+	LIBEMV_AID mastercard1010 = {7, {0xA0, 0x00, 0x00, 0x00, 0x04, 0x10, 0x10}, 1};
+	LIBEMV_AID maestro3060 = {7, {0xA0, 0x00, 0x00, 0x00, 0x04, 0x30, 0x60}, 1};
+	LIBEMV_APPLICATIONS apps[2];
+	LIBEMV_SETTINGS settings;
+
+	memset(&settings, 0, sizeof(settings));
+	settings.appSelectionUsePSE = 1;
+	settings.appSelectionSupportConfirm = 1;
+	settings.appSelectionPartial = 1;
+	settings.appSelectionSupport = 1;
+	settings.apduPredictLe = 1;
+	libemv_set_library_settings(&settings);
+	libemv_set_global_settings(&globalSettings);
+
+	memset(apps, 0, sizeof(apps));
+	memcpy(apps[0].RID, "\xA0\x00\x00\x00\x03", 5);
+	apps[0].aidsCount = 2;
+	apps[0].aids[0] = visa1010;
+	apps[0].aids[1] = visa2010;
+
+	// CA key of sim/vpcd_card, real cards need CA keys of payment systems (configuration image, -c)
+	apps[0].publicKeysCount = 1;
+	apps[0].publicKeys[0].keySize = card_sim_ca_key(&apps[0].publicKeys[0].keyIndex, apps[0].publicKeys[0].keyModulus) * 8;
+	memcpy(apps[0].publicKeys[0].keyExponent, "\x00\x00\x03", 3);
+	memcpy(apps[1].RID, "\xA0\x00\x00\x00\x04", 5);
+	apps[1].aidsCount = 2;
+	apps[1].aids[0] = mastercard1010;
+	apps[1].aids[1] = maestro3060;
+	set_applications_data(apps, 2);
+}
+
+int main(int argc, char** argv)
+{
+	pthread_t workers[MAX_WORKERS];
+	int workersCount;
+	char debug;
+	LONG rv;
+	int i;
+
+	workersCount = 4;
+	debug = 0;
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+			workersCount = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+			configPath = argv[++i];
+		else if (strcmp(argv[i], "-d") == 0)
+			debug = 1;
+	}
+	if (workersCount < 1)
+		workersCount = 1;
+	if (workersCount > MAX_WORKERS)
+		workersCount = MAX_WORKERS;
+
+	rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &hMonitorContext);
+	if (rv != SCARD_S_SUCCESS)
+	{
+		fprintf(stderr, "SCardEstablishContext failed: %s\n", pcsc_stringify_error(rv));
+		return 1;
+	}
+
+	// Shared settings, before start of workers
+	srand((unsigned int) time(NULL));
+	libemv_init();
+	libemv_set_debug_enabled(debug);
+	configure_terminal();
+	if (configPath && libemv_map_config_file(configPath) != LIBEMV_OK)
+	{
+		fprintf(stderr, "Configuration %s is wrong\n", configPath);
+		return 1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	if (configPath)
+		signal(SIGHUP, on_signal);
+
+	for (i = 0; i < workersCount; i++)
+		pthread_create(&workers[i], NULL, worker, NULL);
+
+	monitor();
+
+	pthread_mutex_lock(&queueMutex);
+	stopRequested = 1;
+	pthread_cond_broadcast(&queueCond);
+	pthread_mutex_unlock(&queueMutex);
+	for (i = 0; i < workersCount; i++)
+		pthread_join(workers[i], NULL);
+
+	for (i = 0; i < MAX_READERS; i++)
+	{
+		if (readers[i].used)
+		{
+			printf("%s: %lu transactions\n", readers[i].name, readers[i].transactions);
+			close_reader(&readers[i]);
+		}
+	}
+	SCardReleaseContext(hMonitorContext);
+	libemv_destroy();
+	return 0;
+}
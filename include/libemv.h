@@ -21,17 +21,39 @@ LIBEMV_API void libemv_init(void);
 // Call this function at the end of your program
 LIBEMV_API void libemv_destroy(void);
 
+// Library compiled with LIBEMV_THREADS keeps transaction data per thread:
+// every thread can run own transaction with own reader. Settings and applications data
+// are shared, set them before starting threads. Function set by set_function_apdu()
+// is shared too, it must select reader of calling thread.
+// Configuration (set_applications_data, libemv_set_global_settings, libemv_load_config_image,
+// libemv_map_config_file) can be updated by one thread while transactions run: every transaction
+// uses version of configuration that was current at its start.
+// Call this function at the end of thread, that used libemv
+LIBEMV_API void libemv_destroy_session(void);
+
 // Enable, disable debug output. Default: disabled.
 // enabled: 1 enable, 0 disable
 // Don't use debug in production versions
 LIBEMV_API void libemv_set_debug_enabled(char enabled);
 
-// Required definition
+// Required definition: set_function_apdu() or set_function_transmit()
 // The function f_apdu() must return: 0 communication error, 1 success
+// f_apdu() must process procedure bytes itself (61xx - GET RESPONSE, 6Cxx - repeat with right Le)
 LIBEMV_API void set_function_apdu(char (*f_apdu)(unsigned char cla, unsigned char ins, unsigned char p1, unsigned char p2,
 								  unsigned char dataSize, const unsigned char* data,
 								  int* outDataSize, unsigned char* outData));
 
+// Raw transport, used instead of function of set_function_apdu()
+// f_transmit() sends command (CLA INS P1 P2 P3 [data]) and receives response with SW1 SW2,
+// like SCardTransmit(). context is passed to every call, for example handle of reader connection.
+// Library processes 61xx (GET RESPONSE) and 6Cxx (repeat with right Le) itself.
+// *respSize is size of resp on input (at least LIBEMV_APDU_RESPONSE_SIZE), size of response on output
+// The function must return: 0 communication error, 1 success
+// With LIBEMV_THREADS context belongs to session of calling thread
+#define LIBEMV_APDU_RESPONSE_SIZE		258
+LIBEMV_API void set_function_transmit(char (*f_transmit)(void* context, const unsigned char* cmd, int cmdSize,
+														 unsigned char* resp, int* respSize), void* context);
+
 // Heap functions. Default: malloc(), realloc(), free()
 LIBEMV_API void set_function_malloc(void* (*f_malloc)(size_t size));
 LIBEMV_API void set_function_realloc(void* (*f_realloc)(void* ptr, size_t size));
@@ -47,9 +69,24 @@ LIBEMV_API void set_function_get_date_HHmmss(void (*f_get_time)(char* strtime));
 // Function must return random number at least from 0 to 32767 (RAND_MAX)
 LIBEMV_API void set_function_rand(int (*f_rand)(void));
 
+// Deferred work of library, Ex. check of CDA signature after card is released. f_run_async() must call
+// job(context) once on any thread (Ex. worker pool), job doesn't use data of session
+// Default: 0, work is done by calling thread
+LIBEMV_API void set_function_run_async(void (*f_run_async)(void (*job)(void* context), void* context));
+
+// PIN entry of cardholder verification (see libemv_cardholder_verification), method is LIBEMV_CVM_..., for PIN
+// verified by ICC function sends VERIFY to card, for online PIN it keeps enciphered PIN block for authorisation
+// Function must return LIBEMV_PIN_...
+// Default: 0, terminal hasn't PIN pad
+LIBEMV_API void set_function_verify_pin(int (*f_verify_pin)(unsigned char method));
+
 // Debug output function
 LIBEMV_API void set_function_debug_printf(int (*f_printf)(const char * format, ...));
 
+// Monotonic clock in nanoseconds, used by instrumentation
+// Default: clock_gettime(CLOCK_MONOTONIC), QueryPerformanceCounter() on Windows
+LIBEMV_API void set_function_get_monotonic_time(unsigned long long (*f_time)(void));
+
 // Check ATR, detect whether ATR apply to emv card
 // Return: 1 ok, 0 wrong ATR
 LIBEMV_API char libemv_is_emv_ATR(unsigned char* bufATR, int size);
@@ -69,6 +106,12 @@ typedef struct
 	char appSelectionSupportConfirm;	// 1 - if support cardholder confirmation of application, 0 - not support
 	char appSelectionPartial;			// 1 - if support partial AID selection
 	char appSelectionSupport;			// 1 - if the terminal supports the ability to allow the cardholder to select an application
+	char apduPredictLe;					// 1 - remember Le from 6Cxx and send it next time, works with set_function_transmit()
+	char appSelectionAdaptiveOrder;		// 1 - SELECT AIDs from list in order of hint and AIDs found on previous cards,
+										// skip AIDs which can't add candidates (EMV compliant): after full candidate list and
+										// AIDs started with AID of the same application selected before with partial selection.
+										// Terminal list without such AIDs is selected whole, no APDUs are saved
+	char appSelectionStopOnMatch;		// 1 - stop SELECT of AIDs from list after AID with candidates, not EMV compliant
 } LIBEMV_SETTINGS;
 
 // Set above settings to libemv
@@ -140,6 +183,46 @@ typedef struct
 // Set list of application and its settings supported by terminal
 LIBEMV_API void set_applications_data(LIBEMV_APPLICATIONS* apps, int countApps);
 
+// Binary image of terminal configuration: global settings, applications, AIDs and CAPKs with variable
+// length data, index of AIDs and terminal tags. set_applications_data builds image in memory of process,
+// image saved in file can be mapped read only and shared by all terminal processes of host
+// Image is valid for platform of library (byte order, structure layout), format version is checked
+
+// Build image, global can be 0. If outImage is 0 only size is calculated
+// Returns size of image, 0 if error or maxSize is too small
+LIBEMV_API int libemv_build_config_image(const LIBEMV_GLOBAL* global, const LIBEMV_APPLICATIONS* apps, int countApps,
+										 unsigned char* outImage, int maxSize);
+
+// Use image instead of set_applications_data and libemv_set_global_settings, image isn't copied,
+// memory must be valid until libemv_reclaim_config() returns 0 after next configuration or until libemv_destroy()
+// Returns LIBEMV_OK or LIBEMV_UNKNOWN_ERROR if image is wrong
+LIBEMV_API int libemv_load_config_image(const unsigned char* image, int size);
+
+// Map file with image read only and use it, file is unmapped when next configuration isn't used by
+// transactions or by libemv_destroy()
+// Returns LIBEMV_OK or LIBEMV_UNKNOWN_ERROR
+LIBEMV_API int libemv_map_config_file(const char* path);
+
+// Free old versions of configuration that transactions don't use, new configuration does it too
+// Call it from thread that updates configuration
+// Returns count of old versions still used by transactions
+LIBEMV_API int libemv_reclaim_config(void);
+
+// Transaction doesn't use configuration anymore, old version can be freed. Next transaction
+// starts with current configuration. Tags of terminal settings aren't available after call
+LIBEMV_API void libemv_end_transaction(void);
+
+// Hint for appSelectionAdaptiveOrder: AIDs started with prefix are selected first, for example RID
+// known from ATR historical bytes. Hint is used by next transactions, size 0 clears hint
+LIBEMV_API void libemv_set_aid_hint(const unsigned char* prefix, int size);
+
+// Count of cards found with every AID, order like in set_applications_data()
+// Terminal can save statistics and restore it after set_applications_data(), new configuration
+// with the same count of AIDs keeps statistics
+// Returns count of copied elements
+LIBEMV_API int libemv_get_aid_hits(unsigned long* outHits, int maxCount);
+LIBEMV_API void libemv_set_aid_hits(const unsigned long* hits, int count);
+
 // Application info for select application
 typedef struct
 {
@@ -170,6 +253,31 @@ typedef struct
 // LIBEMV_OK, LIBEMV_UNKNOWN_ERROR, LIBEMV_ERROR_TRANSMIT, LIBEMV_NOT_SUPPORTED
 LIBEMV_API int libemv_build_candidate_list(void);
 
+// Transaction flow. Build candidate list for contactless card from one SELECT of PPSE "2PAY.SYS.DDF02"
+// Candidates are sorted by priority, without cardholder selection call libemv_select_application(0)
+// and libemv_get_processing_option. Failed candidate is removed by libemv_select_application, so
+// repeat with index 0 while libemv_count_candidates() > 0
+// Result can be:
+// LIBEMV_OK, LIBEMV_TERMINATED (no PPSE), LIBEMV_UNKNOWN_ERROR, LIBEMV_ERROR_TRANSMIT, LIBEMV_NOT_SUPPORTED
+LIBEMV_API int libemv_build_candidate_list_contactless(void);
+
+// Transaction data, known before card is presented
+typedef struct
+{
+	unsigned char amountAuthorised[6];				// 9F02, n12, Ex. {0x00, 0x00, 0x00, 0x00, 0x10, 0x00} - 10.00
+	unsigned char amountOther[6];					// 9F03, n12, cashback
+	unsigned char transactionCurrencyCode[2];		// 5F2A, Ex. {0x08, 0x40}
+	unsigned char transactionCurrencyExponent;		// 5F36, Ex. 2
+	unsigned char transactionType;					// 9C, Ex. 0x00 - purchase
+	unsigned char terminalTransactionQualifiers[4];	// 9F66, TTQ, for contactless, Ex. {0x36, 0x00, 0x40, 0x00}
+} LIBEMV_TRANSACTION_DATA;
+
+// Pre-processing, call before card is presented (for contactless before tap)
+// Builds terminal tags: settings global, transaction data, 9A (date), 9F21 (time), 9F37 (unpredictable number),
+// TVR and TSI. Next build candidate list only copies this image, image is used by one transaction
+// Result can be: LIBEMV_OK, LIBEMV_UNKNOWN_ERROR
+LIBEMV_API int libemv_preprocess_transaction(const LIBEMV_TRANSACTION_DATA* data);
+
 // Transaction flow. Final Selection
 // Result can be:
 // LIBEMV_OK - ok, application was selected, call libemv_get_processing_option to process next step
@@ -205,6 +313,252 @@ LIBEMV_API int libemv_get_processing_option(void);
 // LIBEMV_TERMINATED, LIBEMV_ERROR_TRANSMIT, LIBEMV_UNKNOWN_ERROR
 LIBEMV_API int libemv_read_app_data(void);
 
+// Transaction flow. Dynamic data authentication, after libemv_read_app_data, if card (AIP) and terminal
+// (Terminal Capabilities) support DDA or CDA. Keys of issuer and card are recovered while records are read,
+// for DDA INTERNAL AUTHENTICATE is sent with data of DDOL of card or default DDOL of application,
+// for CDA signature is checked with GENERATE AC (see libemv_generate_ac)
+// Failed authentication isn't error, it is in TVR
+// Result can be:
+// LIBEMV_OK - ok, you can process next step
+// LIBEMV_TERMINATED, LIBEMV_ERROR_TRANSMIT, LIBEMV_UNKNOWN_ERROR
+LIBEMV_API int libemv_dynamic_data_authentication(void);
+
+// Cardholder verification methods, CV Rule of CVM list (bits 6-1 of byte 1)
+#define LIBEMV_CVM_FAIL						0x00	// Fail CVM processing
+#define LIBEMV_CVM_PLAINTEXT_PIN			0x01	// Plaintext PIN verified by ICC
+#define LIBEMV_CVM_ONLINE_PIN				0x02	// Enciphered PIN verified online
+#define LIBEMV_CVM_PLAINTEXT_PIN_SIGNATURE	0x03	// Plaintext PIN verified by ICC and signature
+#define LIBEMV_CVM_ENCIPHERED_PIN			0x04	// Enciphered PIN verified by ICC
+#define LIBEMV_CVM_ENCIPHERED_PIN_SIGNATURE	0x05	// Enciphered PIN verified by ICC and signature
+#define LIBEMV_CVM_SIGNATURE				0x1E	// Signature on receipt
+#define LIBEMV_CVM_NO_CVM					0x1F	// No CVM required
+#define LIBEMV_CVM_NOT_PERFORMED			0x3F	// Card doesn't support cardholder verification
+
+// Result of PIN entry, see set_function_verify_pin
+#define LIBEMV_PIN_OK					0	// PIN is verified by ICC or online PIN is entered
+#define LIBEMV_PIN_WRONG				1	// ICC rejected PIN
+#define LIBEMV_PIN_TRY_LIMIT_EXCEEDED	2
+#define LIBEMV_PIN_NOT_ENTERED			3	// Cardholder bypassed PIN entry
+#define LIBEMV_PIN_PAD_FAILED			4	// PIN pad isn't present or doesn't work
+
+// Transaction flow. Cardholder verification, after libemv_read_app_data if card (AIP) supports it: first rule of
+// CVM list with satisfied condition and method supported by terminal (Terminal Capabilities) is performed,
+// if it fails next rule is applied if rule allows it. CVM Results (tag 9F34) and TVR are set, failure isn't error
+// outMethod: performed method LIBEMV_CVM_... (Ex. LIBEMV_CVM_SIGNATURE - receipt must be signed),
+// LIBEMV_CVM_FAIL if verification failed
+// Result can be:
+// LIBEMV_OK - ok, you can process next step
+// LIBEMV_UNKNOWN_ERROR - no application
+// LIBEMV_ERROR_TRANSMIT - transmission error (GET DATA of PIN Try Counter)
+LIBEMV_API int libemv_cardholder_verification(unsigned char* outMethod);
+
+// Cryptogram requested by terminal, P1 of GENERATE AC
+#define LIBEMV_CRYPTOGRAM_AAC	0x00	// Decline offline
+#define LIBEMV_CRYPTOGRAM_TC	0x40	// Approve offline
+#define LIBEMV_CRYPTOGRAM_ARQC	0x80	// Go online
+
+// Transaction flow. Terminal action analysis, after libemv_read_app_data: TVR is compared with TAC of
+// application and IAC of card (denial, then online if terminal type has online capability, else default)
+// outCryptogram: LIBEMV_CRYPTOGRAM_AAC, LIBEMV_CRYPTOGRAM_TC or LIBEMV_CRYPTOGRAM_ARQC
+// Result can be:
+// LIBEMV_OK - ok, outCryptogram is set
+// LIBEMV_UNKNOWN_ERROR - no application
+LIBEMV_API int libemv_terminal_action_analysis(unsigned char* outCryptogram);
+
+// Transaction flow. First GENERATE AC with data of CDOL1, after terminal action analysis
+// cryptogram: LIBEMV_CRYPTOGRAM_... requested by terminal. If card and terminal support CDA, signature is
+// requested for TC and ARQC, it is checked after card interaction (see set_function_run_async)
+// outCryptogram: cryptogram of card, LIBEMV_CRYPTOGRAM_AAC while CDA signature of TC or ARQC is checked
+// by job of set_function_run_async, final decision is result of libemv_generate_ac_result
+// Result can be:
+// LIBEMV_OK - ok, card isn't needed for libemv_generate_ac_result
+// LIBEMV_TERMINATED, LIBEMV_ERROR_TRANSMIT, LIBEMV_UNKNOWN_ERROR
+LIBEMV_API int libemv_generate_ac(unsigned char cryptogram, unsigned char* outCryptogram);
+
+// Result of last GENERATE AC (first or of libemv_completion), waits for check of CDA signature: if signature
+// is wrong, TVR has CDA failed and outCryptogram is LIBEMV_CRYPTOGRAM_AAC
+// Returns LIBEMV_OK
+LIBEMV_API int libemv_generate_ac_result(unsigned char* outCryptogram);
+
+// Result of online authorisation for libemv_completion
+#define LIBEMV_ONLINE_APPROVED	1
+#define LIBEMV_ONLINE_DECLINED	2
+#define LIBEMV_ONLINE_FAILED	3	// Unable to go online, decision by TAC-Default and IAC-Default
+
+// Transaction flow. Completion after card returned ARQC (libemv_generate_ac_result): second GENERATE AC
+// with data of CDOL2, TC if approved, else AAC. If libemv_generate_ac_result wasn't called, check of CDA
+// signature of first GENERATE AC is waited for, ARQC with wrong signature gets AAC (CDA failed in TVR)
+// arc: Authorisation Response Code (tag 8A, 2 bytes) of issuer, not used for LIBEMV_ONLINE_FAILED (Y3 or Z3)
+// issuerAuthData: Issuer Authentication Data (tag 91, 8-16 bytes) or 0, EXTERNAL AUTHENTICATE is sent if
+// card (AIP) supports issuer authentication, failure is in TVR
+// outCryptogram: cryptogram of card, final decision is result of libemv_generate_ac_result
+// Result can be:
+// LIBEMV_OK - ok
+// LIBEMV_TERMINATED, LIBEMV_ERROR_TRANSMIT
+// LIBEMV_UNKNOWN_ERROR - wrong parameters or card didn't ask to go online
+LIBEMV_API int libemv_completion(int onlineResult, const unsigned char* arc, const unsigned char* issuerAuthData, int issuerAuthDataSize,
+								 unsigned char* outCryptogram);
+
+// Exception file (hot card list) of terminal risk management. File is built once (for example daily),
+// mapped read only and shared by terminal processes, changes between files are applied as delta
+typedef struct
+{
+	unsigned char pan[10];		// PAN (tag 5A), BCD padded with 'F', Ex. {0x47, 0x61, 0x73, 0x90, 0x01, 0x01, 0x00, 0x10, 0xFF, 0xFF}
+	unsigned char panSequence;	// PAN Sequence Number (tag 5F34), 0xFF - all cards with PAN
+	unsigned char remove;		// Only for delta: 1 - remove entry, 0 - add entry
+} LIBEMV_EXCEPTION_ENTRY;
+
+// Build image of exception file, entries are sorted, duplicates are removed. If outImage is 0 only size is calculated
+// Returns size of image, 0 if error or maxSize is too small
+LIBEMV_API int libemv_build_exception_image(const LIBEMV_EXCEPTION_ENTRY* entries, int count, unsigned char* outImage, int maxSize);
+
+// Map file with image read only and use it for next transactions, delta is cleared
+// Returns LIBEMV_OK or LIBEMV_UNKNOWN_ERROR
+LIBEMV_API int libemv_map_exception_file(const char* path);
+
+// Apply delta to exception file for next transactions, entries are applied in order, file isn't changed
+// Delta file of terminal management system is array of LIBEMV_EXCEPTION_ENTRY
+// Returns LIBEMV_OK or LIBEMV_UNKNOWN_ERROR
+LIBEMV_API int libemv_apply_exception_delta(const LIBEMV_EXCEPTION_ENTRY* entries, int count);
+
+// Transaction flow. Look up PAN and PAN Sequence Number of card in exception file, after libemv_read_app_data
+// Result can be:
+// 1 - card is in exception file, "Card appears on terminal exception file" is set in TVR
+// 0 - card isn't in exception file or exception file isn't used
+// LIBEMV_UNKNOWN_ERROR - card has no PAN
+LIBEMV_API int libemv_check_exception_file(void);
+
+// Transaction log of terminal for floor limit check of split sales. Log is file with ring of capacity records
+// (PAN, PAN Sequence Number, amount, time), record of approved transaction replaces oldest one.
+// Amounts of PAN are kept in index by time buckets, sum of last 8 buckets is one lookup.
+// Sum covers only last capacity transactions, so capacity must hold transactions of the window
+// Log is opened by one process of terminal, it is shared by sessions of process
+// capacity and bucketSeconds are saved in new file and must be the same for existing file
+// Returns LIBEMV_OK or LIBEMV_UNKNOWN_ERROR
+LIBEMV_API int libemv_open_transaction_log(const char* path, int capacity, int bucketSeconds);
+LIBEMV_API void libemv_close_transaction_log(void);
+
+// Transaction flow. Add approved transaction (PAN, Amount, Authorised) to log
+// Returns LIBEMV_OK or LIBEMV_UNKNOWN_ERROR if log isn't opened or card has no PAN
+LIBEMV_API int libemv_log_transaction(void);
+
+// Transaction flow. Terminal risk management, after libemv_read_app_data and before libemv_terminal_action_analysis:
+// exception file, floor limit with amounts of the card in transaction log, random transaction selection,
+// velocity checking (GET DATA of ATC and Last Online ATC Register if card has consecutive offline limits)
+// Results are in TVR. Nothing is checked if AIP of card doesn't require terminal risk management
+// Result can be:
+// LIBEMV_OK - ok
+// LIBEMV_ERROR_TRANSMIT - transmission error
+// LIBEMV_UNKNOWN_ERROR - no application
+LIBEMV_API int libemv_terminal_risk_management(void);
+
+// EMV cryptography of issuer host (EMV Book 2, Annex A1), keys are double length DES keys (16 bytes)
+// Key schedules are kept in LRU cache (LIBEMV_KEY_CACHE_SIZE keys) shared by sessions of process,
+// so cryptograms of the same card range are verified without key expansion
+// Functions return LIBEMV_OK or LIBEMV_UNKNOWN_ERROR if parameters are wrong
+
+// ICC Master Key from Issuer Master Key, option A: 3DES of rightmost 16 digits of PAN || PAN Sequence Number
+// and of its inverse, key is adjusted to odd parity
+// pan - tag 5A (BCD padded with F), panSequence - tag 5F34 or 0 if card has no PAN Sequence Number
+LIBEMV_API int libemv_derive_icc_master_key(const unsigned char* issuerMasterKey, const unsigned char* pan, int panSize,
+											unsigned char panSequence, unsigned char* outKey);
+
+// Session key method
+#define LIBEMV_SESSION_KEY_COMMON	0	// Common Session Key: 3DES of ATC || F0 || 00.. and ATC || 0F || 00..
+#define LIBEMV_SESSION_KEY_ATC_UN	1	// 3DES of ATC || F0 || 00 || Unpredictable Number and ATC || 0F || 00 || UN
+
+// Session key from ICC Master Key
+// atc - 2 bytes, unpredictableNumber - 4 bytes, only for LIBEMV_SESSION_KEY_ATC_UN
+LIBEMV_API int libemv_derive_session_key(const unsigned char* masterKey, int method, const unsigned char* atc,
+										 const unsigned char* unpredictableNumber, unsigned char* outKey);
+
+// Retail MAC: ISO/IEC 9797-1 MAC algorithm 3 with padding method 2 (80 00..), outMac - 8 bytes
+// Application cryptogram is MAC of CDOL data (and other data of issuer) with session key
+LIBEMV_API int libemv_retail_mac(const unsigned char* key, const unsigned char* data, int size, unsigned char* outMac);
+
+// ARPC method 1: 3DES of ARQC xor (Authorisation Response Code || 00..) with session key
+// arqc, outArpc - 8 bytes, arc - 2 bytes
+LIBEMV_API int libemv_generate_arpc(const unsigned char* sessionKey, const unsigned char* arqc, const unsigned char* arc,
+									unsigned char* outArpc);
+
+// Remove all keys from cache and reset counters, also called by libemv_destroy
+LIBEMV_API void libemv_clear_key_cache(void);
+
+// Lookups of key schedules found in cache and expanded
+LIBEMV_API void libemv_get_key_cache_stats(unsigned long* outHits, unsigned long* outMisses);
+
+// Instrumentation
+// Phases of transaction flow, index in LIBEMV_STATS
+#define LIBEMV_PHASE_BUILD_CANDIDATE_LIST	0	// libemv_build_candidate_list
+#define LIBEMV_PHASE_APPLICATION_SELECTION	1	// libemv_application_selection
+#define LIBEMV_PHASE_SELECT_APPLICATION		2	// libemv_select_application, also called by libemv_application_selection
+#define LIBEMV_PHASE_GET_PROCESSING_OPTION	3	// libemv_get_processing_option
+#define LIBEMV_PHASE_READ_APP_DATA			4	// libemv_read_app_data
+#define LIBEMV_PHASE_TERMINAL_ACTION_ANALYSIS	5	// libemv_terminal_action_analysis
+#define LIBEMV_PHASE_TERMINAL_RISK_MANAGEMENT	6	// libemv_terminal_risk_management
+#define LIBEMV_PHASE_OFFLINE_DATA_AUTHENTICATION	7	// libemv_dynamic_data_authentication
+#define LIBEMV_PHASE_GENERATE_AC			8	// libemv_generate_ac
+#define LIBEMV_PHASE_COMPLETION				9	// libemv_completion
+#define LIBEMV_PHASE_CARDHOLDER_VERIFICATION	10	// libemv_cardholder_verification
+#define LIBEMV_PHASES_COUNT					11
+
+// Counters of current transaction, reset by libemv_build_candidate_list
+typedef struct
+{
+	unsigned long long phaseStart[LIBEMV_PHASES_COUNT];	// Monotonic time (ns) of last start of phase, 0 - phase wasn't run
+	unsigned long long phaseEnd[LIBEMV_PHASES_COUNT];	// Monotonic time (ns) of last end of phase
+	unsigned long apduCount;							// Commands sent to card
+	unsigned long bytesOut;								// Bytes of C-APDUs (header, Lc and data)
+	unsigned long bytesIn;								// Bytes of R-APDUs including SW1 SW2
+	unsigned long retries;								// Commands repeated by library (GET RESPONSE, wrong length)
+	unsigned long tagSetCount;							// Tags added or updated in application buffer
+	unsigned long tagGetCount;							// Lookups in application buffer
+	unsigned long allocCount;							// Calls of malloc and realloc functions
+	unsigned long fetchCount;							// GET DATA of card tags needed by terminal (ATC, ...)
+} LIBEMV_STATS;
+
+// Enable, disable instrumentation. Default: disabled.
+// enabled: 1 enable, 0 disable
+// Disabled instrumentation costs one check of flag per event
+LIBEMV_API void libemv_set_stats_enabled(char enabled);
+
+// Get counters of current (or last) transaction, can be polled after every step
+LIBEMV_API LIBEMV_STATS* libemv_get_stats(void);
+
+// Clear counters
+LIBEMV_API void libemv_reset_stats(void);
+
+// Optional callback, called on start (isEnd = 0) and end (isEnd = 1) of every phase if instrumentation enabled
+// timestamp is value of monotonic clock in nanoseconds
+LIBEMV_API void set_function_phase_callback(void (*f_phase)(int phase, char isEnd, unsigned long long timestamp));
+
+// Binary trace
+// Events are written to ring buffer as records without any formatting:
+// [2 bytes event][2 bytes payload size][8 bytes timestamp, ns][payload], numbers are little endian
+// Records can be read from other thread with libemv_trace_read() and decoded offline (util/trace_decode.c)
+// Every session (thread with LIBEMV_THREADS) has own ring buffer, consumer reads it by handle
+typedef struct LIBEMV_TRACE LIBEMV_TRACE;
+#define LIBEMV_TRACE_HEADER_SIZE		12
+#define LIBEMV_TRACE_APDU_COMMAND		1	// Payload: CLA INS P1 P2 Lc [data]
+#define LIBEMV_TRACE_APDU_RESPONSE		2	// Payload: [data] SW1 SW2
+#define LIBEMV_TRACE_TRANSMIT_ERROR		3	// No payload, apdu function failed
+#define LIBEMV_TRACE_PHASE_BEGIN		4	// Payload: 1 byte phase, see LIBEMV_PHASE_...
+#define LIBEMV_TRACE_PHASE_END			5	// Payload: 1 byte phase
+
+// Enable trace of calling session to buffer provided by application, size must be power of 2
+// buffer = 0 disables trace. Default: disabled
+// Returns handle of ring buffer of session, valid until thread of session exits, 0 if disabled or wrong size
+// Don't read old handle while trace of the same session is enabled again
+LIBEMV_API LIBEMV_TRACE* libemv_trace_enable(unsigned char* buffer, int size);
+
+// Move whole records from ring buffer to outBuffer, can be called from other thread while transaction runs,
+// one consumer per ring buffer
+// Returns size of copied data, 0 if no records
+LIBEMV_API int libemv_trace_read(LIBEMV_TRACE* trace, unsigned char* outBuffer, int outBufferSize);
+
+// Count of records dropped because ring buffer was full
+LIBEMV_API unsigned long libemv_trace_dropped(LIBEMV_TRACE* trace);
+
 /*
 libemv_build_candidate_list
 while (1)
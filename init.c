@@ -5,15 +5,21 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
 
 static void init_functions(void);
 static void get_transaction_date_YYMMDD(char* strdate);
 static void get_transaction_time_HHmmss(char* strtime);
+static unsigned long long get_monotonic_time_ns(void);
 
 // This function can cause problems in custom platforms
 static void init_functions(void)
 {
 	libemv_ext_apdu = 0;
+	libemv_ext_transmit = 0;
+	libemv_transmit_context = 0;
 
 	libemv_malloc = malloc;
 	libemv_realloc = realloc;
@@ -24,7 +30,12 @@ static void init_functions(void)
 
 	libemv_rand = rand;
 
+	libemv_run_async = 0;
+	libemv_verify_pin = 0;
+
 	libemv_printf = printf;
+
+	libemv_get_monotonic_time = get_monotonic_time_ns;
 }
 
 // This function can cause problems in custom platforms
@@ -32,7 +43,7 @@ static void get_transaction_date_YYMMDD(char* strdate)
 {
 	time_t rawtime;
 	time(&rawtime);
-	strftime(strdate, 6, "%y%m%d", localtime(&rawtime));
+	strftime(strdate, 7, "%y%m%d", localtime(&rawtime));
 }
 
 // This function can cause problems in custom platforms
@@ -40,21 +51,38 @@ static void get_transaction_time_HHmmss(char* strtime)
 {
 	time_t rawtime;
 	time(&rawtime);
-	strftime(strtime, 6, "%H%M%S", localtime(&rawtime));
+	strftime(strtime, 7, "%H%M%S", localtime(&rawtime));
+}
+
+// This function can cause problems in custom platforms
+static unsigned long long get_monotonic_time_ns(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return (unsigned long long) (counter.QuadPart / frequency.QuadPart) * 1000000000ULL
+		+ (unsigned long long) (counter.QuadPart % frequency.QuadPart) * 1000000000ULL / frequency.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + (unsigned long long) ts.tv_nsec;
+#endif
 }
 
 LIBEMV_API void libemv_init(void)
 {
 	init_functions();
 	libemv_debug_enabled = 0;
+	libemv_init_stats();
+	libemv_init_trace();
 
 	libemv_init_tlv_buffer();
 
 	// Settings
 	memset(&libemv_settings, 0, sizeof(libemv_settings));
 	memset(&libemv_global, 0, sizeof(libemv_global));
-	libemv_applications_count = 0;
-	libemv_applications = 0;
+	libemv_init_config();
 	libemv_settings.appSelectionUsePSE = 1;
 	libemv_settings.appSelectionSupportConfirm = 1;
 	libemv_settings.appSelectionPartial = 1;
@@ -65,6 +93,16 @@ LIBEMV_API void libemv_destroy(void)
 {
 	if (libemv_debug_enabled)
 		libemv_printf("Destroy allocated data...\n");
+	libemv_oda_cda_drop();
 	libemv_destroy_tlv_buffer();
 	libemv_destroy_settings();
+	libemv_close_transaction_log();
+	libemv_clear_key_cache();
+}
+
+LIBEMV_API void libemv_destroy_session(void)
+{
+	libemv_oda_cda_drop();
+	libemv_destroy_config_session();
+	libemv_destroy_tlv_buffer();
 }
@@ -2,11 +2,27 @@
 #define __INTERNAL_H
 
 #include <stddef.h>
+#include "probes.h"
+
+// Storage of transaction data (application buffer, candidates, instrumentation, trace)
+// With define LIBEMV_THREADS every thread has own session, so several readers
+// can be served in parallel, settings and applications data are shared
+#if defined(LIBEMV_THREADS)
+#if defined(_MSC_VER)
+#define LIBEMV_SESSION __declspec(thread)
+#else
+#define LIBEMV_SESSION __thread
+#endif
+#else
+#define LIBEMV_SESSION
+#endif
 
 // Apdu transmit
 extern char (*libemv_ext_apdu)(unsigned char cla, unsigned char ins, unsigned char p1, unsigned char p2,
 						  unsigned char dataSize, const unsigned char* data,
 						  int* outDataSize, unsigned char* outData);
+extern char (*libemv_ext_transmit)(void* context, const unsigned char* cmd, int cmdSize, unsigned char* resp, int* respSize);
+extern LIBEMV_SESSION void* libemv_transmit_context;
 
 // Alloc
 extern void* (*libemv_malloc)(size_t size);
@@ -20,15 +36,99 @@ extern void (*libemv_get_time)(char* strtime);
 // Random
 extern int (*libemv_rand)(void);
 
+// Deferred work, 0 - work is done by calling thread
+extern void (*libemv_run_async)(void (*job)(void* context), void* context);
+
+// PIN entry of cardholder verification, 0 - no PIN pad
+extern int (*libemv_verify_pin)(unsigned char method);
+
 // Debug
 extern int (*libemv_printf)(const char * format, ...);
 
 // Debug disabled / enabled
 extern char libemv_debug_enabled;
 
+// Monotonic clock, nanoseconds
+extern unsigned long long (*libemv_get_monotonic_time)(void);
+
+// Instrumentation, see LIBEMV_STATS
+extern char libemv_stats_enabled;
+extern LIBEMV_SESSION LIBEMV_STATS libemv_stats;
+extern void (*libemv_phase_callback)(int phase, char isEnd, unsigned long long timestamp);
+
+// Init instrumentation (disabled)
+void libemv_init_stats(void);
+
+// Record start or end of phase
+void libemv_phase_event(int phase, char isEnd);
+
+// Trace, see libemv_trace_enable
+extern LIBEMV_SESSION char libemv_trace_enabled;
+void libemv_init_trace(void);
+
+// Write trace record, payload is data1 followed by data2
+void libemv_trace_event(unsigned short event, const unsigned char* data, int size);
+void libemv_trace_event2(unsigned short event, const unsigned char* data1, int size1, const unsigned char* data2, int size2);
+
+// Only check of flags if instrumentation and trace are disabled
+#define LIBEMV_STATS_ADD(field, value)	do { if (libemv_stats_enabled) libemv_stats.field += (value); } while (0)
+#define LIBEMV_PHASE_BEGIN(phase)		do { LIBEMV_PROBE1(phase_begin, (phase)); if (libemv_stats_enabled | libemv_trace_enabled) libemv_phase_event((phase), 0); } while (0)
+#define LIBEMV_PHASE_END(phase, result)	do { LIBEMV_PROBE2(phase_end, (phase), (result)); if (libemv_stats_enabled | libemv_trace_enabled) libemv_phase_event((phase), 1); } while (0)
+
 // Debug out binary
 void libemv_debug_buffer(char* strPre, unsigned char* buf, int size, char* strPost);
 
+// Format buffer as hex string with separator between bytes
+// Returns length of outStr
+int libemv_format_hex(char* outStr, const unsigned char* buf, int size, const char* separator);
+
+// Memory barrier, writes before it are visible before writes after it and reads after it
+// aren't done before reads before it (trace records and ring buffer positions, flags of jobs)
+// On MSVC it is only compiler barrier, x86 keeps this order
+// LIBEMV_FULL_BARRIER orders also write before it with read after it, needed if thread writes
+// own flag and then reads flag of other thread (epochs of configuration, see libemv_config_enter)
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sched.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define LIBEMV_BARRIER() _ReadWriteBarrier()
+#define LIBEMV_FULL_BARRIER() MemoryBarrier()
+#else
+#define LIBEMV_BARRIER() __sync_synchronize()
+#define LIBEMV_FULL_BARRIER() __sync_synchronize()
+#endif
+
+// Compare and swap, non zero if value was replaced
+#ifdef _WIN32
+#define LIBEMV_CAS_LONG(target, old, value)	(InterlockedCompareExchange((target), (value), (old)) == (old))
+#define LIBEMV_CAS_PTR(target, old, value)	(InterlockedCompareExchangePointer((PVOID volatile*) (target), (value), (old)) == (old))
+#else
+#define LIBEMV_CAS_LONG(target, old, value)	__sync_bool_compare_and_swap((target), (old), (value))
+#define LIBEMV_CAS_PTR(target, old, value)	__sync_bool_compare_and_swap((target), (old), (value))
+#endif
+
+// Round of spin loop that waits for other thread (lock, job): pause of CPU, after LIBEMV_SPIN_LIMIT
+// rounds thread yields, so other thread can run on the same CPU
+// Ex. for (spins = 0; !done; spins++) LIBEMV_SPIN_WAIT(spins);
+#define LIBEMV_SPIN_LIMIT		1024
+#ifdef _WIN32
+#define LIBEMV_CPU_RELAX()		YieldProcessor()
+#define LIBEMV_YIELD()			SwitchToThread()
+#else
+#if defined(__i386__) || defined(__x86_64__)
+#define LIBEMV_CPU_RELAX()		__builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define LIBEMV_CPU_RELAX()		__asm__ __volatile__("yield" ::: "memory")
+#else
+#define LIBEMV_CPU_RELAX()		LIBEMV_BARRIER()
+#endif
+#define LIBEMV_YIELD()			sched_yield()
+#endif
+#define LIBEMV_SPIN_WAIT(spins)	do { if ((spins) < LIBEMV_SPIN_LIMIT) LIBEMV_CPU_RELAX(); else LIBEMV_YIELD(); } while (0)
+
 // Init and destroy application buffer
 void libemv_init_tlv_buffer(void);
 void libemv_destroy_tlv_buffer(void);
@@ -39,6 +139,52 @@ void libemv_set_tag(unsigned short tag, unsigned char* data, int size);
 // Clear application buffer data (not free memory)
 void libemv_clear_tlv_buffer(void);
 
+// Handle of tag of fixed size in application buffer (Ex. TVR, CVM Results), value is written in place
+// without search while values of buffer don't move
+#define TAG_HANDLE_MAX_SIZE		8
+typedef struct
+{
+	unsigned short tag;
+	int size;
+	int offset;						// Offset of value in application buffer
+	unsigned long layout;			// Layout of buffer when offset was found
+} TAG_HANDLE;
+
+void libemv_init_tag_handle(TAG_HANDLE* handle, unsigned short tag, int size);
+
+// Value of tag in application buffer, tag is added (value of template or zeros) if it isn't there
+// Returns 0 if memory can't be allocated
+unsigned char* libemv_tag_handle_data(TAG_HANDLE* handle);
+
+// Set bits of mask in bit map of tag, see EMV_BIT
+void libemv_tag_handle_set_bits(TAG_HANDLE* handle, unsigned long long mask);
+
+// Tag of card from application buffer. Fetchable tag (ATC, Last Online ATC Register, PIN Try Counter) which
+// isn't there is read by GET DATA, card is asked once until application buffer is cleared
+// Returns LIBEMV_OK, LIBEMV_ERROR_TRANSMIT or LIBEMV_UNKNOWN_ERROR if card doesn't have tag
+int libemv_fetch_tag(unsigned short tag, unsigned char** outData, int* outSize);
+
+// Read only templates of terminal tags under application buffer: template of application (in configuration
+// image) and template of LIBEMV_GLOBAL. libemv_get_tag finds tag in application buffer, then in template of
+// application, then in template of LIBEMV_GLOBAL, libemv_set_tag writes to application buffer
+// Both templates belong to version of configuration (see CONFIG_SNAPSHOT)
+
+// Template of application for configuration image, only count size if outTemplate is 0
+// Returns size of template
+int libemv_app_template(const LIBEMV_APPLICATIONS* app, unsigned char* outTemplate);
+
+// Template of LIBEMV_GLOBAL, only count size if outTemplate is 0
+// Returns size of template
+int libemv_global_template(const LIBEMV_GLOBAL* global, unsigned char* outTemplate);
+
+// Template of application of current transaction, -1 - application isn't selected
+void libemv_use_tag_template(int indexApp);
+
+// Copy application buffer to image and restore it, image is raw content of buffer
+// Returns size of image, 0 if buffer is bigger than maxSize
+int libemv_copy_tlv_buffer(unsigned char* outImage, int maxSize);
+void libemv_restore_tlv_buffer(const unsigned char* image, int size);
+
 // Parse custom tlv buffer
 // outBuffer will point to inBuffer with some shift
 // Returns shift to the end of current [tag length value]
@@ -52,18 +198,358 @@ int libemv_make_tlv(unsigned char* inBuffer, int inBufferSize, unsigned short ta
 // Returns size of outBuffer
 int libemv_dol(unsigned char* dol, int dolSize, unsigned char* outBuffer);
 
+// DOL parsed once (default DDOL of configuration, DDOL of card, CDOL), data is built without parsing of DOL
+#define MAX_DOL_ENTRIES		32
+typedef struct
+{
+	unsigned short tag;
+	unsigned char size;
+	unsigned char late;				// Value is set after data is built, see libemv_dol_plan_patch
+} DOL_ENTRY;
+
+typedef struct
+{
+	int count;
+	int size;						// Size of data of DOL
+	DOL_ENTRY entries[MAX_DOL_ENTRIES];
+} DOL_PLAN;
+
+// Parse DOL to plan
+// Returns 0 if DOL is wrong (cut tag or length, more than MAX_DOL_ENTRIES entries)
+int libemv_compile_dol(const unsigned char* dol, int dolSize, DOL_PLAN* outPlan);
+
+// Make data of plan like libemv_dol, outBuffer must have place for plan->size bytes
+// Returns size of outBuffer
+int libemv_dol_plan_data(const DOL_PLAN* plan, unsigned char* outBuffer);
+
+// Returns 1 if DOL of plan has tag
+int libemv_dol_plan_has_tag(const DOL_PLAN* plan, unsigned short tag);
+
+// Mark entries of tags which are set after data of plan is built (Ex. TVR)
+void libemv_dol_plan_set_late(DOL_PLAN* plan, const unsigned short* tags, int count);
+
+// Write again only values of late entries into data built by libemv_dol_plan_data
+void libemv_dol_plan_patch(const DOL_PLAN* plan, unsigned char* buffer);
+
 // Settings
 extern LIBEMV_SETTINGS libemv_settings;
 extern LIBEMV_GLOBAL libemv_global;
-extern int libemv_applications_count;
-extern LIBEMV_APPLICATIONS* libemv_applications;
 void libemv_destroy_settings(void);
 
+// Node of byte trie of terminal AIDs, children of node are linked list (firstChild, nextSibling), node 0 is root
+// AIDs are numbered in order of configuration (ordinal), match with smallest ordinal wins
+typedef struct
+{
+	unsigned char byte;
+	int firstChild;
+	int nextSibling;
+	int exactOrdinal;		// Smallest ordinal of AIDs ending in this node, -1 if none
+	int partialOrdinal;		// Smallest ordinal of AIDs with ASI ending in this node, -1 if none
+} AID_NODE;
+
+// Terminal configuration image, see libemv_build_config_image
+// Offsets are from start of image, sections are aligned to 4 bytes
+// Image is valid only for platform of library (byte order, structure layout), version is checked
+#define CONFIG_MAGIC	0x564D454C	// "LEMV"
+#define CONFIG_VERSION	2
+typedef struct
+{
+	unsigned int magic;
+	unsigned int version;
+	unsigned int size;				// Size of image
+	unsigned int checksum;			// FNV-1a of image after header
+	LIBEMV_GLOBAL global;
+	int appsCount;
+	int aidsCount;
+	int capksCount;
+	int aidNodesCount;
+	unsigned int appsOffset;		// CONFIG_APP[appsCount]
+	unsigned int aidsOffset;		// CONFIG_AID[aidsCount], order of configuration
+	unsigned int capksOffset;		// CONFIG_CAPK[capksCount]
+	unsigned int aidNodesOffset;	// AID_NODE[aidNodesCount]
+	unsigned int templatesOffset;	// unsigned int[appsCount + 1], template of application i is from offset i to i + 1
+} CONFIG_HEADER;
+
+// Application, strings of LIBEMV_APPLICATIONS are only in template of application
+typedef struct
+{
+	unsigned char RID[5];
+	unsigned char applicationVersionNumber[2];
+	unsigned char merchantCategoryCode[2];
+	unsigned char terminalActionCodeDefault[5];
+	unsigned char terminalActionCodeDenial[5];
+	unsigned char terminalActionCodeOnline[5];
+	unsigned char terminalFloorLimit[4];
+	unsigned char thresholdValueForRandomSelection[4];
+	unsigned char transactionReferenceCurrency[2];
+	unsigned char transactionReferenceCurrencyConv[4];
+	unsigned char transactionReferenceCurrencyExponent;
+	unsigned char targetForRandomSelection;
+	unsigned char maxTargetForBiasedRandomSelection;
+	int firstAid;
+	int aidsCount;
+	int firstCapk;
+	int capksCount;
+	unsigned int defaultDDOLOffset;
+	int defaultDDOLSize;
+	unsigned int defaultTDOLOffset;
+	int defaultTDOLSize;
+	DOL_PLAN defaultDDOLPlan;		// Empty if default DDOL is wrong
+} CONFIG_APP;
+
+typedef struct
+{
+	unsigned short app;							// Index of application
+	unsigned char applicationSelectionIndicator;
+	unsigned char aidLength;
+	unsigned int aidOffset;
+} CONFIG_AID;
+
+typedef struct
+{
+	unsigned short app;							// Index of application
+	unsigned char keyIndex;
+	unsigned char exponentLength;				// Without leading zeros
+	unsigned short modulusLength;				// 0 - key isn't usable
+	unsigned int exponentOffset;
+	unsigned int modulusOffset;
+	unsigned char checkSum[20];
+} CONFIG_CAPK;
+
+// Modulus of CAPK is at least header and hash of issuer certificate, at most keyModulus
+#define CONFIG_CAPK_MIN_MODULUS		36
+#define CONFIG_CAPK_MAX_MODULUS		248
+
+// Exception file (hot card list), see libemv_build_exception_image
+// Blocked Bloom filter of PANs: every PAN sets EXCEPTION_BLOOM_HASHES bits in one block (cache line),
+// so negative lookup reads one line. Entries are sorted by PAN and PAN sequence number (memcmp)
+#define EXCEPTION_MAGIC				0x4658454C	// "LEXF"
+#define EXCEPTION_VERSION			1
+#define EXCEPTION_KEY_SIZE			11			// PAN and PAN sequence number of LIBEMV_EXCEPTION_ENTRY
+#define EXCEPTION_BLOOM_BLOCK		64			// Bytes of block
+#define EXCEPTION_BLOOM_HASHES		6
+#define EXCEPTION_BITS_PER_ENTRY	10			// About 1% of false positives
+typedef struct
+{
+	unsigned int magic;
+	unsigned int version;
+	unsigned int size;				// Size of image
+	int count;
+	unsigned int bloomOffset;		// Aligned to EXCEPTION_BLOOM_BLOCK
+	unsigned int bloomBlocks;		// Power of 2
+	unsigned int entriesOffset;		// LIBEMV_EXCEPTION_ENTRY[count]
+} EXCEPTION_HEADER;
+
+// Exception file with delta updates since file was mapped
+typedef struct
+{
+	const EXCEPTION_HEADER* header;		// Mapped file, 0 if no file
+	size_t mappedSize;
+	char ownsFile;						// File is unmapped with list, next list of delta takes file
+	LIBEMV_EXCEPTION_ENTRY* delta;		// Sorted, one entry per key, remove flag overrides file
+	int deltaCount;
+	unsigned char* deltaFilter;			// Bloom filter of delta, deltaBlocks blocks
+	unsigned int deltaBlocks;
+} EXCEPTION_LIST;
+
+// Card is in list (entry with PAN and PAN sequence number or with PAN for all sequence numbers)
+// pan is 10 bytes padded with 'F'
+// Returns 1 if found
+int libemv_exception_lookup(const EXCEPTION_LIST* list, const unsigned char* pan, unsigned char panSequence);
+// Bloom filter of file, returns 0 if PAN is surely not in file
+int libemv_exception_filter(const EXCEPTION_LIST* list, const unsigned char* pan);
+void libemv_free_exception_list(EXCEPTION_LIST* list);
+
+// Terminal transaction log, see libemv_open_transaction_log
+// File is TXLOG_HEADER and ring of capacity TXLOG_RECORD, record is written in place of oldest one.
+// Record is valid if checksum matches, so record torn by crash is ignored when log is opened
+#define TXLOG_MAGIC					0x474C5854	// "TXLG"
+#define TXLOG_VERSION				1
+#define TXLOG_BUCKETS				8			// Time buckets of amounts per PAN, window of sum
+#define TXLOG_RECORDS_OFFSET		64			// Records are aligned to cache line
+typedef struct
+{
+	unsigned int magic;
+	unsigned int version;
+	int capacity;					// Count of records
+	int bucketSeconds;
+	unsigned int recordsOffset;
+} TXLOG_HEADER;
+
+typedef struct
+{
+	unsigned long long sequence;	// From 1, 0 - empty record
+	long long time;					// Seconds since 1970
+	unsigned long long amount;		// Amount, Authorised in minor units
+	unsigned char pan[10];			// Padded with 'F'
+	unsigned char panSequence;		// 0xFF - card has no PAN Sequence Number
+	unsigned char reserved;
+	unsigned int checksum;			// Of fields above
+} TXLOG_RECORD;
+
+// Sum of amounts of logged transactions with PAN in window (TXLOG_BUCKETS buckets up to now)
+// pan is 10 bytes padded with 'F'. Returns 0 if log isn't opened
+unsigned long long libemv_txlog_sum(const unsigned char* pan);
+
+// Key schedules in cache of EMV cryptography (cryptogram.c), build flag
+#if !defined(LIBEMV_KEY_CACHE_SIZE)
+#define LIBEMV_KEY_CACHE_SIZE		64
+#endif
+
+// Version of configuration published to sessions: image, template of LIBEMV_GLOBAL,
+// statistics of AIDs and exception file. New version is built and checked by thread that updates configuration
+// and replaces current version atomically, old version is freed when no session uses it
+typedef struct
+{
+	const CONFIG_HEADER* header;			// 0 if applications aren't set
+	const unsigned char* globalTemplate;	// Tags of LIBEMV_GLOBAL, see libemv_get_tag
+	int globalTemplateLength;
+	unsigned long* aidHits;					// Count of cards per AID ordinal, shared by sessions
+	const EXCEPTION_LIST* exceptions;		// 0 if exception file isn't used
+} CONFIG_SNAPSHOT;
+
+// Version used by transaction of session, pinned by libemv_config_enter, 0 out of transaction
+extern LIBEMV_SESSION const CONFIG_SNAPSHOT* libemv_snapshot;
+extern LIBEMV_SESSION const CONFIG_HEADER* libemv_config;
+#define LIBEMV_CONFIG_PTR(offset)	((const unsigned char*) libemv_config + (offset))
+#define LIBEMV_CONFIG_APPS()		((const CONFIG_APP*) LIBEMV_CONFIG_PTR(libemv_config->appsOffset))
+#define LIBEMV_CONFIG_AIDS()		((const CONFIG_AID*) LIBEMV_CONFIG_PTR(libemv_config->aidsOffset))
+#define LIBEMV_CONFIG_CAPKS()		((const CONFIG_CAPK*) LIBEMV_CONFIG_PTR(libemv_config->capksOffset))
+
+void libemv_init_config(void);
+void libemv_destroy_config(void);
+
+// Start of transaction: session pins current version, it is used until libemv_config_leave
+// or next transaction even if configuration is updated
+// Returns LIBEMV_OK or LIBEMV_UNKNOWN_ERROR
+int libemv_config_enter(void);
+void libemv_config_leave(void);
+
+// End of session: leave configuration and free record of session for next session
+void libemv_destroy_config_session(void);
+
+// Version of thread that updates configuration, for functions called out of transaction
+const CONFIG_SNAPSHOT* libemv_config_current(void);
+
+// Build image of apps with current LIBEMV_GLOBAL and publish it
+// Returns LIBEMV_OK or LIBEMV_UNKNOWN_ERROR
+int libemv_config_from_applications(const LIBEMV_APPLICATIONS* apps, int countApps);
+
+// Publish current image with template of changed LIBEMV_GLOBAL
+// Returns LIBEMV_OK or LIBEMV_UNKNOWN_ERROR
+int libemv_config_global_changed(void);
+
+// Publish current configuration with new exception list, list is freed with version
+// Returns LIBEMV_OK or LIBEMV_UNKNOWN_ERROR, list isn't used on error
+int libemv_config_exceptions_changed(EXCEPTION_LIST* exceptions);
+
+// Map file read only, outSize is size of file
+// Returns address of file or 0
+const unsigned char* libemv_map_file(const char* path, size_t* outSize);
+// Map file for writing, file is created or extended to size. outFile is handle for libemv_sync_file,
+// it is closed by libemv_close_file after unmap (0 if mapping is enough, POSIX)
+// Returns address of file or 0
+unsigned char* libemv_map_file_writable(const char* path, size_t size, void** outFile);
+void libemv_unmap_file(const unsigned char* mapped, size_t size);
+void libemv_close_file(void* file);
+// Write changed pages of mapped range to file and wait, data survives power failure
+void libemv_sync_file(void* file, const unsigned char* address, size_t size);
+
+// Build trie of AIDs of apps, outNodes must have place for count of all AID bytes + 1 nodes
+// Returns count of nodes
+int libemv_build_aid_trie(const LIBEMV_APPLICATIONS* apps, int countApps, AID_NODE* outNodes);
+
+// Find application of DF name: AID equals DF name or, if allowPartial, AID with ASI is prefix of DF name
+// If several AIDs match, first in order of configuration is used
+// Returns index of application in configuration or -1 if not found
+int libemv_find_aid(const unsigned char* dfName, int dfNameLength, char allowPartial);
+
+// Count of AIDs in index, ordinal of AID is its number in order of configuration
+int libemv_aid_count(void);
+
+// Statistics of AIDs found on cards, used for adaptive order of list of AIDs
+void libemv_aid_hit(int ordinal);
+unsigned long libemv_aid_hits(int ordinal);
+
 // Apdu function with debug info
 char libemv_apdu(unsigned char cla, unsigned char ins, unsigned char p1, unsigned char p2,
 				 unsigned char dataSize, const unsigned char* data,
 				 int* outDataSize, unsigned char* outData);
 
+// Offline data authentication of session (oda.c)
+// Start of reading of records, ODA is active if card (AIP) and terminal support DDA or CDA
+void libemv_oda_reset(void);
+// Record of SFI for offline data authentication (record size doesn't include SW1 SW2)
+void libemv_oda_add_record(unsigned char sfi, unsigned char* record, int size);
+// Recover issuer key and ICC certificate if their data is read, called after every record
+void libemv_oda_prepare(const CONFIG_APP* app);
+// Check of ICC certificate with all static data, result is kept for session
+// Returns 1 if ICC public key is recovered
+int libemv_oda_icc_key(const CONFIG_APP* app);
+// Returns 1 if key wasn't recovered because card hasn't data (certificate, exponent, remainder)
+int libemv_oda_icc_data_missing(void);
+// Check of Signed Dynamic Application Data with ICC key, ICC Dynamic Number is saved in application buffer
+// Returns 1 if signature is valid
+int libemv_oda_verify_sdad(const unsigned char* sdad, int size, const unsigned char* ddolData, int ddolSize);
+// Start check of CDA signature of GENERATE AC response, job runs by libemv_run_async or at once
+// hashData: PDOL data, CDOL data, TLVs of response without SDAD (Transaction Data Hash Code)
+// Returns 0 if check can't be started (no ICC key, wrong sizes)
+int libemv_oda_cda_start(const unsigned char* sdad, int sdadSize, unsigned char cid,
+						 const unsigned char* hashData, int hashDataSize);
+// Wait for check of CDA, ICC Dynamic Number and Application Cryptogram of signature are saved in application buffer
+// Returns 1 if signature is valid, 0 if not, -1 if check wasn't started
+int libemv_oda_cda_finish(void);
+// Forget started check, Ex. next transaction
+void libemv_oda_cda_drop(void);
+
+// Cardholder verification (cvm.c)
+// Condition codes of CV Rule (byte 2)
+#define CVM_CONDITION_ALWAYS				0x00
+#define CVM_CONDITION_UNATTENDED_CASH		0x01
+#define CVM_CONDITION_NOT_CASH_OR_CASHBACK	0x02	// Not unattended cash, not manual cash, not purchase with cashback
+#define CVM_CONDITION_TERMINAL_SUPPORTS		0x03
+#define CVM_CONDITION_MANUAL_CASH			0x04
+#define CVM_CONDITION_CASHBACK				0x05
+#define CVM_CONDITION_UNDER_X				0x06
+#define CVM_CONDITION_OVER_X				0x07
+#define CVM_CONDITION_UNDER_Y				0x08
+#define CVM_CONDITION_OVER_Y				0x09
+
+// Capabilities of method which isn't known, no terminal has this bit
+#define CVM_UNRECOGNISED		(1ULL << 63)
+#define CVM_APPLY_SUCCEEDING	0x40		// Bit of CV Rule byte 1: apply next rule if this one is unsuccessful
+#define CVM_RESULT_UNKNOWN		0x00		// Byte 3 of CVM Results
+#define CVM_RESULT_FAILED		0x01
+#define CVM_RESULT_SUCCESSFUL	0x02
+#define MAX_CVM_RULES			124			// CVM list up to 256 bytes
+typedef struct
+{
+	unsigned long long capabilities;	// Bits of Terminal Capabilities needed by method or CVM_UNRECOGNISED
+	unsigned long condition;			// Bit of condition code in word of libemv_cvm_conditions, 0 - unknown code
+	unsigned char rule[2];				// CV Rule: method, condition code
+	unsigned char supportCondition;		// Condition is "terminal supports CVM"
+	unsigned char reserved;
+} CVM_RULE;
+
+typedef struct
+{
+	int count;
+	unsigned long long amountX;
+	unsigned long long amountY;
+	CVM_RULE rules[MAX_CVM_RULES];
+} CVM_TABLE;
+
+#define CVM_SUPPORTED(rule, terminalCapabilities)	(((terminalCapabilities) & (rule)->capabilities) == (rule)->capabilities)
+
+// Compile CVM list (tag 8E) to table
+// Returns 0 if list is empty or wrong
+int libemv_cvm_compile(const unsigned char* list, int size, CVM_TABLE* outTable);
+// Word of satisfied conditions (bit of condition code) from transaction type, terminal type, amount and currency
+unsigned long libemv_cvm_conditions(const CVM_TABLE* table);
+// First rule from index with satisfied condition
+// Returns index of rule, table->count if there is no such rule
+int libemv_cvm_next(const CVM_TABLE* table, int index, unsigned long conditions, unsigned long long capabilities);
+
 // Tags
 #define TAG_FCI_TEMPLATE					0x6F
 #define TAG_DF_NAME							0x84
@@ -104,108 +590,120 @@ char libemv_apdu(unsigned char cla, unsigned char ins, unsigned char p1, unsigne
 #define TAG_READ_RECORD_RESPONSE_TEMPLATE	0x70
 #define TAG_APPLICATION_EXP_DATE			0x5F24
 #define TAG_PAN								0x5A
+#define TAG_PAN_SEQUENCE_NUMBER				0x5F34
 #define TAG_CDOL_1							0x8C
 #define TAG_CDOL_2							0x8D
+#define TAG_AMOUNT_AUTHORISED				0x9F02
+#define TAG_AMOUNT_OTHER					0x9F03
+#define TAG_TRANSACTION_CURRENCY_CODE		0x5F2A
+#define TAG_TRANSACTION_CURRENCY_EXPONENT	0x5F36
+#define TAG_TRANSACTION_TYPE				0x9C
+#define TAG_TRANSACTION_DATE				0x9A
+#define TAG_TRANSACTION_TIME				0x9F21
+#define TAG_UNPREDICTABLE_NUMBER			0x9F37
+#define TAG_TTQ								0x9F66
+#define TAG_IAC_DEFAULT						0x9F0D
+#define TAG_IAC_DENIAL						0x9F0E
+#define TAG_IAC_ONLINE						0x9F0F
+#define TAG_ATC								0x9F36
+#define TAG_LAST_ONLINE_ATC					0x9F13
+#define TAG_PIN_TRY_COUNTER					0x9F17
+#define TAG_LOWER_CONSECUTIVE_OFFLINE_LIMIT	0x9F14
+#define TAG_UPPER_CONSECUTIVE_OFFLINE_LIMIT	0x9F23
+#define TAG_CA_PUBLIC_KEY_INDEX				0x8F
+#define TAG_ISSUER_PK_CERTIFICATE			0x90
+#define TAG_ISSUER_PK_REMAINDER				0x92
+#define TAG_ISSUER_PK_EXPONENT				0x9F32
+#define TAG_ICC_PK_CERTIFICATE				0x9F46
+#define TAG_ICC_PK_EXPONENT					0x9F47
+#define TAG_ICC_PK_REMAINDER				0x9F48
+#define TAG_DDOL							0x9F49
+#define TAG_SDA_TAG_LIST					0x9F4A
+#define TAG_SIGNED_DYNAMIC_APP_DATA			0x9F4B
+#define TAG_ICC_DYNAMIC_NUMBER				0x9F4C
+#define TAG_CID								0x9F27
+#define TAG_APPLICATION_CRYPTOGRAM			0x9F26
+#define TAG_ISSUER_APPLICATION_DATA			0x9F10
+#define TAG_CVM_RESULTS						0x9F34
+#define TAG_AUTHORISATION_RESPONSE_CODE		0x8A
+#define TAG_ISSUER_AUTHENTICATION_DATA		0x91
+#define TAG_CVM_LIST						0x8E
+#define TAG_APPLICATION_CURRENCY_CODE		0x9F42
 
-// Bit map, please control out of limits
-typedef struct
-{
-#ifdef BIG_ENDIAN
-	unsigned char B1b8:1;
-	unsigned char B1b7:1;
-	unsigned char B1b6:1;
-	unsigned char B1b5:1;
-	unsigned char B1b4:1;
-	unsigned char B1b3:1;
-	unsigned char B1b2:1;
-	unsigned char B1b1:1;
-
-	unsigned char B2b8:1;
-	unsigned char B2b7:1;
-	unsigned char B2b6:1;
-	unsigned char B2b5:1;
-	unsigned char B2b4:1;
-	unsigned char B2b3:1;
-	unsigned char B2b2:1;
-	unsigned char B2b1:1;
-
-	unsigned char B3b8:1;
-	unsigned char B3b7:1;
-	unsigned char B3b6:1;
-	unsigned char B3b5:1;
-	unsigned char B3b4:1;
-	unsigned char B3b3:1;
-	unsigned char B3b2:1;
-	unsigned char B3b1:1;
-
-	unsigned char B4b8:1;
-	unsigned char B4b7:1;
-	unsigned char B4b6:1;
-	unsigned char B4b5:1;
-	unsigned char B4b4:1;
-	unsigned char B4b3:1;
-	unsigned char B4b2:1;
-	unsigned char B4b1:1;
-
-	unsigned char B5b8:1;
-	unsigned char B5b7:1;
-	unsigned char B5b6:1;
-	unsigned char B5b5:1;
-	unsigned char B5b4:1;
-	unsigned char B5b3:1;
-	unsigned char B5b2:1;
-	unsigned char B5b1:1;
-#else
-	unsigned char B1b1:1;
-	unsigned char B1b2:1;
-	unsigned char B1b3:1;
-	unsigned char B1b4:1;
-	unsigned char B1b5:1;
-	unsigned char B1b6:1;
-	unsigned char B1b7:1;
-	unsigned char B1b8:1;
-
-	unsigned char B2b1:1;
-	unsigned char B2b2:1;
-	unsigned char B2b3:1;
-	unsigned char B2b4:1;
-	unsigned char B2b5:1;
-	unsigned char B2b6:1;
-	unsigned char B2b7:1;
-	unsigned char B2b8:1;
-
-	unsigned char B3b1:1;
-	unsigned char B3b2:1;
-	unsigned char B3b3:1;
-	unsigned char B3b4:1;
-	unsigned char B3b5:1;
-	unsigned char B3b6:1;
-	unsigned char B3b7:1;
-	unsigned char B3b8:1;
-
-	unsigned char B4b1:1;
-	unsigned char B4b2:1;
-	unsigned char B4b3:1;
-	unsigned char B4b4:1;
-	unsigned char B4b5:1;
-	unsigned char B4b6:1;
-	unsigned char B4b7:1;
-	unsigned char B4b8:1;
-
-	unsigned char B5b1:1;
-	unsigned char B5b2:1;
-	unsigned char B5b3:1;
-	unsigned char B5b4:1;
-	unsigned char B5b5:1;
-	unsigned char B5b6:1;
-	unsigned char B5b7:1;
-	unsigned char B5b8:1;
-#endif
-} EMV_BITS;
+// Bit maps (TVR, TSI, AIP, terminal capabilities) are numbers: byte 1 of value is most significant,
+// so bit map up to 8 bytes is one unsigned long long and checks of several bits are one AND
+// Bit is numbered like in specification: byte from 1, bit from 1 (least significant) to 8
+#define EMV_BIT(size, byte, bit)	(1ULL << (((size) - (byte)) * 8 + (bit) - 1))
+
+// Terminal Verification Results
+#define TVR_BIT(byte, bit)							EMV_BIT(5, byte, bit)
+#define TVR_OFFLINE_DATA_AUTH_NOT_PERFORMED			TVR_BIT(1, 8)
+#define TVR_SDA_FAILED								TVR_BIT(1, 7)
+#define TVR_ICC_DATA_MISSING						TVR_BIT(1, 6)
+#define TVR_CARD_ON_EXCEPTION_FILE					TVR_BIT(1, 5)
+#define TVR_DDA_FAILED								TVR_BIT(1, 4)
+#define TVR_CDA_FAILED								TVR_BIT(1, 3)
+#define TVR_SDA_SELECTED							TVR_BIT(1, 2)
+#define TVR_DIFFERENT_APPLICATION_VERSIONS			TVR_BIT(2, 8)
+#define TVR_EXPIRED_APPLICATION						TVR_BIT(2, 7)
+#define TVR_APPLICATION_NOT_YET_EFFECTIVE			TVR_BIT(2, 6)
+#define TVR_SERVICE_NOT_ALLOWED						TVR_BIT(2, 5)
+#define TVR_NEW_CARD								TVR_BIT(2, 4)
+#define TVR_CARDHOLDER_VERIFICATION_FAILED			TVR_BIT(3, 8)
+#define TVR_UNRECOGNISED_CVM						TVR_BIT(3, 7)
+#define TVR_PIN_TRY_LIMIT_EXCEEDED					TVR_BIT(3, 6)
+#define TVR_PIN_PAD_NOT_PRESENT						TVR_BIT(3, 5)
+#define TVR_PIN_NOT_ENTERED							TVR_BIT(3, 4)
+#define TVR_ONLINE_PIN_ENTERED						TVR_BIT(3, 3)
+#define TVR_FLOOR_LIMIT_EXCEEDED					TVR_BIT(4, 8)
+#define TVR_LOWER_OFFLINE_LIMIT_EXCEEDED			TVR_BIT(4, 7)
+#define TVR_UPPER_OFFLINE_LIMIT_EXCEEDED			TVR_BIT(4, 6)
+#define TVR_RANDOMLY_SELECTED_ONLINE				TVR_BIT(4, 5)
+#define TVR_MERCHANT_FORCED_ONLINE					TVR_BIT(4, 4)
+#define TVR_DEFAULT_TDOL_USED						TVR_BIT(5, 8)
+#define TVR_ISSUER_AUTHENTICATION_FAILED			TVR_BIT(5, 7)
+#define TVR_SCRIPT_FAILED_BEFORE_FINAL_AC			TVR_BIT(5, 6)
+#define TVR_SCRIPT_FAILED_AFTER_FINAL_AC			TVR_BIT(5, 5)
+
+// Transaction Status Information
+#define TSI_BIT(byte, bit)							EMV_BIT(2, byte, bit)
+#define TSI_OFFLINE_DATA_AUTH_PERFORMED				TSI_BIT(1, 8)
+#define TSI_CARDHOLDER_VERIFICATION_PERFORMED		TSI_BIT(1, 7)
+#define TSI_CARD_RISK_MANAGEMENT_PERFORMED			TSI_BIT(1, 6)
+#define TSI_ISSUER_AUTHENTICATION_PERFORMED			TSI_BIT(1, 5)
+#define TSI_TERMINAL_RISK_MANAGEMENT_PERFORMED		TSI_BIT(1, 4)
+#define TSI_SCRIPT_PROCESSING_PERFORMED				TSI_BIT(1, 3)
+
+// Application Interchange Profile
+#define AIP_BIT(byte, bit)							EMV_BIT(2, byte, bit)
+#define AIP_SDA_SUPPORTED							AIP_BIT(1, 7)
+#define AIP_DDA_SUPPORTED							AIP_BIT(1, 6)
+#define AIP_CARDHOLDER_VERIFICATION_SUPPORTED		AIP_BIT(1, 5)
+#define AIP_TERMINAL_RISK_MANAGEMENT_REQUIRED		AIP_BIT(1, 4)
+#define AIP_ISSUER_AUTHENTICATION_SUPPORTED			AIP_BIT(1, 3)
+#define AIP_CDA_SUPPORTED							AIP_BIT(1, 1)
+
+// Terminal Capabilities, byte 2 - CVM capability, byte 3 - security capability
+#define TERMINAL_CAP_BIT(byte, bit)					EMV_BIT(3, byte, bit)
+#define TERMINAL_CAP_PLAINTEXT_PIN					TERMINAL_CAP_BIT(2, 8)
+#define TERMINAL_CAP_ENCIPHERED_PIN_ONLINE			TERMINAL_CAP_BIT(2, 7)
+#define TERMINAL_CAP_SIGNATURE						TERMINAL_CAP_BIT(2, 6)
+#define TERMINAL_CAP_ENCIPHERED_PIN_OFFLINE			TERMINAL_CAP_BIT(2, 5)
+#define TERMINAL_CAP_NO_CVM							TERMINAL_CAP_BIT(2, 4)
+#define TERMINAL_CAP_SDA							TERMINAL_CAP_BIT(3, 8)
+#define TERMINAL_CAP_DDA							TERMINAL_CAP_BIT(3, 7)
+#define TERMINAL_CAP_CDA							TERMINAL_CAP_BIT(3, 4)
+
+// Bit map of size bytes (up to 8) as number, see EMV_BIT
+unsigned long long libemv_pack_bits(const unsigned char* data, int size);
+
+// Bit map of tag from application buffer or templates, 0 if tag isn't set
+unsigned long long libemv_get_bits(unsigned short tag);
+
+// Value of numeric (BCD) tag, Ex. amount in minor units, 0 if tag isn't set
+unsigned long long libemv_get_numeric(unsigned short tag);
 
-extern EMV_BITS* libemv_TVR;
-extern EMV_BITS* libemv_TSI;
-extern EMV_BITS* libemv_capa;
-extern EMV_BITS* libemv_addi_capa;
+// Set bits of mask in bit map of tag in application buffer, tag must be set before
+void libemv_set_bits(unsigned short tag, unsigned long long mask);
 
 #endif // __INTERNAL_H
@@ -6,65 +6,25 @@
 
 SCARDHANDLE hCardHandle;
 
-extern "C" char f_apdu(unsigned char cla, unsigned char ins, unsigned char p1, unsigned char p2,
-					  unsigned char dataSize, const unsigned char* data,
-					  int* outDataSize, unsigned char* outData)
+// Raw transport, GET RESPONSE and wrong length are processed by libemv
+extern "C" char f_transmit(void* context, const unsigned char* cmd, int cmdSize,
+						   unsigned char* resp, int* respSize)
 {
-	BYTE pbRecv[256] = {0};
-	DWORD dwRecv = 256;
-	BYTE pbSend[256] = {cla, ins, p1, p2, dataSize};
-	memcpy(pbSend + 5, data, dataSize);
-	DWORD dwSend = 5 + dataSize;
-	LONG lReturn = SCardTransmit(hCardHandle,
+	SCARDHANDLE* phCard = (SCARDHANDLE*) context;
+	DWORD dwRecv = *respSize;
+	LONG lReturn = SCardTransmit(*phCard,
 		SCARD_PCI_T0,
-		pbSend,
-		dwSend,
+		cmd,
+		cmdSize,
 		NULL,
-		pbRecv,
+		resp,
 		&dwRecv );
 	if ( SCARD_S_SUCCESS != lReturn )
 	{
 		printf("Failed SCardTransmit\n");
 		return 0;
 	}
-	if (dwRecv >= 2 && pbRecv[0] == 0x6C)
-	{
-		BYTE pbSend2[256] = {cla, ins, p1, p2, pbRecv[1]};
-		DWORD dwSend = 5;
-		dwRecv = 256;
-		LONG lReturn = SCardTransmit(hCardHandle,
-			SCARD_PCI_T0,
-			pbSend2,
-			dwSend,
-			NULL,
-			pbRecv,
-			&dwRecv );
-		if ( SCARD_S_SUCCESS != lReturn )
-		{
-			printf("Failed SCardTransmit\n");
-			return 0;
-		}
-	}
-	if (dwRecv >= 2 && pbRecv[0] == 0x61)
-	{
-		BYTE pbSend2[256] = {0x00, 0xC0, 0x00, 0x00, pbRecv[1]};
-		DWORD dwSend = 5;
-		dwRecv = 256;
-		LONG lReturn = SCardTransmit(hCardHandle,
-			SCARD_PCI_T0,
-			pbSend2,
-			dwSend,
-			NULL,
-			pbRecv,
-			&dwRecv );
-		if ( SCARD_S_SUCCESS != lReturn )
-		{
-			printf("Failed SCardTransmit\n");
-			return 0;
-		}
-	}
-	memcpy(outData, pbRecv, dwRecv);
-	*outDataSize = dwRecv;
+	*respSize = dwRecv;
 	return 1;
 }
 
@@ -191,7 +151,7 @@ int main(int argc, char **argv)
 	libemv_init();
 
 	libemv_set_debug_enabled(1);
-	set_function_apdu(f_apdu);
+	set_function_transmit(f_transmit, &hCardHandle);
 
 	// Global settings
 	LIBEMV_GLOBAL globalSettings = {"12345678", {0x08, 0x40}, {0xC1, 0x00, 0xF0, 0xA0, 0x01}, {0xE0, 0xF8, 0xE8}, 0x22};
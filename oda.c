@@ -0,0 +1,571 @@
+#include "include/libemv.h"
+#include "internal.h"
+#include "crypt/rsaeuro.h"
+#include "crypt/rsa.h"
+#include "crypt/sha1.h"
+#include <string.h>
+
+// Offline data authentication (EMV Book 2, sections 5, 6): recovery of issuer and ICC public keys and
+// check of signed dynamic data. RSA of certificates is done while records are read (libemv_oda_prepare),
+// so after INTERNAL AUTHENTICATE only signature of card is recovered. CDA signature of GENERATE AC
+// is checked by job (CDA_JOB) after card is released, see libemv_run_async
+
+#define ODA_STATIC_DATA_SIZE	2048	// Records for offline data authentication
+#define ODA_HASH_SIZE			20		// SHA-1
+
+// State of key: not recovered yet (data isn't read), recovered, failed
+#define ODA_KEY_NONE			0
+#define ODA_KEY_READY			1
+#define ODA_KEY_FAILED			2
+
+static LIBEMV_SESSION char odaActive;
+static LIBEMV_SESSION unsigned char staticData[ODA_STATIC_DATA_SIZE];
+static LIBEMV_SESSION int staticDataSize;
+static LIBEMV_SESSION char staticDataInvalid;
+
+static LIBEMV_SESSION char issuerKeyState;
+static LIBEMV_SESSION R_RSA_PUBLIC_KEY issuerKey;
+
+// Issuer certificate is recovered once, remainder of key can come in later record
+static LIBEMV_SESSION char issuerCertificateState;
+static LIBEMV_SESSION unsigned char issuerCertificate[MAX_RSA_MODULUS_LEN];
+
+// ICC certificate is recovered by libemv_oda_prepare, its hash needs all static data
+static LIBEMV_SESSION char iccCertificateState;
+static LIBEMV_SESSION unsigned char iccCertificate[MAX_RSA_MODULUS_LEN];
+static LIBEMV_SESSION int iccCertificateSize;
+static LIBEMV_SESSION char iccKeyState;
+static LIBEMV_SESSION char iccDataMissing;
+static LIBEMV_SESSION R_RSA_PUBLIC_KEY iccKey;
+
+// Check of CDA signature has copies of all its data, so it can run on other thread after session goes on
+#define CDA_HASH_DATA_SIZE		1024
+#define CDA_JOB_PENDING			0
+#define CDA_JOB_RUNNING			1
+#define CDA_JOB_DONE			2
+typedef struct
+{
+	volatile long state;						// CDA_JOB_..., job is run by libemv_run_async or by session
+	volatile long references;					// Session and libemv_run_async, last one frees job
+	R_RSA_PUBLIC_KEY key;
+	unsigned char sdad[MAX_RSA_MODULUS_LEN];
+	int sdadSize;
+	unsigned char unpredictableNumber[4];
+	unsigned char cid;
+	unsigned char hashData[CDA_HASH_DATA_SIZE];	// Transaction data: PDOL data, CDOL data, response without SDAD
+	int hashDataSize;
+	char valid;									// Result
+	unsigned char cryptogram[8];
+	unsigned char dynamicNumber[8];
+	int dynamicNumberSize;
+} CDA_JOB;
+
+static LIBEMV_SESSION CDA_JOB* cdaJob;
+
+// Public key with big endian modulus and exponent
+static void oda_make_key(const unsigned char* modulus, int modulusSize, const unsigned char* exponent, int exponentSize,
+						 R_RSA_PUBLIC_KEY* outKey)
+{
+	memset(outKey, 0, sizeof(R_RSA_PUBLIC_KEY));
+	outKey->bits = modulusSize * 8;
+	memcpy(outKey->modulus + MAX_RSA_MODULUS_LEN - modulusSize, modulus, modulusSize);
+	memcpy(outKey->exponent + MAX_RSA_MODULUS_LEN - exponentSize, exponent, exponentSize);
+}
+
+// Recover data signed with key, size of data must be size of modulus
+// Returns 0 if RSA failed or data isn't framed with 6A .. BC
+static int oda_recover(R_RSA_PUBLIC_KEY* key, const unsigned char* data, int size, unsigned char* outData)
+{
+	unsigned char input[MAX_RSA_MODULUS_LEN];
+	unsigned int outSize;
+
+	if (size <= ODA_HASH_SIZE + 2 || size != (int) (key->bits / 8))
+		return 0;
+	memcpy(input, data, size);
+	if (RSAPublicBlock(outData, &outSize, input, (unsigned int) size, key) != 0 || (int) outSize != size)
+		return 0;
+	return outData[0] == 0x6A && outData[size - 1] == 0xBC;
+}
+
+static void oda_hash_result(SHA1Context* context, unsigned char* outHash)
+{
+	int i;
+
+	SHA1Result(context);
+	for (i = 0; i < 5; i++)
+	{
+		outHash[i * 4] = (unsigned char) (context->Message_Digest[i] >> 24);
+		outHash[i * 4 + 1] = (unsigned char) (context->Message_Digest[i] >> 16);
+		outHash[i * 4 + 2] = (unsigned char) (context->Message_Digest[i] >> 8);
+		outHash[i * 4 + 3] = (unsigned char) context->Message_Digest[i];
+	}
+}
+
+// Certificate or signature ends with hash of data from format byte, Ex. X[1 .. N - 22] || extra data
+static void oda_hash_start(SHA1Context* context, const unsigned char* recovered, int size)
+{
+	SHA1Reset(context);
+	SHA1Input(context, recovered + 1, (unsigned) (size - ODA_HASH_SIZE - 2));
+}
+
+static int oda_hash_check(SHA1Context* context, const unsigned char* recovered, int size)
+{
+	unsigned char hash[ODA_HASH_SIZE];
+
+	oda_hash_result(context, hash);
+	return memcmp(hash, recovered + size - ODA_HASH_SIZE - 1, ODA_HASH_SIZE) == 0;
+}
+
+// Certificate isn't expired: expiration date MMYY is not before month of transaction
+static int oda_date_valid(const unsigned char* expiration)
+{
+	char strDate[7];
+	unsigned char* date;
+	int size;
+	int year, month, current;
+
+	date = libemv_get_tag(TAG_TRANSACTION_DATE, &size);
+	if (date && size == 3)
+		current = ((date[0] >> 4) * 10 + (date[0] & 0x0F)) * 100 + (date[1] >> 4) * 10 + (date[1] & 0x0F);
+	else
+	{
+		memset(strDate, '0', sizeof(strDate));
+		libemv_get_date(strDate);
+		current = ((strDate[0] - '0') * 10 + strDate[1] - '0') * 100 + (strDate[2] - '0') * 10 + strDate[3] - '0';
+	}
+	month = (expiration[0] >> 4) * 10 + (expiration[0] & 0x0F);
+	year = (expiration[1] >> 4) * 10 + (expiration[1] & 0x0F);
+
+	// Years 50..99 are 1950..1999
+	if (current < 5000)
+		current += 10000;
+	if (year < 50)
+		year += 100;
+	return year * 100 + month >= current;
+}
+
+// Issuer identifier (3 to 8 leftmost digits of PAN, padded with F) matches PAN of card
+static int oda_issuer_matches_pan(const unsigned char* issuerId)
+{
+	unsigned char* pan;
+	int panSize;
+	int i;
+
+	pan = libemv_get_tag(TAG_PAN, &panSize);
+	if (!pan || panSize < 4)
+		return 0;
+	for (i = 0; i < 8; i++)
+	{
+		unsigned char digit;
+		digit = (unsigned char) ((i & 1) ? issuerId[i >> 1] & 0x0F : issuerId[i >> 1] >> 4);
+		if (digit == 0x0F)
+			break;
+		if (digit != ((i & 1) ? pan[i >> 1] & 0x0F : pan[i >> 1] >> 4))
+			return 0;
+	}
+	return i >= 3;
+}
+
+void libemv_oda_reset(void)
+{
+	unsigned long long capabilities;
+
+	capabilities = libemv_get_bits(TAG_TERMINAL_CAPABILITIES);
+	odaActive = (libemv_get_bits(TAG_AIP) & (AIP_DDA_SUPPORTED | AIP_CDA_SUPPORTED))
+		&& (capabilities & (TERMINAL_CAP_DDA | TERMINAL_CAP_CDA));
+	staticDataSize = 0;
+	staticDataInvalid = 0;
+	issuerKeyState = ODA_KEY_NONE;
+	issuerCertificateState = ODA_KEY_NONE;
+	iccCertificateState = ODA_KEY_NONE;
+	iccCertificateSize = 0;
+	iccKeyState = ODA_KEY_NONE;
+	iccDataMissing = 0;
+	libemv_oda_cda_drop();
+}
+
+void libemv_oda_add_record(unsigned char sfi, unsigned char* record, int size)
+{
+	unsigned short tag;
+	unsigned char* value;
+	int valueSize;
+
+	if (!odaActive || staticDataInvalid)
+		return;
+
+	// SFI 1..10: value of template 70, other SFI: whole record
+	if (sfi <= 10)
+	{
+		if (!libemv_parse_tlv(record, size, &tag, &value, &valueSize) || tag != TAG_READ_RECORD_RESPONSE_TEMPLATE)
+		{
+			staticDataInvalid = 1;
+			return;
+		}
+		record = value;
+		size = valueSize;
+	}
+	if (staticDataSize + size > ODA_STATIC_DATA_SIZE)
+	{
+		if (libemv_debug_enabled)
+			libemv_printf("ODA: static data is too big\n");
+		staticDataInvalid = 1;
+		return;
+	}
+	memcpy(staticData + staticDataSize, record, size);
+	staticDataSize += size;
+}
+
+// Recover issuer public key from certificate with key of certification authority (Book 2, 6.3)
+// Returns ODA_KEY_NONE if data of card isn't read yet
+static char oda_issuer_key(const CONFIG_APP* app)
+{
+	const CONFIG_CAPK* capk;
+	R_RSA_PUBLIC_KEY authorityKey;
+	SHA1Context context;
+	unsigned char* recovered;
+	unsigned char modulus[MAX_RSA_MODULUS_LEN];
+	unsigned char* keyIndex;
+	unsigned char* certificate;
+	unsigned char* exponent;
+	unsigned char* remainder;
+	int keyIndexSize, certificateSize, exponentSize, remainderSize;
+	int issuerSize, leftSize;
+	int i;
+
+	keyIndex = libemv_get_tag(TAG_CA_PUBLIC_KEY_INDEX, &keyIndexSize);
+	certificate = libemv_get_tag(TAG_ISSUER_PK_CERTIFICATE, &certificateSize);
+	exponent = libemv_get_tag(TAG_ISSUER_PK_EXPONENT, &exponentSize);
+	if (!keyIndex || !certificate || !exponent)
+		return ODA_KEY_NONE;
+	remainder = libemv_get_tag(TAG_ISSUER_PK_REMAINDER, &remainderSize);
+	if (!remainder)
+		remainderSize = 0;
+
+	// RSA of certificate only once, while remainder isn't read only its check is repeated
+	recovered = issuerCertificate;
+	if (issuerCertificateState == ODA_KEY_NONE)
+	{
+		capk = 0;
+		for (i = 0; i < app->capksCount; i++)
+		{
+			if (LIBEMV_CONFIG_CAPKS()[app->firstCapk + i].keyIndex == keyIndex[0])
+			{
+				capk = &LIBEMV_CONFIG_CAPKS()[app->firstCapk + i];
+				break;
+			}
+		}
+		if (!capk || keyIndexSize != 1 || exponentSize < 1 || exponentSize > 3)
+		{
+			if (libemv_debug_enabled)
+				libemv_printf("ODA: no key of certification authority %02X\n", keyIndex[0]);
+			return ODA_KEY_FAILED;
+		}
+		oda_make_key(LIBEMV_CONFIG_PTR(capk->modulusOffset), capk->modulusLength,
+			LIBEMV_CONFIG_PTR(capk->exponentOffset), capk->exponentLength, &authorityKey);
+		if (!oda_recover(&authorityKey, certificate, certificateSize, recovered) || recovered[1] != 0x02
+			|| recovered[11] != 0x01 || recovered[12] != 0x01)
+			return ODA_KEY_FAILED;
+		issuerCertificateState = ODA_KEY_READY;
+	}
+
+	// Key is in certificate or leftmost part of key is in certificate, rightmost part is remainder
+	issuerSize = recovered[13];
+	leftSize = certificateSize - 36;
+	if (issuerSize == 0)
+		return ODA_KEY_FAILED;
+	if (issuerSize > leftSize)
+	{
+		// Remainder could be in next record
+		if (!remainder)
+			return ODA_KEY_NONE;
+		if (remainderSize != issuerSize - leftSize)
+			return ODA_KEY_FAILED;
+	}
+
+	oda_hash_start(&context, recovered, certificateSize);
+	if (remainder)
+		SHA1Input(&context, remainder, (unsigned) remainderSize);
+	SHA1Input(&context, exponent, (unsigned) exponentSize);
+	if (!oda_hash_check(&context, recovered, certificateSize) || !oda_issuer_matches_pan(recovered + 2)
+		|| !oda_date_valid(recovered + 6))
+		return ODA_KEY_FAILED;
+
+	memcpy(modulus, recovered + 15, issuerSize > leftSize ? leftSize : issuerSize);
+	if (issuerSize > leftSize)
+		memcpy(modulus + leftSize, remainder, remainderSize);
+	oda_make_key(modulus, issuerSize, exponent, exponentSize, &issuerKey);
+	return ODA_KEY_READY;
+}
+
+void libemv_oda_prepare(const CONFIG_APP* app)
+{
+	unsigned char* certificate;
+	int size;
+
+	if (!odaActive)
+		return;
+	if (issuerKeyState == ODA_KEY_NONE)
+	{
+		issuerKeyState = oda_issuer_key(app);
+		if (issuerKeyState == ODA_KEY_FAILED && libemv_debug_enabled)
+			libemv_printf("ODA: issuer public key isn't recovered\n");
+	}
+
+	// RSA of ICC certificate, its hash is checked with all static data by libemv_oda_icc_key
+	if (issuerKeyState == ODA_KEY_READY && iccCertificateState == ODA_KEY_NONE)
+	{
+		certificate = libemv_get_tag(TAG_ICC_PK_CERTIFICATE, &size);
+		if (!certificate)
+			return;
+		if (oda_recover(&issuerKey, certificate, size, iccCertificate) && iccCertificate[1] == 0x04
+			&& iccCertificate[17] == 0x01 && iccCertificate[18] == 0x01)
+		{
+			iccCertificateSize = size;
+			iccCertificateState = ODA_KEY_READY;
+		} else
+			iccCertificateState = ODA_KEY_FAILED;
+	}
+}
+
+int libemv_oda_icc_key(const CONFIG_APP* app)
+{
+	SHA1Context context;
+	unsigned char modulus[MAX_RSA_MODULUS_LEN];
+	unsigned char pan[10];
+	unsigned char* data;
+	unsigned char* exponent;
+	unsigned char* remainder;
+	int size, exponentSize, remainderSize;
+	int iccSize, leftSize;
+
+	if (iccKeyState != ODA_KEY_NONE)
+		return iccKeyState == ODA_KEY_READY;
+	iccKeyState = ODA_KEY_FAILED;
+
+	// Data could be in last record, Ex. remainder
+	libemv_oda_prepare(app);
+	if (!odaActive || staticDataInvalid)
+		return 0;
+	if (issuerKeyState == ODA_KEY_NONE || (issuerKeyState == ODA_KEY_READY
+		&& (iccCertificateState == ODA_KEY_NONE || !libemv_get_tag(TAG_ICC_PK_EXPONENT, &size))))
+		iccDataMissing = 1;
+	if (issuerKeyState != ODA_KEY_READY || iccCertificateState != ODA_KEY_READY || iccDataMissing)
+		return 0;
+
+	iccSize = iccCertificate[19];
+	leftSize = iccCertificateSize - 42;
+	exponent = libemv_get_tag(TAG_ICC_PK_EXPONENT, &exponentSize);
+	remainder = libemv_get_tag(TAG_ICC_PK_REMAINDER, &remainderSize);
+	if (iccSize == 0 || (iccSize > leftSize && (!remainder || remainderSize != iccSize - leftSize)))
+	{
+		iccDataMissing = !remainder;
+		return 0;
+	}
+	if (exponentSize < 1 || exponentSize > 3)
+		return 0;
+
+	// Hash of certificate with remainder, exponent, static data and tags of Static Data Authentication Tag List
+	oda_hash_start(&context, iccCertificate, iccCertificateSize);
+	if (remainder)
+		SHA1Input(&context, remainder, (unsigned) remainderSize);
+	SHA1Input(&context, exponent, (unsigned) exponentSize);
+	SHA1Input(&context, staticData, (unsigned) staticDataSize);
+	data = libemv_get_tag(TAG_SDA_TAG_LIST, &size);
+	if (data && size > 0)
+	{
+		unsigned char* aip;
+		int aipSize;
+
+		// Only AIP could be in list
+		aip = libemv_get_tag(TAG_AIP, &aipSize);
+		if (size != 1 || data[0] != TAG_AIP || !aip)
+			return 0;
+		SHA1Input(&context, aip, (unsigned) aipSize);
+	}
+	if (!oda_hash_check(&context, iccCertificate, iccCertificateSize))
+	{
+		if (libemv_debug_enabled)
+			libemv_printf("ODA: wrong hash of ICC public key certificate\n");
+		return 0;
+	}
+
+	// PAN in certificate is padded with F
+	data = libemv_get_tag(TAG_PAN, &size);
+	if (!data || size > 10)
+		return 0;
+	memset(pan, 0xFF, sizeof(pan));
+	memcpy(pan, data, size);
+	if (memcmp(pan, iccCertificate + 2, 10) != 0 || !oda_date_valid(iccCertificate + 12))
+		return 0;
+
+	memcpy(modulus, iccCertificate + 21, iccSize > leftSize ? leftSize : iccSize);
+	if (iccSize > leftSize)
+		memcpy(modulus + leftSize, remainder, remainderSize);
+	oda_make_key(modulus, iccSize, exponent, exponentSize, &iccKey);
+	iccKeyState = ODA_KEY_READY;
+	return 1;
+}
+
+int libemv_oda_icc_data_missing(void)
+{
+	return iccDataMissing;
+}
+
+int libemv_oda_verify_sdad(const unsigned char* sdad, int size, const unsigned char* ddolData, int ddolSize)
+{
+	SHA1Context context;
+	unsigned char recovered[MAX_RSA_MODULUS_LEN];
+	int dynamicSize;
+
+	if (iccKeyState != ODA_KEY_READY || !oda_recover(&iccKey, sdad, size, recovered)
+		|| recovered[1] != 0x05 || recovered[2] != 0x01)
+		return 0;
+	oda_hash_start(&context, recovered, size);
+	SHA1Input(&context, ddolData, (unsigned) ddolSize);
+	if (!oda_hash_check(&context, recovered, size))
+	{
+		if (libemv_debug_enabled)
+			libemv_printf("ODA: wrong hash of signed dynamic application data\n");
+		return 0;
+	}
+
+	// ICC Dynamic Data starts with length and ICC Dynamic Number
+	dynamicSize = recovered[3];
+	if (dynamicSize > size - 25 || dynamicSize < 3 || recovered[4] < 2 || recovered[4] > 8 || recovered[4] >= dynamicSize)
+		return 0;
+	libemv_set_tag(TAG_ICC_DYNAMIC_NUMBER, recovered + 5, recovered[4]);
+	return 1;
+}
+
+// Recover SDAD of GENERATE AC and check it with transaction data (Book 2, 6.6.2)
+static char cda_check(CDA_JOB* job)
+{
+	SHA1Context context;
+	unsigned char recovered[MAX_RSA_MODULUS_LEN];
+	unsigned char hash[ODA_HASH_SIZE];
+	unsigned char* dynamicData;
+	int dynamicSize, numberSize;
+
+	if (!oda_recover(&job->key, job->sdad, job->sdadSize, recovered) || recovered[1] != 0x05 || recovered[2] != 0x01)
+		return 0;
+	oda_hash_start(&context, recovered, job->sdadSize);
+	SHA1Input(&context, job->unpredictableNumber, 4);
+	if (!oda_hash_check(&context, recovered, job->sdadSize))
+		return 0;
+
+	// ICC Dynamic Data: length of ICC Dynamic Number, number, CID, cryptogram, Transaction Data Hash Code
+	dynamicSize = recovered[3];
+	dynamicData = recovered + 4;
+	numberSize = dynamicData[0];
+	if (dynamicSize > job->sdadSize - 25 || numberSize < 2 || numberSize > 8 || dynamicSize < numberSize + 30
+		|| dynamicData[numberSize + 1] != job->cid)
+		return 0;
+	SHA1Reset(&context);
+	SHA1Input(&context, job->hashData, (unsigned) job->hashDataSize);
+	oda_hash_result(&context, hash);
+	if (memcmp(hash, dynamicData + numberSize + 10, ODA_HASH_SIZE) != 0)
+		return 0;
+
+	memcpy(job->dynamicNumber, dynamicData + 1, numberSize);
+	job->dynamicNumberSize = numberSize;
+	memcpy(job->cryptogram, dynamicData + numberSize + 2, 8);
+	return 1;
+}
+
+static void cda_release(CDA_JOB* job)
+{
+	long references;
+
+	do
+		references = job->references;
+	while (!LIBEMV_CAS_LONG(&job->references, references, references - 1));
+	if (references == 1)
+		libemv_free(job);
+}
+
+// Run job if nobody started it
+static void cda_run(CDA_JOB* job)
+{
+	if (LIBEMV_CAS_LONG(&job->state, CDA_JOB_PENDING, CDA_JOB_RUNNING))
+	{
+		job->valid = cda_check(job);
+		LIBEMV_BARRIER();
+		job->state = CDA_JOB_DONE;
+	}
+}
+
+// Entry of libemv_run_async
+static void cda_job(void* context)
+{
+	cda_run((CDA_JOB*) context);
+	cda_release((CDA_JOB*) context);
+}
+
+int libemv_oda_cda_start(const unsigned char* sdad, int sdadSize, unsigned char cid,
+						 const unsigned char* hashData, int hashDataSize)
+{
+	CDA_JOB* job;
+	unsigned char* unpredictableNumber;
+	int size;
+
+	libemv_oda_cda_drop();
+	unpredictableNumber = libemv_get_tag(TAG_UNPREDICTABLE_NUMBER, &size);
+	if (iccKeyState != ODA_KEY_READY || !unpredictableNumber || size != 4 || sdadSize > MAX_RSA_MODULUS_LEN
+		|| hashDataSize > CDA_HASH_DATA_SIZE)
+		return 0;
+	job = (CDA_JOB*) libemv_malloc(sizeof(CDA_JOB));
+	LIBEMV_STATS_ADD(allocCount, 1);
+	if (!job)
+		return 0;
+	job->state = CDA_JOB_PENDING;
+	job->references = 2;
+	memcpy(&job->key, &iccKey, sizeof(R_RSA_PUBLIC_KEY));
+	memcpy(job->sdad, sdad, sdadSize);
+	job->sdadSize = sdadSize;
+	memcpy(job->unpredictableNumber, unpredictableNumber, 4);
+	job->cid = cid;
+	memcpy(job->hashData, hashData, hashDataSize);
+	job->hashDataSize = hashDataSize;
+	job->valid = 0;
+	cdaJob = job;
+
+	if (libemv_run_async)
+		libemv_run_async(cda_job, job);
+	else
+		cda_job(job);
+	return 1;
+}
+
+int libemv_oda_cda_finish(void)
+{
+	CDA_JOB* job;
+	char valid;
+	int spins;
+
+	job = cdaJob;
+	if (!job)
+		return -1;
+	cdaJob = 0;
+
+	// Job isn't taken by other thread yet, else wait for it (one RSA operation)
+	cda_run(job);
+	for (spins = 0; job->state != CDA_JOB_DONE; spins++)
+		LIBEMV_SPIN_WAIT(spins);
+	LIBEMV_BARRIER();
+	valid = job->valid;
+	if (valid)
+	{
+		libemv_set_tag(TAG_ICC_DYNAMIC_NUMBER, job->dynamicNumber, job->dynamicNumberSize);
+		libemv_set_tag(TAG_APPLICATION_CRYPTOGRAM, job->cryptogram, 8);
+	}
+	cda_release(job);
+	return valid;
+}
+
+void libemv_oda_cda_drop(void)
+{
+	// Job that isn't done yet is freed by libemv_run_async
+	if (cdaJob)
+		cda_release(cdaJob);
+	cdaJob = 0;
+}
@@ -5,6 +5,8 @@
 char (*libemv_ext_apdu)(unsigned char cla, unsigned char ins, unsigned char p1, unsigned char p2,
 				   unsigned char dataSize, const unsigned char* data,
 				   int* outDataSize, unsigned char* outData);
+char (*libemv_ext_transmit)(void* context, const unsigned char* cmd, int cmdSize, unsigned char* resp, int* respSize);
+LIBEMV_SESSION void* libemv_transmit_context;
 
 void* (*libemv_malloc)(size_t size);
 void* (*libemv_realloc)(void* ptr, size_t size);
@@ -15,10 +17,16 @@ void (*libemv_get_time)(char* strtime);
 
 int (*libemv_rand)(void);
 
+void (*libemv_run_async)(void (*job)(void* context), void* context);
+
+int (*libemv_verify_pin)(unsigned char method);
+
 int (*libemv_printf)(const char * format, ...);
 
 char libemv_debug_enabled;
 
+unsigned long long (*libemv_get_monotonic_time)(void);
+
 LIBEMV_API void libemv_set_debug_enabled(char enabled)
 {
 	libemv_debug_enabled = enabled;
@@ -31,6 +39,13 @@ LIBEMV_API void set_function_apdu(char (*f_apdu)(unsigned char cla, unsigned cha
 	libemv_ext_apdu = f_apdu;
 }
 
+LIBEMV_API void set_function_transmit(char (*f_transmit)(void* context, const unsigned char* cmd, int cmdSize,
+														 unsigned char* resp, int* respSize), void* context)
+{
+	libemv_ext_transmit = f_transmit;
+	libemv_transmit_context = context;
+}
+
 LIBEMV_API void set_function_malloc(void* (*f_malloc)(size_t size))
 {
 	libemv_malloc = f_malloc;
@@ -61,20 +76,32 @@ LIBEMV_API void set_function_rand(int (*f_rand)(void))
 	libemv_rand = f_rand;
 }
 
+LIBEMV_API void set_function_run_async(void (*f_run_async)(void (*job)(void* context), void* context))
+{
+	libemv_run_async = f_run_async;
+}
+
+LIBEMV_API void set_function_verify_pin(int (*f_verify_pin)(unsigned char method))
+{
+	libemv_verify_pin = f_verify_pin;
+}
+
 LIBEMV_API void set_function_debug_printf(int (*f_printf)(const char * format, ...))
 {
 	libemv_printf = f_printf;
 }
 
+LIBEMV_API void set_function_get_monotonic_time(unsigned long long (*f_time)(void))
+{
+	libemv_get_monotonic_time = f_time;
+}
+
 LIBEMV_SETTINGS libemv_settings;
 LIBEMV_GLOBAL libemv_global;
-int libemv_applications_count;
-LIBEMV_APPLICATIONS* libemv_applications;
 
 void libemv_destroy_settings(void)
 {
-	if (libemv_applications)
-		libemv_free(libemv_applications);
+	libemv_destroy_config();
 }
 
 LIBEMV_API void libemv_set_library_settings(LIBEMV_SETTINGS* settings)
@@ -85,13 +112,10 @@ LIBEMV_API void libemv_set_library_settings(LIBEMV_SETTINGS* settings)
 LIBEMV_API void libemv_set_global_settings(LIBEMV_GLOBAL* settings)
 {
 	memcpy(&libemv_global, settings, sizeof(LIBEMV_GLOBAL));
+	libemv_config_global_changed();
 }
 
 LIBEMV_API void set_applications_data(LIBEMV_APPLICATIONS* apps, int countApps)
 {
-	if (libemv_applications)
-		libemv_free(libemv_applications);
-	libemv_applications = libemv_malloc(countApps * sizeof(LIBEMV_APPLICATIONS));
-	memcpy(libemv_applications, apps, countApps * sizeof(LIBEMV_APPLICATIONS));
-	libemv_applications_count = countApps;
+	libemv_config_from_applications(apps, countApps);
 }
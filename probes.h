@@ -0,0 +1,41 @@
+#ifndef __PROBES_H
+#define __PROBES_H
+
+// Static tracepoints (USDT) of provider "libemv" for perf, bpftrace and SystemTap
+// Enabled with define LIBEMV_USDT on Linux, needs sys/sdt.h (package systemtap-sdt-dev)
+// Not attached probe is single nop in code, without LIBEMV_USDT probes are empty
+//
+// Probes and arguments:
+//   apdu_send(cla, ins, p1, p2, dataSize)
+//   apdu_receive(ins, sw1sw2, outDataSize)
+//   apdu_error(ins)
+//   phase_begin(phase)
+//   phase_end(phase, result)
+//   tlv_grow(usedSize, oldAllocated, newAllocated)
+//   rsa_public_begin(bits, inputLen), rsa_public_end(bits, status)
+//   rsa_private_begin(bits, inputLen), rsa_private_end(bits, status)
+//   sha1_begin(context), sha1_end(context, messageBits)
+//
+// Example: bpftrace -e 'usdt:./libemv.so:libemv:apdu_send { @t[tid] = nsecs; }
+//   usdt:./libemv.so:libemv:apdu_receive /@t[tid]/ { @us[arg0] = hist((nsecs - @t[tid]) / 1000); delete(@t[tid]); }'
+
+#if defined(LIBEMV_USDT) && defined(__linux__)
+
+#include <sys/sdt.h>
+
+#define LIBEMV_PROBE1(name, a1)							DTRACE_PROBE1(libemv, name, a1)
+#define LIBEMV_PROBE2(name, a1, a2)						DTRACE_PROBE2(libemv, name, a1, a2)
+#define LIBEMV_PROBE3(name, a1, a2, a3)					DTRACE_PROBE3(libemv, name, a1, a2, a3)
+#define LIBEMV_PROBE5(name, a1, a2, a3, a4, a5)			DTRACE_PROBE5(libemv, name, a1, a2, a3, a4, a5)
+
+#else
+
+// Arguments are evaluated and discarded, variables used only by probes aren't reported as unused
+#define LIBEMV_PROBE1(name, a1)							((void) (a1))
+#define LIBEMV_PROBE2(name, a1, a2)						((void) (a1), (void) (a2))
+#define LIBEMV_PROBE3(name, a1, a2, a3)					((void) (a1), (void) (a2), (void) (a3))
+#define LIBEMV_PROBE5(name, a1, a2, a3, a4, a5)			((void) (a1), (void) (a2), (void) (a3), (void) (a4), (void) (a5))
+
+#endif
+
+#endif // __PROBES_H
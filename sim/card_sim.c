@@ -0,0 +1,828 @@
+#include "card_sim.h"
+#include "../crypt/rsaeuro.h"
+#include "../crypt/rsa.h"
+#include "../crypt/sha1.h"
+#include <string.h>
+#include <time.h>
+
+// Simulated card contains one application
+static const unsigned char simAID[] = {0xA0, 0x00, 0x00, 0x00, 0x03, 0x10, 0x10};
+static const char simLabel[] = "VISA CREDIT";
+static const unsigned char simPDOL[] = {0x9F, 0x1A, 0x02, 0x9F, 0x35, 0x01, 0x9F, 0x33, 0x03};
+static const unsigned char simPAN[] = {0x47, 0x61, 0x73, 0x90, 0x01, 0x01, 0x00, 0x10};
+static const unsigned char simIAD[] = {0x06, 0x01, 0x0A, 0x03, 0xA0, 0x00, 0x00};
+static const unsigned char simCAIndex = 0x92;
+static const unsigned char simCertificateExpiration[] = {0x12, 0x49};
+
+// AIP of ODA method: cardholder verification, terminal risk management, issuer authentication
+static const unsigned char simAIP[3][2] = {{0x1C, 0x00}, {0x3C, 0x00}, {0x3D, 0x00}};
+
+#define SIM_MAX_RECORDS		32
+#define SIM_RECORDS_IN_SFI	8
+#define SIM_RECORD_SIZE		254
+#define SIM_ODA_RECORDS		2	// Records 1 and 2 are signed, static data of ICC certificate
+#define SIM_ODA_LAST_RECORD	5	// Records 4 and 5 have certificates
+#define SIM_PIN_TRIES		3
+
+// Keys of card (public exponent 3): modulus, primes p > q, CRT exponents dP, dQ and coefficient qInv,
+// primes and CRT parameters have half size of modulus
+#define SIM_CA_KEY_SIZE		128
+#define SIM_ISSUER_KEY_SIZE	112
+#define SIM_ICC_KEY_SIZE	96
+
+static const unsigned char simCAKey[448] =
+{
+	0xC1, 0x2F, 0xF6, 0xC8, 0x2A, 0x00, 0x10, 0x0E, 0x2A, 0xF0, 0x29, 0xDC, 0xC3, 0x20, 0x16, 0x32,
+	0x6B, 0xD4, 0xDA, 0x8F, 0x3C, 0xFE, 0x82, 0x3D, 0x49, 0x99, 0x6C, 0x3C, 0x12, 0x4F, 0x82, 0x57,
+	0xE5, 0xDB, 0x52, 0xD5, 0xB3, 0x87, 0x26, 0xC0, 0x1C, 0xC0, 0x59, 0xAE, 0x3B, 0xE7, 0x8C, 0x2F,
+	0xC4, 0x51, 0x2F, 0x88, 0x90, 0x9F, 0xF2, 0xA5, 0x5D, 0x56, 0x15, 0x29, 0x4F, 0x61, 0x46, 0xE1,
+	0xA1, 0x4E, 0x40, 0xE4, 0x8D, 0xA9, 0xFD, 0xBE, 0xD3, 0x06, 0xA8, 0xB4, 0x2C, 0x57, 0xCE, 0xE7,
+	0x8B, 0x5F, 0x15, 0xAE, 0x3E, 0x6D, 0xA6, 0x47, 0xF7, 0xF7, 0x69, 0xD6, 0x90, 0x1F, 0xDA, 0x7B,
+	0x70, 0xF8, 0x68, 0x0D, 0x3E, 0x42, 0xC1, 0xF5, 0x3F, 0x37, 0x15, 0x5D, 0xD5, 0xAF, 0x75, 0x31,
+	0x46, 0x77, 0xD6, 0x7D, 0x19, 0xBE, 0x3B, 0xD0, 0x18, 0x20, 0x33, 0x43, 0xAC, 0x7A, 0xFA, 0x4F,
+	0xFF, 0xAC, 0x96, 0x41, 0xCE, 0x49, 0x80, 0x84, 0x11, 0x98, 0x49, 0x32, 0x6A, 0x15, 0xE0, 0x45,
+	0xDC, 0x71, 0x02, 0x88, 0x48, 0x65, 0x5C, 0xFD, 0x61, 0xC9, 0xD0, 0xAD, 0x06, 0x78, 0x5A, 0xB5,
+	0x36, 0x97, 0xDF, 0xA2, 0x39, 0x37, 0x65, 0xD3, 0x4C, 0x6A, 0xFA, 0x3E, 0xCC, 0xCA, 0xAB, 0x7E,
+	0xF7, 0x2A, 0xBF, 0x4A, 0x21, 0xCE, 0x23, 0x59, 0xEF, 0xAC, 0x89, 0x7A, 0x77, 0x61, 0x8A, 0x25,
+	0xC1, 0x6E, 0xFD, 0xAA, 0xA4, 0x4E, 0xBB, 0x68, 0xE0, 0x50, 0xF7, 0xEA, 0x1A, 0x01, 0xD6, 0x54,
+	0xB2, 0xBA, 0x10, 0xF8, 0xB9, 0x3D, 0xA8, 0x96, 0x08, 0xFE, 0x8D, 0xC3, 0xE8, 0x24, 0x6D, 0xA4,
+	0x04, 0x80, 0x23, 0x5D, 0x69, 0xE0, 0x37, 0x95, 0x10, 0x44, 0xD9, 0x2B, 0x2A, 0xB5, 0x54, 0x98,
+	0xEB, 0x5D, 0x24, 0xF9, 0xCA, 0xAA, 0xF6, 0xE1, 0xB8, 0x4B, 0x3C, 0xE1, 0x00, 0x07, 0xF6, 0x63,
+	0xAA, 0x73, 0x0E, 0xD6, 0x89, 0x86, 0x55, 0xAD, 0x61, 0x10, 0x30, 0xCC, 0x46, 0xB9, 0x40, 0x2E,
+	0x92, 0xF6, 0x01, 0xB0, 0x30, 0x43, 0x93, 0x53, 0x96, 0x86, 0x8B, 0x1E, 0x04, 0x50, 0x3C, 0x78,
+	0xCF, 0x0F, 0xEA, 0x6C, 0x26, 0x24, 0xEE, 0x8C, 0xDD, 0x9C, 0xA6, 0xD4, 0x88, 0x87, 0x1C, 0xFF,
+	0x4F, 0x71, 0xD4, 0xDC, 0x16, 0x89, 0x6C, 0xE6, 0x9F, 0xC8, 0x5B, 0xA6, 0xFA, 0x41, 0x06, 0xC3,
+	0x80, 0xF4, 0xA9, 0x1C, 0x6D, 0x89, 0xD2, 0x45, 0xEA, 0xE0, 0xA5, 0x46, 0xBC, 0x01, 0x39, 0x8D,
+	0xCC, 0x7C, 0x0B, 0x50, 0x7B, 0x7E, 0x70, 0x64, 0x05, 0xFF, 0x09, 0x2D, 0x45, 0x6D, 0x9E, 0x6D,
+	0x58, 0x55, 0x6C, 0xE8, 0xF1, 0x40, 0x25, 0x0E, 0x0A, 0xD8, 0x90, 0xC7, 0x71, 0xCE, 0x38, 0x65,
+	0xF2, 0x3E, 0x18, 0xA6, 0x87, 0x1C, 0xA4, 0x96, 0x7A, 0xDC, 0xD3, 0x40, 0xAA, 0xAF, 0xF9, 0x97,
+	0xE3, 0x1E, 0xBA, 0x64, 0x81, 0xD5, 0x80, 0xCA, 0x12, 0xC7, 0xAB, 0xBF, 0xAF, 0x81, 0x7D, 0xEF,
+	0x75, 0x2F, 0xDC, 0x3F, 0xEC, 0xCF, 0xE2, 0xEF, 0xD1, 0x4D, 0xAF, 0xB0, 0xEF, 0x35, 0xBB, 0xA5,
+	0x59, 0x46, 0x2B, 0x3E, 0x0A, 0xA3, 0x4F, 0xA9, 0x6C, 0x20, 0x3D, 0xA5, 0x88, 0xD8, 0xEE, 0x61,
+	0xD1, 0x79, 0xE9, 0xC1, 0x09, 0x5C, 0xBE, 0x97, 0x33, 0x87, 0x4C, 0xD8, 0x1A, 0x5F, 0x82, 0x3D
+};
+
+static const unsigned char simIssuerKey[392] =
+{
+	0xDC, 0xC9, 0x9E, 0x5B, 0x25, 0xA6, 0xD4, 0x6F, 0x83, 0xF8, 0x91, 0xD9, 0x70, 0x3C, 0xAE, 0xAE,
+	0x21, 0x32, 0x01, 0xC6, 0xB8, 0x3B, 0xED, 0xAB, 0xA2, 0x59, 0xD5, 0xE7, 0xA0, 0xCD, 0x6E, 0xC2,
+	0xC8, 0x31, 0xA7, 0x97, 0xC4, 0xFE, 0xED, 0x95, 0x8C, 0x75, 0x42, 0xBC, 0x7A, 0xBF, 0xEE, 0x9B,
+	0xBD, 0xA0, 0xD6, 0xF4, 0x24, 0x8C, 0x48, 0xC6, 0x17, 0x78, 0xD8, 0x6B, 0x77, 0xD7, 0xF6, 0x14,
+	0x7B, 0x7F, 0xDC, 0xA9, 0x0F, 0x05, 0x52, 0x83, 0xB5, 0x7B, 0x5B, 0x87, 0xF3, 0xF0, 0xD6, 0x2F,
+	0x97, 0xBE, 0xD2, 0x7C, 0xBB, 0xDC, 0x88, 0xE4, 0xCF, 0x65, 0x34, 0x86, 0xED, 0x90, 0xCA, 0x74,
+	0x09, 0xB9, 0x64, 0x38, 0x1D, 0x6E, 0x25, 0x4C, 0x56, 0x57, 0xBE, 0xCD, 0x9E, 0xC0, 0x72, 0x9B,
+	0xF2, 0x79, 0x2B, 0x58, 0x02, 0xB0, 0xEF, 0x1A, 0xF2, 0xF1, 0x29, 0x91, 0x9B, 0x25, 0xE7, 0x7F,
+	0x55, 0x61, 0x08, 0x70, 0x6C, 0xE7, 0x29, 0xE5, 0xC9, 0xB7, 0xF6, 0xB4, 0xE2, 0x3C, 0x3C, 0x86,
+	0x27, 0xBF, 0xF7, 0x72, 0xAD, 0x49, 0x7E, 0x81, 0x28, 0x18, 0x3B, 0xFE, 0x6E, 0xD4, 0x86, 0xBA,
+	0x66, 0xA4, 0x56, 0xBC, 0x04, 0xF8, 0x86, 0x81, 0xE9, 0x1A, 0xBF, 0xBB, 0x20, 0x1C, 0x8E, 0x66,
+	0x2C, 0x8C, 0xBF, 0x2A, 0x94, 0xAA, 0xCF, 0x10, 0x2B, 0x70, 0xE6, 0x1F, 0x9D, 0x8B, 0xA4, 0x1C,
+	0x23, 0x4B, 0x0D, 0x20, 0x7D, 0x24, 0x06, 0x92, 0x83, 0xF3, 0x8D, 0xFF, 0x9A, 0xDD, 0xB0, 0x64,
+	0x41, 0x7B, 0x67, 0xD3, 0x29, 0x2D, 0x47, 0xC9, 0x66, 0xFC, 0x27, 0x94, 0xBB, 0x16, 0xC3, 0x1B,
+	0xA1, 0xA6, 0x1C, 0xE5, 0x57, 0x20, 0x9F, 0x67, 0x4C, 0xA0, 0xC6, 0x61, 0x12, 0x19, 0x44, 0xFF,
+	0x8E, 0x40, 0xB0, 0x4A, 0xF3, 0x44, 0xC6, 0x99, 0x31, 0x25, 0x4F, 0x23, 0x41, 0x7D, 0x7D, 0xAE,
+	0xC5, 0x2A, 0xA4, 0xF7, 0x1E, 0x30, 0xFF, 0x00, 0xC5, 0x65, 0x7D, 0x54, 0x49, 0xE3, 0x04, 0x7C,
+	0x44, 0x6D, 0x8F, 0x28, 0x03, 0x50, 0x59, 0xAB, 0x9B, 0x67, 0x2A, 0x7C, 0xC0, 0x13, 0x09, 0x99,
+	0x73, 0x08, 0x7F, 0x71, 0xB8, 0x71, 0xDF, 0x60, 0x1C, 0xF5, 0xEE, 0xBF, 0xBE, 0x5D, 0x18, 0x12,
+	0xC2, 0x32, 0x08, 0xC0, 0x53, 0x6D, 0x59, 0xB7, 0x02, 0xA2, 0x5E, 0xAA, 0x67, 0x3E, 0x75, 0x98,
+	0x2B, 0xA7, 0x9A, 0x8C, 0xC6, 0x1E, 0x2F, 0xDB, 0x99, 0xFD, 0x6F, 0xB8, 0x7C, 0xB9, 0xD7, 0x67,
+	0xE5, 0xA0, 0xC7, 0xC1, 0x84, 0xA5, 0x7B, 0x5A, 0xAF, 0x52, 0xE3, 0xA2, 0xC9, 0x50, 0x4F, 0x54,
+	0xE1, 0xAF, 0x18, 0x03, 0x71, 0x16, 0xD6, 0x5B, 0x95, 0x71, 0x63, 0x69, 0x63, 0x67, 0xBF, 0x3B,
+	0x9A, 0x44, 0xA3, 0x37, 0x84, 0xA2, 0x3C, 0x3F, 0xBC, 0x79, 0x29, 0xB4, 0xC5, 0xFE, 0x03, 0xEF,
+	0x92, 0x94, 0xE4, 0x77, 0x00, 0x64, 0x19, 0x14
+};
+
+static const unsigned char simICCKey[336] =
+{
+	0xBF, 0xD2, 0x6B, 0xB8, 0x66, 0x0B, 0x45, 0xF7, 0xB3, 0x6A, 0x22, 0x05, 0x3E, 0x60, 0xCE, 0x7F,
+	0xE0, 0x82, 0x30, 0x42, 0x3D, 0x60, 0xD1, 0x48, 0x0B, 0xCF, 0x70, 0x40, 0x63, 0x5E, 0x5C, 0xDA,
+	0x0C, 0x80, 0x38, 0x9A, 0xA0, 0xD4, 0xD3, 0x44, 0x0A, 0x43, 0x91, 0xDA, 0xEF, 0xB6, 0x27, 0x8F,
+	0x3F, 0x26, 0x60, 0x39, 0x19, 0x5A, 0xEF, 0x43, 0xDD, 0xB7, 0xB6, 0x27, 0x58, 0x7C, 0xA7, 0x33,
+	0x74, 0x29, 0x90, 0x51, 0x85, 0x5B, 0x50, 0x73, 0xEB, 0x65, 0x1C, 0xA4, 0x1D, 0xD1, 0x2C, 0x8F,
+	0x15, 0x21, 0xC1, 0xD7, 0x21, 0x1B, 0x0B, 0xD6, 0x79, 0x13, 0x7B, 0x65, 0x78, 0x91, 0x4D, 0x63,
+	0xDE, 0xDC, 0x6A, 0xAD, 0xD8, 0x1C, 0x5E, 0xF4, 0x8D, 0x58, 0xBF, 0xCF, 0x9D, 0x18, 0x67, 0xA6,
+	0x26, 0x00, 0xA7, 0xE4, 0x18, 0x00, 0xC4, 0x23, 0x86, 0x12, 0x96, 0x1C, 0x63, 0x8C, 0x71, 0x17,
+	0xD8, 0xC2, 0xA9, 0x94, 0x84, 0x49, 0xF3, 0x87, 0x78, 0x3A, 0xC0, 0x91, 0x40, 0x35, 0xE2, 0x25,
+	0xDC, 0x58, 0x73, 0x2F, 0x75, 0x5E, 0x68, 0x72, 0x13, 0x6F, 0xA0, 0x8D, 0x02, 0xD0, 0x46, 0xDB,
+	0x59, 0xA8, 0xE8, 0x95, 0xFF, 0xEA, 0x2D, 0xA3, 0x77, 0x8E, 0xEE, 0x11, 0x1B, 0xDC, 0x3D, 0xD9,
+	0x23, 0xB5, 0x74, 0x87, 0x26, 0xB2, 0x93, 0x93, 0x20, 0x9E, 0xCB, 0xFC, 0x98, 0x21, 0xE6, 0xE7,
+	0x94, 0x92, 0xF1, 0xC9, 0x3A, 0xBD, 0x94, 0xA3, 0x08, 0xE5, 0xD5, 0x35, 0x13, 0x65, 0x9A, 0x6E,
+	0xC4, 0x00, 0x6F, 0xED, 0x65, 0x55, 0xD8, 0x17, 0xAE, 0xB7, 0x0E, 0xBD, 0x97, 0xB2, 0xF6, 0x0F,
+	0xE5, 0xD7, 0x1B, 0xB8, 0x58, 0x31, 0x4D, 0x04, 0xFA, 0xD1, 0xD5, 0xB6, 0x2A, 0xCE, 0x96, 0xC3,
+	0x92, 0xE5, 0xA2, 0x1F, 0xA3, 0x94, 0x45, 0xA1, 0x62, 0x4A, 0x6B, 0x08, 0xAC, 0x8A, 0xD9, 0xE7,
+	0x91, 0x1B, 0x45, 0xB9, 0x55, 0x46, 0xC9, 0x17, 0xA5, 0x09, 0xF4, 0x0B, 0x67, 0xE8, 0x29, 0x3B,
+	0x6D, 0x23, 0xA3, 0x04, 0xC4, 0x77, 0x0D, 0x0C, 0xC0, 0x69, 0xDD, 0x53, 0x10, 0x16, 0x99, 0xEF,
+	0x75, 0xD9, 0x5C, 0x7F, 0xEF, 0x9D, 0xD3, 0x98, 0x0C, 0x7D, 0xC0, 0x7B, 0x3F, 0xEE, 0x2B, 0x19,
+	0x0B, 0x82, 0xDA, 0x64, 0xB0, 0xBE, 0xBE, 0xD5, 0x69, 0x48, 0x2D, 0xFB, 0xDB, 0xB9, 0xD0, 0xA3,
+	0xCF, 0xDD, 0x49, 0x99, 0x01, 0x4D, 0x65, 0xB0, 0x34, 0x0F, 0x67, 0x57, 0x51, 0xAB, 0x79, 0x45
+};
+static CARD_SIM_PROFILE simProfile;
+static unsigned long simApduCount;
+
+// Counters of card, kept by card_sim_reset
+static unsigned short simATC;
+static unsigned short simLastOnlineATC;
+static int simPinTries;
+
+// GENERATE AC of transaction: count, cryptogram of first one, data of CDA transaction hash
+static int simGenerateAcCount;
+static unsigned char simFirstCID;
+static unsigned char simPDOLData[256];
+static int simPDOLDataSize;
+static unsigned char simCDOL1Data[256];
+static int simCDOL1DataSize;
+
+// ICC private key for INTERNAL AUTHENTICATE and CDA
+static R_RSA_PRIVATE_KEY simICCPrivateKey;
+
+// 0 - nothing selected, 1 - PSE selected, 2 - application selected
+static int simSelected;
+
+// Response waiting for GET RESPONSE (raw transport), data and SW1 SW2
+static unsigned char simPending[258];
+static int simPendingSize;
+
+// Pre-built responses
+static unsigned char simRecords[SIM_MAX_RECORDS][SIM_RECORD_SIZE];
+static int simRecordsSize[SIM_MAX_RECORDS];
+
+// Append tag, length, value to buffer
+// Returns new size of buffer
+static int sim_tlv(unsigned char* buf, int size, unsigned short tag, const unsigned char* value, int valueSize);
+
+// Append tag with pattern filled value
+static int sim_tlv_fill(unsigned char* buf, int size, unsigned short tag, int valueSize, unsigned char seed);
+
+// Wrap buffer to template with tag
+static int sim_wrap(unsigned char* out, unsigned short tag, const unsigned char* value, int valueSize);
+
+// Build records of AFL
+static void sim_build_records(void);
+
+// RSA private key from key of card
+static void sim_private_key(const unsigned char* key, int size, R_RSA_PRIVATE_KEY* outKey);
+
+// EMV signature: block has size of key, header and data of recovered block are set by caller, hash of
+// block (without header byte, hash and trailer) and data is set in block, block is encrypted with key
+static void sim_sign(R_RSA_PRIVATE_KEY* key, unsigned char* block, const unsigned char* data, int dataSize,
+					 unsigned char* outSignature);
+
+// Issuer Public Key Certificate (tag 90), signed by CA, remainder of key is tag 92
+static void sim_issuer_certificate(unsigned char* outCertificate);
+
+// ICC Public Key Certificate (tag 9F46), signed by issuer, hash covers static data and AIP
+static void sim_icc_certificate(const unsigned char* staticData, int staticDataSize, unsigned char* outCertificate);
+
+// Signed Dynamic Application Data (tag 9F4B) with ICC Dynamic Data, hash covers terminal data
+static void sim_sdad(const unsigned char* dynamicData, int dynamicDataSize, const unsigned char* terminalData,
+					 int terminalDataSize, unsigned char* outSdad);
+
+static int sim_sw(unsigned char* outData, int size, unsigned char sw1, unsigned char sw2)
+{
+	outData[size++] = sw1;
+	outData[size++] = sw2;
+	return size;
+}
+
+static int sim_tlv(unsigned char* buf, int size, unsigned short tag, const unsigned char* value, int valueSize)
+{
+	if (tag > 0xFF)
+		buf[size++] = (tag >> 8) & 0xFF;
+	buf[size++] = tag & 0xFF;
+	if (valueSize > 0x7F)
+		buf[size++] = 0x81;
+	buf[size++] = valueSize & 0xFF;
+	memcpy(buf + size, value, valueSize);
+	return size + valueSize;
+}
+
+static int sim_tlv_fill(unsigned char* buf, int size, unsigned short tag, int valueSize, unsigned char seed)
+{
+	unsigned char value[256];
+	int i;
+	for (i = 0; i < valueSize; i++)
+		value[i] = (unsigned char) (seed + i * 7);
+	return sim_tlv(buf, size, tag, value, valueSize);
+}
+
+static int sim_wrap(unsigned char* out, unsigned short tag, const unsigned char* value, int valueSize)
+{
+	return sim_tlv(out, 0, tag, value, valueSize);
+}
+
+static void sim_private_key(const unsigned char* key, int size, R_RSA_PRIVATE_KEY* outKey)
+{
+	int half;
+	half = size / 2;
+	memset(outKey, 0, sizeof(R_RSA_PRIVATE_KEY));
+	outKey->bits = (unsigned int) size * 8;
+	memcpy(outKey->modulus + MAX_RSA_MODULUS_LEN - size, key, size);
+	outKey->publicExponent[MAX_RSA_MODULUS_LEN - 1] = 0x03;
+	key += size;
+	memcpy(outKey->prime[0] + MAX_RSA_PRIME_LEN - half, key, half);
+	memcpy(outKey->prime[1] + MAX_RSA_PRIME_LEN - half, key + half, half);
+	memcpy(outKey->primeExponent[0] + MAX_RSA_PRIME_LEN - half, key + 2 * half, half);
+	memcpy(outKey->primeExponent[1] + MAX_RSA_PRIME_LEN - half, key + 3 * half, half);
+	memcpy(outKey->coefficient + MAX_RSA_PRIME_LEN - half, key + 4 * half, half);
+}
+
+static void sim_sign(R_RSA_PRIVATE_KEY* key, unsigned char* block, const unsigned char* data, int dataSize,
+					 unsigned char* outSignature)
+{
+	SHA1Context context;
+	unsigned int size;
+	int i;
+
+	size = (key->bits + 7) / 8;
+	SHA1Reset(&context);
+	SHA1Input(&context, block + 1, size - 22);
+	SHA1Input(&context, data, (unsigned) dataSize);
+	SHA1Result(&context);
+	for (i = 0; i < 20; i++)
+		block[size - 21 + i] = (unsigned char) (context.Message_Digest[i / 4] >> (24 - 8 * (i % 4)));
+	block[size - 1] = 0xBC;
+	RSAPrivateBlock(outSignature, &size, block, size, key);
+}
+
+static void sim_issuer_certificate(unsigned char* outCertificate)
+{
+	R_RSA_PRIVATE_KEY caKey;
+	unsigned char block[SIM_CA_KEY_SIZE];
+	unsigned char data[SIM_ISSUER_KEY_SIZE];
+	int leftSize;
+	int dataSize;
+
+	sim_private_key(simCAKey, SIM_CA_KEY_SIZE, &caKey);
+	leftSize = SIM_CA_KEY_SIZE - 36;
+	block[0] = 0x6A;
+	block[1] = 0x02;
+	memcpy(block + 2, simPAN, 3);
+	block[5] = 0xFF;
+	memcpy(block + 6, simCertificateExpiration, 2);
+	memcpy(block + 8, "\x00\x00\x01", 3);
+	block[11] = 0x01;
+	block[12] = 0x01;
+	block[13] = SIM_ISSUER_KEY_SIZE;
+	block[14] = 1;
+	memcpy(block + 15, simIssuerKey, leftSize);
+
+	// Remainder and exponent
+	dataSize = SIM_ISSUER_KEY_SIZE - leftSize;
+	memcpy(data, simIssuerKey + leftSize, dataSize);
+	data[dataSize++] = 0x03;
+	sim_sign(&caKey, block, data, dataSize, outCertificate);
+}
+
+static void sim_icc_certificate(const unsigned char* staticData, int staticDataSize, unsigned char* outCertificate)
+{
+	R_RSA_PRIVATE_KEY issuerKey;
+	unsigned char block[SIM_ISSUER_KEY_SIZE];
+	unsigned char data[SIM_ICC_KEY_SIZE + 512];
+	int leftSize;
+	int dataSize;
+
+	sim_private_key(simIssuerKey, SIM_ISSUER_KEY_SIZE, &issuerKey);
+	leftSize = SIM_ISSUER_KEY_SIZE - 42;
+	block[0] = 0x6A;
+	block[1] = 0x04;
+	memset(block + 2, 0xFF, 10);
+	memcpy(block + 2, simPAN, sizeof(simPAN));
+	memcpy(block + 12, simCertificateExpiration, 2);
+	memcpy(block + 14, "\x00\x00\x01", 3);
+	block[17] = 0x01;
+	block[18] = 0x01;
+	block[19] = SIM_ICC_KEY_SIZE;
+	block[20] = 1;
+	memcpy(block + 21, simICCKey, leftSize);
+
+	// Remainder, exponent, static data and AIP (Static Data Authentication Tag List)
+	dataSize = SIM_ICC_KEY_SIZE - leftSize;
+	memcpy(data, simICCKey + leftSize, dataSize);
+	data[dataSize++] = 0x03;
+	memcpy(data + dataSize, staticData, staticDataSize);
+	dataSize += staticDataSize;
+	memcpy(data + dataSize, simAIP[(int) simProfile.odaMethod], 2);
+	dataSize += 2;
+	sim_sign(&issuerKey, block, data, dataSize, outCertificate);
+}
+
+static void sim_sdad(const unsigned char* dynamicData, int dynamicDataSize, const unsigned char* terminalData,
+					 int terminalDataSize, unsigned char* outSdad)
+{
+	unsigned char block[SIM_ICC_KEY_SIZE];
+
+	memset(block, 0xBB, sizeof(block));
+	block[0] = 0x6A;
+	block[1] = 0x05;
+	block[2] = 0x01;
+	block[3] = (unsigned char) dynamicDataSize;
+	memcpy(block + 4, dynamicData, dynamicDataSize);
+	sim_sign(&simICCPrivateKey, block, terminalData, terminalDataSize, outSdad);
+}
+
+static void sim_build_records(void)
+{
+	unsigned char staticData[512];
+	unsigned char certificate[SIM_CA_KEY_SIZE];
+	int staticDataSize;
+	int i;
+
+	staticDataSize = 0;
+	for (i = 0; i < SIM_MAX_RECORDS; i++)
+	{
+		unsigned char content[256];
+		int size;
+		size = 0;
+		switch (i)
+		{
+		case 0:
+			size = sim_tlv(content, size, 0x57, "\x47\x61\x73\x90\x01\x01\x00\x10\xD1\x51\x22\x01\x12\x34\x56\x78\x90\x12\x3F", 19);
+			size = sim_tlv(content, size, 0x5F20, "CARDHOLDER/VISA", 15);
+			size = sim_tlv_fill(content, size, 0x9F1F, 24, 0x30);
+			break;
+		case 1:
+			size = sim_tlv(content, size, 0x5A, simPAN, sizeof(simPAN));
+			size = sim_tlv(content, size, 0x5F24, "\x51\x12\x31", 3);
+			size = sim_tlv(content, size, 0x5F25, "\x09\x07\x01", 3);
+			size = sim_tlv(content, size, 0x5F28, "\x08\x40", 2);
+			size = sim_tlv(content, size, 0x5F34, "\x01", 1);
+			size = sim_tlv(content, size, 0x9F07, "\xFF\x00", 2);
+			size = sim_tlv(content, size, 0x9F0D, "\xF0\x40\x00\x88\x00", 5);
+			size = sim_tlv(content, size, 0x9F0E, "\x00\x10\x00\x00\x00", 5);
+			size = sim_tlv(content, size, 0x9F0F, "\xF0\x40\x00\x98\x00", 5);
+			size = sim_tlv(content, size, 0x8E, "\x00\x00\x00\x00\x00\x00\x00\x00\x41\x03\x42\x03\x1E\x03\x1F\x03", 16);
+			size = sim_tlv(content, size, 0x9F4A, "\x82", 1);
+			break;
+		case 2:
+			size = sim_tlv(content, size, 0x8C, "\x9F\x02\x06\x9F\x03\x06\x9F\x1A\x02\x95\x05\x5F\x2A\x02\x9A\x03\x9C\x01\x9F\x37\x04", 21);
+			size = sim_tlv(content, size, 0x8D, "\x8A\x02\x9F\x02\x06\x9F\x03\x06\x9F\x1A\x02\x95\x05\x5F\x2A\x02\x9A\x03\x9C\x01\x9F\x37\x04", 23);
+			size = sim_tlv(content, size, 0x9F08, "\x00\x8C", 2);
+			size = sim_tlv(content, size, 0x5F30, "\x02\x01", 2);
+			size = sim_tlv(content, size, 0x9F42, "\x08\x40", 2);
+			size = sim_tlv(content, size, 0x9F44, "\x02", 1);
+			size = sim_tlv(content, size, 0x9F14, "\x03", 1);
+			size = sim_tlv(content, size, 0x9F23, "\x05", 1);
+			size = sim_tlv(content, size, 0x8F, &simCAIndex, 1);
+			size = sim_tlv(content, size, 0x9F32, "\x03", 1);
+			break;
+		case 3:
+			sim_issuer_certificate(certificate);
+			size = sim_tlv(content, size, 0x90, certificate, SIM_CA_KEY_SIZE);
+			size = sim_tlv(content, size, 0x92, simIssuerKey + SIM_CA_KEY_SIZE - 36, SIM_ISSUER_KEY_SIZE - (SIM_CA_KEY_SIZE - 36));
+			break;
+		case 4:
+			sim_icc_certificate(staticData, staticDataSize, certificate);
+			size = sim_tlv(content, size, 0x9F46, certificate, SIM_ISSUER_KEY_SIZE);
+			size = sim_tlv(content, size, 0x9F47, "\x03", 1);
+			size = sim_tlv(content, size, 0x9F48, simICCKey + SIM_ISSUER_KEY_SIZE - 42, SIM_ICC_KEY_SIZE - (SIM_ISSUER_KEY_SIZE - 42));
+			size = sim_tlv(content, size, 0x9F49, "\x9F\x37\x04", 3);
+			break;
+		default:
+			// Issuer proprietary data
+			size = sim_tlv_fill(content, size, (unsigned short) (0xDF00 + i), 96, (unsigned char) i);
+			size = sim_tlv_fill(content, size, (unsigned short) (0xDF40 + i), 64, (unsigned char) (i * 3));
+			break;
+		}
+		simRecordsSize[i] = sim_wrap(simRecords[i], 0x70, content, size);
+		if (i < SIM_ODA_RECORDS)
+		{
+			memcpy(staticData + staticDataSize, content, size);
+			staticDataSize += size;
+		}
+	}
+}
+
+void card_sim_init(const CARD_SIM_PROFILE* profile)
+{
+	memcpy(&simProfile, profile, sizeof(CARD_SIM_PROFILE));
+	if (simProfile.aflRecords < 1)
+		simProfile.aflRecords = 1;
+	if (simProfile.aflRecords > SIM_MAX_RECORDS)
+		simProfile.aflRecords = SIM_MAX_RECORDS;
+	if (simProfile.gpoFormat != 2)
+		simProfile.gpoFormat = 1;
+	if (simProfile.odaMethod != CARD_SIM_ODA_DDA && simProfile.odaMethod != CARD_SIM_ODA_CDA)
+		simProfile.odaMethod = CARD_SIM_ODA_NONE;
+	if (simProfile.odaMethod != CARD_SIM_ODA_NONE && simProfile.aflRecords < SIM_ODA_LAST_RECORD)
+		simProfile.aflRecords = SIM_ODA_LAST_RECORD;
+	sim_private_key(simICCKey, SIM_ICC_KEY_SIZE, &simICCPrivateKey);
+	sim_build_records();
+	simApduCount = 0;
+	simATC = 0;
+	simLastOnlineATC = 0;
+	simPinTries = SIM_PIN_TRIES;
+	card_sim_reset();
+}
+
+void card_sim_reset(void)
+{
+	simSelected = 0;
+	simPendingSize = 0;
+	simGenerateAcCount = 0;
+}
+
+int card_sim_ca_key(unsigned char* outIndex, unsigned char* outModulus)
+{
+	*outIndex = simCAIndex;
+	memcpy(outModulus, simCAKey, SIM_CA_KEY_SIZE);
+	return SIM_CA_KEY_SIZE;
+}
+
+unsigned long card_sim_apdu_count(void)
+{
+	return simApduCount;
+}
+
+static void sim_delay(void)
+{
+	struct timespec ts;
+	if (simProfile.apduDelayMicroseconds <= 0)
+		return;
+	ts.tv_sec = simProfile.apduDelayMicroseconds / 1000000;
+	ts.tv_nsec = (simProfile.apduDelayMicroseconds % 1000000) * 1000L;
+	nanosleep(&ts, 0);
+}
+
+// SELECT command
+static int sim_select(unsigned char p1, unsigned char p2, unsigned char dataSize, const unsigned char* data, unsigned char* outData)
+{
+	unsigned char a5[128];
+	unsigned char fci[160];
+	int a5Size;
+	int fciSize;
+	unsigned char entry[64];
+	unsigned char directory[80];
+	int entrySize;
+	int directorySize;
+
+	if (p1 != 0x04)
+		return sim_sw(outData, 0, 0x6A, 0x86);
+
+	// Next occurrence is never found, card has one application
+	if ((p2 & 0x03) == 0x02)
+		return sim_sw(outData, 0, 0x6A, 0x82);
+
+	if (dataSize == 14 && memcmp(data, "1PAY.SYS.DDF01", 14) == 0)
+	{
+		if (!simProfile.hasPSE)
+			return sim_sw(outData, 0, 0x6A, 0x82);
+		a5Size = sim_tlv(a5, 0, 0x88, "\x01", 1);
+		a5Size = sim_tlv(a5, a5Size, 0x5F2D, "en", 2);
+		fciSize = sim_tlv(fci, 0, 0x84, "1PAY.SYS.DDF01", 14);
+		fciSize = sim_tlv(fci, fciSize, 0xA5, a5, a5Size);
+		simSelected = 1;
+		return sim_sw(outData, sim_wrap(outData, 0x6F, fci, fciSize), 0x90, 0x00);
+	}
+
+	// Directory in FCI: BF0C with one entry 61
+	if (dataSize == 14 && memcmp(data, "2PAY.SYS.DDF02", 14) == 0)
+	{
+		if (!simProfile.hasPPSE)
+			return sim_sw(outData, 0, 0x6A, 0x82);
+		entrySize = sim_tlv(entry, 0, 0x4F, simAID, sizeof(simAID));
+		entrySize = sim_tlv(entry, entrySize, 0x50, simLabel, sizeof(simLabel) - 1);
+		entrySize = sim_tlv(entry, entrySize, 0x87, "\x01", 1);
+		directorySize = sim_tlv(directory, 0, 0x61, entry, entrySize);
+		a5Size = sim_tlv(a5, 0, 0xBF0C, directory, directorySize);
+		fciSize = sim_tlv(fci, 0, 0x84, "2PAY.SYS.DDF02", 14);
+		fciSize = sim_tlv(fci, fciSize, 0xA5, a5, a5Size);
+		simSelected = 0;
+		return sim_sw(outData, sim_wrap(outData, 0x6F, fci, fciSize), 0x90, 0x00);
+	}
+
+	// Exact or partial AID
+	if (dataSize >= 5 && dataSize <= sizeof(simAID) && memcmp(data, simAID, dataSize) == 0)
+	{
+		a5Size = sim_tlv(a5, 0, 0x50, simLabel, sizeof(simLabel) - 1);
+		a5Size = sim_tlv(a5, a5Size, 0x87, "\x01", 1);
+		a5Size = sim_tlv(a5, a5Size, 0x9F38, simPDOL, sizeof(simPDOL));
+		a5Size = sim_tlv(a5, a5Size, 0x5F2D, "en", 2);
+		a5Size = sim_tlv(a5, a5Size, 0x9F11, "\x01", 1);
+		a5Size = sim_tlv(a5, a5Size, 0x9F12, "VISA", 4);
+		fciSize = sim_tlv(fci, 0, 0x84, simAID, sizeof(simAID));
+		fciSize = sim_tlv(fci, fciSize, 0xA5, a5, a5Size);
+		simSelected = 2;
+		return sim_sw(outData, sim_wrap(outData, 0x6F, fci, fciSize), 0x90, 0x00);
+	}
+
+	return sim_sw(outData, 0, 0x6A, 0x82);
+}
+
+// READ RECORD command
+static int sim_read_record(unsigned char p1, unsigned char p2, unsigned char* outData)
+{
+	int sfi;
+	int index;
+	sfi = p2 >> 3;
+
+	if ((p2 & 0x07) != 0x04)
+		return sim_sw(outData, 0, 0x6A, 0x86);
+
+	// PSE directory, one record
+	if (simSelected == 1)
+	{
+		unsigned char entry[64];
+		unsigned char tmpl[80];
+		int entrySize;
+		int tmplSize;
+		if (sfi != 1 || p1 != 1)
+			return sim_sw(outData, 0, 0x6A, 0x83);
+		entrySize = sim_tlv(entry, 0, 0x4F, simAID, sizeof(simAID));
+		entrySize = sim_tlv(entry, entrySize, 0x50, simLabel, sizeof(simLabel) - 1);
+		entrySize = sim_tlv(entry, entrySize, 0x87, "\x01", 1);
+		tmplSize = sim_tlv(tmpl, 0, 0x61, entry, entrySize);
+		return sim_sw(outData, sim_wrap(outData, 0x70, tmpl, tmplSize), 0x90, 0x00);
+	}
+
+	if (simSelected != 2)
+		return sim_sw(outData, 0, 0x69, 0x85);
+
+	// Records of application: SFI 1.., up to SIM_RECORDS_IN_SFI records in each
+	index = (sfi - 1) * SIM_RECORDS_IN_SFI + (p1 - 1);
+	if (sfi < 1 || p1 < 1 || p1 > SIM_RECORDS_IN_SFI || index >= simProfile.aflRecords)
+		return sim_sw(outData, 0, 0x6A, 0x83);
+	memcpy(outData, simRecords[index], simRecordsSize[index]);
+	return sim_sw(outData, simRecordsSize[index], 0x90, 0x00);
+}
+
+// GET PROCESSING OPTIONS command, new transaction: ATC is incremented
+static int sim_gpo(unsigned char dataSize, const unsigned char* data, unsigned char* outData)
+{
+	unsigned char afl[4 * ((SIM_MAX_RECORDS + SIM_RECORDS_IN_SFI - 1) / SIM_RECORDS_IN_SFI)];
+	unsigned char body[128];
+	int aflSize;
+	int bodySize;
+	int left;
+	int sfi;
+
+	if (simSelected != 2)
+		return sim_sw(outData, 0, 0x69, 0x85);
+	if (dataSize < 2 || data[0] != 0x83 || data[1] != dataSize - 2)
+		return sim_sw(outData, 0, 0x67, 0x00);
+	memcpy(simPDOLData, data + 2, dataSize - 2);
+	simPDOLDataSize = dataSize - 2;
+	simGenerateAcCount = 0;
+	simATC++;
+
+	aflSize = 0;
+	left = simProfile.aflRecords;
+	for (sfi = 1; left > 0; sfi++)
+	{
+		int count;
+		count = left > SIM_RECORDS_IN_SFI ? SIM_RECORDS_IN_SFI : left;
+		afl[aflSize++] = (unsigned char) (sfi << 3);
+		afl[aflSize++] = 1;
+		afl[aflSize++] = (unsigned char) count;
+		afl[aflSize++] = sfi == 1 && simProfile.odaMethod != CARD_SIM_ODA_NONE ? SIM_ODA_RECORDS : 0;
+		left -= count;
+	}
+
+	if (simProfile.gpoFormat == 1)
+	{
+		memcpy(body, simAIP[(int) simProfile.odaMethod], 2);
+		memcpy(body + 2, afl, aflSize);
+		return sim_sw(outData, sim_wrap(outData, 0x80, body, 2 + aflSize), 0x90, 0x00);
+	}
+
+	bodySize = sim_tlv(body, 0, 0x82, simAIP[(int) simProfile.odaMethod], 2);
+	bodySize = sim_tlv(body, bodySize, 0x94, afl, aflSize);
+	return sim_sw(outData, sim_wrap(outData, 0x77, body, bodySize), 0x90, 0x00);
+}
+
+// ICC Dynamic Data starts with ICC Dynamic Number (length and 8 bytes), number changes with ATC
+// Returns size of data
+static int sim_dynamic_number(unsigned char* outData)
+{
+	outData[0] = 8;
+	outData[1] = (unsigned char) (simATC >> 8);
+	outData[2] = (unsigned char) simATC;
+	memcpy(outData + 3, "\x5A\xC3\x96\x0F\x1E\x2D", 6);
+	return 9;
+}
+
+// INTERNAL AUTHENTICATE command, response format 1 with SDAD of DDOL data
+static int sim_internal_authenticate(unsigned char dataSize, const unsigned char* data, unsigned char* outData)
+{
+	unsigned char dynamicData[16];
+	unsigned char sdad[SIM_ICC_KEY_SIZE];
+
+	if (simSelected != 2 || simProfile.odaMethod == CARD_SIM_ODA_NONE)
+		return sim_sw(outData, 0, 0x69, 0x85);
+	sim_sdad(dynamicData, sim_dynamic_number(dynamicData), data, dataSize, sdad);
+	return sim_sw(outData, sim_wrap(outData, 0x80, sdad, sizeof(sdad)), 0x90, 0x00);
+}
+
+// GENERATE AC command: card returns cryptogram requested by terminal, second GENERATE AC only
+// after ARQC. Cryptogram is hash of ATC and CDOL data. With CDA signature (P1 bit 5) response has
+// SDAD instead of cryptogram, transaction data hash covers PDOL data, CDOL1 data, CDOL2 data of
+// second GENERATE AC and TLVs of response
+static int sim_generate_ac(unsigned char p1, unsigned char dataSize, const unsigned char* data, unsigned char* outData)
+{
+	SHA1Context context;
+	unsigned char hash[20];
+	unsigned char atc[2];
+	unsigned char cid;
+	unsigned char body[256];
+	int bodySize;
+	unsigned char dynamicData[64];
+	int dynamicDataSize;
+	unsigned char sdad[SIM_ICC_KEY_SIZE];
+	int i;
+
+	if (simSelected != 2 || simGenerateAcCount > 1 || (simGenerateAcCount == 1 && simFirstCID != 0x80))
+		return sim_sw(outData, 0, 0x69, 0x85);
+	cid = (unsigned char) (p1 & 0xC0);
+	if (cid == 0xC0 || (simGenerateAcCount == 1 && cid == 0x80))
+		return sim_sw(outData, 0, 0x6A, 0x86);
+
+	// Unpredictable Number is last in CDOL1 and CDOL2
+	if (dataSize < 4)
+		return sim_sw(outData, 0, 0x67, 0x00);
+	if (simGenerateAcCount++ == 0)
+	{
+		simFirstCID = cid;
+		memcpy(simCDOL1Data, data, dataSize);
+		simCDOL1DataSize = dataSize;
+	} else if (cid == 0x40)
+		simLastOnlineATC = simATC;
+
+	atc[0] = (unsigned char) (simATC >> 8);
+	atc[1] = (unsigned char) simATC;
+	SHA1Reset(&context);
+	SHA1Input(&context, atc, 2);
+	SHA1Input(&context, data, dataSize);
+	SHA1Result(&context);
+	for (i = 0; i < 20; i++)
+		hash[i] = (unsigned char) (context.Message_Digest[i / 4] >> (24 - 8 * (i % 4)));
+
+	// Format 1: CID, ATC, cryptogram, Issuer Application Data
+	if (simProfile.gpoFormat == 1 && !((p1 & 0x10) && simProfile.odaMethod == CARD_SIM_ODA_CDA))
+	{
+		body[0] = cid;
+		memcpy(body + 1, atc, 2);
+		memcpy(body + 3, hash, 8);
+		memcpy(body + 11, simIAD, sizeof(simIAD));
+		return sim_sw(outData, sim_wrap(outData, 0x80, body, 11 + sizeof(simIAD)), 0x90, 0x00);
+	}
+
+	bodySize = sim_tlv(body, 0, 0x9F27, &cid, 1);
+	bodySize = sim_tlv(body, bodySize, 0x9F36, atc, 2);
+	if (!(p1 & 0x10) || simProfile.odaMethod != CARD_SIM_ODA_CDA || cid == 0x00)
+	{
+		bodySize = sim_tlv(body, bodySize, 0x9F26, hash, 8);
+		bodySize = sim_tlv(body, bodySize, 0x9F10, simIAD, sizeof(simIAD));
+		return sim_sw(outData, sim_wrap(outData, 0x77, body, bodySize), 0x90, 0x00);
+	}
+
+	// CDA: ICC Dynamic Number, CID, cryptogram, transaction data hash
+	bodySize = sim_tlv(body, bodySize, 0x9F10, simIAD, sizeof(simIAD));
+	dynamicDataSize = sim_dynamic_number(dynamicData);
+	dynamicData[dynamicDataSize++] = cid;
+	memcpy(dynamicData + dynamicDataSize, hash, 8);
+	dynamicDataSize += 8;
+	SHA1Reset(&context);
+	SHA1Input(&context, simPDOLData, (unsigned) simPDOLDataSize);
+	if (simGenerateAcCount == 2)
+		SHA1Input(&context, simCDOL1Data, (unsigned) simCDOL1DataSize);
+	SHA1Input(&context, data, dataSize);
+	SHA1Input(&context, body, (unsigned) bodySize);
+	SHA1Result(&context);
+	for (i = 0; i < 20; i++)
+		dynamicData[dynamicDataSize++] = (unsigned char) (context.Message_Digest[i / 4] >> (24 - 8 * (i % 4)));
+	sim_sdad(dynamicData, dynamicDataSize, data + dataSize - 4, 4, sdad);
+	bodySize = sim_tlv(body, bodySize, 0x9F4B, sdad, sizeof(sdad));
+	return sim_sw(outData, sim_wrap(outData, 0x77, body, bodySize), 0x90, 0x00);
+}
+
+// EXTERNAL AUTHENTICATE command, only after ARQC, Issuer Authentication Data isn't checked
+static int sim_external_authenticate(unsigned char dataSize, unsigned char* outData)
+{
+	if (simSelected != 2 || simGenerateAcCount != 1 || simFirstCID != 0x80)
+		return sim_sw(outData, 0, 0x69, 0x85);
+	if (dataSize < 8 || dataSize > 16)
+		return sim_sw(outData, 0, 0x67, 0x00);
+	return sim_sw(outData, 0, 0x90, 0x00);
+}
+
+// VERIFY command, only plaintext PIN
+static int sim_verify(unsigned char p2, unsigned char dataSize, const unsigned char* data, unsigned char* outData)
+{
+	if (simSelected != 2)
+		return sim_sw(outData, 0, 0x69, 0x85);
+	if (p2 != 0x80)
+		return sim_sw(outData, 0, 0x6A, 0x86);
+	if (simPinTries == 0)
+		return sim_sw(outData, 0, 0x69, 0x83);
+	if (dataSize != 8 || memcmp(data, CARD_SIM_PIN_BLOCK, 8) != 0)
+	{
+		simPinTries--;
+		return sim_sw(outData, 0, 0x63, (unsigned char) (0xC0 | simPinTries));
+	}
+	simPinTries = SIM_PIN_TRIES;
+	return sim_sw(outData, 0, 0x90, 0x00);
+}
+
+// GET DATA command: ATC, Last Online ATC Register, PIN Try Counter
+static int sim_get_data(unsigned char p1, unsigned char p2, unsigned char* outData)
+{
+	unsigned char value[2];
+	unsigned short tag;
+
+	tag = (unsigned short) ((p1 << 8) | p2);
+	if (tag == 0x9F36 || tag == 0x9F13)
+	{
+		value[0] = (unsigned char) ((tag == 0x9F36 ? simATC : simLastOnlineATC) >> 8);
+		value[1] = (unsigned char) (tag == 0x9F36 ? simATC : simLastOnlineATC);
+		return sim_sw(outData, sim_tlv(outData, 0, tag, value, 2), 0x90, 0x00);
+	}
+	if (tag == 0x9F17)
+	{
+		value[0] = (unsigned char) simPinTries;
+		return sim_sw(outData, sim_tlv(outData, 0, tag, value, 1), 0x90, 0x00);
+	}
+	return sim_sw(outData, 0, 0x6A, 0x88);
+}
+
+char card_sim_apdu(unsigned char cla, unsigned char ins, unsigned char p1, unsigned char p2,
+				   unsigned char dataSize, const unsigned char* data,
+				   int* outDataSize, unsigned char* outData)
+{
+	simApduCount++;
+	sim_delay();
+
+	if (cla == 0x00 && ins == 0xA4)
+		*outDataSize = sim_select(p1, p2, dataSize, data, outData);
+	else if (cla == 0x00 && ins == 0xB2)
+		*outDataSize = sim_read_record(p1, p2, outData);
+	else if (cla == 0x80 && ins == 0xA8)
+		*outDataSize = sim_gpo(dataSize, data, outData);
+	else if (cla == 0x00 && ins == 0x88)
+		*outDataSize = sim_internal_authenticate(dataSize, data, outData);
+	else if (cla == 0x80 && ins == 0xAE)
+		*outDataSize = sim_generate_ac(p1, dataSize, data, outData);
+	else if (cla == 0x00 && ins == 0x82)
+		*outDataSize = sim_external_authenticate(dataSize, outData);
+	else if (cla == 0x00 && ins == 0x20)
+		*outDataSize = sim_verify(p2, dataSize, data, outData);
+	else if (cla == 0x80 && ins == 0xCA)
+		*outDataSize = sim_get_data(p1, p2, outData);
+	else
+		*outDataSize = sim_sw(outData, 0, 0x6D, 0x00);
+	return 1;
+}
+
+char card_sim_transmit(void* context, const unsigned char* cmd, int cmdSize, unsigned char* resp, int* respSize)
+{
+	unsigned char out[258];
+	int outSize;
+	int le;
+
+	(void) context;
+	if (cmdSize < 5 || (cmdSize > 5 && cmdSize != 5 + cmd[4]))
+	{
+		*respSize = sim_sw(resp, 0, 0x67, 0x00);
+		return 1;
+	}
+
+	// GET RESPONSE
+	if (cmd[0] == 0x00 && cmd[1] == 0xC0)
+	{
+		simApduCount++;
+		sim_delay();
+		le = cmd[4] == 0 ? 256 : cmd[4];
+		if (simPendingSize == 0)
+			*respSize = sim_sw(resp, 0, 0x6F, 0x00);
+		else if (le != simPendingSize - 2)
+			*respSize = sim_sw(resp, 0, 0x6C, (unsigned char) (simPendingSize - 2));
+		else
+		{
+			memcpy(resp, simPending, simPendingSize);
+			*respSize = simPendingSize;
+			simPendingSize = 0;
+		}
+		return 1;
+	}
+
+	simPendingSize = 0;
+	card_sim_apdu(cmd[0], cmd[1], cmd[2], cmd[3], cmdSize > 5 ? cmd[4] : 0, cmd + 5, &outSize, out);
+
+	// Command with data, response is available by GET RESPONSE
+	if (cmdSize > 5 && outSize > 2)
+	{
+		memcpy(simPending, out, outSize);
+		simPendingSize = outSize;
+		*respSize = sim_sw(resp, 0, 0x61, (unsigned char) (outSize - 2));
+		return 1;
+	}
+
+	// Command without data, P3 must be exact length of response
+	le = cmd[4] == 0 ? 256 : cmd[4];
+	if (cmdSize == 5 && outSize > 2 && le != outSize - 2)
+	{
+		*respSize = sim_sw(resp, 0, 0x6C, (unsigned char) (outSize - 2));
+		return 1;
+	}
+
+	memcpy(resp, out, outSize);
+	*respSize = outSize;
+	return 1;
+}
@@ -0,0 +1,62 @@
+#ifndef __CARD_SIM_H
+#define __CARD_SIM_H
+
+// Simulated EMV card, answers APDUs in memory
+// Used by benchmarks and host tools instead of a real reader
+// Card has real keys of offline data authentication (CA, issuer and ICC, exponent 3), records are signed
+// when profile has ODA. Application Cryptogram isn't MAC of issuer keys and issuer authentication data
+// isn't checked, terminal sees only format of responses
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// Offline data authentication of simulated card, AIP and signed records
+#define CARD_SIM_ODA_NONE	0	// AIP without DDA and CDA
+#define CARD_SIM_ODA_DDA	1	// INTERNAL AUTHENTICATE
+#define CARD_SIM_ODA_CDA	2	// DDA and signature of GENERATE AC
+
+// Plaintext PIN block of VERIFY accepted by simulated card (PIN 1234), card has 3 tries
+#define CARD_SIM_PIN_BLOCK "\x24\x12\x34\xFF\xFF\xFF\xFF\xFF"
+
+// Profile of simulated card
+typedef struct
+{
+	char hasPSE;				// 1 - card has PSE directory "1PAY.SYS.DDF01", 0 - only list of AIDs works
+	char hasPPSE;				// 1 - card has contactless directory "2PAY.SYS.DDF02"
+	char gpoFormat;				// Response format of GET PROCESSING OPTIONS and GENERATE AC: 1 (tag 80) or 2 (tag 77)
+	int aflRecords;				// Count of records in AFL, from 1 to 32
+	int apduDelayMicroseconds;	// Simulated card/reader latency for every APDU, 0 - no delay
+	char odaMethod;				// CARD_SIM_ODA_..., certificates are in records 4 and 5, so AFL has at least 5 records
+} CARD_SIM_PROFILE;
+
+// Set profile and reset card state
+void card_sim_init(const CARD_SIM_PROFILE* profile);
+
+// Reset card state (power cycle), profile, counters (ATC, PIN tries) are kept
+void card_sim_reset(void);
+
+// Public key of certification authority of simulated card for CA keys of terminal, exponent is 3
+// outIndex: CA Public Key Index (tag 8F of card), outModulus: at least 128 bytes
+// Returns size of modulus in bytes
+int card_sim_ca_key(unsigned char* outIndex, unsigned char* outModulus);
+
+// APDU function, compatible with set_function_apdu()
+char card_sim_apdu(unsigned char cla, unsigned char ins, unsigned char p1, unsigned char p2,
+				   unsigned char dataSize, const unsigned char* data,
+				   int* outDataSize, unsigned char* outData);
+
+// Raw transport, compatible with set_function_transmit(), card answers like T=0 card:
+// 61xx on command with data (response is read by GET RESPONSE), 6Cxx on wrong Le
+// context isn't used
+char card_sim_transmit(void* context, const unsigned char* cmd, int cmdSize, unsigned char* resp, int* respSize);
+
+// Count of APDUs processed since card_sim_init()
+unsigned long card_sim_apdu_count(void);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif // __CARD_SIM_H
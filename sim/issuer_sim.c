@@ -0,0 +1,947 @@
+// Local issuer host for load tests of terminals: verifies ARQC and answers with ARPC and issuer scripts
+// ICC Master Key is derived from Issuer Master Key (option A), session key is Common Session Key of ATC,
+// ARQC is retail MAC of values of arqcTags (minimum data of EMV Book 2), ARPC is method 1
+//
+// Messages are 2 bytes length (big endian) and data, on Unix socket or on pipe (stdin/stdout)
+// Event loop reads requests of all connections, workers verify ARQC, response is sent by event loop
+// at its deadline (-l, -j), so latency of host doesn't hold worker or connection. Client sends next
+// request after response, responses of requests sent together can come in other order
+// Request: TLV of card data: 5A, 5F34 (optional), 9F26 and tags of arqcTags
+// Response: 8A Authorisation Response Code, 91 Issuer Authentication Data (ARPC || ARC), issuer script
+// ARC: "00" approved, "05" declined (injected or wrong ARQC), "30" format error (no 91)
+//
+// Build (Linux, from repository root):
+// gcc -O2 -o issuer_sim sim/issuer_sim.c *.c crypt/*.c -lpthread
+//
+// Usage: issuer_sim [-u socket] [-p] [-t threads] [-k key] [-l ms] [-j ms] [-r percent] [-s script] [-c connections] [-n requests]
+//   -u path of Unix socket, default /tmp/issuer_sim.sock
+//   -p serve one stream on stdin/stdout instead of socket
+//   -t worker threads that verify ARQC, default 8. Throughput is limited by CPU of workers, not by
+//      latency, up to MAX_CONNECTIONS connections and MAX_JOBS requests waiting for response
+//   -k Issuer Master Key, 32 hex digits
+//   -l latency of every response, default 0 ms
+//   -j random latency added to -l, up to ms, default 0
+//   -r percent of requests with valid ARQC that are declined, default 0
+//   -s issuer script (template 71 or 72) in hex, added to every approved response
+//   -c load generator: connections to socket of -u, sends requests with valid ARQC of random
+//      cards of one range and checks ARPC, prints requests per second and latency
+//   -n requests of load generator, default 100000
+
+#include "../include/libemv.h"
+#include "../internal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_WORKERS			256
+#define MAX_CONNECTIONS		1024
+#define MAX_JOBS			8192		// Requests in queue of workers or waiting for deadline
+#define MAX_FIELDS			32
+#define MAX_MESSAGE			1024
+#define MAX_SCRIPT			256
+
+// Data of ARQC in order
+static const unsigned short arqcTags[] =
+{
+	0x9F02,		// Amount, Authorised
+	0x9F03,		// Amount, Other
+	0x9F1A,		// Terminal Country Code
+	0x95,		// Terminal Verification Results
+	0x5F2A,		// Transaction Currency Code
+	0x9A,		// Transaction Date
+	0x9C,		// Transaction Type
+	0x9F37,		// Unpredictable Number
+	0x82,		// Application Interchange Profile
+	0x9F36,		// Application Transaction Counter
+	0x9F10		// Issuer Application Data
+};
+
+#define ARQC_TAGS_COUNT		((int) (sizeof(arqcTags) / sizeof(arqcTags[0])))
+
+typedef struct
+{
+	unsigned short tag;
+	unsigned char* value;
+	int size;
+} FIELD;
+
+static unsigned char issuerMasterKey[16] =
+{
+	0x01, 0x23, 0x45, 0x67, 0x89, 0xAB, 0xCD, 0xEF, 0xFE, 0xDC, 0xBA, 0x98, 0x76, 0x54, 0x32, 0x10
+};
+static int latencyMs;
+static int jitterMs;
+static int declinePercent;
+static unsigned char script[MAX_SCRIPT];
+static int scriptSize;
+
+// Connection, only event loop uses it
+typedef struct
+{
+	int in;							// -1 - free slot
+	int out;
+	unsigned int generation;		// Changed when slot is closed, responses of old connection are dropped
+	char inputClosed;				// Slot is closed when last response is sent
+	int pending;					// Requests without response
+	int size;						// Bytes of incomplete messages in buf
+	unsigned char buf[2 + MAX_MESSAGE];
+} CONNECTION;
+
+// Request, then its response
+typedef struct
+{
+	int connection;
+	unsigned int generation;
+	unsigned long long deadlineUs;	// Time of request, then time of response
+	int size;
+	unsigned char data[MAX_MESSAGE];
+} JOB;
+
+static CONNECTION connections[MAX_CONNECTIONS];
+static JOB jobs[MAX_JOBS];
+
+// Only event loop takes and frees jobs
+static int freeJobs[MAX_JOBS];
+static int freeJobsCount;
+
+// Requests waiting for worker
+static int queue[MAX_JOBS];
+static int queueHead;
+static int queueCount;
+static pthread_mutex_t queueMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueCond = PTHREAD_COND_INITIALIZER;
+
+// Responses waiting for deadline, heap by deadlineUs
+static int delayed[MAX_JOBS];
+static int delayedCount;
+static pthread_mutex_t delayedMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Worker wakes event loop by byte in pipe
+static int wakeFds[2];
+
+static volatile sig_atomic_t stopRequested;
+
+// Counters of server, updated atomically by workers
+static unsigned long requestsCount;
+static unsigned long approvedCount;
+static unsigned long declinedCount;
+static unsigned long wrongArqcCount;
+static unsigned long formatErrorCount;
+
+static unsigned long long now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000ULL + (unsigned long long) ts.tv_nsec / 1000ULL;
+}
+
+static void on_signal(int sig)
+{
+	(void) sig;
+	stopRequested = 1;
+}
+
+// Returns count of bytes, -1 if wrong hex
+static int parse_hex(const char* str, unsigned char* out, int maxSize)
+{
+	int size;
+
+	for (size = 0; str[0] && str[1]; str += 2, size++)
+	{
+		unsigned int value;
+		if (size >= maxSize || sscanf(str, "%2x", &value) != 1)
+			return -1;
+		out[size] = (unsigned char) value;
+	}
+	return str[0] ? -1 : size;
+}
+
+static int read_full(int fd, unsigned char* buf, int size)
+{
+	int done, n;
+	for (done = 0; done < size; done += n)
+	{
+		n = (int) read(fd, buf + done, size - done);
+		if (n <= 0)
+			return 0;
+	}
+	return 1;
+}
+
+static int write_full(int fd, const unsigned char* buf, int size)
+{
+	int done, n;
+	for (done = 0; done < size; done += n)
+	{
+		n = (int) write(fd, buf + done, size - done);
+		if (n <= 0)
+			return 0;
+	}
+	return 1;
+}
+
+// Returns size of message, -1 if connection is closed or message is too long
+static int read_message(int fd, unsigned char* buf)
+{
+	unsigned char header[2];
+	int size;
+
+	if (!read_full(fd, header, 2))
+		return -1;
+	size = (header[0] << 8) | header[1];
+	if (size > MAX_MESSAGE || !read_full(fd, buf, size))
+		return -1;
+	return size;
+}
+
+static int write_message(int fd, const unsigned char* data, int size)
+{
+	unsigned char buf[2 + MAX_MESSAGE];
+	buf[0] = (unsigned char) (size >> 8);
+	buf[1] = (unsigned char) size;
+	memcpy(buf + 2, data, size);
+	return write_full(fd, buf, 2 + size);
+}
+
+// Returns count of fields, -1 if TLV is wrong
+static int parse_fields(unsigned char* data, int size, FIELD* fields)
+{
+	int count, shift;
+
+	for (count = 0; size > 0; count++)
+	{
+		if (count >= MAX_FIELDS)
+			return -1;
+		shift = libemv_parse_tlv(data, size, &fields[count].tag, &fields[count].value, &fields[count].size);
+		if (shift <= 0)
+			return -1;
+		data += shift;
+		size -= shift;
+	}
+	return count;
+}
+
+static FIELD* find_field(FIELD* fields, int count, unsigned short tag)
+{
+	int i;
+	for (i = 0; i < count; i++)
+	{
+		if (fields[i].tag == tag)
+			return &fields[i];
+	}
+	return 0;
+}
+
+// Data of ARQC from fields, returns size, 0 if tag is missing
+static int arqc_data(FIELD* fields, int count, unsigned char* outData)
+{
+	FIELD* field;
+	int size, i;
+
+	size = 0;
+	for (i = 0; i < ARQC_TAGS_COUNT; i++)
+	{
+		field = find_field(fields, count, arqcTags[i]);
+		if (!field)
+			return 0;
+		memcpy(outData + size, field->value, field->size);
+		size += field->size;
+	}
+	return size;
+}
+
+// Session key of card, returns 0 if data is wrong
+static int session_key(const FIELD* pan, const FIELD* panSequence, const FIELD* atc, unsigned char* outKey)
+{
+	unsigned char masterKey[16];
+
+	if (atc->size != 2)
+		return 0;
+	if (libemv_derive_icc_master_key(issuerMasterKey, pan->value, pan->size,
+		panSequence && panSequence->size == 1 ? panSequence->value[0] : 0, masterKey) != LIBEMV_OK)
+		return 0;
+	return libemv_derive_session_key(masterKey, LIBEMV_SESSION_KEY_COMMON, atc->value, 0, outKey) == LIBEMV_OK;
+}
+
+// Returns size of response
+static int process_request(unsigned char* request, int requestSize, unsigned char* response, unsigned int* seed)
+{
+	FIELD fields[MAX_FIELDS];
+	FIELD* pan;
+	FIELD* arqc;
+	unsigned char data[MAX_MESSAGE];
+	unsigned char sessionKey[16];
+	unsigned char mac[8];
+	unsigned char authData[10];
+	unsigned char arc[2];
+	int count, dataSize, size;
+
+	__sync_fetch_and_add(&requestsCount, 1);
+	count = parse_fields(request, requestSize, fields);
+	pan = count > 0 ? find_field(fields, count, 0x5A) : 0;
+	arqc = count > 0 ? find_field(fields, count, 0x9F26) : 0;
+	dataSize = count > 0 ? arqc_data(fields, count, data) : 0;
+	if (!pan || !arqc || arqc->size != 8 || dataSize == 0
+		|| !session_key(pan, find_field(fields, count, 0x5F34), find_field(fields, count, 0x9F36), sessionKey))
+	{
+		__sync_fetch_and_add(&formatErrorCount, 1);
+		return libemv_make_tlv((unsigned char*) "30", 2, 0x8A, response);
+	}
+
+	libemv_retail_mac(sessionKey, data, dataSize, mac);
+	if (memcmp(mac, arqc->value, 8) != 0)
+	{
+		__sync_fetch_and_add(&wrongArqcCount, 1);
+		memcpy(arc, "05", 2);
+	} else if (declinePercent > 0 && (int) (rand_r(seed) % 100) < declinePercent)
+	{
+		__sync_fetch_and_add(&declinedCount, 1);
+		memcpy(arc, "05", 2);
+	} else
+	{
+		__sync_fetch_and_add(&approvedCount, 1);
+		memcpy(arc, "00", 2);
+	}
+
+	// ARPC is over ARQC of card even if it is wrong, card checks response of issuer
+	libemv_generate_arpc(sessionKey, arqc->value, arc, authData);
+	memcpy(authData + 8, arc, 2);
+	size = libemv_make_tlv(arc, 2, 0x8A, response);
+	size += libemv_make_tlv(authData, sizeof(authData), 0x91, response + size);
+	if (arc[0] == '0' && arc[1] == '0')
+	{
+		memcpy(response + size, script, scriptSize);
+		size += scriptSize;
+	}
+	memset(sessionKey, 0, sizeof(sessionKey));
+	return size;
+}
+
+// Queue complete requests of buffer of connection while jobs are free
+// Returns 0 if message is too long
+static int connection_requests(int index)
+{
+	CONNECTION* connection;
+	JOB* job;
+	int size;
+
+	connection = &connections[index];
+	while (connection->size >= 2 && freeJobsCount > 0)
+	{
+		size = (connection->buf[0] << 8) | connection->buf[1];
+		if (size > MAX_MESSAGE)
+			return 0;
+		if (connection->size < 2 + size)
+			break;
+		job = &jobs[freeJobs[freeJobsCount - 1]];
+		job->connection = index;
+		job->generation = connection->generation;
+		job->deadlineUs = now_us();
+		job->size = size;
+		memcpy(job->data, connection->buf + 2, size);
+		connection->size -= 2 + size;
+		memmove(connection->buf, connection->buf + 2 + size, connection->size);
+		connection->pending++;
+
+		pthread_mutex_lock(&queueMutex);
+		queue[(queueHead + queueCount) % MAX_JOBS] = freeJobs[--freeJobsCount];
+		queueCount++;
+		pthread_cond_signal(&queueCond);
+		pthread_mutex_unlock(&queueMutex);
+	}
+	return 1;
+}
+
+// Read available bytes of connection, end of input closes connection after last response
+// Returns 0 if connection is broken
+static int connection_read(int index)
+{
+	CONNECTION* connection;
+	int n;
+
+	connection = &connections[index];
+	n = (int) read(connection->in, connection->buf + connection->size, sizeof(connection->buf) - connection->size);
+	if (n < 0)
+		return errno == EINTR || errno == EAGAIN;
+	if (n == 0)
+	{
+		connection->inputClosed = 1;
+		return 1;
+	}
+	connection->size += n;
+	return connection_requests(index);
+}
+
+// Returns slot of connection, -1 if all slots are used
+static int connection_open(int in, int out)
+{
+	int i;
+
+	for (i = 0; i < MAX_CONNECTIONS; i++)
+	{
+		if (connections[i].in < 0)
+		{
+			connections[i].in = in;
+			connections[i].out = out;
+			connections[i].inputClosed = 0;
+			connections[i].pending = 0;
+			connections[i].size = 0;
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void connection_close(int index)
+{
+	CONNECTION* connection;
+
+	connection = &connections[index];
+	if (connection->in < 0)
+		return;
+	close(connection->in);
+	if (connection->out != connection->in)
+		close(connection->out);
+	connection->in = -1;
+	connection->out = -1;
+	connection->generation++;
+}
+
+// Binary heap of responses by deadline, called under delayedMutex
+static void delayed_push(int index)
+{
+	int i, parent;
+
+	for (i = delayedCount++; i > 0; i = parent)
+	{
+		parent = (i - 1) / 2;
+		if (jobs[delayed[parent]].deadlineUs <= jobs[index].deadlineUs)
+			break;
+		delayed[i] = delayed[parent];
+	}
+	delayed[i] = index;
+}
+
+// Returns job of first response if its deadline is passed, else -1
+static int delayed_pop(unsigned long long now)
+{
+	int index, last, i, child;
+
+	if (delayedCount == 0 || jobs[delayed[0]].deadlineUs > now)
+		return -1;
+	index = delayed[0];
+	last = delayed[--delayedCount];
+	for (i = 0; (child = 2 * i + 1) < delayedCount; i = child)
+	{
+		if (child + 1 < delayedCount && jobs[delayed[child + 1]].deadlineUs < jobs[delayed[child]].deadlineUs)
+			child++;
+		if (jobs[last].deadlineUs <= jobs[delayed[child]].deadlineUs)
+			break;
+		delayed[i] = delayed[child];
+	}
+	delayed[i] = last;
+	return index;
+}
+
+// Worker verifies ARQC, response waits for its deadline in event loop, so latency doesn't hold worker
+static void* worker(void* arg)
+{
+	unsigned char response[MAX_MESSAGE];
+	unsigned int seed;
+	JOB* job;
+	int index;
+	char wake;
+
+	seed = (unsigned int) (size_t) arg ^ (unsigned int) time(0);
+	wake = 0;
+	while (1)
+	{
+		pthread_mutex_lock(&queueMutex);
+		while (queueCount == 0 && !stopRequested)
+			pthread_cond_wait(&queueCond, &queueMutex);
+		if (queueCount == 0)
+		{
+			pthread_mutex_unlock(&queueMutex);
+			break;
+		}
+		index = queue[queueHead];
+		queueHead = (queueHead + 1) % MAX_JOBS;
+		queueCount--;
+		pthread_mutex_unlock(&queueMutex);
+
+		job = &jobs[index];
+		job->size = process_request(job->data, job->size, response, &seed);
+		memcpy(job->data, response, job->size);
+		if (latencyMs > 0 || jitterMs > 0)
+			job->deadlineUs += (unsigned long long) (latencyMs + (jitterMs > 0 ? (int) (rand_r(&seed) % (jitterMs + 1)) : 0)) * 1000ULL;
+		pthread_mutex_lock(&delayedMutex);
+		delayed_push(index);
+		pthread_mutex_unlock(&delayedMutex);
+
+		// Full pipe already wakes event loop
+		while (write(wakeFds[1], &wake, 1) < 0 && errno == EINTR)
+			;
+	}
+	return 0;
+}
+
+// Send responses with passed deadline, job is freed
+static void send_responses(void)
+{
+	CONNECTION* connection;
+	JOB* job;
+	unsigned long long now;
+	int index;
+
+	now = now_us();
+	while (1)
+	{
+		pthread_mutex_lock(&delayedMutex);
+		index = delayed_pop(now);
+		pthread_mutex_unlock(&delayedMutex);
+		if (index < 0)
+			break;
+
+		// Response of closed connection is dropped
+		job = &jobs[index];
+		connection = &connections[job->connection];
+		if (connection->in >= 0 && connection->generation == job->generation)
+		{
+			connection->pending--;
+			if (!write_message(connection->out, job->data, job->size))
+				connection_close(job->connection);
+		}
+		freeJobs[freeJobsCount++] = index;
+	}
+}
+
+// Milliseconds to deadline of first response, up to 1000
+static int delayed_timeout(void)
+{
+	unsigned long long now, deadline;
+	int timeout;
+
+	timeout = 1000;
+	pthread_mutex_lock(&delayedMutex);
+	if (delayedCount > 0)
+	{
+		now = now_us();
+		deadline = jobs[delayed[0]].deadlineUs;
+		if (deadline <= now)
+			timeout = 0;
+		else if (deadline - now < 1000000ULL)
+			timeout = (int) ((deadline - now + 999) / 1000);
+	}
+	pthread_mutex_unlock(&delayedMutex);
+	return timeout;
+}
+
+static void accept_connection(int listenFd)
+{
+	int fd;
+
+	fd = accept(listenFd, 0, 0);
+	if (fd < 0)
+		return;
+
+	// Client that doesn't read responses is closed, it doesn't block event loop
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	if (connection_open(fd, fd) < 0)
+		close(fd);
+}
+
+// Event loop: accepts connections, reads requests for workers and sends responses at their deadline
+// Without listenFd only connection is pipe of slot 0, loop ends when it is closed
+static void event_loop(int listenFd)
+{
+	struct pollfd fds[2 + MAX_CONNECTIONS];
+	int slots[2 + MAX_CONNECTIONS];
+	unsigned char drain[256];
+	unsigned long long reportUs, now;
+	unsigned long reported;
+	int count, first, rv, i;
+
+	reported = 0;
+	reportUs = now_us();
+	while (!stopRequested)
+	{
+		// Complete requests wait in buffer while all jobs are used
+		for (i = 0; i < MAX_CONNECTIONS; i++)
+		{
+			if (connections[i].in < 0)
+				continue;
+			if (!connection_requests(i) || (connections[i].inputClosed && connections[i].pending == 0))
+				connection_close(i);
+		}
+		if (listenFd < 0 && connections[0].in < 0)
+			break;
+
+		count = 0;
+		fds[count].fd = wakeFds[0];
+		fds[count++].events = POLLIN;
+		if (listenFd >= 0)
+		{
+			fds[count].fd = listenFd;
+			fds[count++].events = POLLIN;
+		}
+		first = count;
+		for (i = 0; i < MAX_CONNECTIONS; i++)
+		{
+			if (connections[i].in >= 0 && !connections[i].inputClosed && freeJobsCount > 0
+				&& connections[i].size < (int) sizeof(connections[i].buf))
+			{
+				fds[count].fd = connections[i].in;
+				fds[count].events = POLLIN;
+				slots[count++] = i;
+			}
+		}
+
+		rv = poll(fds, count, delayed_timeout());
+		if (rv < 0 && errno != EINTR)
+			break;
+		if (rv > 0)
+		{
+			if (fds[0].revents)
+			{
+				while (read(wakeFds[0], drain, sizeof(drain)) > 0)
+					;
+			}
+			for (i = first; i < count; i++)
+			{
+				if (fds[i].revents && !connection_read(slots[i]))
+					connection_close(slots[i]);
+			}
+			if (listenFd >= 0 && fds[1].revents)
+				accept_connection(listenFd);
+		}
+		send_responses();
+
+		// Rate every second
+		now = now_us();
+		if (now - reportUs >= 1000000ULL && requestsCount != reported)
+		{
+			fprintf(stderr, "%.0f requests/s\n", (double) (requestsCount - reported) * 1e6 / (double) (now - reportUs));
+			reported = requestsCount;
+			reportUs = now;
+		} else if (requestsCount == reported)
+			reportUs = now;
+	}
+}
+
+static int open_socket(const char* path, char listening)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+	strcpy(addr.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (listening)
+	{
+		unlink(path);
+		if (bind(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0 && listen(fd, 128) == 0)
+			return fd;
+	} else if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == 0)
+		return fd;
+	close(fd);
+	return -1;
+}
+
+static void print_counters(const char* prefix, unsigned long requests)
+{
+	fprintf(stderr, "%s%lu requests, %lu approved, %lu declined, %lu wrong ARQC, %lu format errors\n", prefix, requests,
+		approvedCount, declinedCount, wrongArqcCount, formatErrorCount);
+}
+
+// Server on Unix socket or on stdin/stdout (pipeMode)
+static int run_server(const char* path, int workersCount, char pipeMode)
+{
+	pthread_t workers[MAX_WORKERS];
+	int listenFd, i;
+
+	for (i = 0; i < MAX_CONNECTIONS; i++)
+	{
+		connections[i].in = -1;
+		connections[i].out = -1;
+	}
+	for (i = 0; i < MAX_JOBS; i++)
+		freeJobs[i] = MAX_JOBS - 1 - i;
+	freeJobsCount = MAX_JOBS;
+	if (pipe(wakeFds) != 0)
+		return 1;
+	fcntl(wakeFds[0], F_SETFL, fcntl(wakeFds[0], F_GETFL) | O_NONBLOCK);
+	fcntl(wakeFds[1], F_SETFL, fcntl(wakeFds[1], F_GETFL) | O_NONBLOCK);
+
+	listenFd = -1;
+	if (pipeMode)
+		connection_open(0, 1);
+	else
+	{
+		listenFd = open_socket(path, 1);
+		if (listenFd < 0)
+		{
+			fprintf(stderr, "Unable listen on %s\n", path);
+			return 1;
+		}
+	}
+	for (i = 0; i < workersCount; i++)
+		pthread_create(&workers[i], NULL, worker, (void*) (size_t) i);
+	if (!pipeMode)
+		fprintf(stderr, "Listening on %s, %d workers\n", path, workersCount);
+
+	event_loop(listenFd);
+
+	pthread_mutex_lock(&queueMutex);
+	stopRequested = 1;
+	pthread_cond_broadcast(&queueCond);
+	pthread_mutex_unlock(&queueMutex);
+	for (i = 0; i < workersCount; i++)
+		pthread_join(workers[i], NULL);
+	for (i = 0; i < MAX_CONNECTIONS; i++)
+		connection_close(i);
+	close(wakeFds[0]);
+	close(wakeFds[1]);
+	if (listenFd >= 0)
+	{
+		close(listenFd);
+		unlink(path);
+	}
+	print_counters("", requestsCount);
+	return 0;
+}
+
+// Load generator
+typedef struct
+{
+	pthread_t thread;
+	const char* path;
+	int requests;
+	unsigned int seed;
+	unsigned int* latencies;	// us, one per request
+	int done;
+	int failed;					// No response or wrong ARPC
+} CLIENT;
+
+// Request of random card of range 4761739001 with valid ARQC, returns size
+static int make_request(unsigned int* seed, unsigned char* outRequest, unsigned char* outSessionKey, unsigned char* outArqc)
+{
+	unsigned char pan[8] = {0x47, 0x61, 0x73, 0x90, 0x01, 0x00, 0x00, 0x00};
+	unsigned char masterKey[16];
+	unsigned char values[ARQC_TAGS_COUNT][16];
+	int sizes[ARQC_TAGS_COUNT] = {6, 6, 2, 5, 2, 3, 1, 4, 2, 2, 7};
+	unsigned char data[128];
+	unsigned char panSequence;
+	int size, dataSize, i, j;
+
+	for (i = 5; i < 8; i++)
+		pan[i] = (unsigned char) (((rand_r(seed) % 10) << 4) | (rand_r(seed) % 10));
+	panSequence = 0x01;
+	for (i = 0; i < ARQC_TAGS_COUNT; i++)
+	{
+		for (j = 0; j < sizes[i]; j++)
+			values[i][j] = (unsigned char) rand_r(seed);
+	}
+	libemv_derive_icc_master_key(issuerMasterKey, pan, sizeof(pan), panSequence, masterKey);
+	libemv_derive_session_key(masterKey, LIBEMV_SESSION_KEY_COMMON, values[9], 0, outSessionKey);
+
+	dataSize = 0;
+	for (i = 0; i < ARQC_TAGS_COUNT; i++)
+	{
+		memcpy(data + dataSize, values[i], sizes[i]);
+		dataSize += sizes[i];
+	}
+	libemv_retail_mac(outSessionKey, data, dataSize, outArqc);
+
+	size = libemv_make_tlv(pan, sizeof(pan), 0x5A, outRequest);
+	size += libemv_make_tlv(&panSequence, 1, 0x5F34, outRequest + size);
+	size += libemv_make_tlv(outArqc, 8, 0x9F26, outRequest + size);
+	for (i = 0; i < ARQC_TAGS_COUNT; i++)
+		size += libemv_make_tlv(values[i], sizes[i], arqcTags[i], outRequest + size);
+	return size;
+}
+
+// ARPC of response is checked against ARC of response
+static int check_response(unsigned char* response, int size, const unsigned char* sessionKey, const unsigned char* arqc)
+{
+	FIELD fields[MAX_FIELDS];
+	FIELD* arc;
+	FIELD* authData;
+	unsigned char arpc[8];
+	int count;
+
+	count = parse_fields(response, size, fields);
+	if (count <= 0)
+		return 0;
+	arc = find_field(fields, count, 0x8A);
+	authData = find_field(fields, count, 0x91);
+	if (!arc || arc->size != 2 || !authData || authData->size != 10)
+		return 0;
+	libemv_generate_arpc(sessionKey, arqc, arc->value, arpc);
+	return memcmp(arpc, authData->value, 8) == 0;
+}
+
+static void* client(void* arg)
+{
+	CLIENT* state;
+	unsigned char request[MAX_MESSAGE];
+	unsigned char response[MAX_MESSAGE];
+	unsigned char sessionKey[16];
+	unsigned char arqc[8];
+	unsigned long long start;
+	int fd, requestSize, responseSize;
+
+	state = (CLIENT*) arg;
+	fd = open_socket(state->path, 0);
+	if (fd < 0)
+	{
+		state->failed = state->requests;
+		return 0;
+	}
+	for (state->done = 0; state->done < state->requests && !stopRequested; state->done++)
+	{
+		requestSize = make_request(&state->seed, request, sessionKey, arqc);
+		start = now_us();
+		if (!write_message(fd, request, requestSize))
+			break;
+		responseSize = read_message(fd, response);
+		if (responseSize < 0)
+			break;
+		state->latencies[state->done] = (unsigned int) (now_us() - start);
+		if (!check_response(response, responseSize, sessionKey, arqc))
+			state->failed++;
+	}
+	state->failed += state->requests - state->done;
+	close(fd);
+	return 0;
+}
+
+static int compare_latency(const void* a, const void* b)
+{
+	unsigned int x = *(const unsigned int*) a;
+	unsigned int y = *(const unsigned int*) b;
+	return x < y ? -1 : x > y;
+}
+
+static int run_clients(const char* path, int connections, int requests)
+{
+	CLIENT* clients;
+	unsigned int* latencies;
+	unsigned long long start, elapsed;
+	int total, failed, i;
+
+	if (connections > requests)
+		connections = requests;
+	clients = (CLIENT*) calloc(connections, sizeof(CLIENT));
+	latencies = (unsigned int*) calloc(requests, sizeof(unsigned int));
+	if (!clients || !latencies)
+		return 1;
+
+	start = now_us();
+	for (i = 0; i < connections; i++)
+	{
+		clients[i].path = path;
+		clients[i].requests = requests / connections + (i < requests % connections ? 1 : 0);
+		clients[i].seed = (unsigned int) i * 2654435761U + 1;
+		clients[i].latencies = latencies + (requests / connections) * i + (i < requests % connections ? i : requests % connections);
+		pthread_create(&clients[i].thread, NULL, client, &clients[i]);
+	}
+	total = 0;
+	failed = 0;
+	for (i = 0; i < connections; i++)
+	{
+		pthread_join(clients[i].thread, NULL);
+		memmove(latencies + total, clients[i].latencies, clients[i].done * sizeof(unsigned int));
+		total += clients[i].done;
+		failed += clients[i].failed;
+	}
+	elapsed = now_us() - start;
+
+	qsort(latencies, total, sizeof(unsigned int), compare_latency);
+	printf("%d requests, %d failed, %.0f requests/s", total, failed, elapsed ? (double) total * 1e6 / (double) elapsed : 0.0);
+	if (total > 0)
+		printf(", latency p50 %u us, p99 %u us, max %u us", latencies[total / 2], latencies[(int) (total * 0.99)], latencies[total - 1]);
+	printf("\n");
+	free(clients);
+	free(latencies);
+	return failed != 0;
+}
+
+int main(int argc, char** argv)
+{
+	const char* path;
+	char pipeMode;
+	int workersCount, connections, requests;
+	int i;
+
+	path = "/tmp/issuer_sim.sock";
+	pipeMode = 0;
+	workersCount = 8;
+	connections = 0;
+	requests = 100000;
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-p") == 0)
+			pipeMode = 1;
+		else if (i + 1 >= argc)
+			break;
+		else if (strcmp(argv[i], "-u") == 0)
+			path = argv[++i];
+		else if (strcmp(argv[i], "-t") == 0)
+			workersCount = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-k") == 0)
+		{
+			if (parse_hex(argv[++i], issuerMasterKey, sizeof(issuerMasterKey)) != 16)
+			{
+				fprintf(stderr, "Issuer Master Key must be 32 hex digits\n");
+				return 1;
+			}
+		} else if (strcmp(argv[i], "-l") == 0)
+			latencyMs = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-j") == 0)
+			jitterMs = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-r") == 0)
+			declinePercent = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-s") == 0)
+		{
+			scriptSize = parse_hex(argv[++i], script, sizeof(script));
+			if (scriptSize < 0)
+			{
+				fprintf(stderr, "Wrong issuer script\n");
+				return 1;
+			}
+		} else if (strcmp(argv[i], "-c") == 0)
+			connections = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-n") == 0)
+			requests = atoi(argv[++i]);
+	}
+	if (workersCount < 1)
+		workersCount = 1;
+	if (workersCount > MAX_WORKERS)
+		workersCount = MAX_WORKERS;
+
+	libemv_init();
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (connections > 0)
+		i = requests > 0 ? run_clients(path, connections, requests) : 1;
+	else
+		i = run_server(path, workersCount, pipeMode);
+	libemv_destroy();
+	return i;
+}
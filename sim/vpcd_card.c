@@ -0,0 +1,248 @@
+// Simulated card for virtual reader vpcd (vsmartcard project)
+// pcscd with vpcd driver listens for virtual cards on TCP port 35963 (slot 0),
+// 35964 (slot 1) and so on. Card is inserted while connection is open.
+// Every message is 2 bytes length (big endian) and data, 1 byte messages are
+// control: 0 power off, 1 power on, 2 reset, 4 get ATR. Other messages are APDUs.
+//
+// Build (Linux, from repository root):
+// gcc -O2 -o vpcd_card sim/vpcd_card.c sim/card_sim.c crypt/*.c
+//
+// Usage: vpcd_card [-h host] [-p port] [-n insertions] [-i inserted ms] [-g removed ms] [-a] [-d apdu delay us] [-o oda]
+//   -n count of card insertions, 0 - card is never removed, default 0
+//   -i time of card in reader, default 2000 ms
+//   -g time without card between insertions, default 500 ms
+//   -a card without PSE, only list of AIDs works
+//   -o offline data authentication of card: 0 none, 1 DDA (default), 2 CDA
+
+#include "card_sim.h"
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define VPCD_CTRL_OFF	0
+#define VPCD_CTRL_ON	1
+#define VPCD_CTRL_RESET	2
+#define VPCD_CTRL_ATR	4
+
+// T=0, no historical bytes, accepted by libemv_is_emv_ATR
+static const unsigned char cardATR[] = {0x3B, 0x60, 0x00, 0x00};
+
+static unsigned long long now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000ULL + (unsigned long long) ts.tv_nsec / 1000000ULL;
+}
+
+static void sleep_ms(int ms)
+{
+	struct timespec ts;
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (long) (ms % 1000) * 1000000L;
+	nanosleep(&ts, 0);
+}
+
+static int connect_vpcd(const char* host, const char* port)
+{
+	struct addrinfo hints, *addrs, *addr;
+	int sock;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &addrs) != 0)
+		return -1;
+
+	sock = -1;
+	for (addr = addrs; addr; addr = addr->ai_next)
+	{
+		sock = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+		if (sock < 0)
+			continue;
+		if (connect(sock, addr->ai_addr, addr->ai_addrlen) == 0)
+			break;
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(addrs);
+	return sock;
+}
+
+static int read_full(int sock, unsigned char* buf, int size)
+{
+	int done, n;
+	for (done = 0; done < size; done += n)
+	{
+		n = (int) recv(sock, buf + done, size - done, 0);
+		if (n <= 0)
+			return 0;
+	}
+	return 1;
+}
+
+static int send_message(int sock, const unsigned char* data, int size)
+{
+	unsigned char buf[2 + 258];
+	buf[0] = (unsigned char) (size >> 8);
+	buf[1] = (unsigned char) size;
+	memcpy(buf + 2, data, size);
+	return send(sock, buf, 2 + size, 0) == 2 + size;
+}
+
+// Command APDU: CLA INS P1 P2 [P3 [data]]
+static int process_apdu(const unsigned char* cmd, int cmdSize, unsigned char* resp)
+{
+	int respSize;
+	unsigned char dataSize;
+
+	if (cmdSize < 4)
+	{
+		resp[0] = 0x67;
+		resp[1] = 0x00;
+		return 2;
+	}
+
+	dataSize = 0;
+	if (cmdSize > 5)
+		dataSize = cmd[4];
+	if (cmdSize > 5 && 5 + dataSize > cmdSize)
+	{
+		resp[0] = 0x67;
+		resp[1] = 0x00;
+		return 2;
+	}
+
+	respSize = 0;
+	if (!card_sim_apdu(cmd[0], cmd[1], cmd[2], cmd[3], dataSize, cmd + 5, &respSize, resp))
+		return 0;
+	return respSize;
+}
+
+// Serve connection until vpcd closes it or insertion time is over
+// Returns 0 if connection failed
+static int serve(int sock, int insertedMs, unsigned long* apdus)
+{
+	unsigned long long endMs;
+	unsigned char header[2];
+	unsigned char msg[0x10000];
+	unsigned char resp[258];
+	int size, respSize;
+
+	endMs = insertedMs > 0 ? now_ms() + insertedMs : 0;
+	while (1)
+	{
+		struct pollfd pfd;
+		int timeout;
+
+		timeout = -1;
+		if (endMs)
+		{
+			unsigned long long now = now_ms();
+			if (now >= endMs)
+				return 1;
+			timeout = (int) (endMs - now);
+		}
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, timeout) <= 0)
+			continue;
+
+		if (!read_full(sock, header, 2))
+			return 0;
+		size = (header[0] << 8) | header[1];
+		if (!read_full(sock, msg, size))
+			return 0;
+
+		if (size == 1)
+		{
+			switch (msg[0])
+			{
+			case VPCD_CTRL_ON:
+			case VPCD_CTRL_RESET:
+				card_sim_reset();
+				break;
+			case VPCD_CTRL_ATR:
+				if (!send_message(sock, cardATR, sizeof(cardATR)))
+					return 0;
+				break;
+			}
+			continue;
+		}
+
+		respSize = process_apdu(msg, size, resp);
+		(*apdus)++;
+		if (!send_message(sock, resp, respSize))
+			return 0;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	CARD_SIM_PROFILE profile;
+	const char* host;
+	const char* port;
+	int insertions, insertedMs, removedMs;
+	unsigned long apdus;
+	int i;
+
+	memset(&profile, 0, sizeof(profile));
+	profile.hasPSE = 1;
+	profile.gpoFormat = 2;
+	profile.aflRecords = 5;
+	profile.odaMethod = CARD_SIM_ODA_DDA;
+	host = "localhost";
+	port = "35963";
+	insertions = 0;
+	insertedMs = 2000;
+	removedMs = 500;
+	for (i = 1; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-a") == 0)
+			profile.hasPSE = 0;
+		else if (i + 1 >= argc)
+			break;
+		else if (strcmp(argv[i], "-h") == 0)
+			host = argv[++i];
+		else if (strcmp(argv[i], "-p") == 0)
+			port = argv[++i];
+		else if (strcmp(argv[i], "-n") == 0)
+			insertions = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-i") == 0)
+			insertedMs = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-g") == 0)
+			removedMs = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-d") == 0)
+			profile.apduDelayMicroseconds = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-o") == 0)
+			profile.odaMethod = (char) atoi(argv[++i]);
+	}
+	card_sim_init(&profile);
+
+	apdus = 0;
+	for (i = 0; insertions == 0 || i < insertions; i++)
+	{
+		int sock;
+
+		sock = connect_vpcd(host, port);
+		if (sock < 0)
+		{
+			fprintf(stderr, "Unable connect to vpcd %s:%s\n", host, port);
+			return 1;
+		}
+		card_sim_reset();
+		if (!serve(sock, insertions == 0 ? 0 : insertedMs, &apdus) && insertions == 0)
+		{
+			close(sock);
+			break;
+		}
+		close(sock);
+		printf("Card removed, %lu APDUs\n", apdus);
+		sleep_ms(removedMs);
+	}
+	return 0;
+}
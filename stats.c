@@ -0,0 +1,61 @@
+#include "include/libemv.h"
+#include "internal.h"
+#include <string.h>
+
+char libemv_stats_enabled;
+LIBEMV_SESSION LIBEMV_STATS libemv_stats;
+void (*libemv_phase_callback)(int phase, char isEnd, unsigned long long timestamp);
+
+void libemv_init_stats(void)
+{
+	libemv_stats_enabled = 0;
+	libemv_phase_callback = 0;
+	memset(&libemv_stats, 0, sizeof(libemv_stats));
+}
+
+LIBEMV_API void libemv_set_stats_enabled(char enabled)
+{
+	libemv_stats_enabled = enabled;
+}
+
+LIBEMV_API LIBEMV_STATS* libemv_get_stats(void)
+{
+	return &libemv_stats;
+}
+
+LIBEMV_API void libemv_reset_stats(void)
+{
+	memset(&libemv_stats, 0, sizeof(libemv_stats));
+}
+
+LIBEMV_API void set_function_phase_callback(void (*f_phase)(int phase, char isEnd, unsigned long long timestamp))
+{
+	libemv_phase_callback = f_phase;
+}
+
+void libemv_phase_event(int phase, char isEnd)
+{
+	unsigned long long timestamp;
+
+	if (phase < 0 || phase >= LIBEMV_PHASES_COUNT)
+		return;
+
+	if (libemv_trace_enabled)
+	{
+		unsigned char phaseByte;
+		phaseByte = (unsigned char) phase;
+		libemv_trace_event(isEnd ? LIBEMV_TRACE_PHASE_END : LIBEMV_TRACE_PHASE_BEGIN, &phaseByte, 1);
+	}
+
+	if (!libemv_stats_enabled)
+		return;
+
+	timestamp = libemv_get_monotonic_time();
+	if (isEnd)
+		libemv_stats.phaseEnd[phase] = timestamp;
+	else
+		libemv_stats.phaseStart[phase] = timestamp;
+
+	if (libemv_phase_callback)
+		libemv_phase_callback(phase, isEnd, timestamp);
+}
@@ -4,33 +4,62 @@
 
 // Application buffer, from ICC and terminal
 // ([unsigned short tag][int length][data]..)
-static unsigned char* tlv_buffer;
-static int tlv_allocated;
-static int tlv_length;
+static LIBEMV_SESSION unsigned char* tlv_buffer;
+static LIBEMV_SESSION int tlv_allocated;
+static LIBEMV_SESSION int tlv_length;
+
+// Changed when values of application buffer move (size of value changed, buffer cleared), see TAG_HANDLE
+static LIBEMV_SESSION unsigned long tlv_layout;
+
+// Tags of card read by GET DATA when terminal needs them, see libemv_fetch_tag
+static const unsigned short fetchable_tags[] = {TAG_ATC, TAG_LAST_ONLINE_ATC, TAG_PIN_TRY_COUNTER};
+
+// Bit of fetchable tag: GET DATA was sent since application buffer was cleared (answer is in buffer or card
+// hasn't tag)
+static LIBEMV_SESSION unsigned int tlv_fetched;
+
+// Terminal tags of settings are read only layers under application buffer, shared by sessions
+// Templates of LIBEMV_GLOBAL and of applications belong to version of configuration pinned by session
+
+// Template of application of current transaction, see libemv_use_tag_template
+static LIBEMV_SESSION unsigned char* tlv_template;
+static LIBEMV_SESSION int tlv_template_length;
+
+// Layers of tags from top: application buffer, template of application, template of LIBEMV_GLOBAL
+#define TLV_LAYERS 3
 
 void libemv_init_tlv_buffer(void)
 {
 	tlv_buffer = 0;
 	tlv_allocated = 0;
 	tlv_length = 0;
+	tlv_layout++;
+	tlv_fetched = 0;
+	tlv_template = 0;
+	tlv_template_length = 0;
 }
 
 void libemv_destroy_tlv_buffer(void)
 {
 	if (tlv_buffer)
 		libemv_free(tlv_buffer);
+	libemv_init_tlv_buffer();
 }
 
 static void check_and_reserve_buffer(int incrSize)
 {
+	int oldAllocated;
+
 	if (tlv_length + incrSize <= tlv_allocated)
 		return;
 
+	oldAllocated = tlv_allocated;
 	if (tlv_allocated == 0)
 	{
 		// Init size
 		tlv_allocated = 2 * 1024;
 		tlv_buffer = libemv_malloc(tlv_allocated);
+		LIBEMV_STATS_ADD(allocCount, 1);
 	} else
 	{
 		// incrSize musn't very big, but just in case
@@ -38,7 +67,9 @@ static void check_and_reserve_buffer(int incrSize)
 			tlv_allocated *= 2;
 		// Realloc must copy old data
 		tlv_buffer = libemv_realloc(tlv_buffer, tlv_allocated);
+		LIBEMV_STATS_ADD(allocCount, 1);
 	}
+	LIBEMV_PROBE3(tlv_grow, tlv_length, oldAllocated, tlv_allocated);
 
 	// Unable allocate
 	if (tlv_buffer == 0)
@@ -48,20 +79,21 @@ static void check_and_reserve_buffer(int incrSize)
 	}
 }
 
-LIBEMV_API unsigned char* libemv_get_tag(unsigned short tag, int* outSize)
+// Linear search of tag in buffer of format [tag][length][data]
+static unsigned char* find_tag(unsigned char* buffer, int length, unsigned short tag, int* outSize)
 {
 	unsigned char* currBuf;
-	int currPos;	
+	int currPos;
 
-	currBuf = tlv_buffer;
+	currBuf = buffer;
 	currPos = 0;
-	while (currPos < tlv_length)
+	while (currPos < length)
 	{
 		unsigned short currTag;
 		int currLength;
 
 		// Corrupted buffer
-		if (currPos + (int) sizeof(unsigned short) + (int) sizeof(int) > tlv_length)
+		if (currPos + (int) sizeof(unsigned short) + (int) sizeof(int) > length)
 		{
 			if (libemv_debug_enabled)
 				libemv_printf("tlv buffer malfunc\n");
@@ -87,37 +119,105 @@ LIBEMV_API unsigned char* libemv_get_tag(unsigned short tag, int* outSize)
 	return 0;
 }
 
-int libemv_get_next_tag(int shift, unsigned short* outTag, unsigned char** outBuffer, int* outSize)
+// Buffers of layers, see TLV_LAYERS
+static void tlv_layers(unsigned char** outBuffers, int* outLengths)
+{
+	outBuffers[0] = tlv_buffer;
+	outLengths[0] = tlv_length;
+	outBuffers[1] = tlv_template;
+	outLengths[1] = tlv_template_length;
+	outBuffers[2] = libemv_snapshot ? (unsigned char*) libemv_snapshot->globalTemplate : 0;
+	outLengths[2] = libemv_snapshot ? libemv_snapshot->globalTemplateLength : 0;
+}
+
+LIBEMV_API unsigned char* libemv_get_tag(unsigned short tag, int* outSize)
+{
+	unsigned char* found;
+
+	LIBEMV_STATS_ADD(tagGetCount, 1);
+
+	// Upper layer hides tags of lower layers
+	found = find_tag(tlv_buffer, tlv_length, tag, outSize);
+	if (!found && tlv_template)
+		found = find_tag(tlv_template, tlv_template_length, tag, outSize);
+	if (!found && libemv_snapshot && libemv_snapshot->globalTemplate)
+		found = find_tag((unsigned char*) libemv_snapshot->globalTemplate, libemv_snapshot->globalTemplateLength, tag, outSize);
+	return found;
+}
+
+// Read element of buffer at shift
+// Returns shift of next element or 0 if end is reached
+static int next_tag(unsigned char* buffer, int length, int shift, unsigned short* outTag, unsigned char** outBuffer, int* outSize)
 {
 	int sh;
 	sh = shift;
 
 	// Tag
-	if (sh + (int) sizeof(unsigned short) > tlv_length)
+	if (sh + (int) sizeof(unsigned short) > length)
 		return 0;
-	memcpy(outTag, tlv_buffer + sh, sizeof(unsigned short));
+	memcpy(outTag, buffer + sh, sizeof(unsigned short));
 	sh += sizeof(unsigned short);
 
 	// Length
-	if (sh + (int) sizeof(int) > tlv_length)
+	if (sh + (int) sizeof(int) > length)
 		return 0;
-	memcpy(outSize, tlv_buffer + sh, sizeof(int));
+	memcpy(outSize, buffer + sh, sizeof(int));
 	sh += sizeof(int);
 
 	// Value
-	if (sh + *outSize > tlv_length)
+	if (sh + *outSize > length)
 		return 0;
-	*outBuffer = tlv_buffer + sh;
+	*outBuffer = buffer + sh;
 	sh += *outSize;
 
 	return sh;
 }
 
+int libemv_get_next_tag(int shift, unsigned short* outTag, unsigned char** outBuffer, int* outSize)
+{
+	unsigned char* buffers[TLV_LAYERS];
+	int lengths[TLV_LAYERS];
+	int layer;
+	int base;
+
+	// Shift is position in layers one after another, tags hidden by upper layers are skipped
+	tlv_layers(buffers, lengths);
+	base = 0;
+	for (layer = 0; layer < TLV_LAYERS; layer++)
+	{
+		int sh;
+
+		if (shift < base + lengths[layer])
+		{
+			sh = shift - base;
+			while ((sh = next_tag(buffers[layer], lengths[layer], sh, outTag, outBuffer, outSize)) != 0)
+			{
+				int upper;
+				int hiddenSize;
+
+				for (upper = 0; upper < layer; upper++)
+				{
+					if (find_tag(buffers[upper], lengths[upper], *outTag, &hiddenSize))
+						break;
+				}
+				if (upper == layer)
+					return base + sh;
+			}
+			shift = base + lengths[layer];
+		}
+		base += lengths[layer];
+	}
+	return 0;
+}
+
 void libemv_set_tag(unsigned short tag, unsigned char* data, int size)
 {
 	unsigned char* findData;
 	int findDataSize;
-	findData = libemv_get_tag(tag, &findDataSize);
+	LIBEMV_STATS_ADD(tagSetCount, 1);
+
+	// Copy on write: tag of template is added to session
+	findData = find_tag(tlv_buffer, tlv_length, tag, &findDataSize);
 	if (findData)
 	{
 		// Replace data
@@ -133,6 +233,7 @@ void libemv_set_tag(unsigned short tag, unsigned char* data, int size)
 			memcpy(findData - sizeof(int), &size, sizeof(int));
 			memcpy(findData, data, size);
 			tlv_length += size - findDataSize;
+			tlv_layout++;
 		}
 	} else
 	{
@@ -152,6 +253,236 @@ void libemv_set_tag(unsigned short tag, unsigned char* data, int size)
 void libemv_clear_tlv_buffer(void)
 {
 	tlv_length = 0;
+	tlv_layout++;
+	tlv_fetched = 0;
+}
+
+int libemv_fetch_tag(unsigned short tag, unsigned char** outData, int* outSize)
+{
+	int outApduSize;
+	unsigned char outApdu[LIBEMV_APDU_RESPONSE_SIZE];
+	unsigned short parseTag;
+	unsigned char* parseData;
+	int parseSize;
+	int i;
+
+	*outData = find_tag(tlv_buffer, tlv_length, tag, outSize);
+	if (*outData)
+		return LIBEMV_OK;
+	for (i = 0; i < (int) (sizeof(fetchable_tags) / sizeof(fetchable_tags[0])); i++)
+	{
+		if (fetchable_tags[i] == tag)
+			break;
+	}
+	if (i == (int) (sizeof(fetchable_tags) / sizeof(fetchable_tags[0])) || (tlv_fetched & (1U << i)))
+		return LIBEMV_UNKNOWN_ERROR;
+
+	// GET DATA, card is asked once, also if it hasn't tag
+	LIBEMV_STATS_ADD(fetchCount, 1);
+	if (libemv_debug_enabled)
+		libemv_printf("GET DATA %04X\n", tag);
+	if (!libemv_apdu(0x80, 0xCA, (unsigned char) (tag >> 8), (unsigned char) tag, 0, "", &outApduSize, outApdu))
+		return LIBEMV_ERROR_TRANSMIT;
+	tlv_fetched |= 1U << i;
+	if (outApdu[outApduSize - 2] != 0x90 || outApdu[outApduSize - 1] != 0x00)
+		return LIBEMV_UNKNOWN_ERROR;
+	if (!libemv_parse_tlv(outApdu, outApduSize - 2, &parseTag, &parseData, &parseSize) || parseTag != tag)
+		return LIBEMV_UNKNOWN_ERROR;
+	libemv_set_tag(tag, parseData, parseSize);
+	*outData = find_tag(tlv_buffer, tlv_length, tag, outSize);
+	return *outData ? LIBEMV_OK : LIBEMV_UNKNOWN_ERROR;
+}
+
+void libemv_init_tag_handle(TAG_HANDLE* handle, unsigned short tag, int size)
+{
+	handle->tag = tag;
+	handle->size = size;
+	handle->offset = 0;
+	handle->layout = tlv_layout - 1;
+}
+
+unsigned char* libemv_tag_handle_data(TAG_HANDLE* handle)
+{
+	unsigned char value[TAG_HANDLE_MAX_SIZE];
+	unsigned char* data;
+	int size;
+
+	if (handle->layout == tlv_layout)
+		return tlv_buffer + handle->offset;
+
+	// Value isn't in application buffer or has other size: copy of template value, zeros if tag isn't set
+	data = find_tag(tlv_buffer, tlv_length, handle->tag, &size);
+	if (!data || size != handle->size)
+	{
+		if (handle->size > TAG_HANDLE_MAX_SIZE)
+			return 0;
+		memset(value, 0, handle->size);
+		data = libemv_get_tag(handle->tag, &size);
+		if (data)
+			memcpy(value, data, size < handle->size ? size : handle->size);
+		libemv_set_tag(handle->tag, value, handle->size);
+		data = find_tag(tlv_buffer, tlv_length, handle->tag, &size);
+		if (!data)
+			return 0;
+	}
+	handle->offset = (int) (data - tlv_buffer);
+	handle->layout = tlv_layout;
+	return data;
+}
+
+void libemv_tag_handle_set_bits(TAG_HANDLE* handle, unsigned long long mask)
+{
+	unsigned char* data;
+	int i;
+
+	data = libemv_tag_handle_data(handle);
+	if (!data)
+		return;
+	for (i = handle->size - 1; i >= 0 && mask; i--)
+	{
+		data[i] |= (unsigned char) mask;
+		mask >>= 8;
+	}
+}
+
+// Append tag to template, only count size if outTemplate is 0
+// Returns new size of template
+static int template_tag(unsigned char* outTemplate, int size, unsigned short tag, const void* data, int dataSize)
+{
+	if (outTemplate)
+	{
+		memcpy(outTemplate + size, &tag, sizeof(unsigned short));
+		memcpy(outTemplate + size + sizeof(unsigned short), &dataSize, sizeof(int));
+		memcpy(outTemplate + size + sizeof(unsigned short) + sizeof(int), data, dataSize);
+	}
+	return size + sizeof(unsigned short) + sizeof(int) + dataSize;
+}
+
+int libemv_app_template(const LIBEMV_APPLICATIONS* app, unsigned char* outTemplate)
+{
+	int size;
+	int riskSize;
+
+	riskSize = app->terminalRiskManagementDataSize;
+	if (riskSize < 0 || riskSize > (int) sizeof(app->terminalRiskManagementData))
+		riskSize = 0;
+	size = 0;
+	size = template_tag(outTemplate, size, TAG_ACQUIRER_ID, app->strAcquirerIdentifier, strlen(app->strAcquirerIdentifier));
+	size = template_tag(outTemplate, size, TAG_APPLICATION_VERSION_NUMBER, app->applicationVersionNumber, 2);
+	size = template_tag(outTemplate, size, TAG_MCC, app->merchantCategoryCode, 2);
+	size = template_tag(outTemplate, size, TAG_MERCHANT_ID, app->strMerchantIdentifier, strlen(app->strMerchantIdentifier));
+	size = template_tag(outTemplate, size, TAG_MERCHANT_NAME_AND_LOCATION, app->strMerchantNameAndLocation, strlen(app->strMerchantNameAndLocation));
+	size = template_tag(outTemplate, size, TAG_TERMINAL_FLOOR_LIMIT, app->terminalFloorLimit, 4);
+	size = template_tag(outTemplate, size, TAG_TERMINAL_ID, app->strTerminalIdentification, strlen(app->strTerminalIdentification));
+	size = template_tag(outTemplate, size, TAG_RISK_MANAGEMENT_DATA, app->terminalRiskManagementData, riskSize);
+	size = template_tag(outTemplate, size, TAG_TRANSACTION_REFERENCE_CURRENCY, app->transactionReferenceCurrency, 2);
+	size = template_tag(outTemplate, size, TAG_TRANSACTION_REFERENCE_EXPONENT, &app->transactionReferenceCurrencyExponent, 1);
+	return size;
+}
+
+int libemv_global_template(const LIBEMV_GLOBAL* global, unsigned char* outTemplate)
+{
+	int size;
+
+	size = 0;
+	size = template_tag(outTemplate, size, TAG_IFD_SERIAL_NUMBER, global->strIFDSerialNumber, strlen(global->strIFDSerialNumber));
+	size = template_tag(outTemplate, size, TAG_TERMINAL_COUNTRY_CODE, global->terminalCountryCode, 2);
+	size = template_tag(outTemplate, size, TAG_TERMINAL_CAPABILITIES, global->terminalCapabilities, 3);
+	size = template_tag(outTemplate, size, TAG_ADDI_TERMINAL_CAPABILITIES, global->additionalTerminalCapabilities, 5);
+	size = template_tag(outTemplate, size, TAG_TERMINAL_TYPE, &global->terminalType, 1);
+	return size;
+}
+
+void libemv_use_tag_template(int indexApp)
+{
+	const unsigned int* offsets;
+
+	if (!libemv_config || indexApp < 0 || indexApp >= libemv_config->appsCount)
+	{
+		tlv_template = 0;
+		tlv_template_length = 0;
+		return;
+	}
+	offsets = (const unsigned int*) LIBEMV_CONFIG_PTR(libemv_config->templatesOffset);
+	tlv_template = (unsigned char*) LIBEMV_CONFIG_PTR(offsets[indexApp]);
+	tlv_template_length = offsets[indexApp + 1] - offsets[indexApp];
+}
+
+int libemv_copy_tlv_buffer(unsigned char* outImage, int maxSize)
+{
+	if (tlv_length > maxSize)
+		return 0;
+	memcpy(outImage, tlv_buffer, tlv_length);
+	return tlv_length;
+}
+
+void libemv_restore_tlv_buffer(const unsigned char* image, int size)
+{
+	tlv_length = 0;
+	tlv_layout++;
+	tlv_fetched = 0;
+	check_and_reserve_buffer(size);
+	if (!tlv_buffer)
+		return;
+	memcpy(tlv_buffer, image, size);
+	tlv_length = size;
+}
+
+unsigned long long libemv_pack_bits(const unsigned char* data, int size)
+{
+	unsigned long long bits;
+	int i;
+
+	bits = 0;
+	for (i = 0; i < size && i < 8; i++)
+		bits = (bits << 8) | data[i];
+	return bits;
+}
+
+unsigned long long libemv_get_numeric(unsigned short tag)
+{
+	unsigned char* data;
+	unsigned long long value;
+	int size;
+	int i;
+
+	data = libemv_get_tag(tag, &size);
+	if (!data)
+		return 0;
+	value = 0;
+	for (i = 0; i < size; i++)
+		value = value * 100 + (data[i] >> 4) * 10 + (data[i] & 0x0F);
+	return value;
+}
+
+unsigned long long libemv_get_bits(unsigned short tag)
+{
+	unsigned char* data;
+	int size;
+
+	data = libemv_get_tag(tag, &size);
+	if (!data)
+		return 0;
+	return libemv_pack_bits(data, size);
+}
+
+void libemv_set_bits(unsigned short tag, unsigned long long mask)
+{
+	unsigned char* data;
+	unsigned char bits[8];
+	int size;
+	int i;
+
+	data = libemv_get_tag(tag, &size);
+	if (!data || size <= 0 || size > (int) sizeof(bits))
+		return;
+	mask |= libemv_pack_bits(data, size);
+	for (i = size - 1; i >= 0; i--)
+	{
+		bits[i] = (unsigned char) mask;
+		mask >>= 8;
+	}
+	libemv_set_tag(tag, bits, size);
 }
 
 int libemv_parse_tlv(unsigned char* inBuffer, int inBufferSize, unsigned short* outTag, unsigned char** outBuffer, int* outSize)
@@ -242,8 +573,7 @@ int libemv_make_tlv(unsigned char* inBuffer, int inBufferSize, unsigned short ta
 			n = 3;
 		else
 			n = 4;
-		n |= 0x80;
-		tlvBuffer[tlvSize++] = n & 0xFF;
+		tlvBuffer[tlvSize++] = (n | 0x80) & 0xFF;
 		while (n--)
 		{
 			tlvBuffer[tlvSize++] = (inBufferSize >> (n * 8)) & 0xFF;
@@ -312,3 +642,113 @@ int libemv_dol(unsigned char* dol, int dolSize, unsigned char* outBuffer)
 
 	return outSize;
 }
+
+int libemv_compile_dol(const unsigned char* dol, int dolSize, DOL_PLAN* outPlan)
+{
+	int dolShift;
+
+	outPlan->count = 0;
+	outPlan->size = 0;
+	dolShift = 0;
+	while (dolShift < dolSize)
+	{
+		DOL_ENTRY* entry;
+		unsigned short tag;
+
+		// Tag could be 1 or 2 byte, length only 1 byte
+		tag = dol[dolShift];
+		if ((dol[dolShift] & 0x1F) == 0x1F)
+		{
+			dolShift++;
+			if (dolShift >= dolSize)
+				return 0;
+			tag <<= 8;
+			tag |= dol[dolShift];
+		}
+		dolShift++;
+		if (dolShift >= dolSize || outPlan->count >= MAX_DOL_ENTRIES)
+			return 0;
+
+		entry = &outPlan->entries[outPlan->count++];
+		entry->tag = tag;
+		entry->size = dol[dolShift];
+		entry->late = 0;
+		outPlan->size += entry->size;
+		dolShift++;
+	}
+
+	return 1;
+}
+
+// Left part of value, zeros after it (see libemv_dol)
+static void dol_entry_data(const DOL_ENTRY* entry, unsigned char* outBuffer)
+{
+	unsigned char* findData;
+	int findSize;
+
+	findData = libemv_get_tag(entry->tag, &findSize);
+	if (!findData)
+		findSize = 0;
+	if (findSize > entry->size)
+		findSize = entry->size;
+	if (findSize > 0)
+		memcpy(outBuffer, findData, findSize);
+	if (entry->size > findSize)
+		memset(outBuffer + findSize, 0, entry->size - findSize);
+}
+
+int libemv_dol_plan_data(const DOL_PLAN* plan, unsigned char* outBuffer)
+{
+	int outSize;
+	int i;
+
+	outSize = 0;
+	for (i = 0; i < plan->count; i++)
+	{
+		dol_entry_data(&plan->entries[i], outBuffer + outSize);
+		outSize += plan->entries[i].size;
+	}
+
+	return outSize;
+}
+
+void libemv_dol_plan_set_late(DOL_PLAN* plan, const unsigned short* tags, int count)
+{
+	int i, j;
+
+	for (i = 0; i < plan->count; i++)
+	{
+		plan->entries[i].late = 0;
+		for (j = 0; j < count; j++)
+		{
+			if (plan->entries[i].tag == tags[j])
+				plan->entries[i].late = 1;
+		}
+	}
+}
+
+void libemv_dol_plan_patch(const DOL_PLAN* plan, unsigned char* buffer)
+{
+	int offset;
+	int i;
+
+	offset = 0;
+	for (i = 0; i < plan->count; i++)
+	{
+		if (plan->entries[i].late)
+			dol_entry_data(&plan->entries[i], buffer + offset);
+		offset += plan->entries[i].size;
+	}
+}
+
+int libemv_dol_plan_has_tag(const DOL_PLAN* plan, unsigned short tag)
+{
+	int i;
+
+	for (i = 0; i < plan->count; i++)
+	{
+		if (plan->entries[i].tag == tag)
+			return 1;
+	}
+	return 0;
+}
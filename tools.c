@@ -2,15 +2,48 @@
 #include "internal.h"
 #include <string.h>
 
-void libemv_debug_buffer(char* strPre, unsigned char* buf, int size, char* strPost)
+// Bytes formatted by one call of libemv_printf
+#define DEBUG_CHUNK_SIZE 128
+
+int libemv_format_hex(char* outStr, const unsigned char* buf, int size, const char* separator)
 {
+	static const char hexDigits[] = "0123456789ABCDEF";
+	int separatorLength;
+	int length;
 	int i;
-	libemv_printf(strPre);
+
+	separatorLength = strlen(separator);
+	length = 0;
 	for (i = 0; i < size; i++)
 	{
-		libemv_printf("%02X", buf[i] & 0xFF);
-		if (i != size - 1)
-			libemv_printf(", ");
+		if (i != 0 && separatorLength)
+		{
+			memcpy(outStr + length, separator, separatorLength);
+			length += separatorLength;
+		}
+		outStr[length++] = hexDigits[(buf[i] >> 4) & 0x0F];
+		outStr[length++] = hexDigits[buf[i] & 0x0F];
 	}
-	libemv_printf(strPost);
+	outStr[length] = 0;
+	return length;
+}
+
+void libemv_debug_buffer(char* strPre, unsigned char* buf, int size, char* strPost)
+{
+	char strHex[DEBUG_CHUNK_SIZE * 4 + 1];
+	int shift;
+
+	// One printf for usual buffers
+	shift = 0;
+	do
+	{
+		int chunkSize;
+		int length;
+		chunkSize = size - shift > DEBUG_CHUNK_SIZE ? DEBUG_CHUNK_SIZE : size - shift;
+		length = libemv_format_hex(strHex, buf + shift, chunkSize, ", ");
+		shift += chunkSize;
+		if (shift < size)
+			strcpy(strHex + length, ", ");
+		libemv_printf("%s%s%s", chunkSize == shift ? strPre : "", strHex, shift >= size ? strPost : "");
+	} while (shift < size);
 }
@@ -0,0 +1,167 @@
+#include "include/libemv.h"
+#include "internal.h"
+#include <string.h>
+
+// Ring buffer of trace records, single producer (transaction) and single consumer (libemv_trace_read)
+// Positions grow forever, index in buffer is position & (size - 1)
+// With LIBEMV_THREADS every session has own ring, consumer on other thread reads it by handle
+struct LIBEMV_TRACE
+{
+	unsigned char* buffer;
+	unsigned long size;
+	volatile unsigned long head;	// Written by producer only
+	volatile unsigned long tail;	// Written by consumer only
+	volatile unsigned long dropped;
+};
+
+LIBEMV_SESSION char libemv_trace_enabled;
+static LIBEMV_SESSION LIBEMV_TRACE trace_ring;
+
+void libemv_init_trace(void)
+{
+	libemv_trace_enabled = 0;
+	memset(&trace_ring, 0, sizeof(trace_ring));
+}
+
+LIBEMV_API LIBEMV_TRACE* libemv_trace_enable(unsigned char* buffer, int size)
+{
+	libemv_trace_enabled = 0;
+	LIBEMV_BARRIER();
+	if (!buffer || size <= 0)
+	{
+		trace_ring.buffer = 0;
+		trace_ring.size = 0;
+		return 0;
+	}
+
+	// Size must be power of 2
+	if ((size & (size - 1)) != 0 || size < LIBEMV_TRACE_HEADER_SIZE * 2)
+		return 0;
+
+	trace_ring.buffer = buffer;
+	trace_ring.size = size;
+	trace_ring.head = 0;
+	trace_ring.tail = 0;
+	trace_ring.dropped = 0;
+	LIBEMV_BARRIER();
+	libemv_trace_enabled = 1;
+	return &trace_ring;
+}
+
+static void trace_copy_in(LIBEMV_TRACE* trace, unsigned long position, const unsigned char* data, int size)
+{
+	unsigned long index;
+	unsigned long first;
+	index = position & (trace->size - 1);
+	first = trace->size - index;
+	if ((unsigned long) size <= first)
+	{
+		memcpy(trace->buffer + index, data, size);
+	} else
+	{
+		memcpy(trace->buffer + index, data, first);
+		memcpy(trace->buffer, data + first, size - first);
+	}
+}
+
+static void trace_copy_out(const LIBEMV_TRACE* trace, unsigned long position, unsigned char* data, int size)
+{
+	unsigned long index;
+	unsigned long first;
+	index = position & (trace->size - 1);
+	first = trace->size - index;
+	if ((unsigned long) size <= first)
+	{
+		memcpy(data, trace->buffer + index, size);
+	} else
+	{
+		memcpy(data, trace->buffer + index, first);
+		memcpy(data + first, trace->buffer, size - first);
+	}
+}
+
+void libemv_trace_event2(unsigned short event, const unsigned char* data1, int size1, const unsigned char* data2, int size2)
+{
+	unsigned char header[LIBEMV_TRACE_HEADER_SIZE];
+	LIBEMV_TRACE* trace;
+	unsigned long long timestamp;
+	unsigned long head;
+	unsigned long recordSize;
+	int payloadSize;
+	int i;
+
+	payloadSize = size1 + size2;
+	recordSize = LIBEMV_TRACE_HEADER_SIZE + payloadSize;
+	trace = &trace_ring;
+	head = trace->head;
+
+	// Never block transaction, drop record if consumer is slow
+	if (recordSize > trace->size - (head - trace->tail))
+	{
+		trace->dropped++;
+		return;
+	}
+
+	// Little endian header: event, payload size, timestamp
+	timestamp = libemv_get_monotonic_time();
+	header[0] = event & 0xFF;
+	header[1] = (event >> 8) & 0xFF;
+	header[2] = payloadSize & 0xFF;
+	header[3] = (payloadSize >> 8) & 0xFF;
+	for (i = 0; i < 8; i++)
+		header[4 + i] = (unsigned char) (timestamp >> (i * 8));
+
+	trace_copy_in(trace, head, header, LIBEMV_TRACE_HEADER_SIZE);
+	if (size1 > 0)
+		trace_copy_in(trace, head + LIBEMV_TRACE_HEADER_SIZE, data1, size1);
+	if (size2 > 0)
+		trace_copy_in(trace, head + LIBEMV_TRACE_HEADER_SIZE + size1, data2, size2);
+
+	// Publish record after its data
+	LIBEMV_BARRIER();
+	trace->head = head + recordSize;
+}
+
+void libemv_trace_event(unsigned short event, const unsigned char* data, int size)
+{
+	libemv_trace_event2(event, data, size, 0, 0);
+}
+
+LIBEMV_API int libemv_trace_read(LIBEMV_TRACE* trace, unsigned char* outBuffer, int outBufferSize)
+{
+	unsigned long tail;
+	unsigned long head;
+	int outSize;
+
+	if (!trace || !trace->buffer)
+		return 0;
+
+	tail = trace->tail;
+	head = trace->head;
+	LIBEMV_BARRIER();
+
+	// Copy whole records only
+	outSize = 0;
+	while (tail != head)
+	{
+		unsigned char header[LIBEMV_TRACE_HEADER_SIZE];
+		int recordSize;
+		trace_copy_out(trace, tail, header, LIBEMV_TRACE_HEADER_SIZE);
+		recordSize = LIBEMV_TRACE_HEADER_SIZE + (header[2] | (header[3] << 8));
+		if (outSize + recordSize > outBufferSize)
+			break;
+		trace_copy_out(trace, tail, outBuffer + outSize, recordSize);
+		outSize += recordSize;
+		tail += recordSize;
+	}
+
+	// Release space to producer after data is copied
+	LIBEMV_BARRIER();
+	trace->tail = tail;
+	return outSize;
+}
+
+LIBEMV_API unsigned long libemv_trace_dropped(LIBEMV_TRACE* trace)
+{
+	return trace ? trace->dropped : 0;
+}
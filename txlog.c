@@ -0,0 +1,326 @@
+#include "include/libemv.h"
+#include "internal.h"
+#include <string.h>
+#include <time.h>
+
+// Terminal transaction log (see TXLOG_HEADER) is shared by sessions of process. File is only source
+// of truth, index of PANs in memory is built from records when log is opened and updated on append.
+// Every record is synced to file after append, record torn by crash of process or power failure
+// fails its checksum and is ignored
+
+// Amounts of PAN by time bucket, slot of bucket is bucket % TXLOG_BUCKETS
+typedef struct
+{
+	unsigned char pan[10];
+	unsigned int bucket[TXLOG_BUCKETS];			// Number of bucket (time / bucketSeconds) in slot
+	unsigned long long amount[TXLOG_BUCKETS];
+} TXLOG_PAN;
+
+static TXLOG_HEADER* txlogHeader;
+static void* txlogFile;						// See libemv_sync_file
+static TXLOG_RECORD* txlogRecords;
+static size_t txlogSize;
+static unsigned long long txlogSequence;	// Sequence of last record
+
+// Open addressing by hash of PAN, slot is index in txlogPans or -1
+// Entries aren't removed, index is rebuilt from records when txlogPans is full
+static int* txlogSlots;
+static unsigned int txlogSlotsMask;
+static TXLOG_PAN* txlogPans;
+static int txlogPansCount;
+static int txlogPansMax;
+
+static volatile long txlogLock;
+
+// Lock can be held while index is rebuilt from all records, waiting sessions back off
+static void txlog_lock(void)
+{
+	int spins;
+
+	for (spins = 0; txlogLock || !LIBEMV_CAS_LONG(&txlogLock, 0, 1); spins++)
+		LIBEMV_SPIN_WAIT(spins);
+}
+
+static void txlog_unlock(void)
+{
+	LIBEMV_BARRIER();
+	txlogLock = 0;
+}
+
+// FNV-1a
+static unsigned int txlog_checksum(const TXLOG_RECORD* record)
+{
+	const unsigned char* data;
+	unsigned int hash;
+	size_t i;
+
+	data = (const unsigned char*) record;
+	hash = 2166136261U;
+	for (i = 0; i < offsetof(TXLOG_RECORD, checksum); i++)
+	{
+		hash ^= data[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static unsigned int txlog_hash(const unsigned char* pan)
+{
+	unsigned int hash;
+	int i;
+
+	hash = 2166136261U;
+	for (i = 0; i < 10; i++)
+	{
+		hash ^= pan[i];
+		hash *= 16777619U;
+	}
+	return hash ^ (hash >> 15);
+}
+
+// Entry of PAN, added if not exists
+// Returns 0 if no place
+static TXLOG_PAN* txlog_find(const unsigned char* pan, char add)
+{
+	TXLOG_PAN* entry;
+	unsigned int slot;
+
+	for (slot = txlog_hash(pan) & txlogSlotsMask; txlogSlots[slot] >= 0; slot = (slot + 1) & txlogSlotsMask)
+	{
+		entry = &txlogPans[txlogSlots[slot]];
+		if (memcmp(entry->pan, pan, 10) == 0)
+			return entry;
+	}
+	if (!add || txlogPansCount >= txlogPansMax)
+		return 0;
+
+	entry = &txlogPans[txlogPansCount];
+	memcpy(entry->pan, pan, 10);
+	memset(entry->bucket, 0, sizeof(entry->bucket));
+	memset(entry->amount, 0, sizeof(entry->amount));
+	txlogSlots[slot] = txlogPansCount++;
+	return entry;
+}
+
+static unsigned int txlog_bucket(long long time)
+{
+	return (unsigned int) (time / txlogHeader->bucketSeconds);
+}
+
+// Add amount of record to bucket of its time, records older than window of bucket are ignored
+// Returns 0 if no place for PAN
+static char txlog_index(const TXLOG_RECORD* record)
+{
+	TXLOG_PAN* entry;
+	unsigned int bucket;
+	int slot;
+
+	entry = txlog_find(record->pan, 1);
+	if (!entry)
+		return 0;
+	bucket = txlog_bucket(record->time);
+	slot = bucket % TXLOG_BUCKETS;
+	if (entry->bucket[slot] == bucket)
+		entry->amount[slot] += record->amount;
+	else if (entry->bucket[slot] < bucket)
+	{
+		entry->bucket[slot] = bucket;
+		entry->amount[slot] = record->amount;
+	}
+	return 1;
+}
+
+// Remove amount of record that is overwritten, if its bucket is still in index
+static void txlog_unindex(const TXLOG_RECORD* record)
+{
+	TXLOG_PAN* entry;
+	unsigned int bucket;
+	int slot;
+
+	entry = txlog_find(record->pan, 0);
+	if (!entry)
+		return;
+	bucket = txlog_bucket(record->time);
+	slot = bucket % TXLOG_BUCKETS;
+	if (entry->bucket[slot] == bucket && entry->amount[slot] >= record->amount)
+		entry->amount[slot] -= record->amount;
+}
+
+// Index valid records of window ending at now
+static void txlog_rebuild(long long now)
+{
+	unsigned int oldest;
+	int i;
+
+	memset(txlogSlots, 0xFF, (txlogSlotsMask + 1) * sizeof(int));
+	txlogPansCount = 0;
+	oldest = txlog_bucket(now);
+	oldest = oldest >= TXLOG_BUCKETS - 1 ? oldest - (TXLOG_BUCKETS - 1) : 0;
+	for (i = 0; i < txlogHeader->capacity; i++)
+	{
+		const TXLOG_RECORD* record;
+		record = &txlogRecords[i];
+		if (record->sequence == 0 || record->checksum != txlog_checksum(record) || txlog_bucket(record->time) < oldest)
+			continue;
+		txlog_index(record);
+	}
+}
+
+LIBEMV_API int libemv_open_transaction_log(const char* path, int capacity, int bucketSeconds)
+{
+	TXLOG_HEADER* header;
+	void* file;
+	size_t size;
+	unsigned int slots;
+	int i;
+
+	if (capacity <= 0 || capacity > 0x1000000 || bucketSeconds <= 0)
+		return LIBEMV_UNKNOWN_ERROR;
+	libemv_close_transaction_log();
+
+	size = TXLOG_RECORDS_OFFSET + (size_t) capacity * sizeof(TXLOG_RECORD);
+	header = (TXLOG_HEADER*) libemv_map_file_writable(path, size, &file);
+	if (!header)
+		return LIBEMV_UNKNOWN_ERROR;
+	if (header->magic == 0)
+	{
+		// New file, records are zeros
+		header->version = TXLOG_VERSION;
+		header->capacity = capacity;
+		header->bucketSeconds = bucketSeconds;
+		header->recordsOffset = TXLOG_RECORDS_OFFSET;
+		LIBEMV_BARRIER();
+		header->magic = TXLOG_MAGIC;
+		libemv_sync_file(file, (const unsigned char*) header, sizeof(TXLOG_HEADER));
+	}
+	if (header->magic != TXLOG_MAGIC || header->version != TXLOG_VERSION || header->capacity != capacity
+		|| header->bucketSeconds != bucketSeconds || header->recordsOffset != TXLOG_RECORDS_OFFSET)
+	{
+		if (libemv_debug_enabled)
+			libemv_printf("Transaction log: wrong format or parameters\n");
+		libemv_unmap_file((const unsigned char*) header, size);
+		libemv_close_file(file);
+		return LIBEMV_UNKNOWN_ERROR;
+	}
+
+	// Every record can have own PAN, twice more entries to rebuild index only after capacity appends
+	for (slots = 1; slots < (unsigned int) capacity * 4; slots <<= 1)
+		;
+	txlogSlots = libemv_malloc(slots * sizeof(int));
+	txlogPans = libemv_malloc((size_t) capacity * 2 * sizeof(TXLOG_PAN));
+	LIBEMV_STATS_ADD(allocCount, 2);
+	if (!txlogSlots || !txlogPans)
+	{
+		if (libemv_debug_enabled)
+			libemv_printf("Unable allocate memory\n");
+		if (txlogSlots)
+			libemv_free(txlogSlots);
+		if (txlogPans)
+			libemv_free(txlogPans);
+		txlogSlots = 0;
+		txlogPans = 0;
+		libemv_unmap_file((const unsigned char*) header, size);
+		libemv_close_file(file);
+		return LIBEMV_UNKNOWN_ERROR;
+	}
+	txlogSlotsMask = slots - 1;
+	txlogPansMax = capacity * 2;
+	txlogHeader = header;
+	txlogFile = file;
+	txlogRecords = (TXLOG_RECORD*) ((unsigned char*) header + header->recordsOffset);
+	txlogSize = size;
+
+	// Last written record, torn record is overwritten by next append
+	txlogSequence = 0;
+	for (i = 0; i < capacity; i++)
+	{
+		if (txlogRecords[i].sequence > txlogSequence && txlogRecords[i].checksum == txlog_checksum(&txlogRecords[i]))
+			txlogSequence = txlogRecords[i].sequence;
+	}
+	txlog_rebuild((long long) time(0));
+	return LIBEMV_OK;
+}
+
+LIBEMV_API void libemv_close_transaction_log(void)
+{
+	if (!txlogHeader)
+		return;
+	libemv_unmap_file((const unsigned char*) txlogHeader, txlogSize);
+	libemv_close_file(txlogFile);
+	libemv_free(txlogSlots);
+	libemv_free(txlogPans);
+	txlogHeader = 0;
+	txlogFile = 0;
+	txlogRecords = 0;
+	txlogSlots = 0;
+	txlogPans = 0;
+}
+
+LIBEMV_API int libemv_log_transaction(void)
+{
+	TXLOG_RECORD record;
+	TXLOG_RECORD* target;
+	unsigned char* data;
+	int size;
+
+	data = libemv_get_tag(TAG_PAN, &size);
+	if (!txlogHeader || !data || size <= 0 || size > 10)
+		return LIBEMV_UNKNOWN_ERROR;
+	memset(&record, 0, sizeof(record));
+	memset(record.pan, 0xFF, sizeof(record.pan));
+	memcpy(record.pan, data, size);
+	data = libemv_get_tag(TAG_PAN_SEQUENCE_NUMBER, &size);
+	record.panSequence = data && size == 1 ? *data : 0xFF;
+	record.amount = libemv_get_numeric(TAG_AMOUNT_AUTHORISED);
+	record.time = (long long) time(0);
+
+	txlog_lock();
+	record.sequence = ++txlogSequence;
+	record.checksum = txlog_checksum(&record);
+	target = &txlogRecords[(record.sequence - 1) % txlogHeader->capacity];
+	if (target->sequence != 0 && target->checksum == txlog_checksum(target))
+		txlog_unindex(target);
+
+	// Checksum is written last, record is invalid until it is complete
+	target->checksum = ~record.checksum;
+	LIBEMV_BARRIER();
+	memcpy(target, &record, offsetof(TXLOG_RECORD, checksum));
+	LIBEMV_BARRIER();
+	target->checksum = record.checksum;
+
+	if (!txlog_index(&record))
+	{
+		// Entries of PANs out of window are dropped, new record is in file
+		txlog_rebuild(record.time);
+	}
+	txlog_unlock();
+
+	// Record is durable before transaction goes on, other appends don't wait for disk
+	libemv_sync_file(txlogFile, (const unsigned char*) target, sizeof(TXLOG_RECORD));
+	return LIBEMV_OK;
+}
+
+unsigned long long libemv_txlog_sum(const unsigned char* pan)
+{
+	const TXLOG_PAN* entry;
+	unsigned long long sum;
+	unsigned int bucket;
+	int i;
+
+	if (!txlogHeader)
+		return 0;
+	sum = 0;
+	bucket = txlog_bucket((long long) time(0));
+	txlog_lock();
+	entry = txlog_find(pan, 0);
+	if (entry)
+	{
+		for (i = 0; i < TXLOG_BUCKETS; i++)
+		{
+			if (entry->bucket[i] + TXLOG_BUCKETS > bucket && entry->bucket[i] <= bucket)
+				sum += entry->amount[i];
+		}
+	}
+	txlog_unlock();
+	return sum;
+}
@@ -0,0 +1,118 @@
+// Decoder of libemv binary trace
+// Reads records saved from libemv_trace_read() and prints them as text
+//
+// Build: gcc -O2 -o trace_decode util/trace_decode.c
+// Usage: trace_decode [trace.bin], reads stdin if file isn't specified
+
+#include "../include/libemv.h"
+#include <stdio.h>
+
+static const char* phaseNames[LIBEMV_PHASES_COUNT] =
+{
+	"build_candidate_list",
+	"application_selection",
+	"select_application",
+	"get_processing_option",
+	"read_app_data",
+	"terminal_action_analysis",
+	"terminal_risk_management",
+	"offline_data_authentication",
+	"generate_ac",
+	"completion",
+	"cardholder_verification"
+};
+
+static void print_hex(const unsigned char* buf, int size)
+{
+	int i;
+	for (i = 0; i < size; i++)
+		printf("%02X", buf[i]);
+}
+
+static void print_record(unsigned short event, const unsigned char* payload, int size)
+{
+	switch (event)
+	{
+	case LIBEMV_TRACE_APDU_COMMAND:
+		if (size < 5)
+			break;
+		printf("C-APDU: %02X %02X %02X %02X; %02X ", payload[0], payload[1], payload[2], payload[3], payload[4]);
+		print_hex(payload + 5, size - 5);
+		printf("\n");
+		return;
+	case LIBEMV_TRACE_APDU_RESPONSE:
+		if (size < 2)
+			break;
+		printf("R-APDU: ");
+		print_hex(payload, size - 2);
+		printf("; %02X %02X\n", payload[size - 2], payload[size - 1]);
+		return;
+	case LIBEMV_TRACE_TRANSMIT_ERROR:
+		printf("Transmission error\n");
+		return;
+	case LIBEMV_TRACE_PHASE_BEGIN:
+	case LIBEMV_TRACE_PHASE_END:
+		if (size < 1)
+			break;
+		printf("%s %s\n", event == LIBEMV_TRACE_PHASE_BEGIN ? "Begin" : "End",
+			payload[0] < LIBEMV_PHASES_COUNT ? phaseNames[payload[0]] : "unknown phase");
+		return;
+	}
+
+	printf("Event %u: ", event);
+	print_hex(payload, size);
+	printf("\n");
+}
+
+int main(int argc, char** argv)
+{
+	FILE* file;
+	unsigned char header[LIBEMV_TRACE_HEADER_SIZE];
+	unsigned char payload[0x10000];
+	unsigned long long firstTimestamp;
+	int first;
+
+	file = stdin;
+	if (argc > 1)
+	{
+		file = fopen(argv[1], "rb");
+		if (!file)
+		{
+			fprintf(stderr, "Unable open %s\n", argv[1]);
+			return 1;
+		}
+	}
+
+	first = 1;
+	firstTimestamp = 0;
+	while (fread(header, 1, LIBEMV_TRACE_HEADER_SIZE, file) == LIBEMV_TRACE_HEADER_SIZE)
+	{
+		unsigned short event;
+		int size;
+		unsigned long long timestamp;
+		int i;
+
+		event = (unsigned short) (header[0] | (header[1] << 8));
+		size = header[2] | (header[3] << 8);
+		timestamp = 0;
+		for (i = 7; i >= 0; i--)
+			timestamp = (timestamp << 8) | header[4 + i];
+		if ((int) fread(payload, 1, size, file) != size)
+		{
+			fprintf(stderr, "Truncated record\n");
+			break;
+		}
+
+		if (first)
+		{
+			firstTimestamp = timestamp;
+			first = 0;
+		}
+		printf("%12.3f us  ", (double) (timestamp - firstTimestamp) / 1000.0);
+		print_record(event, payload, size);
+	}
+
+	if (file != stdin)
+		fclose(file);
+	return 0;
+}